@@ -354,6 +354,18 @@ else()
    set(FLTK_XDBE_FOUND FALSE)
 endif(OPTION_USE_XDBE AND HAVE_XDBE_H)
 
+#######################################################################
+if(X11_FOUND)
+   option(OPTION_USE_XSHM "use the MIT-SHM extension" ON)
+endif(X11_FOUND)
+
+if(OPTION_USE_XSHM AND HAVE_XSHM_H AND X11_Xext_FOUND)
+   set(HAVE_XSHM 1)
+   set(FLTK_XSHM_FOUND TRUE)
+else()
+   set(FLTK_XSHM_FOUND FALSE)
+endif(OPTION_USE_XSHM AND HAVE_XSHM_H AND X11_Xext_FOUND)
+
 #######################################################################
 # prior to CMake 3.0 this feature was buggy
 if(NOT CMAKE_VERSION VERSION_LESS 3.0.0)
@@ -31,12 +31,16 @@ find_file(HAVE_LOCALE_H locale.h)
 find_file(HAVE_OPENGL_GLU_H OpenGL/glu.h)
 find_file(HAVE_PNG_H png.h)
 find_file(HAVE_PTHREAD_H pthread.h)
+find_file(HAVE_REGEX_H regex.h)
 find_file(HAVE_STDIO_H stdio.h)
 find_file(HAVE_STRINGS_H strings.h)
+find_file(HAVE_SYS_EPOLL_H sys/epoll.h)
+find_file(HAVE_SYS_EVENTFD_H sys/eventfd.h)
 find_file(HAVE_SYS_SELECT_H sys/select.h)
 find_file(HAVE_SYS_STDTYPES_H sys/stdtypes.h)
 find_file(HAVE_X11_XREGION_H X11/Xregion.h)
 find_path(HAVE_XDBE_H Xdbe.h PATH_SUFFIXES X11/extensions extensions)
+find_path(HAVE_XSHM_H XShm.h PATH_SUFFIXES X11/extensions extensions)
 
 # Simulate the behavior of autoconf macro AC_HEADER_DIRENT, see:
 # https://www.gnu.org/software/autoconf/manual/autoconf-2.69/html_node/Particular-Headers.html
@@ -61,10 +65,12 @@ mark_as_advanced(HAVE_ALSA_ASOUNDLIB_H HAVE_DIRENT_H HAVE_DLFCN_H)
 mark_as_advanced(HAVE_FREETYPE_H HAVE_GL_GL_H HAVE_GL_GLU_H)
 mark_as_advanced(HAVE_LIBPNG_PNG_H HAVE_LOCALE_H HAVE_NDIR_H)
 mark_as_advanced(HAVE_OPENGL_GLU_H HAVE_PNG_H HAVE_PTHREAD_H)
+mark_as_advanced(HAVE_REGEX_H)
 mark_as_advanced(HAVE_STDIO_H HAVE_STRINGS_H HAVE_SYS_DIR_H)
+mark_as_advanced(HAVE_SYS_EPOLL_H HAVE_SYS_EVENTFD_H)
 mark_as_advanced(HAVE_SYS_NDIR_H HAVE_SYS_SELECT_H)
 mark_as_advanced(HAVE_SYS_STDTYPES_H HAVE_XDBE_H)
-mark_as_advanced(HAVE_X11_XREGION_H)
+mark_as_advanced(HAVE_X11_XREGION_H HAVE_XSHM_H)
 
 # where to find freetype headers
 find_path(FREETYPE_PATH freetype.h PATH_SUFFIXES freetype2)
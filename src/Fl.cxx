@@ -53,6 +53,7 @@
 #include <ctype.h>
 #include <stdlib.h>
 #include "flstring.h"
+#include "fl_profile.h"
 
 #if defined(DEBUG) || defined(DEBUG_WATCH)
 #  include <stdio.h>
@@ -251,40 +252,166 @@ int Fl::event_inside(const Fl_Widget *o) /*const*/ {
 
 
 ////////////////////////////////////////////////////////////////////////
-// Timeouts are stored in a sorted list (*first_timeout), so only the
-// first one needs to be checked to see if any should be called.
-// Allocated, but unused (free) Timeout structs are stored in another
-// linked list (*free_timeout).
+// Timeouts are stored with their absolute deadline on a monotonic clock
+// in a binary min-heap (timeout_heap), so only the first one needs to be
+// checked to see if any should be called, and adding or calling one
+// costs O(log n) however many there are. Timeouts with the same deadline
+// are called in the order they were added, as with the sorted list this
+// replaces.
+// All timeouts are also listed in a hash table by callback and argument,
+// which makes has_timeout() and remove_timeout() O(1). A removed timeout
+// is only marked as such (cb = NULL) and left in the heap, until it
+// reaches the top or until removed timeouts fill half the heap.
+// Allocated, but unused (free) Timeout structs are stored in a linked
+// list (*free_timeout).
 
 struct Timeout {
-  double time;
-  void (*cb)(void*);
+  double time;		// deadline, see timeout_clock
+  unsigned long seq;	// order of the timeouts with the same deadline
+  void (*cb)(void*);	// callback, or NULL if the timeout was removed
   void* arg;
-  Timeout* next;
+  Timeout* next;	// next timeout in the hash table or free list
 };
-static Timeout* first_timeout, *free_timeout;
+static Timeout** timeout_heap;	// heap of timeouts, including removed ones
+static int timeout_count, timeout_alloc, timeout_removed;
+static Timeout** timeout_table;	// hash table of the timeouts not removed
+static int timeout_buckets, timeout_entries;
+static Timeout* free_timeout;
+static unsigned long timeout_seq;
 
 #include <sys/time.h>
+#include <time.h>
+
+// Time of the last clock reading, in seconds. All timeouts are relative
+// to this, so that the ones added or repeated in the callbacks of one
+// call of Fl::wait() are relative to the same time.
+static double timeout_clock;
 
 // I avoid the overhead of getting the current time when we have no
 // timeouts by setting this flag instead of getting the time.
-// In this case calling elapse_timeouts() does nothing, but records
-// the current time, and the next call will actually elapse time.
+// In this case the time is only read when the next timeout is added.
 static char reset_clock = 1;
 
-static void elapse_timeouts() {
-  static struct timeval prevclock;
-  struct timeval newclock;
-  gettimeofday(&newclock, NULL);
-  double elapsed = newclock.tv_sec - prevclock.tv_sec +
-    (newclock.tv_usec - prevclock.tv_usec)/1000000.0;
-  prevclock.tv_sec = newclock.tv_sec;
-  prevclock.tv_usec = newclock.tv_usec;
-  if (reset_clock) {
+// Reads the clock, which is monotonic if possible, so that changes of
+// the system time neither fire nor delay the timeouts.
+static void update_clock() {
+#ifdef CLOCK_MONOTONIC
+  struct timespec ts;
+  if (!clock_gettime(CLOCK_MONOTONIC, &ts)) {
+    timeout_clock = ts.tv_sec + ts.tv_nsec / 1000000000.0;
     reset_clock = 0;
-  } else if (elapsed > 0) {
-    for (Timeout* t = first_timeout; t; t = t->next) t->time -= elapsed;
+    return;
+  }
+#endif // CLOCK_MONOTONIC
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  timeout_clock = tv.tv_sec + tv.tv_usec / 1000000.0;
+  reset_clock = 0;
+}
+
+// Heap order: earlier deadline first, then the timeout added first.
+static inline int timeout_before(const Timeout *a, const Timeout *b) {
+  return a->time < b->time || (a->time == b->time && a->seq < b->seq);
+}
+
+static void timeout_sift_up(int i) {
+  Timeout *t = timeout_heap[i];
+  while (i > 0) {
+    int parent = (i - 1) / 2;
+    if (!timeout_before(t, timeout_heap[parent])) break;
+    timeout_heap[i] = timeout_heap[parent];
+    i = parent;
+  }
+  timeout_heap[i] = t;
+}
+
+static void timeout_sift_down(int i) {
+  Timeout *t = timeout_heap[i];
+  for (;;) {
+    int child = 2 * i + 1;
+    if (child >= timeout_count) break;
+    if (child + 1 < timeout_count &&
+        timeout_before(timeout_heap[child + 1], timeout_heap[child])) child ++;
+    if (!timeout_before(timeout_heap[child], t)) break;
+    timeout_heap[i] = timeout_heap[child];
+    i = child;
+  }
+  timeout_heap[i] = t;
+}
+
+// Removes the first timeout from the heap and returns it.
+static Timeout *timeout_pop() {
+  Timeout *t = timeout_heap[0];
+  if (--timeout_count > 0) {
+    timeout_heap[0] = timeout_heap[timeout_count];
+    timeout_sift_down(0);
+  }
+  return t;
+}
+
+static inline Timeout **timeout_bucket(void (*cb)(void*), void *arg) {
+  size_t h = (size_t)cb * 31 + (size_t)arg;
+  h ^= h >> 15; h *= 0x2c1b3c6dU; h ^= h >> 12;
+  return timeout_table + (h & (timeout_buckets - 1));
+}
+
+static void timeout_table_add(Timeout *t) {
+  if (timeout_entries >= timeout_buckets) {
+    // Grow the table to keep the chains short...
+    Timeout **old = timeout_table;
+    int i, old_buckets = timeout_buckets;
+    timeout_buckets = old_buckets ? 2 * old_buckets : 64;
+    timeout_table   = (Timeout **)calloc(timeout_buckets, sizeof(Timeout *));
+    for (i = 0; i < old_buckets; i ++)
+      while (old[i]) {
+        Timeout *o = old[i];
+        old[i] = o->next;
+        Timeout **b = timeout_bucket(o->cb, o->arg);
+        o->next = *b;
+        *b = o;
+      }
+    free(old);
+  }
+  Timeout **b = timeout_bucket(t->cb, t->arg);
+  t->next = *b;
+  *b = t;
+  timeout_entries ++;
+}
+
+static void timeout_table_remove(Timeout *t) {
+  for (Timeout **p = timeout_bucket(t->cb, t->arg); *p; p = &((*p)->next))
+    if (*p == t) {
+      *p = t->next;
+      timeout_entries --;
+      return;
+    }
+}
+
+static void timeout_free(Timeout *t) {
+  t->next = free_timeout;
+  free_timeout = t;
+}
+
+// Returns the first timeout that was not removed, or NULL.
+static Timeout *first_timeout() {
+  while (timeout_count && !timeout_heap[0]->cb) {
+    timeout_free(timeout_pop());
+    timeout_removed --;
+  }
+  return timeout_count ? timeout_heap[0] : 0;
+}
+
+// Drops the removed timeouts from the heap once they fill half of it.
+static void compact_timeouts() {
+  if (timeout_removed < 32 || 2 * timeout_removed < timeout_count) return;
+  int i, n = 0;
+  for (i = 0; i < timeout_count; i ++) {
+    if (timeout_heap[i]->cb) timeout_heap[n++] = timeout_heap[i];
+    else timeout_free(timeout_heap[i]);
   }
+  timeout_count   = n;
+  timeout_removed = 0;
+  for (i = n / 2 - 1; i >= 0; i --) timeout_sift_down(i);
 }
 
 // Continuously-adjusted error value, this is a number <= 0 for how late
@@ -294,11 +421,12 @@ static void elapse_timeouts() {
 static double missed_timeout_by;
 
 void Fl::add_timeout(double time, Fl_Timeout_Handler cb, void *argp) {
-  elapse_timeouts();
+  update_clock();
   repeat_timeout(time, cb, argp);
 }
 
 void Fl::repeat_timeout(double time, Fl_Timeout_Handler cb, void *argp) {
+  if (reset_clock) update_clock();
   time += missed_timeout_by; if (time < -.05) time = 0;
   Timeout* t = free_timeout;
   if (t) {
@@ -306,21 +434,26 @@ void Fl::repeat_timeout(double time, Fl_Timeout_Handler cb, void *argp) {
   } else {
       t = new Timeout;
   }
-  t->time = time;
+  t->time = timeout_clock + time;
+  t->seq = timeout_seq ++;
   t->cb = cb;
   t->arg = argp;
-  // insert-sort the new timeout:
-  Timeout** p = &first_timeout;
-  while (*p && (*p)->time <= time) p = &((*p)->next);
-  t->next = *p;
-  *p = t;
+  timeout_table_add(t);
+  // add the new timeout to the heap:
+  if (timeout_count >= timeout_alloc) {
+    timeout_alloc = timeout_alloc ? 2 * timeout_alloc : 64;
+    timeout_heap  = (Timeout **)realloc(timeout_heap, timeout_alloc * sizeof(Timeout *));
+  }
+  timeout_heap[timeout_count] = t;
+  timeout_sift_up(timeout_count ++);
 }
 
 /**
   Returns true if the timeout exists and has not been called yet.
 */
 int Fl::has_timeout(Fl_Timeout_Handler cb, void *argp) {
-  for (Timeout* t = first_timeout; t; t = t->next)
+  if (!timeout_entries) return 0;
+  for (Timeout* t = *timeout_bucket(cb, argp); t; t = t->next)
     if (t->cb == cb && t->arg == argp) return 1;
   return 0;
 }
@@ -333,16 +466,24 @@ int Fl::has_timeout(Fl_Timeout_Handler cb, void *argp) {
 	This may change in the future.
 */
 void Fl::remove_timeout(Fl_Timeout_Handler cb, void *argp) {
-  for (Timeout** p = &first_timeout; *p;) {
-    Timeout* t = *p;
-    if (t->cb == cb && (t->arg == argp || !argp)) {
-      *p = t->next;
-      t->next = free_timeout;
-      free_timeout = t;
-    } else {
-      p = &(t->next);
+  if (!timeout_entries) return;
+  // Without an argument all the timeouts of cb are removed, so all
+  // buckets must be searched...
+  Timeout **b = argp ? timeout_bucket(cb, argp) : timeout_table;
+  Timeout **last = argp ? b : timeout_table + timeout_buckets - 1;
+  for (; b <= last; b ++)
+    for (Timeout** p = b; *p;) {
+      Timeout* t = *p;
+      if (t->cb == cb && (t->arg == argp || !argp)) {
+        *p = t->next;
+        timeout_entries --;
+        t->cb = 0; // freed when it reaches the top of the heap
+        timeout_removed ++;
+      } else {
+        p = &(t->next);
+      }
     }
-  }
+  compact_timeouts();
 }
 
 #endif
@@ -445,7 +586,9 @@ static void run_checks()
     while (next_check) {
       Check* checkp = next_check;
       next_check = checkp->next;
+      double t0 = fl_profile_begin();
       (checkp->cb)(checkp->arg);
+      fl_profile_end(t0, FL_PROFILE_IDLE);
     }
     next_check = first_check;
   }
@@ -526,6 +669,7 @@ void (*Fl::idle)(); // see Fl::add_idle.cxx for the add/remove functions
 
 extern int fl_ready(); // in Fl_<platform>.cxx
 extern int fl_wait(double time); // in Fl_<platform>.cxx
+extern void fl_frame_flush(); // see below
 
 /**
   See int Fl::wait()
@@ -545,21 +689,23 @@ double Fl::wait(double time_to_wait) {
 
 #else
 
-  if (first_timeout) {
-    elapse_timeouts();
+  if (timeout_count) {
+    update_clock();
     Timeout *t;
-    while ((t = first_timeout)) {
-      if (t->time > 0) break;
-      // The first timeout in the array has expired.
-      missed_timeout_by = t->time;
-      // We must remove timeout from array before doing the callback:
+    while ((t = first_timeout())) {
+      if (t->time > timeout_clock) break;
+      // The first timeout in the heap has expired.
+      missed_timeout_by = t->time - timeout_clock;
+      // We must remove timeout from heap before doing the callback:
       void (*cb)(void*) = t->cb;
       void *argp = t->arg;
-      first_timeout = t->next;
-      t->next = free_timeout;
-      free_timeout = t;
+      timeout_pop();
+      timeout_table_remove(t);
+      timeout_free(t);
       // Now it is safe for the callback to do add_timeout:
+      double t0 = fl_profile_begin();
       cb(argp);
+      fl_profile_end(t0, FL_PROFILE_TIMEOUTS);
     }
   } else {
     reset_clock = 1; // we are not going to check the clock
@@ -569,24 +715,32 @@ double Fl::wait(double time_to_wait) {
   if (idle) {
     if (!in_idle) {
       in_idle = 1;
+      double t0 = fl_profile_begin();
       idle();
+      fl_profile_end(t0, FL_PROFILE_IDLE);
       in_idle = 0;
     }
     // the idle function may turn off idle, we can then wait:
     if (idle) time_to_wait = 0.0;
   }
-  if (first_timeout && first_timeout->time < time_to_wait)
-    time_to_wait = first_timeout->time;
+  Timeout *first = first_timeout();
+  if (first && first->time - timeout_clock < time_to_wait)
+    time_to_wait = first->time - timeout_clock;
   if (time_to_wait <= 0.0) {
     // do flush second so that the results of events are visible:
     int ret = fl_wait(0.0);
-    flush();
+    fl_frame_flush();
     return ret;
   } else {
     // do flush first so that user sees the display:
-    flush();
+    fl_frame_flush();
     if (idle && !in_idle) // 'idle' may have been set within flush()
       time_to_wait = 0.0;
+    // a postponed flush may have added a timeout:
+    first = first_timeout();
+    if (first && first->time - timeout_clock < time_to_wait)
+      time_to_wait = first->time - timeout_clock;
+    if (time_to_wait < 0.0) time_to_wait = 0.0;
     return fl_wait(time_to_wait);
   }
 #endif
@@ -677,9 +831,10 @@ int Fl::check() {
 */
 int Fl::ready() {
 #if ! defined( WIN32 )  &&  ! defined(__APPLE__)
-  if (first_timeout) {
-    elapse_timeouts();
-    if (first_timeout->time <= 0) return 1;
+  if (timeout_count) {
+    update_clock();
+    Timeout *first = first_timeout();
+    if (first && first->time <= timeout_clock) return 1;
   } else {
     reset_clock = 1;
   }
@@ -750,11 +905,135 @@ void Fl::redraw() {
   for (Fl_X* i = Fl_X::first; i; i = i->next) i->w->redraw();
 }
 
+////////////////////////////////////////////////////////////////
+// Frame pacing and statistics:
+//
+// With a frame rate set, the event loop calls fl_frame_flush() instead of
+// Fl::flush(): damage is only flushed once per frame interval, and the
+// flush is postponed while user input is waiting, by at most one more
+// interval. A timeout wakes up the event loop for the postponed flush.
+// Fl::flush() itself always flushes.
+
+static double frame_interval = 0.0;	// 1 / frame rate, 0 if not paced
+static double frame_last = -1e20;	// start of the last paced flush
+
+struct Fl_Frame_Window {
+  const Fl_Window *win;
+  Fl_Frame_Stats stats;
+  double start;				// start of the last frame
+  double total;				// time of all the frames
+  Fl_Frame_Window *next;
+};
+
+static Fl_Frame_Window *frame_windows = 0;
+static Fl_Frame_Stats frame_all;	// statistics of all windows
+static double frame_all_start, frame_all_total;
+
+// Adds a frame that started at t0 and ended at t1 to the statistics.
+static void frame_count(Fl_Frame_Stats &s, double &start, double &total,
+                        double t0, double t1) {
+  double t = t1 - t0;
+  if (s.frames) s.interval = t0 - start;
+  start = t0;
+  s.frames ++;
+  s.last = t;
+  total += t;
+  s.average = total / s.frames;
+  if (t > s.max) s.max = t;
+}
+
+static void frame_drawn(const Fl_Window *win, double t0, double t1) {
+  Fl_Frame_Window *f;
+  for (f = frame_windows; f; f = f->next)
+    if (f->win == win) break;
+  if (!f) {
+    f = new Fl_Frame_Window;
+    memset(f, 0, sizeof(*f));
+    f->win = win;
+    f->next = frame_windows;
+    frame_windows = f;
+  }
+  frame_count(f->stats, f->start, f->total, t0, t1);
+}
+
+// Forgets the statistics of a window, called when it is hidden.
+static void frame_forget(const Fl_Window *win) {
+  for (Fl_Frame_Window **p = &frame_windows; *p; p = &(*p)->next)
+    if ((*p)->win == win) {
+      Fl_Frame_Window *f = *p;
+      *p = f->next;
+      delete f;
+      return;
+    }
+}
+
+// Returns non-zero if user input is waiting to be handled.
+static int frame_input_pending() {
+#if defined(USE_X11)
+  return fl_display && XEventsQueued(fl_display, QueuedAfterReading);
+#elif defined(WIN32)
+  return HIWORD(GetQueueStatus(QS_INPUT)) != 0;
+#else
+  return 0;
+#endif
+}
+
+// Only wakes up the event loop for a postponed flush. It is added with the
+// address of frame_timeout_arg, so that it is found in the timeout table
+// without searching all the timeouts.
+static void frame_timeout(void *) {}
+static char frame_timeout_arg;
+
+// Sends the drawing commands to the display.
+static void flush_output() {
+#if defined(USE_X11)
+  if (fl_display) XFlush(fl_display);
+#elif defined(WIN32)
+  GdiFlush();
+#elif defined (__APPLE_QUARTZ__)
+  if (fl_gc)
+    CGContextFlush(fl_gc);
+#else
+# error unsupported platform
+#endif
+}
+
+// Called by the event loop instead of Fl::flush() (also in Fl_win32.cxx
+// and Fl_cocoa.mm).
+void fl_frame_flush() {
+  if (frame_interval <= 0.0 || !Fl::damage()) {
+    Fl::flush();
+    return;
+  }
+
+  double now = fl_clock();
+  double due = frame_last + frame_interval;
+  double wake = 0.0;
+
+  if (now < due) wake = due;
+  else if (now < due + frame_interval && frame_input_pending()) wake = due + frame_interval;
+
+  if (wake > 0.0) {
+    // Not yet, make sure that the event loop comes back in time...
+    if (!Fl::has_timeout(frame_timeout, &frame_timeout_arg))
+      Fl::add_timeout(wake - now, frame_timeout, &frame_timeout_arg);
+    frame_all.deferred ++;
+    flush_output();
+    return;
+  }
+
+  Fl::remove_timeout(frame_timeout, &frame_timeout_arg);
+  // Keep the frames on the interval grid unless the loop fell behind
+  frame_last = now < due + frame_interval ? due : now;
+  Fl::flush();
+}
+
 /**
   Causes all the windows that need it to be redrawn and graphics forced
   out through the pipes.
 
-  This is what wait() does before looking for events.
+  This is what wait() does before looking for events, unless a frame rate
+  was set with frame_rate(double).
 
   Note: in multi-threaded applications you should only call Fl::flush()
   from the main thread. If a child thread needs to trigger a redraw event,
@@ -768,21 +1047,87 @@ void Fl::flush() {
       if (i->wait_for_expose) {damage_ = 1; continue;}
       Fl_Window* wi = i->w;
       if (!wi->visible_r()) continue;
-      if (wi->damage()) {i->flush(); wi->clear_damage();}
+      if (wi->damage()) {
+        double p0 = fl_profile_begin();
+        double t0 = fl_clock();
+        i->flush();
+        wi->clear_damage();
+        double t1 = fl_clock();
+        fl_profile_end(p0, FL_PROFILE_FLUSH, wi);
+        frame_drawn(wi, t0, t1);
+        frame_count(frame_all, frame_all_start, frame_all_total, t0, t1);
+      }
       // destroy damage regions for windows that don't use them:
       if (i->region) {XDestroyRegion(i->region); i->region = 0;}
     }
   }
-#if defined(USE_X11)
-  if (fl_display) XFlush(fl_display);
-#elif defined(WIN32)
-  GdiFlush();
-#elif defined (__APPLE_QUARTZ__)
-  if (fl_gc)
-    CGContextFlush(fl_gc);
-#else
-# error unsupported platform
-#endif
+  flush_output();
+}
+
+/**
+  Limits how often the event loop redraws the windows.
+
+  By default wait() redraws the damaged windows each time it is called,
+  which can be thousands of times per second when many events, timeouts
+  or Fl::awake() callbacks arrive. With a frame rate of \p fps frames per
+  second, the damage is accumulated and the windows are redrawn at most
+  once per 1 / \p fps seconds. The redraw is also postponed while user
+  input is waiting, by one frame interval at most, so that the program
+  handles the input before it spends time on drawing.
+
+  Widgets are redrawn exactly as without a frame rate, only less often.
+  Calling flush() directly always redraws the windows. A frame rate of 0
+  (the default) disables the pacing.
+
+  \see frame_stats()
+  \version 1.3.5
+*/
+void Fl::frame_rate(double fps) {
+  frame_interval = fps > 0.0 ? 1.0 / fps : 0.0;
+  if (!frame_interval) Fl::remove_timeout(frame_timeout, &frame_timeout_arg);
+}
+
+/** Returns the frame rate set with frame_rate(double), or 0. */
+double Fl::frame_rate() {
+  return frame_interval > 0.0 ? 1.0 / frame_interval : 0.0;
+}
+
+/**
+  Gets the frame statistics of a window.
+
+  FLTK measures the time it takes to draw each window when flush()
+  redraws it. If \p win is NULL, \p stats is set to the statistics of
+  all the windows together, and \p stats->deferred to the number of
+  times the event loop postponed a redraw because of frame_rate(double).
+
+  Returns 0 and sets \p stats to zeros if \p win was not drawn since it
+  was shown or since reset_frame_stats(), or 1 otherwise.
+
+  \version 1.3.5
+*/
+int Fl::frame_stats(const Fl_Window *win, Fl_Frame_Stats *stats) {
+  if (!win) {
+    *stats = frame_all;
+    return frame_all.frames != 0;
+  }
+  for (Fl_Frame_Window *f = frame_windows; f; f = f->next)
+    if (f->win == win) {
+      *stats = f->stats;
+      return 1;
+    }
+  memset(stats, 0, sizeof(*stats));
+  return 0;
+}
+
+/** Clears the frame statistics of all the windows, see frame_stats(). */
+void Fl::reset_frame_stats() {
+  while (frame_windows) {
+    Fl_Frame_Window *f = frame_windows;
+    frame_windows = f->next;
+    delete f;
+  }
+  memset(&frame_all, 0, sizeof(frame_all));
+  frame_all_total = 0.0;
 }
 
 
@@ -1539,6 +1884,8 @@ void Fl_Window::hide() {
 
   if (!shown()) return;
 
+  frame_forget(this);
+
   // remove from the list of windows:
   Fl_X* ip = i;
   Fl_X** pp = &Fl_X::first;
@@ -1975,10 +2322,12 @@ void Fl::delete_widget(Fl_Widget *wi) {
 void Fl::do_widget_deletion() {
   if (!num_dwidgets) return;
 
+  double t0 = fl_profile_begin();
   for (int i = 0; i < num_dwidgets; i ++)
     delete dwidgets[i];
 
   num_dwidgets = 0;
+  fl_profile_end(t0, FL_PROFILE_DELETION);
 }
 
 
@@ -31,6 +31,7 @@
 #include <config.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include "Fl_Image_Reader.H"
 
 
 //
@@ -45,15 +46,6 @@
 #endif // !BI_RGB
 
 
-//
-// Local functions...
-//
-
-static int		read_long(FILE *fp);
-static unsigned short	read_word(FILE *fp);
-static unsigned int	read_dword(FILE *fp);
-
-
 /**
  The constructor loads the named BMP image from the given bmp filename.
 
@@ -67,7 +59,7 @@ static unsigned int	read_dword(FILE *fp);
  */
 Fl_BMP_Image::Fl_BMP_Image(const char *bmp) // I - File to read
   : Fl_RGB_Image(0,0,0) {
-  FILE		*fp;		// File pointer
+  Fl_Image_Reader r;		// File reader
   int		info_size,	// Size of info header
 		depth,		// Depth of image (bits)
 		bDepth = 3,	// Depth of image (bytes)
@@ -92,27 +84,26 @@ Fl_BMP_Image::Fl_BMP_Image(const char *bmp) // I - File to read
 
 
   // Open the file...
-  if ((fp = fl_fopen(bmp, "rb")) == NULL) {
+  if (r.open(bmp)) {
     ld(ERR_FILE_ACCESS);
     return;
   }
 
   // Get the header...
-  byte = (uchar)getc(fp);	// Check "BM" sync chars
-  bit  = (uchar)getc(fp);
+  byte = (uchar)r.read_byte();	// Check "BM" sync chars
+  bit  = (uchar)r.read_byte();
   if (byte != 'B' || bit != 'M') {
-    fclose(fp);
     ld(ERR_FORMAT);
     return;
   }
 
-  read_dword(fp);		// Skip size
-  read_word(fp);		// Skip reserved stuff
-  read_word(fp);
-  offbits = (long)read_dword(fp);// Read offset to image data
+  r.read_dword();		// Skip size
+  r.read_word();		// Skip reserved stuff
+  r.read_word();
+  offbits = (long)r.read_dword();// Read offset to image data
 
   // Then the bitmap information...
-  info_size = read_dword(fp);
+  info_size = r.read_dword();
 
 //  printf("offbits = %ld, info_size = %d\n", offbits, info_size);
 
@@ -122,29 +113,29 @@ Fl_BMP_Image::Fl_BMP_Image(const char *bmp) // I - File to read
 
   if (info_size < 40) {
     // Old Windows/OS2 BMP header...
-    w(read_word(fp));
-    h(read_word(fp));
-    read_word(fp);
-    depth = read_word(fp);
+    w(r.read_word());
+    h(r.read_word());
+    r.read_word();
+    depth = r.read_word();
     compression = BI_RGB;
     colors_used = 0;
 
     repcount = info_size - 12;
   } else {
     // New BMP header...
-    w(read_long(fp));
+    w(r.read_long());
     // If the height is negative, the row order is flipped
-    temp = read_long(fp);
+    temp = r.read_long();
     if (temp < 0) row_order = 1;
     h(abs(temp));
-    read_word(fp);
-    depth = read_word(fp);
-    compression = read_dword(fp);
-    dataSize = read_dword(fp);
-    read_long(fp);
-    read_long(fp);
-    colors_used = read_dword(fp);
-    read_dword(fp);
+    r.read_word();
+    depth = r.read_word();
+    compression = r.read_dword();
+    dataSize = r.read_dword();
+    r.read_long();
+    r.read_long();
+    colors_used = r.read_dword();
+    r.read_dword();
 
     repcount = info_size - 40;
 
@@ -164,13 +155,12 @@ Fl_BMP_Image::Fl_BMP_Image(const char *bmp) // I - File to read
 
   // Skip remaining header bytes...
   while (repcount > 0) {
-    getc(fp);
+    r.read_byte();
     repcount --;
   }
 
   // Check header data...
   if (!w() || !h() || !depth) {
-    fclose(fp);
     w(0); h(0); d(0); ld(ERR_FORMAT);
     return;
   }
@@ -181,15 +171,15 @@ Fl_BMP_Image::Fl_BMP_Image(const char *bmp) // I - File to read
 
   for (repcount = 0; repcount < colors_used; repcount ++) {
     // Read BGR color...
-    if (fread(colormap[repcount], 1, 3, fp)==0) { /* ignore */ }
+    if (r.read(colormap[repcount], 3)==0) { /* ignore */ }
 
     // Skip pad byte for new BMP files...
-    if (info_size > 12) getc(fp);
+    if (info_size > 12) r.read_byte();
   }
 
   // Read first dword of colormap. It tells us if 5:5:5 or 5:6:5 for 16 bit
   if (depth == 16)
-    use_5_6_5 = (read_dword(fp) == 0xf800);
+    use_5_6_5 = (r.read_dword() == 0xf800);
 
   // Set byte depth for RGBA images
   if (depth == 32)
@@ -197,11 +187,10 @@ Fl_BMP_Image::Fl_BMP_Image(const char *bmp) // I - File to read
 
   // Setup image and buffers...
   d(bDepth);
-  if (offbits) fseek(fp, offbits, SEEK_SET);
+  if (offbits) r.seek(offbits);
 
   if (((size_t)w()) * h() * d() > max_size() ) {
     Fl::warning("BMP file \"%s\" is too large!\n", bmp);
-    fclose(fp);
     w(0); h(0); d(0); ld(ERR_FORMAT);
     return;
   }
@@ -230,7 +219,7 @@ Fl_BMP_Image::Fl_BMP_Image(const char *bmp) // I - File to read
     {
       case 1 : // Bitmap
           for (x = w(), bit = 128; x > 0; x --) {
-	    if (bit == 128) byte = (uchar)getc(fp);
+	    if (bit == 128) byte = (uchar)r.read_byte();
 
 	    if (byte & bit) {
 	      *ptr++ = colormap[1][2];
@@ -250,7 +239,7 @@ Fl_BMP_Image::Fl_BMP_Image(const char *bmp) // I - File to read
 
           // Read remaining bytes to align to 32 bits...
 	  for (temp = (w() + 7) / 8; temp & 3; temp ++) {
-	    getc(fp);
+	    r.read_byte();
 	  }
           break;
 
@@ -264,11 +253,11 @@ Fl_BMP_Image::Fl_BMP_Image(const char *bmp) // I - File to read
               } else {
 		while (align > 0) {
 	          align --;
-		  getc(fp);
+		  r.read_byte();
         	}
 
-		if ((repcount = getc(fp)) == 0) {
-		  if ((repcount = getc(fp)) == 0) {
+		if ((repcount = r.read_byte()) == 0) {
+		  if ((repcount = r.read_byte()) == 0) {
 		    // End of line...
                     x ++;
 		    continue;
@@ -277,7 +266,7 @@ Fl_BMP_Image::Fl_BMP_Image(const char *bmp) // I - File to read
 		    break;
 		  } else if (repcount == 2) {
 		    // Delta...
-		    repcount = getc(fp) * getc(fp) * w();
+		    repcount = r.read_byte() * r.read_byte() * w();
 		    color = 0;
 		  } else {
 		    // Absolute...
@@ -285,7 +274,7 @@ Fl_BMP_Image::Fl_BMP_Image(const char *bmp) // I - File to read
 		    align = ((4 - (repcount & 3)) / 2) & 1;
 		  }
 		} else {
-	          color = getc(fp);
+	          color = r.read_byte();
 		}
 	      }
 	    }
@@ -296,7 +285,7 @@ Fl_BMP_Image::Fl_BMP_Image(const char *bmp) // I - File to read
 	    // Extract the next pixel...
             if (bit == 0xf0) {
 	      // Get the next color byte as needed...
-              if (color < 0) temp = getc(fp);
+              if (color < 0) temp = r.read_byte();
 	      else temp = color;
 
               // Copy the color value...
@@ -319,7 +308,7 @@ Fl_BMP_Image::Fl_BMP_Image(const char *bmp) // I - File to read
 	  if (!compression) {
             // Read remaining bytes to align to 32 bits...
 	    for (temp = (w() + 1) / 2; temp & 3; temp ++) {
-	      getc(fp);
+	      r.read_byte();
 	    }
 	  }
           break;
@@ -335,11 +324,11 @@ Fl_BMP_Image::Fl_BMP_Image(const char *bmp) // I - File to read
 	    if (repcount == 0) {
 	      while (align > 0) {
 	        align --;
-		getc(fp);
+		r.read_byte();
               }
 
-	      if ((repcount = getc(fp)) == 0) {
-		if ((repcount = getc(fp)) == 0) {
+	      if ((repcount = r.read_byte()) == 0) {
+		if ((repcount = r.read_byte()) == 0) {
 		  // End of line...
                   x ++;
 		  continue;
@@ -348,7 +337,7 @@ Fl_BMP_Image::Fl_BMP_Image(const char *bmp) // I - File to read
 		  break;
 		} else if (repcount == 2) {
 		  // Delta...
-		  repcount = getc(fp) * getc(fp) * w();
+		  repcount = r.read_byte() * r.read_byte() * w();
 		  color = 0;
 		} else {
 		  // Absolute...
@@ -356,12 +345,12 @@ Fl_BMP_Image::Fl_BMP_Image(const char *bmp) // I - File to read
 		  align = (2 - (repcount & 1)) & 1;
 		}
 	      } else {
-	        color = getc(fp);
+	        color = r.read_byte();
               }
             }
 
             // Get a new color as needed...
-            if (color < 0) temp = getc(fp);
+            if (color < 0) temp = r.read_byte();
 	    else temp = color;
 
             repcount --;
@@ -376,14 +365,14 @@ Fl_BMP_Image::Fl_BMP_Image(const char *bmp) // I - File to read
 	  if (!compression) {
             // Read remaining bytes to align to 32 bits...
 	    for (temp = w(); temp & 3; temp ++) {
-	      getc(fp);
+	      r.read_byte();
 	    }
 	  }
           break;
 
       case 16 : // 16-bit 5:5:5 or 5:6:5 RGB
           for (x = w(); x > 0; x --, ptr += bDepth) {
-	    uchar b = getc(fp), a = getc(fp) ;
+	    uchar b = r.read_byte(), a = r.read_byte() ;
 	    if (use_5_6_5) {
 		ptr[2] = (uchar)(( b << 3 ) & 0xf8);
 		ptr[1] = (uchar)(((a << 5) & 0xe0) | ((b >> 3) & 0x1c));
@@ -397,29 +386,29 @@ Fl_BMP_Image::Fl_BMP_Image(const char *bmp) // I - File to read
 
           // Read remaining bytes to align to 32 bits...
 	  for (temp = w() * 2; temp & 3; temp ++) {
-	    getc(fp);
+	    r.read_byte();
 	  }
           break;
 
       case 24 : // 24-bit RGB
           for (x = w(); x > 0; x --, ptr += bDepth) {
-	    ptr[2] = (uchar)getc(fp);
-	    ptr[1] = (uchar)getc(fp);
-	    ptr[0] = (uchar)getc(fp);
+	    ptr[2] = (uchar)r.read_byte();
+	    ptr[1] = (uchar)r.read_byte();
+	    ptr[0] = (uchar)r.read_byte();
 	  }
 
           // Read remaining bytes to align to 32 bits...
 	  for (temp = w() * 3; temp & 3; temp ++) {
-	    getc(fp);
+	    r.read_byte();
 	  }
           break;
 		  
       case 32 : // 32-bit RGBA
          for (x = w(); x > 0; x --, ptr += bDepth) {
-            ptr[2] = (uchar)getc(fp);
-            ptr[1] = (uchar)getc(fp);
-            ptr[0] = (uchar)getc(fp);
-            ptr[3] = (uchar)getc(fp);
+            ptr[2] = (uchar)r.read_byte();
+            ptr[1] = (uchar)r.read_byte();
+            ptr[0] = (uchar)r.read_byte();
+            ptr[3] = (uchar)r.read_byte();
           }
           break;
     }
@@ -429,7 +418,7 @@ Fl_BMP_Image::Fl_BMP_Image(const char *bmp) // I - File to read
     for (y = h() - 1; y >= 0; y --) {
       ptr = (uchar *)array + y * w() * d() + 3;
       for (x = w(), bit = 128; x > 0; x --, ptr+=bDepth) {
-	if (bit == 128) byte = (uchar)getc(fp);
+	if (bit == 128) byte = (uchar)r.read_byte();
 	if (byte & bit)
 	  *ptr = 0;
 	else
@@ -441,61 +430,9 @@ Fl_BMP_Image::Fl_BMP_Image(const char *bmp) // I - File to read
       }
       // Read remaining bytes to align to 32 bits...
       for (temp = (w() + 7) / 8; temp & 3; temp ++)
-	getc(fp);
+	r.read_byte();
     }
   }
-
-  // Close the file and return...
-  fclose(fp);
-}
-
-
-//
-// 'read_word()' - Read a 16-bit unsigned integer.
-//
-
-static unsigned short	// O - 16-bit unsigned integer
-read_word(FILE *fp) {	// I - File to read from
-  unsigned char b0, b1;	// Bytes from file
-
-  b0 = (uchar)getc(fp);
-  b1 = (uchar)getc(fp);
-
-  return ((b1 << 8) | b0);
-}
-
-
-//
-// 'read_dword()' - Read a 32-bit unsigned integer.
-//
-
-static unsigned int		// O - 32-bit unsigned integer
-read_dword(FILE *fp) {		// I - File to read from
-  unsigned char b0, b1, b2, b3;	// Bytes from file
-
-  b0 = (uchar)getc(fp);
-  b1 = (uchar)getc(fp);
-  b2 = (uchar)getc(fp);
-  b3 = (uchar)getc(fp);
-
-  return ((((((b3 << 8) | b2) << 8) | b1) << 8) | b0);
-}
-
-
-//
-// 'read_long()' - Read a 32-bit signed integer.
-//
-
-static int			// O - 32-bit signed integer
-read_long(FILE *fp) {		// I - File to read from
-  unsigned char b0, b1, b2, b3;	// Bytes from file
-
-  b0 = (uchar)getc(fp);
-  b1 = (uchar)getc(fp);
-  b2 = (uchar)getc(fp);
-  b3 = (uchar)getc(fp);
-
-  return ((int)(((((b3 << 8) | b2) << 8) | b1) << 8) | b0);
 }
 
 
@@ -29,6 +29,7 @@
 #include <stdlib.h>
 #include <FL/fl_utf8.h>
 #include "flstring.h"
+#include "Fl_Image_Reader.H"
 
 // Read a .gif file and convert it to a "xpm" format (actually my
 // modified one with compressed colormaps).
@@ -67,7 +68,7 @@
 
 typedef unsigned char uchar;
 
-#define NEXTBYTE (uchar)getc(GifFile)
+#define NEXTBYTE (uchar)GifFile.read_byte()
 #define GETSHORT(var) var = NEXTBYTE; var += NEXTBYTE << 8
 
 /**
@@ -82,23 +83,21 @@ typedef unsigned char uchar;
  be loaded for another reason.
  */
 Fl_GIF_Image::Fl_GIF_Image(const char *infname) : Fl_Pixmap((char *const*)0) {
-  FILE *GifFile;	// File to read
+  Fl_Image_Reader GifFile;	// File to read
   char **new_data;	// Data array
 
-  if ((GifFile = fl_fopen(infname, "rb")) == NULL) {
+  if (GifFile.open(infname)) {
     Fl::error("Fl_GIF_Image: Unable to open %s!", infname);
     ld(ERR_FILE_ACCESS);
     return;
   }
 
   {char b[6];
-  if (fread(b,1,6,GifFile)<6) {
-    fclose(GifFile);
+  if (GifFile.read(b,6)<6) {
     ld(ERR_FILE_ACCESS);
     return; /* quit on eof */
   }
   if (b[0]!='G' || b[1]!='I' || b[2] != 'F') {
-    fclose(GifFile);
     Fl::error("Fl_GIF_Image: %s is not a GIF file.\n", infname);
     ld(ERR_FORMAT);
     return;
@@ -142,7 +141,6 @@ Fl_GIF_Image::Fl_GIF_Image(const char *infname) : Fl_Pixmap((char *const*)0) {
 
     int i = NEXTBYTE;
     if (i<0) {
-      fclose(GifFile);
       Fl::error("Fl_GIF_Image: %s - unexpected EOF",infname); 
       w(0); h(0); d(0); ld(ERR_FORMAT);
       return;
@@ -160,7 +158,7 @@ Fl_GIF_Image::Fl_GIF_Image(const char *infname) : Fl_Pixmap((char *const*)0) {
 
 	char bits;
 	bits = NEXTBYTE;
-	getc(GifFile); getc(GifFile); // GETSHORT(delay);
+	GifFile.read_byte(); GifFile.read_byte(); // GETSHORT(delay);
 	transparent_pixel = NEXTBYTE;
 	if (bits & 1) has_transparent = 1;
 	blocklen = NEXTBYTE;
@@ -381,8 +379,6 @@ Fl_GIF_Image::Fl_GIF_Image(const char *infname) : Fl_Pixmap((char *const*)0) {
   alloc_data = 1;
 
   delete[] Image;
-
-  fclose(GifFile);
 }
 
 
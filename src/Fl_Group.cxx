@@ -27,6 +27,7 @@
 #include <FL/Fl_Window.H>
 #include <FL/fl_draw.H>
 #include <stdlib.h>
+#include "fl_profile.h"
 
 #include <FL/Fl_Input_Choice.H>
 #include <FL/Fl_Spinner.H>
@@ -754,8 +755,10 @@ void Fl_Group::draw() {
 void Fl_Group::update_child(Fl_Widget& widget) const {
   if (widget.damage() && widget.visible() && widget.type() < FL_WINDOW &&
       fl_not_clipped(widget.x(), widget.y(), widget.w(), widget.h())) {
+    double t0 = fl_profile_begin();
     widget.draw();	
     widget.clear_damage();
+    fl_profile_end(t0, FL_PROFILE_DRAW, &widget);
   }
 }
 
@@ -768,9 +771,11 @@ void Fl_Group::update_child(Fl_Widget& widget) const {
 void Fl_Group::draw_child(Fl_Widget& widget) const {
   if (widget.visible() && widget.type() < FL_WINDOW &&
       fl_not_clipped(widget.x(), widget.y(), widget.w(), widget.h())) {
+    double t0 = fl_profile_begin();
     widget.clear_damage(FL_DAMAGE_ALL);
     widget.draw();
     widget.clear_damage();
+    fl_profile_end(t0, FL_PROFILE_DRAW, &widget);
   }
 }
 
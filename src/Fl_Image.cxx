@@ -24,12 +24,21 @@
 #include <FL/Fl_Image.H>
 #include <FL/Fl_Printer.H>
 #include "flstring.h"
+#include "Fl_Image_Reader.H"
+#if defined(USE_X11) && HAVE_XRENDER
+#  include <X11/extensions/Xrender.h>
+#endif
+#if defined(__SSE2__)
+#  include <emmintrin.h>
+#endif
 
 #ifdef WIN32
 void fl_release_dc(HWND, HDC); // from Fl_win32.cxx
 #endif
 
 void fl_restore_clip(); // from fl_rect.cxx
+void fl_scale_image(const uchar *src, int w, int h, int d, int ld,
+                    uchar *dst, int W, int H, Fl_RGB_Scaling method); // from fl_scale_image.cxx
 
 //
 // Base image class...
@@ -293,6 +302,7 @@ Fl_RGB_Image::~Fl_RGB_Image() {
   uncache();
   if (alloc_array) delete[] (uchar *)array;
 #endif
+  Fl_Image_Reader::release(this);
 }
 
 void Fl_RGB_Image::uncache() {
@@ -305,6 +315,12 @@ void Fl_RGB_Image::uncache() {
   }
 #else
   if (id_) {
+#if defined(USE_X11) && HAVE_XRENDER
+    // images with an alpha channel are cached in an XRender Picture
+    if ((d() == 2 || d() == 4) && fl_can_do_alpha_blending())
+      XRenderFreePicture(fl_display, id_);
+    else
+#endif
     fl_delete_offscreen((Fl_Offscreen)id_);
     id_ = 0;
   }
@@ -396,67 +412,8 @@ Fl_Image *Fl_RGB_Image::copy(int W, int H) {
       }
     }
   } else {
-    // Bilinear scaling (FL_RGB_SCALING_BILINEAR)
-    const float xscale = (w() - 1) / (float) W;
-    const float yscale = (h() - 1) / (float) H;
-    for (dy = 0; dy < H; dy++) {
-      float oldy = dy * yscale;
-      if (oldy >= h())
-        oldy = h() - 1;
-      const float yfract = oldy - (unsigned) oldy;
-
-      for (dx = 0; dx < W; dx++) {
-        new_ptr = new_array + dy * W * d() + dx * d();
-
-        float oldx = dx * xscale;
-        if (oldx >= w())
-          oldx = w() - 1;
-        const float xfract = oldx - (unsigned) oldx;
-
-        const unsigned leftx = oldx;
-        const unsigned lefty = oldy;
-        const unsigned rightx = oldx + 1 >= w() ? oldx : oldx + 1;
-        const unsigned righty = oldy;
-        const unsigned dleftx = oldx;
-        const unsigned dlefty = oldy + 1 >= h() ? oldy : oldy + 1;
-        const unsigned drightx = rightx;
-        const unsigned drighty = dlefty;
-
-        uchar left[4], right[4], downleft[4], downright[4];
-        memcpy(left, array + lefty * line_d + leftx * d(), d());
-        memcpy(right, array + righty * line_d + rightx * d(), d());
-        memcpy(downleft, array + dlefty * line_d + dleftx * d(), d());
-        memcpy(downright, array + drighty * line_d + drightx * d(), d());
-
-        int i;
-        if (d() == 4) {
-          for (i = 0; i < 3; i++) {
-            left[i] *= left[3] / 255.0f;
-            right[i] *= right[3] / 255.0f;
-            downleft[i] *= downleft[3] / 255.0f;
-            downright[i] *= downright[3] / 255.0f;
-          }
-        }
-
-	const float leftf = 1 - xfract;
-	const float rightf = xfract;
-	const float upf = 1 - yfract;
-	const float downf = yfract;
-
-        for (i = 0; i < d(); i++) {
-          new_ptr[i] = (left[i] * leftf +
-                   right[i] * rightf) * upf +
-                   (downleft[i] * leftf +
-                   downright[i] * rightf) * downf;
-        }
-
-        if (d() == 4 && new_ptr[3]) {
-          for (i = 0; i < 3; i++) {
-            new_ptr[i] /= new_ptr[3] / 255.0f;
-          }
-        }
-      }
-    }
+    // Filter the image with a separable filter (see fl_scale_image.cxx)
+    fl_scale_image(array, w(), h(), d(), line_d, new_array, W, H, Fl_Image::RGB_scaling());
   }
 
   return new_image;
@@ -561,62 +518,99 @@ void Fl_RGB_Image::desaturate() {
 }
 
 #if !defined(WIN32) && !defined(__APPLE__)
+// Blends the source color s with alpha a over the destination color d,
+// rounding (s*a + d*(255-a))/255 to the nearest integer.
+static inline uchar blend(int s, int d, int a) {
+  int x = s * a + d * (255 - a) + 128;
+  return (uchar)((x + (x >> 8)) >> 8);
+}
+
+#if defined(__SSE2__)
+// Blends n RGBA pixels over the RGBA pixels of dst, 4 at a time, the same
+// way as blend(). Returns the number of pixels done.
+static int blend_rgba(const uchar *src, uchar *dst, int n) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i c255 = _mm_set1_epi16(255);
+  const __m128i c128 = _mm_set1_epi16(128);
+  int i;
+  for (i = 0; i + 4 <= n; i += 4) {
+    __m128i s = _mm_loadu_si128((const __m128i *)(src + 4 * i));
+    __m128i d = _mm_loadu_si128((const __m128i *)(dst + 4 * i));
+    __m128i r[2];
+    for (int k = 0; k < 2; k++) {
+      __m128i s16 = k ? _mm_unpackhi_epi8(s, zero) : _mm_unpacklo_epi8(s, zero);
+      __m128i d16 = k ? _mm_unpackhi_epi8(d, zero) : _mm_unpacklo_epi8(d, zero);
+      __m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s16, _MM_SHUFFLE(3,3,3,3)),
+                                      _MM_SHUFFLE(3,3,3,3));
+      __m128i x = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(s16, a),
+                                              _mm_mullo_epi16(d16, _mm_sub_epi16(c255, a))),
+                                c128);
+      r[k] = _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+    }
+    _mm_storeu_si128((__m128i *)(dst + 4 * i), _mm_packus_epi16(r[0], r[1]));
+  }
+  return i;
+}
+#endif // __SSE2__
+
 // Composite an image with alpha on systems that don't have accelerated
 // alpha compositing...
 static void alpha_blend(Fl_RGB_Image *img, int X, int Y, int W, int H, int cx, int cy) {
+  int d = img->d();
   int ld = img->ld();
-  if (ld == 0) ld = img->w() * img->d();
-  uchar *srcptr = (uchar*)img->array + cy * ld + cx * img->d();
-  int srcskip = ld - img->d() * W;
-
-  uchar *dst = new uchar[W * H * 3];
-  uchar *dstptr = dst;
-
-  fl_read_image(dst, X, Y, W, H, 0);
-
-  uchar srcr, srcg, srcb, srca;
-  uchar dstr, dstg, dstb, dsta;
-
-  if (img->d() == 2) {
-    // Composite grayscale + alpha over RGB...
-    for (int y = H; y > 0; y--, srcptr+=srcskip)
-      for (int x = W; x > 0; x--) {
-	srcg = *srcptr++;
-	srca = *srcptr++;
-
-	dstr = dstptr[0];
-	dstg = dstptr[1];
-	dstb = dstptr[2];
-	dsta = 255 - srca;
-
-	*dstptr++ = (srcg * srca + dstr * dsta) >> 8;
-	*dstptr++ = (srcg * srca + dstg * dsta) >> 8;
-	*dstptr++ = (srcg * srca + dstb * dsta) >> 8;
+  if (ld == 0) ld = img->w() * d;
+  const uchar *srcptr = img->array + cy * ld + cx * d;
+
+  uchar *dst = new uchar[W * H * 4];
+  fl_read_image(dst, X, Y, W, H, 255);
+
+  for (int y = 0; y < H; y++, srcptr += ld) {
+    const uchar *src = srcptr;
+    uchar *dstptr = dst + y * W * 4;
+    int x = 0;
+    if (d == 2) {
+      // Composite grayscale + alpha over RGB...
+      for (; x < W; x++, src += 2, dstptr += 4) {
+        dstptr[0] = blend(src[0], dstptr[0], src[1]);
+        dstptr[1] = blend(src[0], dstptr[1], src[1]);
+        dstptr[2] = blend(src[0], dstptr[2], src[1]);
       }
-  } else {
-    // Composite RGBA over RGB...
-    for (int y = H; y > 0; y--, srcptr+=srcskip)
-      for (int x = W; x > 0; x--) {
-	srcr = *srcptr++;
-	srcg = *srcptr++;
-	srcb = *srcptr++;
-	srca = *srcptr++;
-
-	dstr = dstptr[0];
-	dstg = dstptr[1];
-	dstb = dstptr[2];
-	dsta = 255 - srca;
-
-	*dstptr++ = (srcr * srca + dstr * dsta) >> 8;
-	*dstptr++ = (srcg * srca + dstg * dsta) >> 8;
-	*dstptr++ = (srcb * srca + dstb * dsta) >> 8;
+    } else {
+      // Composite RGBA over RGB...
+#if defined(__SSE2__)
+      x = blend_rgba(src, dstptr, W);
+      src += 4 * x;
+      dstptr += 4 * x;
+#endif
+      for (; x < W; x++, src += 4, dstptr += 4) {
+        dstptr[0] = blend(src[0], dstptr[0], src[3]);
+        dstptr[1] = blend(src[1], dstptr[1], src[3]);
+        dstptr[2] = blend(src[2], dstptr[2], src[3]);
       }
+    }
   }
 
-  fl_draw_image(dst, X, Y, W, H, 3, 0);
+  fl_draw_image(dst, X, Y, W, H, 4, 0);
 
   delete[] dst;
 }
+
+// Returns 1 if all pixels of an image with an alpha channel are opaque,
+// 2 if they are either opaque or fully transparent, and 0 otherwise.
+static int alpha_type(const Fl_RGB_Image *img) {
+  int d = img->d();
+  int ld = img->ld();
+  if (ld == 0) ld = img->w() * d;
+  int type = 1;
+  for (int y = 0; y < img->h(); y++) {
+    const uchar *p = img->array + y * ld + d - 1;
+    for (int x = img->w(); x > 0; x--, p += d) {
+      if (*p == 0) type = 2;
+      else if (*p != 255) return 0;
+    }
+  }
+  return type;
+}
 #endif // !WIN32 && !__APPLE__
 
 void Fl_RGB_Image::draw(int XP, int YP, int WP, int HP, int cx, int cy) {
@@ -786,6 +780,57 @@ int Fl_GDI_Printer_Graphics_Driver::draw_scaled(Fl_Image *img, int XP, int YP, i
 }
 
 #else
+#if HAVE_XRENDER
+// Uploads an image with an alpha channel, premultiplied, into an ARGB
+// Picture. The X server then composites it each time the image is drawn.
+static Picture create_picture(const Fl_RGB_Image *img) {
+  int w = img->w(), h = img->h(), ld = img->ld();
+  const uchar *array = img->array;
+  uchar *rgba = 0;
+  if (img->d() == 2) {
+    // expand grayscale + alpha to RGBA
+    if (ld == 0) ld = w * 2;
+    rgba = new uchar[w * h * 4];
+    uchar *p = rgba;
+    for (int y = 0; y < h; y++) {
+      const uchar *q = array + y * ld;
+      for (int x = w; x > 0; x--, q += 2, p += 4) {
+        p[0] = p[1] = p[2] = q[0];
+        p[3] = q[1];
+      }
+    }
+    array = rgba;
+    ld = 0;
+  }
+  Fl_Offscreen pixmap = fl_create_offscreen_with_alpha(w, h);
+  fl_begin_offscreen(pixmap);
+  fl_draw_image(array, 0, 0, w, h, 4 | FL_IMAGE_WITH_ALPHA, ld);
+  fl_end_offscreen();
+  delete[] rgba;
+
+  static XRenderPictFormat *format = XRenderFindStandardFormat(fl_display, PictStandardARGB32);
+  XRenderPictureAttributes attr;
+  memset(&attr, 0, sizeof(attr));
+  Picture picture = XRenderCreatePicture(fl_display, pixmap, format, 0, &attr);
+  // the server keeps the pixels as long as the picture exists:
+  fl_delete_offscreen(pixmap);
+  return picture;
+}
+
+// Composites part of a picture made by create_picture() at X,Y.
+static void composite_picture(Picture picture, int X, int Y, int W, int H, int cx, int cy) {
+  static XRenderPictFormat *format = XRenderFindVisualFormat(fl_display, fl_visual->visual);
+  XRenderPictureAttributes attr;
+  memset(&attr, 0, sizeof(attr));
+  Picture dst = XRenderCreatePicture(fl_display, fl_window, format, 0, &attr);
+  const Fl_Region clipr = fl_clip_region();
+  if (clipr)
+    XRenderSetPictureClipRegion(fl_display, dst, clipr);
+  XRenderComposite(fl_display, PictOpOver, picture, None, dst, cx, cy, 0, 0, X, Y, W, H);
+  XRenderFreePicture(fl_display, dst);
+}
+#endif // HAVE_XRENDER
+
 void Fl_Xlib_Graphics_Driver::draw(Fl_RGB_Image *img, int XP, int YP, int WP, int HP, int cx, int cy) {
   int X, Y, W, H;
   // Don't draw an empty image...
@@ -796,18 +841,27 @@ void Fl_Xlib_Graphics_Driver::draw(Fl_RGB_Image *img, int XP, int YP, int WP, in
   if (start(img, XP, YP, WP, HP, img->w(), img->h(), cx, cy, X, Y, W, H)) {
     return;
   }
+  const int alpha = img->d() == 2 || img->d() == 4;
+#if HAVE_XRENDER
+  if (alpha && fl_can_do_alpha_blending()) {
+    if (!img->id_) img->id_ = create_picture(img);
+    composite_picture(img->id_, X, Y, W, H, cx, cy);
+    return;
+  }
+#endif
   if (!img->id_) {
-    if (img->d() == 1 || img->d() == 3) {
+    // Images whose pixels are all opaque or fully transparent are drawn
+    // with a mask, other images with alpha must be blended each time
+    int type = alpha ? alpha_type(img) : 1;
+    if (type) {
       img->id_ = fl_create_offscreen(img->w(), img->h());
       fl_begin_offscreen((Fl_Offscreen)img->id_);
       fl_draw_image(img->array, 0, 0, img->w(), img->h(), img->d(), img->ld());
       fl_end_offscreen();
-    } else if (img->d() == 4 && fl_can_do_alpha_blending()) {
-      img->id_ = fl_create_offscreen_with_alpha(img->w(), img->h());
-      fl_begin_offscreen((Fl_Offscreen)img->id_);
-      fl_draw_image(img->array, 0, 0, img->w(), img->h(), img->d() | FL_IMAGE_WITH_ALPHA,
-                    img->ld());
-      fl_end_offscreen();
+      if (type == 2) {
+        int skip = img->ld() ? img->ld() - img->w() * img->d() : 0;
+        img->mask_ = fl_create_alphamask(img->w(), img->h(), img->d(), skip, img->array);
+      }
     }
   }
   if (img->id_) {
@@ -824,10 +878,7 @@ void Fl_Xlib_Graphics_Driver::draw(Fl_RGB_Image *img, int XP, int YP, int WP, in
       XSetClipOrigin(fl_display, fl_gc, X-cx, Y-cy);
     }
 
-    if (img->d() == 4 && fl_can_do_alpha_blending())
-      copy_offscreen_with_alpha(X, Y, W, H, img->id_, cx, cy);
-    else
-      copy_offscreen(X, Y, W, H, img->id_, cx, cy);
+    copy_offscreen(X, Y, W, H, img->id_, cx, cy);
 
     if (img->mask_) {
       // put the old clip region back
@@ -0,0 +1,603 @@
+//
+// "$Id$"
+//
+// Streaming image decoder routines for the Fast Light Tool Kit (FLTK).
+//
+// Copyright 1998-2016 by Bill Spitzak and others.
+//
+// This library is free software. Distribution and use rights are outlined in
+// the file "COPYING" which should have been included with this file.  If this
+// file is missing or damaged, see the license at:
+//
+//     http://www.fltk.org/COPYING.php
+//
+// Please report all bugs and problems on the following page:
+//
+//     http://www.fltk.org/str.php
+//
+// Contents:
+//
+//   Fl_Image_Decoder::write() - Decode the next chunk of an image.
+//   Fl_Image_Decoder::close() - Decode the end of an image.
+//
+
+//
+// Include necessary header files...
+//
+
+#include <FL/Fl.H>
+#include <FL/Fl_Image_Decoder.H>
+#include <FL/Fl_Widget.H>
+#include <config.h>
+#include "flstring.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <setjmp.h>
+
+#if defined(HAVE_LIBPNG) && defined(HAVE_LIBZ)
+extern "C"
+{
+#  include <zlib.h>
+#  ifdef HAVE_PNG_H
+#    include <png.h>
+#  else
+#    include <libpng/png.h>
+#  endif // HAVE_PNG_H
+}
+#endif // HAVE_LIBPNG && HAVE_LIBZ
+
+#if defined(WIN32) && defined(__CYGWIN__)
+#  define XMD_H
+#endif // WIN32 && __CYGWIN__
+
+extern "C"
+{
+#ifdef HAVE_LIBJPEG
+#  include <jpeglib.h>
+#endif // HAVE_LIBJPEG
+}
+
+
+// Formats of the data
+enum {
+  FORMAT_UNKNOWN = 0,
+  FORMAT_PNG,
+  FORMAT_JPEG
+};
+
+// Number of scanlines decoded by each jpeg_read_scanlines() call
+#define FL_JPEG_ROWS 16
+
+
+//
+// PNG decoding with libpng's progressive reader...
+//
+
+#if defined(HAVE_LIBPNG) && defined(HAVE_LIBZ)
+struct Fl_Image_Decoder_PNG {
+  png_structp		pp;		// PNG read pointer
+  png_infop		info;		// PNG info pointer
+  Fl_Image_Decoder	*dec;
+
+  void header();
+  void row(png_bytep new_row, png_uint_32 row_num);
+  void end() { dec->status_ = 1; }
+};
+
+extern "C" {
+  static void fl_png_info_cb(png_structp pp, png_infop) {
+    ((Fl_Image_Decoder_PNG *)png_get_progressive_ptr(pp))->header();
+  }
+
+  static void fl_png_row_cb(png_structp pp, png_bytep new_row,
+                            png_uint_32 row_num, int) {
+    ((Fl_Image_Decoder_PNG *)png_get_progressive_ptr(pp))->row(new_row, row_num);
+  }
+
+  static void fl_png_end_cb(png_structp pp, png_infop) {
+    ((Fl_Image_Decoder_PNG *)png_get_progressive_ptr(pp))->end();
+  }
+}
+
+// Set up the same conversions as Fl_PNG_Image and create the image.
+void Fl_Image_Decoder_PNG::header() {
+  int channels;
+
+  if (png_get_color_type(pp, info) == PNG_COLOR_TYPE_PALETTE)
+    png_set_expand(pp);
+
+  if (png_get_color_type(pp, info) & PNG_COLOR_MASK_COLOR)
+    channels = 3;
+  else
+    channels = 1;
+
+  int num_trans = 0;
+  png_get_tRNS(pp, info, 0, &num_trans, 0);
+  if ((png_get_color_type(pp, info) & PNG_COLOR_MASK_ALPHA) || (num_trans != 0))
+    channels ++;
+
+  if (png_get_bit_depth(pp, info) < 8)
+  {
+    png_set_packing(pp);
+    png_set_expand(pp);
+  }
+  else if (png_get_bit_depth(pp, info) == 16)
+    png_set_strip_16(pp);
+
+#  if defined(HAVE_PNG_GET_VALID) && defined(HAVE_PNG_SET_TRNS_TO_ALPHA)
+  // Handle transparency...
+  if (png_get_valid(pp, info, PNG_INFO_tRNS))
+    png_set_tRNS_to_alpha(pp);
+#  endif // HAVE_PNG_GET_VALID && HAVE_PNG_SET_TRNS_TO_ALPHA
+
+  int W = (int)png_get_image_width(pp, info);
+  int H = (int)png_get_image_height(pp, info);
+  if (((size_t)W) * H * channels > Fl_RGB_Image::max_size())
+    png_error(pp, "image is too large");
+
+  png_set_interlace_handling(pp);
+  png_read_update_info(pp, info);
+
+  dec->create_image(W, H, channels);
+}
+
+// Merge a decoded row, or the pixels of an interlace pass, into the image.
+void Fl_Image_Decoder_PNG::row(png_bytep new_row, png_uint_32 row_num) {
+  Fl_RGB_Image *img = dec->image_;
+  if (!new_row || !img || (int)row_num >= img->h()) return;
+
+  uchar *dst = (uchar *)img->array + (size_t)row_num * img->w() * img->d();
+  png_progressive_combine_row(pp, dst, new_row);
+
+#ifdef WIN32
+  // Some Windows graphics drivers don't honor transparency when RGB == white
+  if (img->d() == 4) {
+    for (int i = img->w(); i > 0; i --, dst += 4)
+      if (!dst[3]) dst[0] = dst[1] = dst[2] = 0;
+  }
+#endif // WIN32
+
+  dec->changed((int)row_num, (int)row_num + 1);
+}
+#endif // HAVE_LIBPNG && HAVE_LIBZ
+
+
+//
+// JPEG decoding with a suspending data source...
+//
+// libjpeg returns JPEG_SUSPENDED or 0 rows when the source runs out of
+// data, and is called again with the unused data followed by the next
+// chunk. Progressive JPEG images are decoded in buffered-image mode, so
+// that an output pass shows every scan that has arrived.
+//
+
+#ifdef HAVE_LIBJPEG
+// States of the JPEG decoder
+enum {
+  JPEG_HEADER = 0,		// reading the header
+  JPEG_START,			// starting the decompressor
+  JPEG_OUTPUT_START,		// starting an output pass (buffered-image mode)
+  JPEG_SCANLINES,		// reading scanlines
+  JPEG_OUTPUT_FINISH,		// finishing an output pass (buffered-image mode)
+  JPEG_FINISH,			// finishing the decompressor
+  JPEG_DONE
+};
+
+struct Fl_Image_Decoder_JPEG {
+  jpeg_decompress_struct dinfo;		// Decompressor info
+  jpeg_error_mgr	err;		// Error handler info
+  jmp_buf		errhand;	// Error handler
+  jpeg_source_mgr	src;		// Data source
+  JOCTET		*buf;		// Data not used by libjpeg yet
+  size_t		alloc;		// Allocated size of buf
+  long			skip;		// Bytes to skip in the next chunk
+  int			eof;		// Was the end of the data reached?
+  int			state;		// JPEG_HEADER...
+
+  void append(const uchar *data, int len);
+};
+
+extern "C" {
+  static void fl_jpeg_error_handler(j_common_ptr dinfo) {
+    longjmp(((Fl_Image_Decoder_JPEG *)dinfo->client_data)->errhand, 1);
+  }
+
+  static void fl_jpeg_output_handler(j_common_ptr) {
+  }
+
+  static void fl_jpeg_init_source(j_decompress_ptr) {
+  }
+
+  static boolean fl_jpeg_fill_input_buffer(j_decompress_ptr dinfo) {
+    Fl_Image_Decoder_JPEG *j = (Fl_Image_Decoder_JPEG *)dinfo->client_data;
+    static const JOCTET eoi[2] = { 0xFF, JPEG_EOI };
+    if (!j->eof) return FALSE; // suspend until the next chunk arrives
+    // Insert a fake end of image marker, like libjpeg's stdio source...
+    j->src.next_input_byte = eoi;
+    j->src.bytes_in_buffer = 2;
+    return TRUE;
+  }
+
+  static void fl_jpeg_skip_input_data(j_decompress_ptr dinfo, long num_bytes) {
+    Fl_Image_Decoder_JPEG *j = (Fl_Image_Decoder_JPEG *)dinfo->client_data;
+    if (num_bytes <= 0) return;
+    if ((size_t)num_bytes > j->src.bytes_in_buffer) {
+      j->skip += num_bytes - (long)j->src.bytes_in_buffer;
+      num_bytes = (long)j->src.bytes_in_buffer;
+    }
+    j->src.next_input_byte += num_bytes;
+    j->src.bytes_in_buffer -= num_bytes;
+  }
+
+  static void fl_jpeg_term_source(j_decompress_ptr) {
+  }
+}
+
+// Append a chunk to the data that libjpeg did not use yet.
+void Fl_Image_Decoder_JPEG::append(const uchar *data, int len) {
+  if (skip) {
+    long n = skip < len ? skip : len;
+    data += n;
+    len  -= (int)n;
+    skip -= n;
+  }
+
+  size_t keep = src.bytes_in_buffer;
+  if (keep + len > alloc) {
+    alloc = (keep + len) * 2;
+    JOCTET *temp = (JOCTET *)malloc(alloc);
+    if (keep) memcpy(temp, src.next_input_byte, keep);
+    free(buf);
+    buf = temp;
+  } else if (keep && src.next_input_byte != buf) {
+    memmove(buf, src.next_input_byte, keep);
+  }
+
+  memcpy(buf + keep, data, len);
+  src.next_input_byte = buf;
+  src.bytes_in_buffer = keep + len;
+}
+#endif // HAVE_LIBJPEG
+
+
+/**
+  Creates a decoder for a PNG or JPEG image.
+  \param owner the widget that shows the image, or NULL
+*/
+Fl_Image_Decoder::Fl_Image_Decoder(Fl_Widget *owner) {
+  owner_      = owner;
+  cb_         = 0;
+  data_       = 0;
+  image_      = 0;
+  own_image_  = 1;
+  format_     = FORMAT_UNKNOWN;
+  status_     = 0;
+  header_len_ = 0;
+  band_y0_    = band_y1_ = 0;
+  png_        = 0;
+  jpeg_       = 0;
+}
+
+
+/**
+  Deletes the decoder and, unless it was detached, the image. If the
+  image is the owner's image, the owner's image is reset.
+*/
+Fl_Image_Decoder::~Fl_Image_Decoder() {
+#if defined(HAVE_LIBPNG) && defined(HAVE_LIBZ)
+  if (png_) {
+    Fl_Image_Decoder_PNG *p = (Fl_Image_Decoder_PNG *)png_;
+    png_destroy_read_struct(&p->pp, &p->info, NULL);
+    delete p;
+  }
+#endif // HAVE_LIBPNG && HAVE_LIBZ
+#ifdef HAVE_LIBJPEG
+  if (jpeg_) {
+    Fl_Image_Decoder_JPEG *j = (Fl_Image_Decoder_JPEG *)jpeg_;
+    jpeg_destroy_decompress(&j->dinfo);
+    free(j->buf);
+    delete j;
+  }
+#endif // HAVE_LIBJPEG
+
+  if (image_ && own_image_) {
+    if (owner_ && owner_->image() == image_) owner_->image(0);
+    delete image_;
+  }
+}
+
+
+/**
+  Gives the image to the caller, who must delete it when it is no longer
+  used. The decoder can still fill in the rows of the image until it is
+  deleted.
+*/
+Fl_RGB_Image *Fl_Image_Decoder::detach() {
+  own_image_ = 0;
+  return image_;
+}
+
+
+//
+// 'Fl_Image_Decoder::create_image()' - Create the image once its size is known.
+//
+
+void Fl_Image_Decoder::create_image(int W, int H, int D) {
+  uchar *array = new uchar[(size_t)W * H * D];
+  memset(array, 0, (size_t)W * H * D);
+
+  image_ = new Fl_RGB_Image(array, W, H, D);
+  image_->alloc_array = 1;
+
+  if (owner_) {
+    if (!owner_->image()) owner_->image(image_);
+    if (!cb_) owner_->redraw();
+  }
+  if (cb_) (cb_)(this, 0, 0, data_);
+}
+
+
+//
+// 'Fl_Image_Decoder::changed()' - Add rows to the band to notify.
+//
+
+void Fl_Image_Decoder::changed(int y0, int y1) {
+  if (band_y0_ >= band_y1_) {
+    band_y0_ = y0;
+    band_y1_ = y1;
+  } else {
+    if (y0 < band_y0_) band_y0_ = y0;
+    if (y1 > band_y1_) band_y1_ = y1;
+  }
+}
+
+
+//
+// 'Fl_Image_Decoder::notify()' - Show the rows decoded since the last call.
+//
+
+void Fl_Image_Decoder::notify() {
+  if (band_y0_ >= band_y1_ || !image_) return;
+
+  int y = band_y0_, h = band_y1_ - band_y0_;
+  band_y0_ = band_y1_ = 0;
+
+  // The pixels changed, don't draw a cached copy of the image...
+  image_->uncache();
+
+  if (cb_) (cb_)(this, y, h, data_);
+  else if (owner_) {
+    // Damage the band where the image is drawn, centered in the owner...
+    int X = owner_->x() + (owner_->w() - image_->w()) / 2;
+    int Y = owner_->y() + (owner_->h() - image_->h()) / 2;
+    owner_->damage(FL_DAMAGE_ALL, X, Y + y, image_->w(), h);
+  }
+}
+
+
+//
+// 'Fl_Image_Decoder::start()' - Detect the format and set up its decoder.
+//
+
+int Fl_Image_Decoder::start(const uchar *data, int len) {
+  // Collect the first bytes...
+  while (header_len_ < (int)sizeof(header_) && len > 0) {
+    header_[header_len_ ++] = *data ++;
+    len --;
+  }
+  if (header_len_ < (int)sizeof(header_)) return 0;
+
+#if defined(HAVE_LIBPNG) && defined(HAVE_LIBZ)
+  if (memcmp(header_, "\211PNG", 4) == 0) {
+    Fl_Image_Decoder_PNG *p = new Fl_Image_Decoder_PNG;
+    p->dec  = this;
+    p->info = 0;
+    p->pp   = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (p->pp) p->info = png_create_info_struct(p->pp);
+    png_ = p;
+    if (!p->pp || !p->info) return status_ = Fl_Image::ERR_FORMAT;
+    png_set_progressive_read_fn(p->pp, p, fl_png_info_cb, fl_png_row_cb, fl_png_end_cb);
+    format_ = FORMAT_PNG;
+  }
+#endif // HAVE_LIBPNG && HAVE_LIBZ
+
+#ifdef HAVE_LIBJPEG
+  if (memcmp(header_, "\377\330\377", 3) == 0) {
+    Fl_Image_Decoder_JPEG *j = new Fl_Image_Decoder_JPEG;
+    j->buf   = 0;
+    j->alloc = 0;
+    j->skip  = 0;
+    j->eof   = 0;
+    j->state = JPEG_HEADER;
+    j->dinfo.err                = jpeg_std_error(&j->err);
+    j->err.error_exit           = fl_jpeg_error_handler;
+    j->err.output_message       = fl_jpeg_output_handler;
+    jpeg_create_decompress(&j->dinfo);
+    j->dinfo.client_data        = j;
+    j->src.init_source          = fl_jpeg_init_source;
+    j->src.fill_input_buffer    = fl_jpeg_fill_input_buffer;
+    j->src.skip_input_data      = fl_jpeg_skip_input_data;
+    j->src.resync_to_restart    = jpeg_resync_to_restart;
+    j->src.term_source          = fl_jpeg_term_source;
+    j->src.next_input_byte      = 0;
+    j->src.bytes_in_buffer      = 0;
+    j->dinfo.src                = &j->src;
+    jpeg_ = j;
+    format_ = FORMAT_JPEG;
+  }
+#endif // HAVE_LIBJPEG
+
+  if (format_ == FORMAT_UNKNOWN) return status_ = Fl_Image::ERR_FORMAT;
+
+  // Decode the first bytes, then the rest of the chunk...
+  int ret = (format_ == FORMAT_PNG) ? write_png(header_, header_len_)
+                                    : write_jpeg(header_, header_len_, 0);
+  if (ret || !len) return ret;
+  return (format_ == FORMAT_PNG) ? write_png(data, len) : write_jpeg(data, len, 0);
+}
+
+
+//
+// 'Fl_Image_Decoder::write_png()' - Decode a chunk of PNG data.
+//
+
+int Fl_Image_Decoder::write_png(const uchar *data, int len) {
+#if defined(HAVE_LIBPNG) && defined(HAVE_LIBZ)
+  Fl_Image_Decoder_PNG *p = (Fl_Image_Decoder_PNG *)png_;
+
+  if (setjmp(png_jmpbuf(p->pp))) {
+    Fl::warning("PNG data is too large or contains errors!\n");
+    notify();
+    return status_ = Fl_Image::ERR_FORMAT;
+  }
+
+  png_process_data(p->pp, p->info, (png_bytep)data, (png_size_t)len);
+  notify();
+#endif // HAVE_LIBPNG && HAVE_LIBZ
+  return status_;
+}
+
+
+//
+// 'Fl_Image_Decoder::write_jpeg()' - Decode a chunk of JPEG data.
+//
+
+int Fl_Image_Decoder::write_jpeg(const uchar *data, int len, int eof) {
+#ifdef HAVE_LIBJPEG
+  Fl_Image_Decoder_JPEG *j = (Fl_Image_Decoder_JPEG *)jpeg_;
+  jpeg_decompress_struct *dinfo = &j->dinfo;
+  JSAMPROW rows[FL_JPEG_ROWS];	// Sample row pointers
+  int i, n, y;
+
+  if (len) j->append(data, len);
+  if (eof) j->eof = 1;
+
+  if (setjmp(j->errhand)) {
+    Fl::warning("JPEG data is too large or contains errors!\n");
+    notify();
+    return status_ = Fl_Image::ERR_FORMAT;
+  }
+
+  for (;;) {
+    switch (j->state) {
+      case JPEG_HEADER :
+        if (jpeg_read_header(dinfo, TRUE) == JPEG_SUSPENDED) return 0;
+
+        dinfo->quantize_colors      = (boolean)FALSE;
+        dinfo->out_color_space      = JCS_RGB;
+        dinfo->out_color_components = 3;
+        dinfo->output_components    = 3;
+        // Show each scan of progressive images as it arrives...
+        dinfo->buffered_image       = jpeg_has_multiple_scans(dinfo);
+        j->state = JPEG_START;
+        break;
+
+      case JPEG_START :
+        if (!jpeg_start_decompress(dinfo)) return 0;
+
+        if (((size_t)dinfo->output_width) * dinfo->output_height * 3 > Fl_RGB_Image::max_size())
+          longjmp(j->errhand, 1);
+        create_image(dinfo->output_width, dinfo->output_height, 3);
+        j->state = dinfo->buffered_image ? JPEG_OUTPUT_START : JPEG_SCANLINES;
+        break;
+
+      case JPEG_OUTPUT_START :
+        // Absorb all the data there is, then show the latest scan...
+        do n = jpeg_consume_input(dinfo);
+        while (n != JPEG_SUSPENDED && n != JPEG_REACHED_EOI);
+
+        if (dinfo->input_scan_number == dinfo->output_scan_number &&
+            !jpeg_input_complete(dinfo)) return 0;
+        if (!jpeg_start_output(dinfo, dinfo->input_scan_number)) return 0;
+        j->state = JPEG_SCANLINES;
+        break;
+
+      case JPEG_SCANLINES :
+        while (dinfo->output_scanline < dinfo->output_height) {
+          y = dinfo->output_scanline;
+          n = dinfo->output_height - y;
+          if (n > FL_JPEG_ROWS) n = FL_JPEG_ROWS;
+          for (i = 0; i < n; i ++)
+            rows[i] = (JSAMPROW)(image_->array + (size_t)(y + i) * dinfo->output_width * 3);
+
+          n = jpeg_read_scanlines(dinfo, rows, (JDIMENSION)n);
+          if (!n) {
+            // wait for more data...
+            notify();
+            return 0;
+          }
+          changed(y, y + n);
+        }
+
+        notify();
+        j->state = dinfo->buffered_image ? JPEG_OUTPUT_FINISH : JPEG_FINISH;
+        break;
+
+      case JPEG_OUTPUT_FINISH :
+        if (!jpeg_finish_output(dinfo)) return 0;
+
+        if (jpeg_input_complete(dinfo) &&
+            dinfo->input_scan_number == dinfo->output_scan_number)
+          j->state = JPEG_FINISH;
+        else
+          j->state = JPEG_OUTPUT_START;
+        break;
+
+      case JPEG_FINISH :
+        if (!jpeg_finish_decompress(dinfo)) return 0;
+
+        j->state = JPEG_DONE;
+        return status_ = 1;
+
+      default :
+        return status_;
+    }
+  }
+#else
+  return status_;
+#endif // HAVE_LIBJPEG
+}
+
+
+/**
+  Decodes the next chunk of the image data.
+
+  The rows that could be decoded are copied to image() and shown in the
+  owner widget, or reported to the callback, before write() returns.
+
+  \param data, len the next \p len bytes of the image data
+  \returns 0 if more data is expected, 1 if the image is complete, or
+    Fl_Image::ERR_FORMAT if the data is not a PNG or JPEG image or
+    contains errors
+*/
+int Fl_Image_Decoder::write(const void *data, int len) {
+  if (status_ || len <= 0) return status_;
+
+  if (format_ == FORMAT_UNKNOWN) return start((const uchar *)data, len);
+  if (format_ == FORMAT_PNG) return write_png((const uchar *)data, len);
+  return write_jpeg((const uchar *)data, len, 0);
+}
+
+
+/**
+  Tells the decoder that there is no more data.
+
+  A truncated JPEG image is completed with the rows that could be decoded,
+  like Fl_JPEG_Image does. Truncated PNG images keep the rows that were
+  decoded, and done() returns Fl_Image::ERR_FORMAT.
+
+  \returns the new value of done()
+*/
+int Fl_Image_Decoder::close() {
+  if (status_) return status_;
+
+  if (format_ == FORMAT_JPEG) write_jpeg(0, 0, 1);
+  if (!status_) status_ = Fl_Image::ERR_FORMAT;
+
+  return status_;
+}
+
+
+//
+// End of "$Id$".
+//
@@ -0,0 +1,309 @@
+//
+// "$Id$"
+//
+// Image file reader for the Fast Light Tool Kit (FLTK).
+//
+// Copyright 1998-2016 by Bill Spitzak and others.
+//
+// This library is free software. Distribution and use rights are outlined in
+// the file "COPYING" which should have been included with this file.  If this
+// file is missing or damaged, see the license at:
+//
+//     http://www.fltk.org/COPYING.php
+//
+// Please report all bugs and problems on the following page:
+//
+//     http://www.fltk.org/str.php
+//
+
+#include <FL/Fl_Image.H>
+#include <FL/fl_utf8.h>
+#include <config.h>
+#include "Fl_Image_Reader.H"
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#if defined(WIN32) && !defined(__CYGWIN__)
+#  include <windows.h>
+#  include <io.h>
+#else
+#  include <unistd.h>
+#  include <sys/mman.h>
+#  ifdef HAVE_PTHREAD
+#    include <pthread.h>
+#  endif // HAVE_PTHREAD
+#endif // WIN32 && !__CYGWIN__
+
+#ifndef O_BINARY
+#  define O_BINARY 0
+#endif // !O_BINARY
+
+// Files smaller than this are read, mapping them costs more than it saves
+#define FL_READER_MAP_MIN 65536
+
+
+//
+// Memory of the files that was handed over to images with give().
+// Images may be loaded by the threads of Fl_Shared_Image::get_async(),
+// so the list is protected by a mutex.
+//
+
+struct Fl_Image_Reader_Memory {
+  Fl_Image_Reader_Memory *next;
+  Fl_RGB_Image	*image;		// Image using the memory
+  const uchar	*data;		// Start and size of the memory
+  size_t	size;
+  int		mapped;		// Mapped, or malloc'ed?
+};
+
+static Fl_Image_Reader_Memory *given_memory = 0;
+static int file_mapping_ = 0;	// Fl_RGB_Image::file_mapping()
+static int file_mapping_used = 0;// Was file_mapping() ever enabled?
+
+#if defined(WIN32) && !defined(__CYGWIN__)
+static CRITICAL_SECTION given_mutex;
+#elif defined(HAVE_PTHREAD)
+static pthread_mutex_t given_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif // WIN32 && !__CYGWIN__
+
+static void lock_given() {
+#if defined(WIN32) && !defined(__CYGWIN__)
+  EnterCriticalSection(&given_mutex);
+#elif defined(HAVE_PTHREAD)
+  pthread_mutex_lock(&given_mutex);
+#endif // WIN32 && !__CYGWIN__
+}
+
+static void unlock_given() {
+#if defined(WIN32) && !defined(__CYGWIN__)
+  LeaveCriticalSection(&given_mutex);
+#elif defined(HAVE_PTHREAD)
+  pthread_mutex_unlock(&given_mutex);
+#endif // WIN32 && !__CYGWIN__
+}
+
+// Releases memory that was mapped or malloc'ed by Fl_Image_Reader::open().
+static void free_memory(const uchar *data, size_t size, int mapped) {
+  if (!mapped) free((void *)data);
+#if defined(WIN32) && !defined(__CYGWIN__)
+  else UnmapViewOfFile(data);
+#else
+  else munmap((void *)data, size);
+#endif // WIN32 && !__CYGWIN__
+}
+
+// Maps the open file fd of the given size, returns NULL on failure.
+static const uchar *map_file(int fd, size_t size) {
+#if defined(WIN32) && !defined(__CYGWIN__)
+  HANDLE mapping = CreateFileMapping((HANDLE)_get_osfhandle(fd), NULL,
+                                     PAGE_READONLY, 0, 0, NULL);
+  if (!mapping) return 0;
+  void *data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, size);
+  CloseHandle(mapping);	// the view keeps the mapping alive
+  return (const uchar *)data;
+#else
+  void *data = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  return data == MAP_FAILED ? 0 : (const uchar *)data;
+#endif // WIN32 && !__CYGWIN__
+}
+
+
+/**
+  Opens the named file (UTF-8 encoded) and makes its contents available.
+
+  Returns 0 on success, or -1 if the file could not be opened or read.
+*/
+int Fl_Image_Reader::open(const char *filename) {
+  struct stat	st;
+  uchar		*buf;
+  size_t	size = 0, alloc;
+  int		fd, n;
+
+  close();
+  if ((fd = fl_open(filename, O_RDONLY | O_BINARY, 0)) < 0) return -1;
+
+  if (!fstat(fd, &st) && (st.st_mode & S_IFMT) == S_IFREG &&
+      st.st_size == (off_t)(size_t)st.st_size &&
+      st.st_size >= FL_READER_MAP_MIN &&
+      (data_ = map_file(fd, (size_t)st.st_size)) != 0) {
+    mapped_ = 1;
+    ptr_    = data_;
+    end_    = data_ + st.st_size;
+    ::close(fd);
+    return 0;
+  }
+
+  // Not a regular file, too small or not mappable, read it...
+  alloc = (!fstat(fd, &st) && st.st_size > 0) ? (size_t)st.st_size + 1 : 65536;
+  buf   = (uchar *)malloc(alloc);
+  while (buf) {
+    if (size == alloc) {
+      uchar *temp = (uchar *)realloc(buf, alloc *= 2);
+      if (!temp) { free(buf); buf = 0; break; }
+      buf = temp;
+    }
+    if ((n = (int)::read(fd, buf + size, (unsigned)(alloc - size))) <= 0) break;
+    size += n;
+  }
+  ::close(fd);
+  if (!buf) return -1;
+
+  data_   = buf;
+  mapped_ = 0;
+  ptr_    = data_;
+  end_    = data_ + size;
+  return 0;
+}
+
+
+/** Releases the contents of the file, unless they were given to an image. */
+void Fl_Image_Reader::close() {
+  if (data_) free_memory(data_, size(), mapped_);
+  data_ = ptr_ = end_ = 0;
+  mapped_ = 0;
+}
+
+
+/** Reads a 16-bit little endian unsigned integer. */
+unsigned short Fl_Image_Reader::read_word() {
+  unsigned char b0, b1;
+
+  b0 = (uchar)read_byte();
+  b1 = (uchar)read_byte();
+
+  return ((b1 << 8) | b0);
+}
+
+
+/** Reads a 32-bit little endian unsigned integer. */
+unsigned int Fl_Image_Reader::read_dword() {
+  unsigned char b0, b1, b2, b3;
+
+  b0 = (uchar)read_byte();
+  b1 = (uchar)read_byte();
+  b2 = (uchar)read_byte();
+  b3 = (uchar)read_byte();
+
+  return ((((((b3 << 8) | b2) << 8) | b1) << 8) | b0);
+}
+
+
+/** Reads a 32-bit little endian signed integer. */
+int Fl_Image_Reader::read_long() {
+  return (int)read_dword();
+}
+
+
+/** Reads up to \p n bytes into \p buf like fread(), returns the number of bytes read. */
+size_t Fl_Image_Reader::read(void *buf, size_t n) {
+  if (n > left()) n = left();
+  memcpy(buf, ptr_, n);
+  ptr_ += n;
+  return n;
+}
+
+
+/**
+  Reads a line of at most \p size - 1 bytes into \p buf like fgets(),
+  including the newline. Returns NULL at the end of the file.
+*/
+char *Fl_Image_Reader::gets(char *buf, int size) {
+  char *s = buf;
+
+  if (eof() || size < 1) return 0;
+  while (--size > 0 && ptr_ < end_)
+    if ((*s++ = (char)*ptr_++) == '\n') break;
+  *s = '\0';
+  return buf;
+}
+
+
+/**
+  Hands the contents of the file over to \p img, if file mapping is enabled.
+
+  The decoder has pointed the image's array into data(). The memory stays
+  valid until \p img is destroyed, and the reader no longer owns it.
+  Returns 1 if the memory was given to the image, or 0 if the decoder
+  must copy the pixels.
+
+  \see Fl_RGB_Image::file_mapping(int)
+*/
+int Fl_Image_Reader::give(Fl_RGB_Image *img) {
+  if (!file_mapping_ || !data_) return 0;
+
+  Fl_Image_Reader_Memory *mem = new Fl_Image_Reader_Memory;
+  mem->image  = img;
+  mem->data   = data_;
+  mem->size   = size();
+  mem->mapped = mapped_;
+
+  lock_given();
+  mem->next    = given_memory;
+  given_memory = mem;
+  unlock_given();
+
+  data_ = ptr_ = end_ = 0;
+  mapped_ = 0;
+  return 1;
+}
+
+
+/** Releases the file contents that were given to \p img, called by ~Fl_RGB_Image(). */
+void Fl_Image_Reader::release(Fl_RGB_Image *img) {
+  Fl_Image_Reader_Memory *mem, *prev;
+
+  if (!file_mapping_used) return;
+
+  lock_given();
+  for (prev = 0, mem = given_memory; mem; prev = mem, mem = mem->next)
+    if (mem->image == img) {
+      if (prev) prev->next = mem->next;
+      else given_memory = mem->next;
+      break;
+    }
+  unlock_given();
+
+  if (mem) {
+    free_memory(mem->data, mem->size, mem->mapped);
+    delete mem;
+  }
+}
+
+
+/**
+  Lets images point directly at the pixels of the files they were loaded from.
+
+  Image files are always read through memory mapping when possible. With
+  file mapping enabled, Fl_PNM_Image does not copy the pixels of binary
+  8-bit PNM files either: the image array points into the mapped file,
+  which stays mapped until the image is destroyed. Loading large raw
+  frames then costs neither a copy nor extra memory beyond the page cache.
+
+  While an image uses its file, the file must not be truncated or
+  modified, and on Windows it cannot be deleted or replaced. This is why
+  file mapping is disabled by default. It should be enabled before any
+  image is loaded, in the main thread.
+
+  \version 1.3.5
+*/
+void Fl_RGB_Image::file_mapping(int on) {
+#if defined(WIN32) && !defined(__CYGWIN__)
+  if (on && !file_mapping_used) InitializeCriticalSection(&given_mutex);
+#endif // WIN32 && !__CYGWIN__
+  if (on) file_mapping_used = 1;
+  file_mapping_ = on;
+}
+
+
+/** Returns non-zero if images may use the memory of their files, see file_mapping(int). */
+int Fl_RGB_Image::file_mapping() {
+  return file_mapping_;
+}
+
+
+//
+// End of "$Id$".
+//
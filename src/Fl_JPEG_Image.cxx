@@ -19,6 +19,7 @@
 // Contents:
 //
 //   Fl_JPEG_Image::Fl_JPEG_Image() - Load a JPEG image file.
+//   Fl_JPEG_Image::load_jpeg_()    - Decode a JPEG image from a file or from memory.
 //
 
 //
@@ -33,6 +34,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <setjmp.h>
+#include "Fl_Image_Reader.H"
 
 
 // Some releases of the Cygwin JPEG libraries don't have a correctly
@@ -52,6 +54,10 @@ extern "C"
 }
 
 
+// Number of scanlines decoded by each jpeg_read_scanlines() call
+#define FL_JPEG_ROWS 16
+
+
 //
 // Custom JPEG error handling structure...
 //
@@ -82,123 +88,6 @@ extern "C" {
 #endif // HAVE_LIBJPEG
 
 
-/**
- \brief The constructor loads the JPEG image from the given jpeg filename.
- 
- The inherited destructor frees all memory and server resources that are used 
- by the image.
- 
- Use Fl_Image::fail() to check if Fl_JPEG_Image failed to load. fail() returns
- ERR_FILE_ACCESS if the file could not be opened or read, ERR_FORMAT if the
- JPEG format could not be decoded, and ERR_NO_IMAGE if the image could not
- be loaded for another reason. If the image has loaded correctly,
- w(), h(), and d() should return values greater than zero.
- 
- \param[in] filename a full path and name pointing to a valid jpeg file.
- */
-Fl_JPEG_Image::Fl_JPEG_Image(const char *filename)	// I - File to load
-: Fl_RGB_Image(0,0,0) {
-#ifdef HAVE_LIBJPEG
-  FILE				*fp;	// File pointer
-  jpeg_decompress_struct	dinfo;	// Decompressor info
-  fl_jpeg_error_mgr		jerr;	// Error handler info
-  JSAMPROW			row;	// Sample row pointer
-  
-  // the following variables are pointers allocating some private space that
-  // is not reset by 'setjmp()'
-  char* max_finish_decompress_err;      // count errors and give up afer a while
-  char* max_destroy_decompress_err;     // to avoid recusion and deadlock
-  
-  // Clear data...
-  alloc_array = 0;
-  array = (uchar *)0;
-  
-  // Open the image file...
-  if ((fp = fl_fopen(filename, "rb")) == NULL) {
-    ld(ERR_FILE_ACCESS);
-    return;
-  }
-  
-  // Setup the decompressor info and read the header...
-  dinfo.err                = jpeg_std_error((jpeg_error_mgr *)&jerr);
-  jerr.pub_.error_exit     = fl_jpeg_error_handler;
-  jerr.pub_.output_message = fl_jpeg_output_handler;
-  
-  // Setup error loop variables
-  max_finish_decompress_err = (char*)malloc(1);   // allocate space on the frame for error counters
-  max_destroy_decompress_err = (char*)malloc(1);  // otherwise, the variables are reset on the longjmp
-  *max_finish_decompress_err=10;
-  *max_destroy_decompress_err=10;
-  
-  if (setjmp(jerr.errhand_))
-  {
-    // JPEG error handling...
-    Fl::warning("JPEG file \"%s\" is too large or contains errors!\n", filename);
-    // if any of the cleanup routines hits another error, we would end up 
-    // in a loop. So instead, we decrement max_err for some upper cleanup limit.
-    if ( ((*max_finish_decompress_err)-- > 0) && array)
-      jpeg_finish_decompress(&dinfo);
-    if ( (*max_destroy_decompress_err)-- > 0)
-      jpeg_destroy_decompress(&dinfo);
-    
-    fclose(fp);
-    
-    w(0);
-    h(0);
-    d(0);
-    
-    if (array) {
-      delete[] (uchar *)array;
-      array = 0;
-      alloc_array = 0;
-    }
-    
-    free(max_destroy_decompress_err);
-    free(max_finish_decompress_err);
-    
-    ld(ERR_FORMAT);
-    return;
-  }
-  
-  jpeg_create_decompress(&dinfo);
-  jpeg_stdio_src(&dinfo, fp);
-  jpeg_read_header(&dinfo, TRUE);
-  
-  dinfo.quantize_colors      = (boolean)FALSE;
-  dinfo.out_color_space      = JCS_RGB;
-  dinfo.out_color_components = 3;
-  dinfo.output_components    = 3;
-  
-  jpeg_calc_output_dimensions(&dinfo);
-  
-  w(dinfo.output_width); 
-  h(dinfo.output_height);
-  d(dinfo.output_components);
-  
-  if (((size_t)w()) * h() * d() > max_size() ) longjmp(jerr.errhand_, 1);
-  array = new uchar[w() * h() * d()];
-  alloc_array = 1;
-  
-  jpeg_start_decompress(&dinfo);
-  
-  while (dinfo.output_scanline < dinfo.output_height) {
-    row = (JSAMPROW)(array +
-                     dinfo.output_scanline * dinfo.output_width *
-                     dinfo.output_components);
-    jpeg_read_scanlines(&dinfo, &row, (JDIMENSION)1);
-  }
-  
-  jpeg_finish_decompress(&dinfo);
-  jpeg_destroy_decompress(&dinfo);
-  
-  free(max_destroy_decompress_err);
-  free(max_finish_decompress_err);
-  
-  fclose(fp);
-#endif // HAVE_LIBJPEG
-}
-
-
 // data source manager for reading jpegs from memory
 // init_source (j_decompress_ptr cinfo)
 // fill_input_buffer (j_decompress_ptr cinfo)
@@ -212,6 +101,7 @@ Fl_JPEG_Image::Fl_JPEG_Image(const char *filename)	// I - File to load
 typedef struct {
   struct jpeg_source_mgr pub;
   const unsigned char *data, *s;
+  const unsigned char *end;	// end of the data, or NULL if unknown
   // JOCTET * buffer;              /* start of buffer */
   // boolean start_of_file;        /* have we gotten any data yet? */
 } my_source_mgr;
@@ -229,6 +119,16 @@ extern "C" {
   static boolean fill_input_buffer(j_decompress_ptr cinfo) {
     my_src_ptr src = (my_src_ptr)cinfo->src;
     size_t nbytes = 4096;
+    if (src->end) {
+      // Pass all the data at once, then end the image like jpeg_stdio_src()...
+      static const JOCTET eoi[2] = { 0xFF, JPEG_EOI };
+      nbytes = (size_t)(src->end - src->s);
+      if (!nbytes) {
+        src->pub.next_input_byte = eoi;
+        src->pub.bytes_in_buffer = 2;
+        return TRUE;
+      }
+    }
     src->pub.next_input_byte = src->s;
     src->pub.bytes_in_buffer = nbytes;
     src->s += nbytes;
@@ -253,10 +153,14 @@ extern "C" {
 
 } // extern "C"
 
-static void jpeg_mem_src(j_decompress_ptr cinfo, const unsigned char *data)
+static void jpeg_mem_src(j_decompress_ptr cinfo, const unsigned char *data,
+                         const unsigned char *end)
 {
   my_src_ptr src;
-  cinfo->src = (struct jpeg_source_mgr *)malloc(sizeof(my_source_mgr));
+  // Allocate from the permanent pool like jpeg_stdio_src(), so that
+  // jpeg_destroy_decompress() frees the source manager...
+  cinfo->src = (struct jpeg_source_mgr *)
+    (*cinfo->mem->alloc_small)((j_common_ptr)cinfo, JPOOL_PERMANENT, sizeof(my_source_mgr));
   src = (my_src_ptr)cinfo->src;
   src->pub.init_source = init_source;
   src->pub.fill_input_buffer = fill_input_buffer;
@@ -267,36 +171,71 @@ static void jpeg_mem_src(j_decompress_ptr cinfo, const unsigned char *data)
   src->pub.next_input_byte = NULL; /* until buffer loaded */
   src->data = data;
   src->s = data;
+  src->end = end;
 }
 #endif // HAVE_LIBJPEG
 
 
 /**
- \brief The constructor loads the JPEG image from memory.
-
- Construct an image from a block of memory inside the application. Fluid offers
- "binary Data" chunks as a great way to add image data into the C++ source code.
- name_png can be NULL. If a name is given, the image is added to the list of 
- shared images (see: Fl_Shared_Image) and will be available by that name.
-
+ \brief The constructor loads the JPEG image from the given jpeg filename.
+ 
  The inherited destructor frees all memory and server resources that are used 
  by the image.
-
+ 
  Use Fl_Image::fail() to check if Fl_JPEG_Image failed to load. fail() returns
  ERR_FILE_ACCESS if the file could not be opened or read, ERR_FORMAT if the
  JPEG format could not be decoded, and ERR_NO_IMAGE if the image could not
  be loaded for another reason. If the image has loaded correctly,
  w(), h(), and d() should return values greater than zero.
+ 
+ \param[in] filename a full path and name pointing to a valid jpeg file.
+ */
+Fl_JPEG_Image::Fl_JPEG_Image(const char *filename)	// I - File to load
+: Fl_RGB_Image(0,0,0) {
+  load_jpeg_(filename, 0, 0, 0);
+}
 
- \param name A unique name or NULL
- \param data A pointer to the memory location of the JPEG image
+
+/**
+ \brief The constructor loads a reduced size JPEG image from the given jpeg filename.
+
+ JPEG images can be decoded at 1/2, 1/4 or 1/8 of their size (and, with
+ libjpeg 7 or later, at any multiple of 1/8) much faster than at full size,
+ and with far less memory. This constructor decodes the image at the
+ smallest of these sizes that is at least \p W x \p H pixels, or at full
+ size if the image is smaller. The image is not scaled further: w() and h()
+ return the decoded size, and copy(W, H) gives an image of the exact size.
+ This is how Fl_Shared_Image::get_async() makes thumbnails of JPEG files.
+
+ \code
+ Fl_JPEG_Image photo("photo.jpg", 128, 128);	// decodes 24 MP at 1/8 size
+ Fl_Image *thumb = photo.copy(128, 96);
+ \endcode
+
+ \param[in] filename a full path and name pointing to a valid jpeg file.
+ \param[in] W, H minimum size of the decoded image
+ \see Fl_JPEG_Image(const char *filename)
+ \version 1.3.5
  */
-Fl_JPEG_Image::Fl_JPEG_Image(const char *name, const unsigned char *data)
+Fl_JPEG_Image::Fl_JPEG_Image(const char *filename, int W, int H)
 : Fl_RGB_Image(0,0,0) {
+  load_jpeg_(filename, 0, W, H);
+}
+
+
+//
+// 'Fl_JPEG_Image::load_jpeg_()' - Decode a JPEG image from a file or from memory.
+//
+
+void Fl_JPEG_Image::load_jpeg_(const char *filename,	// I - File to load, or NULL
+                               const unsigned char *data,// I - JPEG data if no file
+                               int W, int H) {		// I - Minimum size, or 0
 #ifdef HAVE_LIBJPEG
+  Fl_Image_Reader		r;	// File reader
   jpeg_decompress_struct	dinfo;	// Decompressor info
   fl_jpeg_error_mgr		jerr;	// Error handler info
-  JSAMPROW			row;	// Sample row pointer
+  JSAMPROW			rows[FL_JPEG_ROWS];// Sample row pointers
+  int				i, n;
   
   // the following variables are pointers allocating some private space that
   // is not reset by 'setjmp()'
@@ -307,6 +246,12 @@ Fl_JPEG_Image::Fl_JPEG_Image(const char *name, const unsigned char *data)
   alloc_array = 0;
   array = (uchar *)0;
   
+  // Open the image file...
+  if (filename && r.open(filename)) {
+    ld(ERR_FILE_ACCESS);
+    return;
+  }
+  
   // Setup the decompressor info and read the header...
   dinfo.err                = jpeg_std_error((jpeg_error_mgr *)&jerr);
   jerr.pub_.error_exit     = fl_jpeg_error_handler;
@@ -321,7 +266,8 @@ Fl_JPEG_Image::Fl_JPEG_Image(const char *name, const unsigned char *data)
   if (setjmp(jerr.errhand_))
   {
     // JPEG error handling...
-    Fl::warning("JPEG data is too large or contains errors!\n");
+    if (filename) Fl::warning("JPEG file \"%s\" is too large or contains errors!\n", filename);
+    else Fl::warning("JPEG data is too large or contains errors!\n");
     // if any of the cleanup routines hits another error, we would end up 
     // in a loop. So instead, we decrement max_err for some upper cleanup limit.
     if ( ((*max_finish_decompress_err)-- > 0) && array)
@@ -342,17 +288,42 @@ Fl_JPEG_Image::Fl_JPEG_Image(const char *name, const unsigned char *data)
     free(max_destroy_decompress_err);
     free(max_finish_decompress_err);
     
+    if (filename) ld(ERR_FORMAT);
     return;
   }
   
   jpeg_create_decompress(&dinfo);
-  jpeg_mem_src(&dinfo, data);
+  if (filename) jpeg_mem_src(&dinfo, r.data(), r.data() + r.size());
+  else jpeg_mem_src(&dinfo, data, (const unsigned char *)0);
   jpeg_read_header(&dinfo, TRUE);
   
   dinfo.quantize_colors      = (boolean)FALSE;
   dinfo.out_color_space      = JCS_RGB;
   dinfo.out_color_components = 3;
   dinfo.output_components    = 3;
+
+  if (W > 0 && H > 0) {
+    // Let the IDCT scale the image down as far as possible...
+    int iw = (int)dinfo.image_width, ih = (int)dinfo.image_height;
+#if JPEG_LIB_VERSION >= 70
+    for (n = 1; n < 8; n ++)
+      if ((iw * n + 7) / 8 >= W && (ih * n + 7) / 8 >= H) break;
+    dinfo.scale_num   = n;
+    dinfo.scale_denom = 8;
+    int scaled = n < 8;
+#else
+    for (n = 8; n > 1; n /= 2)
+      if ((iw + n - 1) / n >= W && (ih + n - 1) / n >= H) break;
+    dinfo.scale_num   = 1;
+    dinfo.scale_denom = n;
+    int scaled = n > 1;
+#endif // JPEG_LIB_VERSION >= 70
+    if (scaled) {
+      // The image will be scaled down further, trade accuracy for speed...
+      dinfo.dct_method          = JDCT_IFAST;
+      dinfo.do_fancy_upsampling = (boolean)FALSE;
+    }
+  }
   
   jpeg_calc_output_dimensions(&dinfo);
   
@@ -366,11 +337,15 @@ Fl_JPEG_Image::Fl_JPEG_Image(const char *name, const unsigned char *data)
   
   jpeg_start_decompress(&dinfo);
   
+  // Read up to FL_JPEG_ROWS scanlines at a time...
   while (dinfo.output_scanline < dinfo.output_height) {
-    row = (JSAMPROW)(array +
-                     dinfo.output_scanline * dinfo.output_width *
-                     dinfo.output_components);
-    jpeg_read_scanlines(&dinfo, &row, (JDIMENSION)1);
+    n = dinfo.output_height - dinfo.output_scanline;
+    if (n > FL_JPEG_ROWS) n = FL_JPEG_ROWS;
+    for (i = 0; i < n; i ++)
+      rows[i] = (JSAMPROW)(array +
+                           (size_t)(dinfo.output_scanline + i) * dinfo.output_width *
+                           dinfo.output_components);
+    jpeg_read_scanlines(&dinfo, rows, (JDIMENSION)n);
   }
   
   jpeg_finish_decompress(&dinfo);
@@ -378,7 +353,35 @@ Fl_JPEG_Image::Fl_JPEG_Image(const char *name, const unsigned char *data)
   
   free(max_destroy_decompress_err);
   free(max_finish_decompress_err);
+#endif // HAVE_LIBJPEG
+}
+
+
+/**
+ \brief The constructor loads the JPEG image from memory.
+
+ Construct an image from a block of memory inside the application. Fluid offers
+ "binary Data" chunks as a great way to add image data into the C++ source code.
+ name_png can be NULL. If a name is given, the image is added to the list of 
+ shared images (see: Fl_Shared_Image) and will be available by that name.
+
+ The inherited destructor frees all memory and server resources that are used 
+ by the image.
+
+ Use Fl_Image::fail() to check if Fl_JPEG_Image failed to load. fail() returns
+ ERR_FILE_ACCESS if the file could not be opened or read, ERR_FORMAT if the
+ JPEG format could not be decoded, and ERR_NO_IMAGE if the image could not
+ be loaded for another reason. If the image has loaded correctly,
+ w(), h(), and d() should return values greater than zero.
 
+ \param name A unique name or NULL
+ \param data A pointer to the memory location of the JPEG image
+ */
+Fl_JPEG_Image::Fl_JPEG_Image(const char *name, const unsigned char *data)
+: Fl_RGB_Image(0,0,0) {
+  load_jpeg_(0, data, 0, 0);
+
+#ifdef HAVE_LIBJPEG
   if (w() && h() && name) {
     Fl_Shared_Image *si = new Fl_Shared_Image(name, this);
     si->add();
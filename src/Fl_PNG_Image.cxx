@@ -33,6 +33,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <FL/fl_utf8.h>
+#include "Fl_Image_Reader.H"
 
 #if defined(HAVE_LIBPNG) && defined(HAVE_LIBZ)
 extern "C"
@@ -112,7 +113,7 @@ void Fl_PNG_Image::load_png_(const char *name_png, const unsigned char *buffer_p
 {
 #if defined(HAVE_LIBPNG) && defined(HAVE_LIBZ)
   int i;	  // Looping var
-  FILE *fp = NULL;	  // File pointer
+  Fl_Image_Reader r;	  // File reader
   int channels;	  // Number of color channels
   png_structp pp; // PNG read pointer
   png_infop info; // PNG info pointers
@@ -121,10 +122,12 @@ void Fl_PNG_Image::load_png_(const char *name_png, const unsigned char *buffer_p
   int from_memory = (buffer_png != NULL); // true if reading image from memory
 
   if (!from_memory) {
-    if ((fp = fl_fopen(name_png, "rb")) == NULL) {
+    if (r.open(name_png)) {
       ld(ERR_FILE_ACCESS);
       return;
     }
+    buffer_png = r.data();
+    maxsize    = (int)r.size();
   }
   const char *display_name = (name_png ? name_png : "In-memory PNG data");
 
@@ -133,7 +136,6 @@ void Fl_PNG_Image::load_png_(const char *name_png, const unsigned char *buffer_p
   if (pp) info = png_create_info_struct(pp);
   if (!pp || !info) {
     if (pp) png_destroy_read_struct(&pp, NULL, NULL);
-    if (!from_memory) fclose(fp);
     Fl::warning("Cannot allocate memory to read PNG file or data \"%s\".\n", display_name);
     w(0); h(0); d(0); ld(ERR_FORMAT);
     return;
@@ -142,21 +144,17 @@ void Fl_PNG_Image::load_png_(const char *name_png, const unsigned char *buffer_p
   if (setjmp(png_jmpbuf(pp)))
   {
     png_destroy_read_struct(&pp, &info, NULL);
-    if (!from_memory) fclose(fp);
     Fl::warning("PNG file or data \"%s\" is too large or contains errors!\n", display_name);
     w(0); h(0); d(0); ld(ERR_FORMAT);
     return;
   }
 
-  if (from_memory) {
-    png_mem_data.current = buffer_png;
-    png_mem_data.last = buffer_png + maxsize;
-    png_mem_data.pp = pp;
-    // Initialize the function pointer to the PNG read "engine"...
-    png_set_read_fn (pp, (png_voidp) &png_mem_data, png_read_data_from_mem);
-  } else {
-    png_init_io(pp, fp); // Initialize the PNG file read "engine"...
-  }  
+  // Files are read from memory as well...
+  png_mem_data.current = buffer_png;
+  png_mem_data.last = buffer_png + maxsize;
+  png_mem_data.pp = pp;
+  // Initialize the function pointer to the PNG read "engine"...
+  png_set_read_fn (pp, (png_voidp) &png_mem_data, png_read_data_from_mem);
 
   // Get the image dimensions and convert to grayscale or RGB...
   png_read_info(pp, info);
@@ -227,8 +225,6 @@ void Fl_PNG_Image::load_png_(const char *name_png, const unsigned char *buffer_p
       Fl_Shared_Image *si = new Fl_Shared_Image(name_png, this);
       si->add();
     }
-  } else {
-    fclose(fp);
   }
 #endif // HAVE_LIBPNG && HAVE_LIBZ
 }
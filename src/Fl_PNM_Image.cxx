@@ -31,6 +31,31 @@
 #include <stdlib.h>
 #include <FL/fl_utf8.h>
 #include "flstring.h"
+#include "Fl_Image_Reader.H"
+
+
+//
+// 'read_int()' - Read a decimal number like fscanf(fp, "%d", &val).
+//
+
+static int			// O - 1 on success, 0 at end of file
+read_int(Fl_Image_Reader &r,	// I - File to read from
+         int &val) {		// O - Number read
+  int c, sign = 1;
+
+  while ((c = r.read_byte()) >= 0 && isspace(c));
+  if (c == '-' || c == '+') {
+    if (c == '-') sign = -1;
+    c = r.read_byte();
+  }
+  if (c < 0 || !isdigit(c)) return 0;
+
+  for (val = 0; c >= 0 && isdigit(c); c = r.read_byte())
+    val = val * 10 + c - '0';
+  if (c >= 0) r.seek(r.tell() - 1);	// put back the delimiter
+  val *= sign;
+  return 1;
+}
 
 
 //
@@ -44,6 +69,10 @@
  The destructor frees all memory and server resources that are used by
  the image.
 
+ Binary PNM images with 8-bit samples use the pixels of the file as they
+ are. If Fl_RGB_Image::file_mapping() is enabled, the image array points
+ directly into the memory mapped file instead of a copy.
+
  Use Fl_Image::fail() to check if Fl_PNM_Image failed to load. fail() returns
  ERR_FILE_ACCESS if the file could not be opened or read, ERR_FORMAT if the
  PNM format could not be decoded, and ERR_NO_IMAGE if the image could not
@@ -51,7 +80,7 @@
  */
 Fl_PNM_Image::Fl_PNM_Image(const char *name)	// I - File to read
   : Fl_RGB_Image(0,0,0) {
-  FILE		*fp;		// File pointer
+  Fl_Image_Reader r;		// File reader
   int		x, y;		// Looping vars
   char		line[1024],	// Input line
 		*lineptr;	// Pointer in line
@@ -63,7 +92,7 @@ Fl_PNM_Image::Fl_PNM_Image(const char *name)	// I - File to read
 		maxval;		// Maximum pixel value
 
 
-  if ((fp = fl_fopen(name, "rb")) == NULL) {
+  if (r.open(name)) {
     ld(ERR_FILE_ACCESS);
     return;
   }
@@ -81,9 +110,8 @@ Fl_PNM_Image::Fl_PNM_Image(const char *name)	// I - File to read
   //   max sample
   //
 
-  lineptr = fgets(line, sizeof(line), fp);
+  lineptr = r.gets(line, sizeof(line));
   if (!lineptr) {
-    fclose(fp);
     Fl::error("Early end-of-file in PNM file \"%s\"!", name);
     ld(ERR_FILE_ACCESS);
     return;
@@ -98,7 +126,7 @@ Fl_PNM_Image::Fl_PNM_Image(const char *name)	// I - File to read
 
   while (lineptr != NULL && w() == 0) {
     if (*lineptr == '\0' || *lineptr == '#') {
-      lineptr = fgets(line, sizeof(line), fp);
+      lineptr = r.gets(line, sizeof(line));
     } else if (isdigit(*lineptr)) {
       w(strtol(lineptr, &lineptr, 10));
     } else lineptr ++;
@@ -106,7 +134,7 @@ Fl_PNM_Image::Fl_PNM_Image(const char *name)	// I - File to read
 
   while (lineptr != NULL && h() == 0) {
     if (*lineptr == '\0' || *lineptr == '#') {
-      lineptr = fgets(line, sizeof(line), fp);
+      lineptr = r.gets(line, sizeof(line));
     } else if (isdigit(*lineptr)) {
       h(strtol(lineptr, &lineptr, 10));
     } else lineptr ++;
@@ -117,7 +145,7 @@ Fl_PNM_Image::Fl_PNM_Image(const char *name)	// I - File to read
 
     while (lineptr != NULL && maxval == 0) {
       if (*lineptr == '\0' || *lineptr == '#') {
-	lineptr = fgets(line, sizeof(line), fp);
+	lineptr = r.gets(line, sizeof(line));
       } else if (isdigit(*lineptr)) {
 	maxval = strtol(lineptr, &lineptr, 10);
       } else lineptr ++;
@@ -132,10 +160,20 @@ Fl_PNM_Image::Fl_PNM_Image(const char *name)	// I - File to read
 
   if (((size_t)w()) * h() * d() > max_size() ) {
     Fl::warning("PNM file \"%s\" is too large!\n", name);
-    fclose(fp);
     w(0); h(0); d(0); ld(ERR_FORMAT);
     return;
   }
+
+  // Use the pixels of binary 8-bit files in place if possible...
+  if ((format == 5 || format == 6) && maxval < 256 &&
+      ((size_t)w()) * h() * d() <= r.left()) {
+    array = r.ptr();
+    if (r.give(this)) {
+      alloc_array = 0;
+      return;
+    }
+  }
+
   array       = new uchar[w() * h() * d()];
   alloc_array = 1;
 
@@ -146,31 +184,31 @@ Fl_PNM_Image::Fl_PNM_Image(const char *name)	// I - File to read
     switch (format) {
       case 1 :
         for (x = w(); x > 0; x --)
-          if (fscanf(fp, "%d", &val) == 1) *ptr++ = (uchar)(255 * (1-val));
+          if (read_int(r, val) == 1) *ptr++ = (uchar)(255 * (1-val));
         break;
         
       case 2 :
           for (x = w(); x > 0; x --)
-            if (fscanf(fp, "%d", &val) == 1) *ptr++ = (uchar)(255 * val / maxval);
+            if (read_int(r, val) == 1) *ptr++ = (uchar)(255 * val / maxval);
           break;
 
       case 3 :
           for (x = w(); x > 0; x --) {
-            if (fscanf(fp, "%d", &val) == 1) *ptr++ = (uchar)(255 * val / maxval);
-            if (fscanf(fp, "%d", &val) == 1) *ptr++ = (uchar)(255 * val / maxval);
-            if (fscanf(fp, "%d", &val) == 1) *ptr++ = (uchar)(255 * val / maxval);
+            if (read_int(r, val) == 1) *ptr++ = (uchar)(255 * val / maxval);
+            if (read_int(r, val) == 1) *ptr++ = (uchar)(255 * val / maxval);
+            if (read_int(r, val) == 1) *ptr++ = (uchar)(255 * val / maxval);
           }
           break;
 
       case 4 :
-        for (x = w(), byte = (uchar)getc(fp), bit = 128; x > 0; x --) {
+        for (x = w(), byte = (uchar)r.read_byte(), bit = 128; x > 0; x --) {
           if ((byte & bit) == 0) *ptr++ = 255; // 0 bit for white pixel
           else *ptr++ = 0; // 1 bit for black pixel
           
           if (bit > 1) bit >>= 1;
           else {
             bit  = 128;
-            if (x > 1) byte = (uchar)getc(fp);
+            if (x > 1) byte = (uchar)r.read_byte();
           }
         }
         break;
@@ -178,11 +216,11 @@ Fl_PNM_Image::Fl_PNM_Image(const char *name)	// I - File to read
       case 5 :
       case 6 :
         if (maxval < 256) {
-          if (fread(ptr, w(), d(), fp)) { /* ignored */ }
+          r.read(ptr, w() * d());
         } else {
           for (x = d() * w(); x > 0; x --) {
-            val = (uchar)getc(fp);
-            val = (val<<8)|(uchar)getc(fp);
+            val = (uchar)r.read_byte();
+            val = (val<<8)|(uchar)r.read_byte();
             *ptr++ = (255*val)/maxval;
           }
         }
@@ -190,7 +228,7 @@ Fl_PNM_Image::Fl_PNM_Image(const char *name)	// I - File to read
         
       case 7 : /* XV 3:3:2 thumbnail format */
         for (x = w(); x > 0; x --) {
-          byte = (uchar)getc(fp);
+          byte = (uchar)r.read_byte();
           
           *ptr++ = (uchar)(255 * ((byte >> 5) & 7) / 7);
           *ptr++ = (uchar)(255 * ((byte >> 2) & 7) / 7);
@@ -199,8 +237,6 @@ Fl_PNM_Image::Fl_PNM_Image(const char *name)	// I - File to read
         break;
     }
   }
-
-  fclose(fp);
 }
 
 
@@ -0,0 +1,373 @@
+//
+// "$Id$"
+//
+// Event loop profiler for the Fast Light Tool Kit (FLTK).
+//
+// Copyright 1998-2016 by Bill Spitzak and others.
+//
+// This library is free software. Distribution and use rights are outlined in
+// the file "COPYING" which should have been included with this file.  If this
+// file is missing or damaged, see the license at:
+//
+//     http://www.fltk.org/COPYING.php
+//
+// Please report all bugs and problems on the following page:
+//
+//     http://www.fltk.org/str.php
+//
+
+#include <config.h>
+#include <FL/Fl_Profile.H>
+#include <FL/Fl_Widget.H>
+#include <FL/fl_utf8.h>
+#include "fl_profile.h"
+#include "flstring.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <typeinfo>
+
+#ifdef WIN32
+#  include <windows.h>
+#else
+#  include <sys/time.h>
+#  include <time.h>
+#endif // WIN32
+
+#ifdef __GNUC__
+#  include <cxxabi.h>
+#endif // __GNUC__
+
+int fl_profile_on = 0;
+
+// Returns the time in seconds on a monotonic clock.
+double fl_clock() {
+#if defined(WIN32)
+  static LARGE_INTEGER freq;
+  LARGE_INTEGER count;
+  if (!freq.QuadPart) QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&count);
+  return (double)count.QuadPart / (double)freq.QuadPart;
+#else
+#  ifdef CLOCK_MONOTONIC
+  struct timespec ts;
+  if (!clock_gettime(CLOCK_MONOTONIC, &ts))
+    return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+#  endif // CLOCK_MONOTONIC
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+#endif // WIN32
+}
+
+static Fl_Profile_Stats phases[FL_PROFILE_PHASES];
+
+static const char * const phase_names[FL_PROFILE_PHASES] = {
+  "wait", "timeouts", "fd", "events", "idle", "deletion", "flush", "draw"
+};
+
+// Widget classes, looked up by the address of their typeid() name in an
+// open addressing hash table. The classes are never freed, so that the
+// trace events can point at their names.
+
+struct Fl_Profile_Class {
+  const char *key;			// typeid(widget).name()
+  char *name;				// readable name
+  Fl_Profile_Stats stats;
+};
+
+static Fl_Profile_Class *classes_ = 0;
+static int num_classes = 0, alloc_classes = 0;
+
+struct Fl_Profile_Key {
+  const char *key;
+  int index;
+};
+
+static Fl_Profile_Key *class_hash = 0;
+static int class_hash_size = 0;		// a power of 2
+
+// The phases that are running, with the time of their nested phases:
+#define MAX_DEPTH 64
+static double nested[MAX_DEPTH];
+static int depth = 0;
+
+// The trace events, a ring buffer of the last ones:
+struct Fl_Profile_Event {
+  const char *name;
+  int phase;
+  double start;
+  double duration;
+};
+
+static Fl_Profile_Event *events = 0;
+static int max_events = 0, num_events = 0, next_event = 0;
+
+// Returns a readable name for a typeid() name.
+static char *readable_name(const char *key) {
+#ifdef __GNUC__
+  int status = -1;
+  char *name = abi::__cxa_demangle(key, 0, 0, &status);
+  if (name && !status) return name;
+  free(name);
+#endif // __GNUC__
+  if (!strncmp(key, "class ", 6)) key += 6;	// Visual C++
+  return strdup(key);
+}
+
+static void hash_insert(const char *key, int index) {
+  unsigned h = (unsigned)(((fl_uintptr_t)key) >> 3);
+  for (;;) {
+    Fl_Profile_Key &k = class_hash[h & (class_hash_size - 1)];
+    if (!k.key) {
+      k.key = key;
+      k.index = index;
+      return;
+    }
+    h ++;
+  }
+}
+
+static Fl_Profile_Class *find_class(const char *key) {
+  if (class_hash_size) {
+    unsigned h = (unsigned)(((fl_uintptr_t)key) >> 3);
+    for (;;) {
+      Fl_Profile_Key &k = class_hash[h & (class_hash_size - 1)];
+      if (k.key == key) return classes_ + k.index;
+      if (!k.key) break;
+      h ++;
+    }
+  }
+
+  // Keep the hash table at most half full:
+  if (2 * (num_classes + 1) > class_hash_size) {
+    Fl_Profile_Key *old = class_hash;
+    int old_size = class_hash_size;
+    class_hash_size = class_hash_size ? 2 * class_hash_size : 64;
+    class_hash = (Fl_Profile_Key *)calloc(class_hash_size, sizeof(Fl_Profile_Key));
+    for (int i = 0; i < old_size; i ++)
+      if (old[i].key) hash_insert(old[i].key, old[i].index);
+    free(old);
+  }
+
+  // The same class can have several typeid() names if it is used in
+  // several shared libraries:
+  int i;
+  for (i = 0; i < num_classes; i ++)
+    if (!strcmp(classes_[i].key, key)) break;
+
+  if (i == num_classes) {
+    if (num_classes >= alloc_classes) {
+      alloc_classes = alloc_classes ? 2 * alloc_classes : 32;
+      classes_ = (Fl_Profile_Class *)realloc(classes_, alloc_classes * sizeof(Fl_Profile_Class));
+    }
+    Fl_Profile_Class &c = classes_[num_classes++];
+    memset(&c, 0, sizeof(c));
+    c.key = key;
+    c.name = readable_name(key);
+  }
+  hash_insert(key, i);
+  return classes_ + i;
+}
+
+static void add_time(Fl_Profile_Stats &s, double t, double self) {
+  s.count ++;
+  s.total += t;
+  s.self += self;
+  if (t > s.max) s.max = t;
+  int b = 0;
+  double limit = Fl_Profile::bucket_limit(0);
+  while (b < FL_PROFILE_BUCKETS - 1 && t >= limit) {
+    b ++;
+    limit *= 2.0;
+  }
+  s.histogram[b] ++;
+}
+
+// Starts a phase, returns its start time.
+double fl_profile_push() {
+  double t0 = fl_clock();
+  if (depth < MAX_DEPTH) nested[depth] = 0.0;
+  depth ++;
+  return t0;
+}
+
+// Ends the phase that started at t0, and adds it to the statistics.
+void fl_profile_pop(double t0, int phase, const Fl_Widget *widget) {
+  double t = fl_clock() - t0;
+  depth --;
+  double self = depth < MAX_DEPTH ? t - nested[depth] : t;
+  if (depth > 0 && depth <= MAX_DEPTH) nested[depth - 1] += t;
+
+  add_time(phases[phase], t, self);
+  const char *name = phase_names[phase];
+  if (widget) {
+    Fl_Profile_Class *c = find_class(typeid(*widget).name());
+    add_time(c->stats, t, self);
+    name = c->name;
+  }
+
+  if (max_events) {
+    Fl_Profile_Event &e = events[next_event];
+    e.name = name;
+    e.phase = phase;
+    e.start = t0;
+    e.duration = t;
+    next_event = (next_event + 1) % max_events;
+    if (num_events < max_events) num_events ++;
+  }
+}
+
+/**
+  Turns the profiler on or off.
+
+  The statistics are kept when the profiler is turned off, and are added
+  to when it is turned on again. Use reset() to clear them.
+
+  \version 1.3.5
+*/
+void Fl_Profile::enable(int on) {
+  fl_profile_on = on;
+}
+
+/** Returns non-zero if the profiler is on. */
+int Fl_Profile::enabled() {
+  return fl_profile_on;
+}
+
+/** Clears the statistics of all the phases and classes, and the trace. */
+void Fl_Profile::reset() {
+  memset(phases, 0, sizeof(phases));
+  for (int i = 0; i < num_classes; i ++)
+    memset(&classes_[i].stats, 0, sizeof(Fl_Profile_Stats));
+  num_events = next_event = 0;
+}
+
+/**
+  Returns the name of a phase, for instance "flush" for FL_PROFILE_FLUSH,
+  or NULL if \p phase is not one of the Fl_Profile_Phase values.
+*/
+const char *Fl_Profile::phase_name(int phase) {
+  if (phase < 0 || phase >= FL_PROFILE_PHASES) return NULL;
+  return phase_names[phase];
+}
+
+/**
+  Gets the statistics of a phase of the event loop.
+
+  FL_PROFILE_FLUSH counts the windows, and FL_PROFILE_DRAW the widgets
+  drawn by Fl_Group inside them. Both are also counted per class, see
+  class_stats().
+
+  Returns 1, or 0 and sets \p stats to zeros if \p phase is not one of the
+  Fl_Profile_Phase values.
+*/
+int Fl_Profile::phase_stats(int phase, Fl_Profile_Stats *stats) {
+  if (phase < 0 || phase >= FL_PROFILE_PHASES) {
+    memset(stats, 0, sizeof(*stats));
+    return 0;
+  }
+  *stats = phases[phase];
+  return 1;
+}
+
+/** Returns the number of widget classes that were drawn, see class_stats(). */
+int Fl_Profile::classes() {
+  return num_classes;
+}
+
+/**
+  Gets the draw statistics of a widget class.
+
+  \p i goes from 0 to classes() - 1. The classes of the windows are
+  included, with the time it took to flush them. The self time of a
+  class does not count the time spent drawing the children of its
+  widgets.
+
+  Returns the name of the class, or NULL and sets \p stats to zeros if
+  \p i is out of range.
+*/
+const char *Fl_Profile::class_stats(int i, Fl_Profile_Stats *stats) {
+  if (i < 0 || i >= num_classes) {
+    memset(stats, 0, sizeof(*stats));
+    return NULL;
+  }
+  *stats = classes_[i].stats;
+  return classes_[i].name;
+}
+
+/**
+  Returns the upper limit of a bucket of Fl_Profile_Stats::histogram.
+
+  Bucket 0 counts the times that are less than 1/16 millisecond, and each
+  next bucket the times that are less than twice the limit of the bucket
+  before it, up to about one second. The last bucket counts the longer
+  times, and its limit is 0.
+*/
+double Fl_Profile::bucket_limit(int bucket) {
+  if (bucket < 0 || bucket >= FL_PROFILE_BUCKETS - 1) return 0.0;
+  return 0.0000625 * (1 << bucket);
+}
+
+/**
+  Keeps the last \p n events for write_trace().
+
+  Each phase and each widget draw is an event, the older events are
+  dropped. A value of 0 (the default) frees the events and turns the
+  trace off.
+*/
+void Fl_Profile::trace(int n) {
+  free(events);
+  events = n > 0 ? (Fl_Profile_Event *)malloc(n * sizeof(Fl_Profile_Event)) : 0;
+  max_events = events ? n : 0;
+  num_events = next_event = 0;
+}
+
+static void write_string(FILE *f, const char *s) {
+  putc('"', f);
+  for (; *s; s ++) {
+    if (*s == '"' || *s == '\\') putc('\\', f);
+    if ((unsigned char)*s >= ' ') putc(*s, f);
+  }
+  putc('"', f);
+}
+
+/**
+  Saves the events kept by trace() to a file in the Chrome trace event
+  format.
+
+  The times in the file start at the first event that was kept. Returns
+  0 on success, or -1 if the file could not be written.
+*/
+int Fl_Profile::write_trace(const char *filename) {
+  FILE *f = fl_fopen(filename, "w");
+  if (!f) return -1;
+
+  int first = (next_event - num_events + max_events) % (max_events ? max_events : 1);
+  double base = 0.0;
+  int i;
+  for (i = 0; i < num_events; i ++) {
+    double t = events[(first + i) % max_events].start;
+    if (!i || t < base) base = t;
+  }
+
+  fputs("{\"traceEvents\":[\n"
+        "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,"
+        "\"args\":{\"name\":\"FLTK event loop\"}}", f);
+  for (i = 0; i < num_events; i ++) {
+    const Fl_Profile_Event &e = events[(first + i) % max_events];
+    fputs(",\n{\"name\":", f);
+    write_string(f, e.name);
+    fprintf(f, ",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+            "\"pid\":1,\"tid\":1}", phase_names[e.phase],
+            (e.start - base) * 1000000.0, e.duration * 1000000.0);
+  }
+  fputs("\n],\"displayTimeUnit\":\"ms\"}\n", f);
+
+  int err = ferror(f);
+  if (fclose(f) || err) return -1;
+  return 0;
+}
+
+//
+// End of "$Id$".
+//
@@ -20,9 +20,11 @@
 #include <stdlib.h>
 #include <FL/fl_utf8.h>
 #include "flstring.h"
+#include "fl_threads.h"
 
 #include <FL/Fl.H>
 #include <FL/Fl_Shared_Image.H>
+#include <FL/Fl_Thread_Pool.H>
 #include <FL/Fl_XBM_Image.H>
 #include <FL/Fl_XPM_Image.H>
 #include <FL/Fl_Preferences.H>
@@ -40,13 +42,163 @@ Fl_Shared_Handler *Fl_Shared_Image::handlers_ = 0;// Additional format handlers
 int	Fl_Shared_Image::num_handlers_ = 0;	// Number of format handlers
 int	Fl_Shared_Image::alloc_handlers_ = 0;	// Allocated format handlers
 
+static Fl_Shared_Sized_Handler *sized_handlers_ = 0;// Reduced size format handlers
+static int num_sized_handlers_ = 0;	// Number of reduced size format handlers
+static int alloc_sized_handlers_ = 0;	// Allocated reduced size format handlers
+
+
+//
+// The shared image cache...
+//
+// Every image that was add()ed has an entry in a hash table keyed by its
+// name, so that find() neither allocates a key image nor needs a sorted
+// images_ array. Referenced images are also listed in images_, at the
+// index stored in their entry. When a cache size is set, unreferenced
+// images that can be reloaded from their file stay in the table: first on
+// the LRU list with their pixels, then, once evicted, on the evicted list
+// with only their name and size.
+//
+
+struct Fl_Shared_Image_Entry {
+  Fl_Shared_Image	*image;		// The shared image
+  unsigned		hash;		// Hash of the image name
+  int			index;		// Index in images_, -1 if unreferenced
+  int			reloadable;	// Can the image be reloaded from its file?
+  int			loading;	// Is get_async() reloading the image?
+  size_t		bytes;		// Pixel memory accounted for the image
+  Fl_Shared_Image_Entry	*next;		// Next entry in the hash bucket
+  Fl_Shared_Image_Entry	*older, *newer;	// Links in the LRU or evicted list
+};
+
+struct Fl_Shared_Image_List {
+  Fl_Shared_Image_Entry	*oldest, *newest;
+  int			count;
+};
+
+// Number of evicted images whose name and size are remembered
+#define MAX_EVICTED 1024
+
+// Modes of Fl_Shared_Image::lookup()
+#define LOOKUP_COUNT	1	// update the hits and misses
+#define LOOKUP_NO_RELOAD 2	// return evicted images without reloading them
 
 //
-// Typedef the C API sort function type the only way I know how...
+// Loads images for get_async(), see the end of this file...
 //
 
-extern "C" {
-  typedef int (*compare_func_t)(const void *, const void *);
+class Fl_Shared_Image_Loader {
+  struct Job;
+  struct Waiter;
+  static Job *queue_, *queue_last_;	// Jobs waiting for the thread pool
+  static Job *done_;			// Jobs waiting for delivery by a timeout
+  static Job *pending_;			// All jobs not delivered yet
+  static int max_, running_;		// running_ jobs are in the thread pool
+
+  static void start(Job *job);
+  static void run_queue();
+  static void decode(Job *job);
+  static void decode_work(void *);
+  static void decode_done(void *);
+  static void done(Job *job);
+  static void deliver(void *);
+  static void finish(Job *job);
+  static void free_job(Job *job);
+  static void add_waiter(Job *job, Fl_Shared_Image_Cb cb, void *data);
+  static Job *find(const char *n, int W, int H);
+  static Fl_Image *load(const char *name, int W, int H,
+                        const Fl_Shared_Handler *handlers, int num_handlers,
+                        const Fl_Shared_Sized_Handler *sized, int num_sized);
+
+public:
+  static Fl_Image *load(const char *name, int W, int H);
+  static Fl_Shared_Image *get(const char *n, int W, int H, Fl_Shared_Image_Cb cb, void *data);
+  static void cancel(Fl_Shared_Image *img);
+  static void max(int n);
+  static int max();
+};
+
+static Fl_Shared_Image_Entry **cache_table = 0;	// Hash buckets
+static unsigned		cache_buckets = 0;	// Number of buckets, a power of 2
+static unsigned		cache_entries = 0;	// Number of entries
+static Fl_Shared_Image_List cache_lru = { 0, 0, 0 };	// Unreferenced images with pixels
+static Fl_Shared_Image_List cache_evicted = { 0, 0, 0 };// Unreferenced images without pixels
+static size_t		cache_budget = 0;	// Cache size, 0 = no caching
+static Fl_Shared_Image_Stats cache_stats_;	// Statistics
+
+static unsigned hash_name(const char *n) {
+  unsigned h = 2166136261U; // FNV-1a
+  if (n) for (; *n; n ++) h = (h ^ (uchar)*n) * 16777619U;
+  return h;
+}
+
+// Rough pixel memory of an image: bitmaps and pixmaps count one byte
+// per pixel.
+static size_t image_bytes(Fl_Image *img) {
+  if (!img) return 0;
+  size_t line = img->d() > 0 ? (img->ld() ? img->ld() : img->w() * img->d()) : img->w();
+  return line * img->h();
+}
+
+static Fl_Shared_Image_Entry *entry_of(Fl_Shared_Image *img) {
+  if (!cache_entries) return 0;
+  unsigned h = hash_name(img->name());
+  for (Fl_Shared_Image_Entry *e = cache_table[h & (cache_buckets - 1)]; e; e = e->next)
+    if (e->image == img) return e;
+  return 0;
+}
+
+static void table_insert(Fl_Shared_Image_Entry *e) {
+  if (cache_entries >= cache_buckets) {
+    // Double the number of buckets and rehash...
+    unsigned n = cache_buckets ? cache_buckets * 2 : 64;
+    Fl_Shared_Image_Entry **table = new Fl_Shared_Image_Entry *[n];
+    memset(table, 0, n * sizeof(Fl_Shared_Image_Entry *));
+    for (unsigned i = 0; i < cache_buckets; i ++)
+      while (Fl_Shared_Image_Entry *f = cache_table[i]) {
+        cache_table[i] = f->next;
+        f->next = table[f->hash & (n - 1)];
+        table[f->hash & (n - 1)] = f;
+      }
+    delete[] cache_table;
+    cache_table   = table;
+    cache_buckets = n;
+  }
+  Fl_Shared_Image_Entry **b = cache_table + (e->hash & (cache_buckets - 1));
+  e->next = *b;
+  *b = e;
+  cache_entries ++;
+}
+
+static void table_remove(Fl_Shared_Image_Entry *e) {
+  Fl_Shared_Image_Entry **p = cache_table + (e->hash & (cache_buckets - 1));
+  while (*p != e) p = &(*p)->next;
+  *p = e->next;
+  cache_entries --;
+}
+
+static void list_append(Fl_Shared_Image_List &l, Fl_Shared_Image_Entry *e) {
+  e->older = l.newest;
+  e->newer = 0;
+  if (l.newest) l.newest->newer = e;
+  else l.oldest = e;
+  l.newest = e;
+  l.count ++;
+  if (&l == &cache_lru) {
+    cache_stats_.cached_bytes += e->bytes;
+    cache_stats_.cached ++;
+  }
+}
+
+static void list_remove(Fl_Shared_Image_List &l, Fl_Shared_Image_Entry *e) {
+  if (e->older) e->older->newer = e->newer;
+  else l.oldest = e->newer;
+  if (e->newer) e->newer->older = e->older;
+  else l.newest = e->older;
+  l.count --;
+  if (&l == &cache_lru) {
+    cache_stats_.cached_bytes -= e->bytes;
+    cache_stats_.cached --;
+  }
 }
 
 
@@ -123,7 +275,7 @@ Fl_Shared_Image::Fl_Shared_Image(const char *n,		// I - Filename
 
 
 //
-// 'Fl_Shared_Image::add()' - Add a shared image to the array.
+// 'Fl_Shared_Image::add()' - Add a shared image to the array and the cache.
 //
 
 void
@@ -144,13 +296,23 @@ Fl_Shared_Image::add() {
     alloc_images_ += 32;
   }
 
+  Fl_Shared_Image_Entry *e = entry_of(this);
+  if (!e) {
+    e = new Fl_Shared_Image_Entry;
+    e->image      = this;
+    e->hash       = hash_name(name_);
+    e->reloadable = 0;
+    e->loading    = 0;
+    e->bytes      = image_bytes(image_);
+    table_insert(e);
+    cache_stats_.bytes += e->bytes;
+  }
+  e->index = num_images_;
+
   images_[num_images_] = this;
   num_images_ ++;
 
-  if (num_images_ > 1) {
-    qsort(images_, num_images_, sizeof(Fl_Shared_Image *),
-          (compare_func_t)compare);
-  }
+  trim_cache();
 }
 
 
@@ -166,6 +328,13 @@ Fl_Shared_Image::update() {
     d(image_->d());
     data(image_->data(), image_->count());
   }
+
+  Fl_Shared_Image_Entry *e = entry_of(this);
+  if (e) {
+    size_t bytes = image_bytes(image_);
+    cache_stats_.bytes += bytes - e->bytes;
+    e->bytes = bytes;
+  }
 }
 
 /**
@@ -187,25 +356,43 @@ Fl_Shared_Image::~Fl_Shared_Image() {
 /** 
   Releases and possibly destroys (if refcount <=0) a shared image. 
   In the latter case, it will reorganize the shared image array so that no hole will occur.
+  When a cache size is set, an image that can be reloaded from its file
+  is kept in the cache instead of being destroyed. Releasing an image
+  returned by get_async() before it is loaded cancels the load.
+  \see cache_size(size_t)
 */
 void Fl_Shared_Image::release() {
-  int	i;	// Looping var...
-
   refcount_ --;
   if (refcount_ > 0) return;
 
-  for (i = 0; i < num_images_; i ++)
-    if (images_[i] == this) {
-      num_images_ --;
+  Fl_Shared_Image_Loader::cancel(this);
 
-      if (i < num_images_) {
-        memmove(images_ + i, images_ + i + 1,
-               (num_images_ - i) * sizeof(Fl_Shared_Image *));
-      }
+  Fl_Shared_Image_Entry *e = entry_of(this);
 
-      break;
+  if (e && e->index >= 0) {
+    // Move the last image into the hole...
+    num_images_ --;
+
+    if (e->index < num_images_) {
+      images_[e->index] = images_[num_images_];
+      entry_of(images_[e->index])->index = e->index;
     }
 
+    e->index = -1;
+  }
+
+  if (e && e->reloadable && cache_budget) {
+    list_append(image_ ? cache_lru : cache_evicted, e);
+    trim_cache();
+    return;
+  }
+
+  if (e) {
+    table_remove(e);
+    cache_stats_.bytes -= e->bytes;
+    delete e;
+  }
+
   delete this;
 
   if (num_images_ == 0 && images_) {
@@ -221,33 +408,14 @@ void Fl_Shared_Image::release() {
 /** Reloads the shared image from disk */
 void Fl_Shared_Image::reload() {
   // Load image from disk...
-  int		i;		// Looping var
-  FILE		*fp;		// File pointer
-  uchar		header[64];	// Buffer for auto-detecting files
   Fl_Image	*img;		// New image
 
   if (!name_) return;
 
-  if ((fp = fl_fopen(name_, "rb")) != NULL) {
-    if (fread(header, 1, sizeof(header), fp)==0) { /* ignore */ }
-    fclose(fp);
-  } else {
-    return;
-  }
-
-  // Load the image as appropriate...
-  if (memcmp(header, "#define", 7) == 0) // XBM file
-    img = new Fl_XBM_Image(name_);
-  else if (memcmp(header, "/* XPM */", 9) == 0) // XPM file
-    img = new Fl_XPM_Image(name_);
-  else {
-    // Not a standard format; try an image handler...
-    for (i = 0, img = 0; i < num_handlers_; i ++) {
-      img = (handlers_[i])(name_, header, sizeof(header));
-
-      if (img) break;
-    }
-  }
+  // Originals are loaded at the size of their file, never by the sized
+  // handlers, which may trade quality for speed...
+  if (original_) img = Fl_Shared_Image_Loader::load(name_, 0, 0);
+  else img = Fl_Shared_Image_Loader::load(name_, w(), h());
 
   if (img) {
     if (alloc_image_) delete image_;
@@ -308,6 +476,10 @@ Fl_Shared_Image::color_average(Fl_Color c,	// I - Color to blend with
 
   image_->color_average(c, i);
   update();
+
+  // The modified pixels can't be reloaded from the file
+  Fl_Shared_Image_Entry *e = entry_of(this);
+  if (e) e->reloadable = 0;
 }
 
 
@@ -321,6 +493,10 @@ Fl_Shared_Image::desaturate() {
 
   image_->desaturate();
   update();
+
+  // The modified pixels can't be reloaded from the file
+  Fl_Shared_Image_Entry *e = entry_of(this);
+  if (e) e->reloadable = 0;
 }
 
 
@@ -424,29 +600,67 @@ void Fl_Shared_Image::uncache()
 
 /** Finds a shared image from its named and size specifications */
 Fl_Shared_Image* Fl_Shared_Image::find(const char *n, int W, int H) {
-  Fl_Shared_Image	*key,		// Image key
-			**match;	// Matching image
+  return lookup(n, W, H, LOOKUP_COUNT);
+}
 
-  if (num_images_) {
-    key = new Fl_Shared_Image();
-    key->name_ = new char[strlen(n) + 1];
-    strcpy((char *)key->name_, n);
-    key->w(W);
-    key->h(H);
 
-    match = (Fl_Shared_Image **)bsearch(&key, images_, num_images_,
-                                        sizeof(Fl_Shared_Image *),
-                                        (compare_func_t)compare);
+//
+// 'Fl_Shared_Image::lookup()' - Find, reference and if needed reload an image.
+//
 
-    delete key;
+Fl_Shared_Image *
+Fl_Shared_Image::lookup(const char *n,		// I - Name of the image
+                        int W, int H,		// I - Size, 0 for the original image
+                        int mode) {		// I - LOOKUP_COUNT, LOOKUP_NO_RELOAD
+  Fl_Shared_Image_Entry	*e;		// Matching entry
+  Fl_Shared_Image	*img = 0;	// Matching image
+  unsigned		h = hash_name(n);
+  int			count = mode & LOOKUP_COUNT;
+
+  for (e = cache_entries ? cache_table[h & (cache_buckets - 1)] : 0; e; e = e->next) {
+    img = e->image;
+    if (e->hash == h && !e->loading && !strcmp(img->name_, n) &&
+        ((W == 0 && img->original_) || (img->w() == W && img->h() == H))) break;
+  }
 
-    if (match) {
-      (*match)->refcount_ ++;
-      return *match;
-    }
+  if (!e) {
+    if (count) cache_stats_.misses ++;
+    return 0;
   }
 
-  return 0;
+  if (e->index < 0) {
+    // Take the image out of the cache...
+    if (img->image_) {
+      list_remove(cache_lru, e);
+      if (count) cache_stats_.hits ++;
+    } else {
+      list_remove(cache_evicted, e);
+      if (count) cache_stats_.misses ++;
+
+      if (mode & LOOKUP_NO_RELOAD) {
+        // get_async() reloads the image...
+        e->loading = 1;
+        img->refcount_ = 1;
+        return img;
+      }
+
+      img->reload();
+
+      if (!img->image_) {
+        // The file is gone...
+        table_remove(e);
+        delete e;
+        delete img;
+        return 0;
+      }
+    }
+
+    img->refcount_ = 0;
+    img->add();
+  } else if (count) cache_stats_.hits ++;
+
+  img->refcount_ ++;
+  return img;
 }
 
 
@@ -472,10 +686,11 @@ Fl_Shared_Image* Fl_Shared_Image::find(const char *n, int W, int H) {
 */
 Fl_Shared_Image* Fl_Shared_Image::get(const char *n, int W, int H) {
   Fl_Shared_Image	*temp;		// Image
+  int			reloadable;	// Can the image be reloaded from its file?
 
-  if ((temp = find(n, W, H)) != NULL) return temp;
+  if ((temp = lookup(n, W, H, LOOKUP_COUNT)) != NULL) return temp;
 
-  if ((temp = find(n)) == NULL) {
+  if ((temp = lookup(n, 0, 0, 0)) == NULL) {
     temp = new Fl_Shared_Image(n);
 
     if (!temp->image_) {
@@ -484,11 +699,13 @@ Fl_Shared_Image* Fl_Shared_Image::get(const char *n, int W, int H) {
     }
 
     temp->add();
-  }
+    reloadable = entry_of(temp)->reloadable = 1;
+  } else reloadable = entry_of(temp)->reloadable;
 
   if ((temp->w() != W || temp->h() != H) && W && H) {
     temp = (Fl_Shared_Image *)temp->copy(W, H);
     temp->add();
+    entry_of(temp)->reloadable = reloadable;
   }
 
   return temp;
@@ -508,6 +725,85 @@ Fl_Shared_Image *Fl_Shared_Image::get(Fl_RGB_Image *rgb, int own_it)
 }
 
 
+/**
+  Sets the size of the shared image cache in bytes.
+
+  With a non-zero size, images that were loaded from a file by get()
+  are not destroyed when their last reference is released, but kept
+  for later get() calls. When the pixel memory of all shared images,
+  referenced or not, exceeds \p bytes, the least recently released
+  images have their pixels freed while their name and size are kept,
+  so that the next get() reloads them from the file.
+
+  Images that were built from memory, with get(Fl_RGB_Image*, int) or
+  the named memory constructors of Fl_JPEG_Image and Fl_PNG_Image, and
+  images that were changed with color_average() or desaturate(), are
+  still destroyed when released.
+
+  The default size is 0, which disables the cache: all unreferenced
+  images are destroyed.
+
+  \param bytes the cache size, 0 to empty and disable the cache
+  \see cache_stats()
+  \version 1.3.5
+*/
+void Fl_Shared_Image::cache_size(size_t bytes) {
+  cache_budget = bytes;
+  trim_cache();
+}
+
+/** Returns the size of the shared image cache in bytes, see cache_size(size_t) */
+size_t Fl_Shared_Image::cache_size() {
+  return cache_budget;
+}
+
+/**
+  Returns the statistics of the shared image cache: lookups by find()
+  and get(), evictions, and the pixel memory held by shared images.
+  \version 1.3.5
+*/
+const Fl_Shared_Image_Stats &Fl_Shared_Image::cache_stats() {
+  return cache_stats_;
+}
+
+
+//
+// 'Fl_Shared_Image::trim_cache()' - Free images until the cache fits its size.
+//
+
+void Fl_Shared_Image::trim_cache() {
+  Fl_Shared_Image_Entry	*e;		// Oldest unreferenced image
+  Fl_Shared_Image	*img;
+
+  while ((e = cache_lru.oldest) != NULL &&
+         (!cache_budget || cache_stats_.bytes > cache_budget)) {
+    list_remove(cache_lru, e);
+    img = e->image;
+
+    if (img->alloc_image_) delete img->image_;
+    img->image_ = 0;
+    img->data(0, 0);
+#if FLTK_ABI_VERSION >= 10304
+    delete img->scaled_image_;
+    img->scaled_image_ = 0;
+#endif
+
+    cache_stats_.bytes -= e->bytes;
+    e->bytes = 0;
+    cache_stats_.evictions ++;
+    list_append(cache_evicted, e);
+  }
+
+  while ((e = cache_evicted.oldest) != NULL &&
+         (!cache_budget || cache_evicted.count > MAX_EVICTED)) {
+    list_remove(cache_evicted, e);
+    table_remove(e);
+    delete e->image;
+    delete e;
+  }
+}
+
+
 /** Adds a shared image handler, which is basically a test function for adding new formats */
 void Fl_Shared_Image::add_handler(Fl_Shared_Handler f) {
   int			i;		// Looping var...
@@ -560,6 +856,584 @@ void Fl_Shared_Image::remove_handler(Fl_Shared_Handler f) {
 }
 
 
+/**
+  Adds a shared image handler for formats that can be loaded at a reduced
+  size faster than at full size, like JPEG. The handler is called instead
+  of the other handlers when get_async() or reload() need the image at a
+  size of \p W x \p H; it returns an image of at least that size, or NULL
+  if it does not support the format of the file.
+  \version 1.3.5
+*/
+void Fl_Shared_Image::add_handler(Fl_Shared_Sized_Handler f) {
+  int			i;		// Looping var...
+  Fl_Shared_Sized_Handler *temp;	// New image handler array...
+
+  for (i = 0; i < num_sized_handlers_; i ++) {
+    if (sized_handlers_[i] == f) return;
+  }
+
+  if (num_sized_handlers_ >= alloc_sized_handlers_) {
+    temp = new Fl_Shared_Sized_Handler [alloc_sized_handlers_ + 8];
+
+    if (alloc_sized_handlers_) {
+      memcpy(temp, sized_handlers_, alloc_sized_handlers_ * sizeof(Fl_Shared_Sized_Handler));
+
+      delete[] sized_handlers_;
+    }
+
+    sized_handlers_       = temp;
+    alloc_sized_handlers_ += 8;
+  }
+
+  sized_handlers_[num_sized_handlers_] = f;
+  num_sized_handlers_ ++;
+}
+
+
+/** Removes a shared image handler for formats that can be loaded at a reduced size */
+void Fl_Shared_Image::remove_handler(Fl_Shared_Sized_Handler f) {
+  int	i;				// Looping var...
+
+  for (i = 0; i < num_sized_handlers_; i ++) {
+    if (sized_handlers_[i] == f) break;
+  }
+
+  if (i >= num_sized_handlers_) return;
+
+  num_sized_handlers_ --;
+
+  if (i < num_sized_handlers_) {
+    memmove(sized_handlers_ + i, sized_handlers_ + i + 1,
+           (num_sized_handlers_ - i) * sizeof(Fl_Shared_Sized_Handler));
+  }
+}
+
+
+//
+// 'Fl_Shared_Image_Loader' - Load images with Fl_Thread_Pool for get_async().
+//
+// get_async() returns a placeholder shared image right away and queues a
+// job with a copy of the file name. Up to max() jobs at a time are given
+// to Fl_Thread_Pool, whose work function decodes the file and scales it to
+// the requested size, and whose done function hands the image to the
+// placeholder in the main thread. Without Fl::lock(), the pool decodes
+// the files in idle callbacks instead.
+//
+// A get_async() of an image that a job is already loading shares that
+// job: the image is decoded once and all the callbacks are called.
+//
+// Only the work function runs outside of the main thread, and it only
+// looks at its own job, so the loader needs no locking. The job keeps a
+// copy of the image handlers from when it was queued, so that the work
+// function never reads the handler arrays that add_handler() and
+// remove_handler() change.
+//
+
+// Maximum number of images decoded at the same time by default
+#define MAX_ASYNC 4
+
+struct Fl_Shared_Image_Loader::Waiter {
+  Waiter		*next;		// Next callback of the job
+  Fl_Shared_Image_Cb	cb;		// Callback and its data
+  void			*data;
+};
+
+struct Fl_Shared_Image_Loader::Job {
+  Job			*next;		// Next job in queue_ or done_
+  Job			*next_pending;	// Next job in pending_
+  char			*name;		// Copy of the file name
+  int			W, H;		// Requested size, 0 for the original size
+  Fl_Image		*image;		// Decoded image, NULL if it failed
+  int			scaled;		// Was a size requested?
+  int			loaded;		// Was the image already loaded by get_async()?
+  volatile int		cancelled;	// Can the work function skip the job?
+  Fl_Shared_Image	*img;		// The placeholder, NULL when cancelled
+  Waiter		*waiters;	// Callbacks in the order of the calls
+  Fl_Shared_Handler	*handlers;	// Copy of the handlers when queued
+  int			num_handlers;
+  Fl_Shared_Sized_Handler *sized_handlers;// Copy of the reduced size handlers
+  int			num_sized_handlers;
+};
+
+Fl_Shared_Image_Loader::Job *Fl_Shared_Image_Loader::queue_ = 0;
+Fl_Shared_Image_Loader::Job *Fl_Shared_Image_Loader::queue_last_ = 0;
+Fl_Shared_Image_Loader::Job *Fl_Shared_Image_Loader::done_ = 0;
+Fl_Shared_Image_Loader::Job *Fl_Shared_Image_Loader::pending_ = 0;
+int Fl_Shared_Image_Loader::max_ = 0;
+int Fl_Shared_Image_Loader::running_ = 0;
+
+
+//
+// 'Fl_Shared_Image_Loader::load()' - Load an image file with the handlers.
+//
+// If W and H are not 0, the reduced size handlers may load the image at
+// any size of at least W x H pixels. Only called by the main thread, the
+// worker threads use the handlers copied into their job.
+//
+
+Fl_Image *Fl_Shared_Image_Loader::load(const char *name, int W, int H) {
+  return load(name, W, H, Fl_Shared_Image::handlers_, Fl_Shared_Image::num_handlers_,
+              sized_handlers_, num_sized_handlers_);
+}
+
+Fl_Image *Fl_Shared_Image_Loader::load(const char *name, int W, int H,
+                                       const Fl_Shared_Handler *handlers, int num_handlers,
+                                       const Fl_Shared_Sized_Handler *sized, int num_sized) {
+  int		i;		// Looping var
+  FILE		*fp;		// File pointer
+  uchar		header[64];	// Buffer for auto-detecting files
+  Fl_Image	*img;		// New image
+
+  if ((fp = fl_fopen(name, "rb")) != NULL) {
+    if (fread(header, 1, sizeof(header), fp)==0) { /* ignore */ }
+    fclose(fp);
+  } else {
+    return 0;
+  }
+
+  // Load the image as appropriate...
+  if (W > 0 && H > 0) {
+    for (i = 0; i < num_sized; i ++) {
+      img = (sized[i])(name, header, sizeof(header), W, H);
+
+      if (img) return img;
+    }
+  }
+
+  if (memcmp(header, "#define", 7) == 0) // XBM file
+    img = new Fl_XBM_Image(name);
+  else if (memcmp(header, "/* XPM */", 9) == 0) // XPM file
+    img = new Fl_XPM_Image(name);
+  else {
+    // Not a standard format; try an image handler...
+    for (i = 0, img = 0; i < num_handlers; i ++) {
+      img = (handlers[i])(name, header, sizeof(header));
+
+      if (img) break;
+    }
+  }
+
+  return img;
+}
+
+
+//
+// 'Fl_Shared_Image_Loader::decode()' - Load and scale the image of a job.
+//
+
+void Fl_Shared_Image_Loader::decode(Job *job) {
+  Fl_Image *img = load(job->name, job->W, job->H,
+                       job->handlers, job->num_handlers,
+                       job->sized_handlers, job->num_sized_handlers);
+
+  if (img && (img->w() <= 0 || img->h() <= 0)) {
+    delete img;
+    img = 0;
+  }
+
+  if (img && job->W && job->H) {
+    if (img->w() != job->W || img->h() != job->H) {
+      Fl_Image *temp = img->copy(job->W, job->H);
+      delete img;
+      img = temp;
+    }
+    job->scaled = 1;
+  }
+
+  job->image = img;
+}
+
+
+//
+// 'Fl_Shared_Image_Loader::decode_work()' - Decode a job in a worker thread.
+//
+
+void Fl_Shared_Image_Loader::decode_work(void *data) {
+  Job *job = (Job *)data;
+  if (!job->cancelled) decode(job);
+}
+
+
+//
+// 'Fl_Shared_Image_Loader::decode_done()' - Deliver a decoded job in the main thread.
+//
+
+void Fl_Shared_Image_Loader::decode_done(void *data) {
+  running_ --;
+  finish((Job *)data);
+  run_queue();
+}
+
+
+//
+// 'Fl_Shared_Image_Loader::start()' - Queue a job.
+//
+
+void Fl_Shared_Image_Loader::start(Job *job) {
+  job->num_handlers = Fl_Shared_Image::num_handlers_;
+  job->handlers     = new Fl_Shared_Handler[job->num_handlers + 1];
+  if (job->num_handlers)
+    memcpy(job->handlers, Fl_Shared_Image::handlers_,
+           job->num_handlers * sizeof(Fl_Shared_Handler));
+  job->num_sized_handlers = num_sized_handlers_;
+  job->sized_handlers     = new Fl_Shared_Sized_Handler[job->num_sized_handlers + 1];
+  if (job->num_sized_handlers)
+    memcpy(job->sized_handlers, sized_handlers_,
+           job->num_sized_handlers * sizeof(Fl_Shared_Sized_Handler));
+
+  job->next_pending = pending_;
+  pending_          = job;
+
+  job->next = 0;
+  if (queue_last_) queue_last_->next = job;
+  else queue_ = job;
+  queue_last_ = job;
+
+  run_queue();
+}
+
+
+//
+// 'Fl_Shared_Image_Loader::run_queue()' - Give the queued jobs to the thread pool.
+//
+
+void Fl_Shared_Image_Loader::run_queue() {
+  while (queue_ && running_ < max()) {
+    Job *job = queue_;
+    if ((queue_ = job->next) == NULL) queue_last_ = 0;
+
+    running_ ++;
+    if (Fl_Thread_Pool::submit(decode_work, decode_done, job) < 0) {
+      // Out of memory, decode it now and deliver it from the event loop...
+      running_ --;
+      decode(job);
+      done(job);
+    }
+  }
+}
+
+
+//
+// 'Fl_Shared_Image_Loader::done()' - Deliver a job from the event loop.
+//
+
+void Fl_Shared_Image_Loader::done(Job *job) {
+  job->next = done_;
+  done_     = job;
+
+  if (!Fl::has_timeout(deliver)) Fl::add_timeout(0.0, deliver);
+}
+
+
+//
+// 'Fl_Shared_Image_Loader::deliver()' - Deliver the jobs passed to done().
+//
+
+void Fl_Shared_Image_Loader::deliver(void *) {
+  Job	*list = 0, *job, *next;
+
+  // Reverse the done list to deliver in the order of the calls...
+  for (job = done_; job; job = next) {
+    next      = job->next;
+    job->next = list;
+    list      = job;
+  }
+  done_ = 0;
+
+  for (job = list; job; job = next) {
+    next = job->next;
+    finish(job);
+  }
+}
+
+
+//
+// 'Fl_Shared_Image_Loader::finish()' - Give the decoded image to its placeholder.
+//
+
+void Fl_Shared_Image_Loader::finish(Job *job) {
+  Job **p = &pending_;
+  while (*p != job) p = &(*p)->next_pending;
+  *p = job->next_pending;
+
+  Fl_Shared_Image *img = job->img;
+
+  if (!img) {
+    // cancelled...
+    delete job->image;
+  } else if (!job->loaded) {
+    Fl_Shared_Image_Entry *e = entry_of(img);
+    if (e) e->loading = 0;
+
+    if (job->image) {
+      img->image_      = job->image;
+      img->alloc_image_ = 1;
+      if (!e) img->original_ = !job->scaled;
+      img->update();
+      img->add();
+      entry_of(img)->reloadable = 1;
+    } else {
+      // The file is gone or not an image...
+      if (e) {
+        table_remove(e);
+        delete e;
+      }
+      img->w(0);
+      img->h(0);
+    }
+  }
+
+  if (img) {
+    // Keep the image while the callbacks release their references...
+    img->refcount_ ++;
+    for (Waiter *w = job->waiters; w; w = w->next)
+      if (w->cb) (w->cb)(img, w->data);
+    img->release();
+  }
+
+  free_job(job);
+}
+
+
+//
+// 'Fl_Shared_Image_Loader::free_job()' - Free a job and its callbacks.
+//
+
+void Fl_Shared_Image_Loader::free_job(Job *job) {
+  while (Waiter *w = job->waiters) {
+    job->waiters = w->next;
+    delete w;
+  }
+
+  delete[] job->name;
+  delete[] job->handlers;
+  delete[] job->sized_handlers;
+  delete job;
+}
+
+
+//
+// 'Fl_Shared_Image_Loader::add_waiter()' - Add a callback to a job.
+//
+
+void Fl_Shared_Image_Loader::add_waiter(Job *job, Fl_Shared_Image_Cb cb, void *data) {
+  Waiter *w = new Waiter;
+  w->next = 0;
+  w->cb   = cb;
+  w->data = data;
+
+  Waiter **p = &job->waiters;
+  while (*p) p = &(*p)->next;
+  *p = w;
+}
+
+
+//
+// 'Fl_Shared_Image_Loader::find()' - Find the job that is loading an image.
+//
+// Uses the same test as Fl_Shared_Image::lookup() on the placeholders of the
+// jobs, which are not found by lookup() until they are loaded.
+//
+
+Fl_Shared_Image_Loader::Job *Fl_Shared_Image_Loader::find(const char *n, int W, int H) {
+  for (Job *job = pending_; job; job = job->next_pending) {
+    Fl_Shared_Image *img = job->img;
+
+    if (img && !job->loaded && !strcmp(job->name, n) &&
+        ((W == 0 && img->original_) || (img->w() == W && img->h() == H)))
+      return job;
+  }
+
+  return 0;
+}
+
+
+//
+// 'Fl_Shared_Image_Loader::get()' - Return a placeholder and start loading it.
+//
+
+Fl_Shared_Image *Fl_Shared_Image_Loader::get(const char *n, int W, int H,
+                                             Fl_Shared_Image_Cb cb, void *data) {
+  if (!W || !H) W = H = 0;
+
+  Fl_Shared_Image *img = Fl_Shared_Image::lookup(n, W, H, LOOKUP_COUNT | LOOKUP_NO_RELOAD);
+  Job *job;
+
+  if (!img && (job = find(n, W, H)) != NULL) {
+    // Already loading, share the job...
+    job->img->refcount_ ++;
+    add_waiter(job, cb, data);
+    return job->img;
+  }
+
+  job = new Job;
+  job->next = job->next_pending = 0;
+  job->name   = new char[strlen(n) + 1];
+  strcpy(job->name, n);
+  job->W      = W;
+  job->H      = H;
+  job->image  = 0;
+  job->scaled = 0;
+  job->loaded = 0;
+  job->cancelled = 0;
+  job->waiters = 0;
+  job->handlers = 0;
+  job->num_handlers = 0;
+  job->sized_handlers = 0;
+  job->num_sized_handlers = 0;
+  add_waiter(job, cb, data);
+
+  if (img && img->image_) {
+    // Already loaded, call back from the event loop like for the other images...
+    job->img    = img;
+    job->loaded = 1;
+    job->next_pending = pending_;
+    pending_          = job;
+    done(job);
+    return img;
+  }
+
+  if (img) {
+    // An evicted image is reloaded into the same shared image...
+    if (!img->original_) {
+      job->W = img->w();
+      job->H = img->h();
+    }
+  } else {
+    img = new Fl_Shared_Image();
+    img->name_ = new char[strlen(n) + 1];
+    strcpy((char *)img->name_, n);
+    img->w(W);
+    img->h(H);
+  }
+
+  job->img = img;
+  start(job);
+  return img;
+}
+
+
+//
+// 'Fl_Shared_Image_Loader::cancel()' - Cancel the jobs of a released image.
+//
+
+void Fl_Shared_Image_Loader::cancel(Fl_Shared_Image *img) {
+  for (Job **p = &pending_; *p;) {
+    Job *job = *p;
+
+    if (job->img != img) {
+      p = &job->next_pending;
+      continue;
+    }
+
+    job->img = 0;
+    Fl_Shared_Image_Entry *e = entry_of(img);
+    if (e) e->loading = 0;
+
+    // Drop the job if it was not given to the thread pool yet...
+    int queued = 0;
+    for (Job **q = &queue_, *prev = 0; *q; prev = *q, q = &(*q)->next)
+      if (*q == job) {
+        *q = job->next;
+        if (queue_last_ == job) queue_last_ = prev;
+        queued = 1;
+        break;
+      }
+
+    if (queued) {
+      *p = job->next_pending;
+      free_job(job);
+    } else {
+      job->cancelled = 1;
+      p = &job->next_pending;
+    }
+  }
+}
+
+
+void Fl_Shared_Image_Loader::max(int n) {
+  max_ = n < 1 ? 1 : n;
+  run_queue();
+}
+
+
+int Fl_Shared_Image_Loader::max() {
+  if (!max_) {
+    max_ = fl_processor_count();
+    if (max_ > MAX_ASYNC) max_ = MAX_ASYNC;
+  }
+  return max_;
+}
+
+
+/**
+  Loads an image in the background.
+
+  Returns a shared image right away, like get() does, but loads the file
+  \p n in a worker thread and scales it to \p W x \p H if both are
+  non-zero. When the image is loaded, \p cb is called in the main thread
+  with the returned shared image, which has its pixels from then on. The
+  callback typically redraws the widgets that show the image. If the file
+  could not be loaded, the image's count() is 0 when \p cb is called.
+
+  Until then the returned image is a placeholder without pixels, which
+  draws as an empty box; it already has the requested size, if any. If the
+  image is in the cache, the loaded image is returned and \p cb is still
+  called from the event loop, never from get_async() itself.
+
+  Releasing the returned image before it is loaded cancels the load, and
+  \p cb is not called. If get_async() is called again for an image that
+  is still loading, it returns the same placeholder and the file is only
+  decoded once: all the callbacks are called when it is loaded, and the
+  load is only cancelled once all the references are released.
+
+  The files are decoded by the worker threads of Fl_Thread_Pool if
+  Fl::lock() was called, otherwise by the main thread, one in each idle
+  callback. At most max_async() images are decoded at the same time, the
+  other ones wait for their turn.
+
+  \note The image handlers, see add_handler(), and the image classes they
+  create may then run in the worker threads, and so may the Fl::warning()
+  and Fl::error() functions that report the errors of the image files.
+  The handlers used are the ones registered when get_async() was called.
+
+  \code
+  void loaded_cb(Fl_Shared_Image *img, void *data) {
+    ((Fl_Widget *)data)->redraw();
+  }
+  ...
+  Fl::lock();
+  ...
+  box->image(Fl_Shared_Image::get_async("photo.jpg", 160, 120, loaded_cb, box));
+  \endcode
+
+  \param n name of the image file
+  \param W, H size of the image, or 0 for the size of the file
+  \param cb function called when the image is loaded
+  \param data user data passed to \p cb
+  \see get(const char *n, int W, int H), max_async(int)
+  \version 1.3.5
+*/
+Fl_Shared_Image *Fl_Shared_Image::get_async(const char *n, int W, int H,
+                                            Fl_Shared_Image_Cb cb, void *data) {
+  return Fl_Shared_Image_Loader::get(n, W, H, cb, data);
+}
+
+/**
+  Sets the maximum number of images decoded at the same time by get_async().
+  The default is the number of processors, but at most 4.
+  \version 1.3.5
+*/
+void Fl_Shared_Image::max_async(int n) {
+  Fl_Shared_Image_Loader::max(n);
+}
+
+/** Returns the maximum number of images decoded at the same time by get_async(). */
+int Fl_Shared_Image::max_async() {
+  return Fl_Shared_Image_Loader::max();
+}
+
+
 //
 // End of "$Id$".
 //
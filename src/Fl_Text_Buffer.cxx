@@ -16,6 +16,7 @@
 //     http://www.fltk.org/str.php
 //
 
+#include <config.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <FL/fl_utf8.h>
@@ -23,7 +24,12 @@
 #include <ctype.h>
 #include <FL/Fl.H>
 #include <FL/Fl_Text_Buffer.H>
+#include <FL/Fl_Text_Search.H>
+#include <FL/Fl_Thread_Pool.H>
 #include <FL/fl_ask.H>
+#if defined(__SSE2__)
+#  include <emmintrin.h>
+#endif
 
 
 /*
@@ -53,20 +59,1269 @@
  */
 
 
-#ifndef min
+#ifndef min
+
+static int max(int i1, int i2)
+{
+  return i1 >= i2 ? i1 : i2;
+}
+
+static int min(int i1, int i2)
+{
+  return i1 <= i2 ? i1 : i2;
+}
+
+#endif
+
+
+/*
+ Byte scanning kernels.
+
+ Newlines and other ASCII characters can never be part of a multibyte UTF-8
+ sequence, so searching them does not need any UTF-8 decoding. The text on
+ each side of the gap is scanned with memchr() or, where SSE2 is available,
+ 16 bytes at a time.
+ */
+
+/*
+ Count the bytes equal to c between p and e.
+ */
+static int count_byte(const char *p, const char *e, char c)
+{
+  int count = 0;
+#if defined(__SSE2__)
+  const __m128i needle = _mm_set1_epi8(c);
+  const __m128i zero = _mm_setzero_si128();
+  while (e - p >= 16) {
+    // matches are counted in 8 bit lanes, which must not overflow
+    int nBlocks = (int)((e - p) / 16);
+    if (nBlocks > 255) nBlocks = 255;
+    __m128i acc = zero;
+    for (int i = 0; i < nBlocks; i++, p += 16)
+      acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), needle));
+    __m128i sums = _mm_sad_epu8(acc, zero);
+    count += _mm_cvtsi128_si32(sums) + _mm_cvtsi128_si32(_mm_srli_si128(sums, 8));
+  }
+#endif
+  for (; p < e; p++)
+    if (*p == c)
+      count++;
+  return count;
+}
+
+/*
+ Return a pointer to the last byte equal to c between b and e, or NULL.
+ */
+static const char *find_byte_backward(const char *b, const char *e, char c)
+{
+#if defined(__SSE2__)
+  const __m128i needle = _mm_set1_epi8(c);
+  while (e - b >= 16) {
+    int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(e - 16)), needle));
+    e -= 16;
+    if (mask) {
+      int i = 15;
+      while (!(mask & (1 << i)))
+        i--;
+      return e + i;
+    }
+  }
+#endif
+  while (e > b)
+    if (*--e == c)
+      return e;
+  return NULL;
+}
+
+
+#if FLTK_ABI_VERSION >= 10304
+
+/* Ranges shorter than this are scanned directly instead of using the line index */
+#define FL_TEXT_LINE_INDEX_MIN 4096
+
+/*
+ Index of the newlines of a text buffer.
+
+ The buffer is divided into consecutive blocks of a few KB. For each block
+ the index stores its length and the number of newlines it contains, and it
+ keeps the prefix sums of both in Fenwick (binary indexed) trees. The block
+ containing a given position, or a given newline, is found in O(log n), and
+ only the text inside that block has to be scanned.
+
+ Insertions and deletions update the blocks they touch. Blocks that grow
+ too large are split and empty blocks are dropped, which rebuilds the trees.
+ */
+class Fl_Text_Line_Index {
+  enum { BLOCK_SIZE = 8192 };   // target size of a block in bytes
+  int nBlocks;          // number of blocks
+  int allocBlocks;      // allocated size of the arrays below
+  int *mLen;            // length of each block
+  int *mNl;             // number of newlines in each block
+  int *mLenTree;        // Fenwick tree over mLen (1-based)
+  int *mNlTree;         // Fenwick tree over mNl (1-based)
+  int mTopBit;          // highest power of 2 <= nBlocks, for tree descents
+
+  static int count_newlines(const Fl_Text_Buffer *buf, int start, int end);
+  void reserve(int n);
+  void build_trees();
+  static void tree_add(int *tree, int n, int i, int delta);
+  static int tree_sum(const int *tree, int i);
+  int tree_find(const int *tree, int value, int *sum) const;
+  void split(const Fl_Text_Buffer *buf, int k, int blockStart);
+
+public:
+  static int find_newline(const Fl_Text_Buffer *buf, int start, int end, int n);
+  static int rfind_newline(const Fl_Text_Buffer *buf, int start, int end, int n);
+  Fl_Text_Line_Index(const Fl_Text_Buffer *buf);
+  ~Fl_Text_Line_Index();
+  void inserted(const Fl_Text_Buffer *buf, int pos, int nInserted);
+  void removing(const Fl_Text_Buffer *buf, int start, int end);
+  int newlines_before(const Fl_Text_Buffer *buf, int pos) const;
+  int newline_position(const Fl_Text_Buffer *buf, int n) const;
+  int newlines() const { return tree_sum(mNlTree, nBlocks); }
+};
+
+/*
+ Count the newlines between buffer positions start and end.
+ */
+int Fl_Text_Line_Index::count_newlines(const Fl_Text_Buffer *buf, int start, int end)
+{
+  int count = 0;
+  while (start < end) {
+    // find the contiguous part of [start, end)
+    int segEnd = min(buf->segment_end(start), end);
+    const char *p = buf->address(start);
+    count += count_byte(p, p + (segEnd - start), '\n');
+    start = segEnd;
+  }
+  return count;
+}
+
+/*
+ Return the buffer position of newline number n (counting from 0) between
+ start and end, or -1 if there are not enough newlines.
+ */
+int Fl_Text_Line_Index::find_newline(const Fl_Text_Buffer *buf, int start, int end, int n)
+{
+  while (start < end) {
+    int segEnd = min(buf->segment_end(start), end);
+    const char *b = buf->address(start), *p = b, *e = b + (segEnd - start);
+    while ((p = (const char *)memchr(p, '\n', e - p)) != NULL) {
+      if (n-- == 0)
+        return start + (int)(p - b);
+      p++;
+    }
+    start = segEnd;
+  }
+  return -1;
+}
+
+/*
+ Return the buffer position of newline number n (counting from 0) backwards
+ from end, not including end, down to start, or -1 if there are not enough
+ newlines.
+ */
+int Fl_Text_Line_Index::rfind_newline(const Fl_Text_Buffer *buf, int start, int end, int n)
+{
+  while (end > start) {
+    int segStart = max(buf->segment_start(end - 1), start);
+    const char *b = buf->address(segStart), *p = b + (end - segStart);
+    while ((p = find_byte_backward(b, p, '\n')) != NULL) {
+      if (n-- == 0)
+        return segStart + (int)(p - b);
+    }
+    end = segStart;
+  }
+  return -1;
+}
+
+Fl_Text_Line_Index::Fl_Text_Line_Index(const Fl_Text_Buffer *buf)
+{
+  nBlocks = allocBlocks = 0;
+  mLen = mNl = mLenTree = mNlTree = NULL;
+  int length = buf->length();
+  reserve(length / BLOCK_SIZE + 1);
+  for (int pos = 0; pos < length; pos += BLOCK_SIZE) {
+    int end = min(pos + BLOCK_SIZE, length);
+    mLen[nBlocks] = end - pos;
+    mNl[nBlocks] = count_newlines(buf, pos, end);
+    nBlocks++;
+  }
+  build_trees();
+}
+
+Fl_Text_Line_Index::~Fl_Text_Line_Index()
+{
+  free(mLen);
+  free(mNl);
+  free(mLenTree);
+  free(mNlTree);
+}
+
+/*
+ Make room for at least n blocks.
+ */
+void Fl_Text_Line_Index::reserve(int n)
+{
+  if (n <= allocBlocks)
+    return;
+  allocBlocks = max(n, allocBlocks * 2);
+  mLen = (int *)realloc(mLen, allocBlocks * sizeof(int));
+  mNl = (int *)realloc(mNl, allocBlocks * sizeof(int));
+  mLenTree = (int *)realloc(mLenTree, (allocBlocks + 1) * sizeof(int));
+  mNlTree = (int *)realloc(mNlTree, (allocBlocks + 1) * sizeof(int));
+}
+
+/*
+ Recompute both trees from the block arrays in O(n).
+ */
+void Fl_Text_Line_Index::build_trees()
+{
+  int i;
+  for (i = 1; i <= nBlocks; i++) {
+    mLenTree[i] = mLen[i - 1];
+    mNlTree[i] = mNl[i - 1];
+  }
+  for (i = 1; i <= nBlocks; i++) {
+    int parent = i + (i & -i);
+    if (parent <= nBlocks) {
+      mLenTree[parent] += mLenTree[i];
+      mNlTree[parent] += mNlTree[i];
+    }
+  }
+  for (mTopBit = 1; mTopBit * 2 <= nBlocks; mTopBit *= 2) { }
+}
+
+void Fl_Text_Line_Index::tree_add(int *tree, int n, int i, int delta)
+{
+  for (i++; i <= n; i += i & -i)
+    tree[i] += delta;
+}
+
+/*
+ Sum of the first i values.
+ */
+int Fl_Text_Line_Index::tree_sum(const int *tree, int i)
+{
+  int sum = 0;
+  for (; i > 0; i -= i & -i)
+    sum += tree[i];
+  return sum;
+}
+
+/*
+ Return the last block k such that the sum of the values of the blocks
+ before k is <= value, and that sum in *sum.
+ */
+int Fl_Text_Line_Index::tree_find(const int *tree, int value, int *sum) const
+{
+  int k = 0, s = 0;
+  for (int bit = mTopBit; bit > 0; bit >>= 1) {
+    if (k + bit <= nBlocks && s + tree[k + bit] <= value) {
+      k += bit;
+      s += tree[k];
+    }
+  }
+  // k is now the largest number of blocks whose sum is <= value; when
+  // value is beyond the total, return the last block
+  if (k >= nBlocks) {
+    k = nBlocks - 1;
+    s = tree_sum(tree, k);
+  }
+  *sum = s;
+  return k;
+}
+
+/*
+ Split block k, which starts at buffer position blockStart, into blocks
+ of BLOCK_SIZE bytes.
+ */
+void Fl_Text_Line_Index::split(const Fl_Text_Buffer *buf, int k, int blockStart)
+{
+  int len = mLen[k];
+  int pieces = (len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  reserve(nBlocks + pieces - 1);
+  memmove(mLen + k + pieces, mLen + k + 1, (nBlocks - k - 1) * sizeof(int));
+  memmove(mNl + k + pieces, mNl + k + 1, (nBlocks - k - 1) * sizeof(int));
+  nBlocks += pieces - 1;
+  for (int i = 0; i < pieces; i++) {
+    int start = blockStart + i * BLOCK_SIZE;
+    int end = min(start + BLOCK_SIZE, blockStart + len);
+    mLen[k + i] = end - start;
+    mNl[k + i] = count_newlines(buf, start, end);
+  }
+  build_trees();
+}
+
+/*
+ Update the index after nInserted bytes were inserted at pos.
+ */
+void Fl_Text_Line_Index::inserted(const Fl_Text_Buffer *buf, int pos, int nInserted)
+{
+  if (nInserted <= 0)
+    return;
+  int newlines = count_newlines(buf, pos, pos + nInserted);
+  if (nBlocks == 0) {
+    reserve(1);
+    mLen[0] = nInserted;
+    mNl[0] = newlines;
+    nBlocks = 1;
+    build_trees();
+  } else {
+    int blockStart;
+    int k = tree_find(mLenTree, pos, &blockStart);
+    mLen[k] += nInserted;
+    mNl[k] += newlines;
+    tree_add(mLenTree, nBlocks, k, nInserted);
+    tree_add(mNlTree, nBlocks, k, newlines);
+    if (mLen[k] > 2 * BLOCK_SIZE)
+      split(buf, k, blockStart);
+  }
+}
+
+/*
+ Update the index before the bytes between start and end are removed.
+ */
+void Fl_Text_Line_Index::removing(const Fl_Text_Buffer *buf, int start, int end)
+{
+  if (start >= end || nBlocks == 0)
+    return;
+  int blockStart, emptied = 0;
+  int k = tree_find(mLenTree, start, &blockStart);
+  int pos = start;
+  while (pos < end && k < nBlocks) {
+    int n = min(blockStart + mLen[k], end) - pos;
+    int newlines = count_newlines(buf, pos, pos + n);
+    blockStart += mLen[k];
+    mLen[k] -= n;
+    mNl[k] -= newlines;
+    tree_add(mLenTree, nBlocks, k, -n);
+    tree_add(mNlTree, nBlocks, k, -newlines);
+    if (mLen[k] == 0)
+      emptied++;
+    pos += n;
+    k++;
+  }
+  if (emptied) {
+    int j = 0;
+    for (int i = 0; i < nBlocks; i++) {
+      if (mLen[i] == 0) continue;
+      mLen[j] = mLen[i];
+      mNl[j] = mNl[i];
+      j++;
+    }
+    nBlocks = j;
+    build_trees();
+  }
+}
+
+/*
+ Return the number of newlines before buffer position pos.
+ */
+int Fl_Text_Line_Index::newlines_before(const Fl_Text_Buffer *buf, int pos) const
+{
+  if (nBlocks == 0 || pos <= 0)
+    return 0;
+  int blockStart;
+  int k = tree_find(mLenTree, pos, &blockStart);
+  int blockEnd = blockStart + mLen[k];
+  if (pos >= blockEnd)
+    return newlines();
+  // scan the shorter part of the block
+  if (pos - blockStart <= blockEnd - pos)
+    return tree_sum(mNlTree, k) + count_newlines(buf, blockStart, pos);
+  return tree_sum(mNlTree, k + 1) - count_newlines(buf, pos, blockEnd);
+}
+
+/*
+ Return the buffer position of newline number n (counting from 0), or -1
+ if the buffer contains n newlines or less.
+ */
+int Fl_Text_Line_Index::newline_position(const Fl_Text_Buffer *buf, int n) const
+{
+  if (n < 0 || n >= newlines())
+    return -1;
+  int before;
+  // the blocks before k hold at most n newlines, so newline n is in block k
+  int k = tree_find(mNlTree, n, &before);
+  int blockStart = tree_sum(mLenTree, k);
+  return find_newline(buf, blockStart, blockStart + mLen[k], n - before);
+}
+
+/*
+ Return the line index of this buffer, creating it if needed.
+ */
+Fl_Text_Line_Index *Fl_Text_Buffer::line_index() const
+{
+  if (!mLineIndex)
+    mLineIndex = new Fl_Text_Line_Index(this);
+  return mLineIndex;
+}
+
+/*
+ Rope storage of the text of a buffer, see Fl_Text_Buffer::storage().
+
+ The text is split into blocks of a few KB, which are the nodes of a treap
+ (a binary search tree balanced by random priorities) in text order. Each
+ node keeps the length and the number of newlines of its block and of its
+ subtree, so the block holding a position, or a given newline, is found
+ in O(log n). A modification only copies the bytes of the blocks it
+ touches; blocks that become too small are merged with a neighbour.
+ Blocks are always cut at UTF-8 character boundaries, and are never empty.
+ */
+class Fl_Text_Rope {
+  enum {
+    BLOCK_SIZE = 8192,          // size of the blocks that are built
+    MAX_BLOCK = 16384,          // blocks can grow up to this size in place
+    MIN_BLOCK = 2048            // smaller blocks are merged with a neighbour
+  };
+  struct Node {
+    Node *left, *right;
+    unsigned prio;              // random priority, higher than its children's
+    int count;                  // number of nodes in the subtree
+    int sumLen, sumNl;          // bytes and newlines in the subtree
+    int len, nl;                // bytes and newlines in this block
+    int size;                   // allocated size of text
+    char *text;
+  };
+  // Cuts the bytes appended to it into new blocks of about the same size
+  struct Builder {
+    Fl_Text_Rope *rope;
+    Node *tree, *cur;
+    int total, done, pieces, piece;
+    Builder(Fl_Text_Rope *r, int t);
+    void append(const char *p, int n);
+    Node *finish();
+  };
+  Node *root;
+  unsigned seed;
+  // the last block found, for sequential access through address()
+  mutable Node *cacheNode;
+  mutable int cacheStart, cacheIndex;
+
+  Node *new_node(int size);
+  static void destroy(Node *t);
+  static void update(Node *t);
+  static void reserve(Node *t, int size);
+  Node *merge(Node *a, Node *b);
+  static void split(Node *t, int k, Node *&a, Node *&b);
+  Node *find(int pos, int *start, int *index) const;
+  void add_on_path(int index, int dLen, int dNl);
+
+public:
+  Fl_Text_Rope() : root(NULL), seed(2463534242U), cacheNode(NULL) { }
+  ~Fl_Text_Rope() { destroy(root); }
+  int length() const { return root ? root->sumLen : 0; }
+  int newlines() const { return root ? root->sumNl : 0; }
+  const char *address(int pos) const;
+  int segment_start(int pos) const;
+  int segment_end(int pos) const;
+  void replace(int start, int end, const char *text, int n);
+  int newlines_before(int pos) const;
+  int newline_position(int n) const;
+};
+
+Fl_Text_Rope::Node *Fl_Text_Rope::new_node(int size)
+{
+  Node *t = new Node;
+  t->left = t->right = NULL;
+  seed ^= seed << 13;           // xorshift
+  seed ^= seed >> 17;
+  seed ^= seed << 5;
+  t->prio = seed;
+  t->len = t->nl = 0;
+  t->size = size;
+  t->text = (char *)malloc(size);
+  update(t);
+  return t;
+}
+
+void Fl_Text_Rope::destroy(Node *t)
+{
+  if (!t) return;
+  destroy(t->left);
+  destroy(t->right);
+  free(t->text);
+  delete t;
+}
+
+/*
+ Recompute the sums of a node from its children.
+ */
+void Fl_Text_Rope::update(Node *t)
+{
+  t->count = 1;
+  t->sumLen = t->len;
+  t->sumNl = t->nl;
+  if (t->left) {
+    t->count += t->left->count;
+    t->sumLen += t->left->sumLen;
+    t->sumNl += t->left->sumNl;
+  }
+  if (t->right) {
+    t->count += t->right->count;
+    t->sumLen += t->right->sumLen;
+    t->sumNl += t->right->sumNl;
+  }
+}
+
+/*
+ Make room for size bytes in the block of a node.
+ */
+void Fl_Text_Rope::reserve(Node *t, int size)
+{
+  if (size <= t->size)
+    return;
+  t->size = min(max(size, t->size + t->size / 2), max(size, (int)MAX_BLOCK));
+  t->text = (char *)realloc(t->text, t->size);
+}
+
+/*
+ Join two trees, all the blocks of a coming before those of b.
+ */
+Fl_Text_Rope::Node *Fl_Text_Rope::merge(Node *a, Node *b)
+{
+  if (!a) return b;
+  if (!b) return a;
+  if (a->prio > b->prio) {
+    a->right = merge(a->right, b);
+    update(a);
+    return a;
+  }
+  b->left = merge(a, b->left);
+  update(b);
+  return b;
+}
+
+/*
+ Split a tree into its first k blocks and the others.
+ */
+void Fl_Text_Rope::split(Node *t, int k, Node *&a, Node *&b)
+{
+  if (!t) {
+    a = b = NULL;
+    return;
+  }
+  int leftCount = t->left ? t->left->count : 0;
+  if (k <= leftCount) {
+    split(t->left, k, a, t->left);
+    update(t);
+    b = t;
+  } else {
+    split(t->right, k - leftCount - 1, t->right, b);
+    update(t);
+    a = t;
+  }
+}
+
+/*
+ Return the block containing pos, or the last block if pos is the end of
+ the text, with its start position and its index. The rope must not be
+ empty.
+ */
+Fl_Text_Rope::Node *Fl_Text_Rope::find(int pos, int *start, int *index) const
+{
+  if (cacheNode && pos >= cacheStart && pos < cacheStart + cacheNode->len) {
+    *start = cacheStart;
+    *index = cacheIndex;
+    return cacheNode;
+  }
+  Node *t = root;
+  int s = 0, i = 0;
+  for (;;) {
+    int leftLen = t->left ? t->left->sumLen : 0;
+    if (pos - s < leftLen) {
+      t = t->left;
+      continue;
+    }
+    if (t->left) {
+      s += leftLen;
+      i += t->left->count;
+    }
+    if (pos - s < t->len || !t->right)
+      break;
+    s += t->len;
+    i++;
+    t = t->right;
+  }
+  cacheNode = t;
+  *start = cacheStart = s;
+  *index = cacheIndex = i;
+  return t;
+}
+
+/*
+ Add to the sums of the nodes from the root to the block number index.
+ */
+void Fl_Text_Rope::add_on_path(int index, int dLen, int dNl)
+{
+  Node *t = root;
+  for (;;) {
+    t->sumLen += dLen;
+    t->sumNl += dNl;
+    int leftCount = t->left ? t->left->count : 0;
+    if (index == leftCount)
+      return;
+    if (index < leftCount) {
+      t = t->left;
+    } else {
+      index -= leftCount + 1;
+      t = t->right;
+    }
+  }
+}
+
+Fl_Text_Rope::Builder::Builder(Fl_Text_Rope *r, int t)
+{
+  rope = r;
+  tree = cur = NULL;
+  total = t;
+  done = piece = 0;
+  pieces = max((total + BLOCK_SIZE - 1) / BLOCK_SIZE, 1);
+}
+
+/*
+ Append n bytes, which must start and end at character boundaries. Piece
+ i ends at the first character boundary after (i + 1) * total / pieces.
+ */
+void Fl_Text_Rope::Builder::append(const char *p, int n)
+{
+  while (n > 0) {
+    if (!cur)
+      cur = rope->new_node(min((total + pieces - 1) / pieces + 4, total - done));
+    int take = n, cut = 0;
+    if (piece < pieces - 1) {
+      int end = (int)((long long)(piece + 1) * total / pieces);
+      if (done + n >= end) {
+        take = max(end - done, 0);
+        // do not cut a UTF-8 sequence
+        int limit = min(take + 3, n);
+        while (take < limit && (p[take] & 0xc0) == 0x80)
+          take++;
+        cut = 1;
+      }
+    }
+    reserve(cur, cur->len + take);
+    memcpy(cur->text + cur->len, p, take);
+    cur->len += take;
+    cur->nl += count_byte(p, p + take, '\n');
+    done += take;
+    p += take;
+    n -= take;
+    if (cut) {
+      if (cur->len) {
+        update(cur);
+        tree = rope->merge(tree, cur);
+        cur = NULL;
+      }
+      piece++;
+    }
+  }
+}
+
+/*
+ Return the tree of the new blocks.
+ */
+Fl_Text_Rope::Node *Fl_Text_Rope::Builder::finish()
+{
+  if (cur && cur->len) {
+    update(cur);
+    tree = rope->merge(tree, cur);
+  } else {
+    destroy(cur);
+  }
+  cur = NULL;
+  return tree;
+}
+
+const char *Fl_Text_Rope::address(int pos) const
+{
+  static char empty[1] = "";
+  if (!root)
+    return empty;
+  int start, index;
+  Node *t = find(pos, &start, &index);
+  return t->text + (pos - start);
+}
+
+/*
+ Return the start of the block containing pos.
+ */
+int Fl_Text_Rope::segment_start(int pos) const
+{
+  if (!root)
+    return 0;
+  int start, index;
+  find(pos, &start, &index);
+  return start;
+}
+
+/*
+ Return the end of the block containing pos.
+ */
+int Fl_Text_Rope::segment_end(int pos) const
+{
+  if (!root)
+    return 0;
+  int start, index;
+  Node *t = find(pos, &start, &index);
+  return start + t->len;
+}
+
+/*
+ Replace the bytes between start and end by n bytes of text.
+ */
+void Fl_Text_Rope::replace(int start, int end, const char *text, int n)
+{
+  if (start >= end && n <= 0)
+    return;
+  cacheNode = NULL;
+  if (!root) {
+    Builder b(this, n);
+    b.append(text, n);
+    root = b.finish();
+    return;
+  }
+  int firstStart, firstIndex;
+  Node *first = find(start, &firstStart, &firstIndex);
+  int off = start - firstStart;
+
+  // edit the block in place if the result keeps a reasonable size
+  if (end <= firstStart + first->len) {
+    int len = first->len - (end - start) + n;
+    if (len > 0 && len <= MAX_BLOCK && (len >= MIN_BLOCK || root->count == 1)) {
+      int dNl = count_byte(text, text + n, '\n')
+              - count_byte(first->text + off, first->text + off + (end - start), '\n');
+      reserve(first, len);
+      memmove(first->text + off + n, first->text + end - firstStart,
+              first->len - (end - firstStart));
+      memcpy(first->text + off, text, n);
+      first->len = len;
+      first->nl += dNl;
+      add_on_path(firstIndex, n - (end - start), dNl);
+      return;
+    }
+  }
+
+  // otherwise rebuild the blocks from first to last, and a neighbour if
+  // the result is small
+  int lastStart = firstStart, lastIndex = firstIndex;
+  Node *last = first;
+  if (end > firstStart + first->len)
+    last = find(end - 1, &lastStart, &lastIndex);
+  int tail = end - lastStart;
+  int total = off + n + last->len - tail;
+  Node *prev = NULL, *next = NULL;
+  int prevStart, prevIndex = firstIndex, nextStart, nextIndex = lastIndex;
+  if (total > 0 && total < MIN_BLOCK) {
+    if (lastStart + last->len < length())
+      next = find(lastStart + last->len, &nextStart, &nextIndex);
+    else if (firstStart > 0)
+      prev = find(firstStart - 1, &prevStart, &prevIndex);
+  }
+  Builder b(this, total + (prev ? prev->len : 0) + (next ? next->len : 0));
+  if (prev)
+    b.append(prev->text, prev->len);
+  b.append(first->text, off);
+  b.append(text, n);
+  b.append(last->text + tail, last->len - tail);
+  if (next)
+    b.append(next->text, next->len);
+  Node *blocks = b.finish();
+
+  Node *before, *old, *after;
+  split(root, prevIndex, before, old);
+  split(old, nextIndex - prevIndex + 1, old, after);
+  destroy(old);
+  root = merge(merge(before, blocks), after);
+  cacheNode = NULL;
+}
+
+/*
+ Return the number of newlines before position pos.
+ */
+int Fl_Text_Rope::newlines_before(int pos) const
+{
+  if (pos <= 0)
+    return 0;
+  if (pos >= length())
+    return newlines();
+  Node *t = root;
+  int count = 0;
+  for (;;) {
+    int leftLen = t->left ? t->left->sumLen : 0;
+    if (pos < leftLen) {
+      t = t->left;
+      continue;
+    }
+    if (t->left) {
+      pos -= leftLen;
+      count += t->left->sumNl;
+    }
+    if (pos < t->len)
+      break;
+    pos -= t->len;
+    count += t->nl;
+    t = t->right;
+  }
+  // scan the shorter part of the block
+  if (pos <= t->len - pos)
+    return count + count_byte(t->text, t->text + pos, '\n');
+  return count + t->nl - count_byte(t->text + pos, t->text + t->len, '\n');
+}
+
+/*
+ Return the position of newline number n (counting from 0), or -1 if the
+ text contains n newlines or less.
+ */
+int Fl_Text_Rope::newline_position(int n) const
+{
+  if (n < 0 || n >= newlines())
+    return -1;
+  Node *t = root;
+  int pos = 0;
+  for (;;) {
+    int leftNl = t->left ? t->left->sumNl : 0;
+    if (n < leftNl) {
+      t = t->left;
+      continue;
+    }
+    if (t->left) {
+      n -= leftNl;
+      pos += t->left->sumLen;
+    }
+    if (n < t->nl)
+      break;
+    n -= t->nl;
+    pos += t->len;
+    t = t->right;
+  }
+  const char *p = t->text;
+  for (;; p++) {
+    p = (const char *)memchr(p, '\n', t->text + t->len - p);
+    if (n-- == 0)
+      return pos + (int)(p - t->text);
+  }
+}
+
+/*
+ Return the number of newlines before pos, from the rope or the line index.
+ */
+int Fl_Text_Buffer::newlines_before(int pos) const
+{
+  if (mRope)
+    return mRope->newlines_before(pos);
+  return line_index()->newlines_before(this, pos);
+}
+
+/*
+ Return the position of newline number n, from the rope or the line index.
+ */
+int Fl_Text_Buffer::newline_position(int n) const
+{
+  if (mRope)
+    return mRope->newline_position(n);
+  return line_index()->newline_position(this, n);
+}
+
+const char *Fl_Text_Buffer::rope_address(int pos) const
+{
+  return mRope->address(pos);
+}
+
+/*
+ Convert the text to the other storage, see the header.
+ */
+void Fl_Text_Buffer::storage(Storage s)
+{
+  if ((s == ROPE_STORAGE) == (mRope != NULL))
+    return;
+  if (s == ROPE_STORAGE) {
+    Fl_Text_Rope *rope = new Fl_Text_Rope;
+    rope->replace(0, 0, mBuf, mGapStart);
+    rope->replace(mGapStart, mGapStart, mBuf + mGapEnd, mLength - mGapStart);
+    free(mBuf);
+    mBuf = NULL;
+    mGapStart = mGapEnd = 0;
+    // the rope counts the newlines itself
+    delete mLineIndex;
+    mLineIndex = NULL;
+    mRope = rope;
+  } else {
+    char *buf = (char *) malloc(mLength + mPreferredGapSize);
+    copy_bytes(buf, 0, mLength);
+    delete mRope;
+    mRope = NULL;
+    mBuf = buf;
+    mGapStart = mLength;
+    mGapEnd = mLength + mPreferredGapSize;
+  }
+}
+
+/* Default memory limit of the undo history of a buffer */
+#define FL_TEXT_UNDO_LIMIT (16 * 1024 * 1024)
+
+/*
+ Undo history of a text buffer.
+
+ Each modification of the buffer appends a record to an array: its
+ position, its length and, for deletions, the deleted text. The text of
+ inserted ranges is only saved when they are undone, for redo(). Typing
+ characters one after the other, or deleting them, extends the last record
+ instead of adding new ones, so that they are undone together. Pasted
+ text, or typing somewhere else, starts a new record.
+
+ The text is stored in large blocks that are shared by many records and
+ freed when all their records are gone. Records before the current
+ position in the history can be undone, records after it redone; a new
+ modification forgets the records that could be redone. When the memory
+ used exceeds the limit of the buffer, the oldest records are forgotten.
+ */
+class Fl_Text_Undo {
+  enum { INSERTED, DELETED };
+  enum { BLOCK_SIZE = 65536 }; // minimum size of a text block in bytes
+
+  struct Block {
+    Block *next;        // next older block
+    int size;           // size of the text area following this header
+    int used;           // number of bytes allocated from the block
+    int count;          // number of records using the block
+  };
+
+  struct Record {
+    int pos;            // position of the inserted or deleted text
+    int length;         // length of the inserted or deleted text
+    char type;          // INSERTED or DELETED
+    char joined;        // undone together with the previous record
+    char *text;         // the deleted text, or the inserted text once undone
+    int size;           // allocated size of text
+    Block *block;       // block containing text
+  };
+
+  Record *mRecords;     // array of records
+  int mFirst;           // index of the oldest record in mRecords
+  int mCount;           // number of records
+  int mAlloc;           // allocated size of mRecords
+  int mDone;            // number of records that can be undone
+  Block *mBlocks;       // blocks of text, newest first
+  int mMemory;          // memory used by the blocks
+  int mJoin;            // the next modification may extend the last record
+  int mTyping;          // the last record is a run of typed characters
+  int mApplying;        // the modifications are done by undo() or redo()
+
+  Record &record(int i) { return mRecords[mFirst + i]; }
+  char *alloc(int size, Block **block);
+  void release(Record &r);
+  void save_text(const Fl_Text_Buffer *buf, Record &r, int start, int n, int prepend);
+  Record &append();
+  void forget_redo();
+  void forget_oldest(int limit);
+
+public:
+  Fl_Text_Undo();
+  ~Fl_Text_Undo();
+  void clear();
+  void inserted(const Fl_Text_Buffer *buf, int pos, int nInserted);
+  void removing(const Fl_Text_Buffer *buf, int start, int end);
+  int undo(Fl_Text_Buffer *buf);
+  int redo(Fl_Text_Buffer *buf);
+};
+
+Fl_Text_Undo::Fl_Text_Undo()
+{
+  mRecords = NULL;
+  mFirst = mCount = mAlloc = mDone = 0;
+  mBlocks = NULL;
+  mMemory = 0;
+  mJoin = 0;
+  mTyping = 0;
+  mApplying = 0;
+}
+
+Fl_Text_Undo::~Fl_Text_Undo()
+{
+  clear();
+  free(mRecords);
+}
+
+/*
+ Forget the whole history.
+ */
+void Fl_Text_Undo::clear()
+{
+  while (mBlocks) {
+    Block *next = mBlocks->next;
+    free(mBlocks);
+    mBlocks = next;
+  }
+  mFirst = mCount = mDone = 0;
+  mMemory = 0;
+  mJoin = 0;
+  mTyping = 0;
+}
+
+/*
+ Allocate size bytes of text for a record from the newest block, or from
+ a new block if it is full.
+ */
+char *Fl_Text_Undo::alloc(int size, Block **block)
+{
+  Block *b = mBlocks;
+  if (b && !b->count && b->size < size) {
+    // the newest block is unused but too small
+    mBlocks = b->next;
+    mMemory -= b->size;
+    free(b);
+    b = mBlocks;
+  }
+  if (!b || b->size - b->used < size) {
+    int blockSize = max(size, BLOCK_SIZE);
+    b = (Block *) malloc(sizeof(Block) + blockSize);
+    b->next = mBlocks;
+    b->size = blockSize;
+    b->used = b->count = 0;
+    mBlocks = b;
+    mMemory += blockSize;
+  }
+  char *text = (char *)(b + 1) + b->used;
+  b->used += size;
+  b->count++;
+  *block = b;
+  return text;
+}
+
+/*
+ Free the text of a record. Blocks are freed when their last record is
+ released, except the newest one which is reused.
+ */
+void Fl_Text_Undo::release(Record &r)
+{
+  Block *b = r.block;
+  r.text = NULL;
+  r.block = NULL;
+  r.size = 0;
+  if (!b || --b->count > 0)
+    return;
+  if (b == mBlocks) {
+    b->used = 0;
+    return;
+  }
+  for (Block **p = &mBlocks->next; *p; p = &(*p)->next) {
+    if (*p == b) {
+      *p = b->next;
+      mMemory -= b->size;
+      free(b);
+      break;
+    }
+  }
+}
+
+/*
+ Copy n bytes of the buffer at start to the text of record r, before or
+ after the text it already has. The text of a record is nul-terminated and
+ grows geometrically, so that deleting characters one by one is O(1) per
+ character.
+ */
+void Fl_Text_Undo::save_text(const Fl_Text_Buffer *buf, Record &r, int start, int n, int prepend)
+{
+  int length = r.text ? r.length : 0;
+  if (length + n + 1 > r.size) {
+    int size = length ? 2 * (length + n + 1) : n + 1;
+    Block *block;
+    char *text = alloc(size, &block);
+    if (length)
+      memcpy(text, r.text, length);
+    release(r);
+    r.text = text;
+    r.size = size;
+    r.block = block;
+  }
+  char *dst = r.text;
+  if (prepend)
+    memmove(r.text + n, r.text, length);
+  else
+    dst += length;
+  buf->copy_bytes(dst, start, start + n);
+  r.text[length + n] = 0;
+}
+
+/*
+ Add a record at the end of the history. The array of records grows
+ geometrically, or is shifted back when the oldest records were forgotten.
+ */
+Fl_Text_Undo::Record &Fl_Text_Undo::append()
+{
+  if (mFirst + mCount == mAlloc) {
+    if (mFirst > mAlloc / 2) {
+      memmove(mRecords, mRecords + mFirst, mCount * sizeof(Record));
+    } else {
+      mAlloc = mAlloc ? 2 * mAlloc : 64;
+      mRecords = (Record *) realloc(mRecords, mAlloc * sizeof(Record));
+    }
+    mFirst = 0;
+  }
+  Record &r = mRecords[mFirst + mCount++];
+  mDone = mCount;
+  r.text = NULL;
+  r.size = 0;
+  r.block = NULL;
+  r.joined = 0;
+  return r;
+}
+
+/*
+ Forget the records that were undone, before a new modification.
+ */
+void Fl_Text_Undo::forget_redo()
+{
+  while (mCount > mDone)
+    release(record(--mCount));
+}
+
+/*
+ Forget the oldest modifications until the memory used is below limit.
+ The last modification is always kept.
+ */
+void Fl_Text_Undo::forget_oldest(int limit)
+{
+  while (mMemory + mCount * (int)sizeof(Record) > limit) {
+    // find the end of the oldest group of records
+    int n = 1;
+    while (n < mDone && record(n).joined)
+      n++;
+    if (n >= mDone)
+      break;
+    for (int i = 0; i < n; i++)
+      release(record(i));
+    mFirst += n;
+    mCount -= n;
+    mDone -= n;
+  }
+}
+
+/*
+ Record the insertion of nInserted bytes at pos.
+ */
+void Fl_Text_Undo::inserted(const Fl_Text_Buffer *buf, int pos, int nInserted)
+{
+  if (mApplying)
+    return;
+  forget_redo();
+  Record *last = mCount ? &record(mCount - 1) : NULL;
+  // a single character, as typed, not pasted text:
+  int typed = nInserted == fl_utf8len1(buf->byte_at(pos));
+  if (mJoin && mTyping && typed && last && last->type == INSERTED &&
+      last->pos + last->length == pos) {
+    // typing goes on
+    release(*last);
+    last->length += nInserted;
+    return;
+  }
+  // replacing deleted text is undone in one step
+  int joined = mJoin && last && last->type == DELETED && last->pos == pos;
+  Record &r = append();
+  r.type = INSERTED;
+  r.pos = pos;
+  r.length = nInserted;
+  r.joined = joined;
+  mJoin = 1;
+  mTyping = typed;
+  forget_oldest(buf->mUndoMemoryLimit);
+}
+
+/*
+ Record the deletion of the text between start and end, before the text is
+ removed from the buffer.
+ */
+void Fl_Text_Undo::removing(const Fl_Text_Buffer *buf, int start, int end)
+{
+  if (mApplying)
+    return;
+  forget_redo();
+  Record *last = mCount ? &record(mCount - 1) : NULL;
+  if (mJoin && last && last->type == DELETED && (last->pos == end || last->pos == start)) {
+    // backspace or delete goes on
+    int prepend = last->pos == end;
+    save_text(buf, *last, start, end - start, prepend);
+    if (prepend) last->pos = start;
+    last->length += end - start;
+  } else {
+    Record &r = append();
+    r.type = DELETED;
+    r.pos = start;
+    r.length = 0;
+    save_text(buf, r, start, end - start, 0);
+    r.length = end - start;
+    mJoin = 1;
+  }
+  mTyping = 0;
+  forget_oldest(buf->mUndoMemoryLimit);
+}
+
+/*
+ Undo the last group of modifications. Return 0 if there is nothing to undo.
+ */
+int Fl_Text_Undo::undo(Fl_Text_Buffer *buf)
+{
+  if (!mDone)
+    return 0;
+  mApplying = 1;
+  for (;;) {
+    Record &r = record(--mDone);
+    if (r.type == INSERTED) {
+      // keep the inserted text for redo()
+      if (!r.text)
+        save_text(buf, r, r.pos, r.length, 0);
+      buf->remove(r.pos, r.pos + r.length);
+    } else {
+      buf->insert(r.pos, r.text);
+    }
+    if (!r.joined || !mDone)
+      break;
+  }
+  mApplying = 0;
+  mJoin = 0;
+  mTyping = 0;
+  forget_oldest(buf->mUndoMemoryLimit);
+  return 1;
+}
 
-static int max(int i1, int i2)
+/*
+ Redo the next group of undone modifications. Return 0 if there is nothing
+ to redo.
+ */
+int Fl_Text_Undo::redo(Fl_Text_Buffer *buf)
 {
-  return i1 >= i2 ? i1 : i2;
+  if (mDone == mCount)
+    return 0;
+  mApplying = 1;
+  do {
+    Record &r = record(mDone++);
+    if (r.type == INSERTED)
+      buf->insert(r.pos, r.text);
+    else
+      buf->remove(r.pos, r.pos + r.length);
+  } while (mDone < mCount && record(mDone).joined);
+  mApplying = 0;
+  mJoin = 0;
+  mTyping = 0;
+  return 1;
 }
 
-static int min(int i1, int i2)
+/*
+ Return the undo history of this buffer, creating it if needed.
+ */
+Fl_Text_Undo *Fl_Text_Buffer::undo_journal()
 {
-  return i1 <= i2 ? i1 : i2;
+  if (!mUndo)
+    mUndo = new Fl_Text_Undo;
+  return mUndo;
 }
 
-#endif
+#endif // FLTK_ABI_VERSION >= 10304
+
 
+#if FLTK_ABI_VERSION < 10304
 
 static char *undobuffer;
 static int undobufferlength;
@@ -94,6 +1349,21 @@ static void undobuffersize(int n)
   }
 }
 
+#endif // FLTK_ABI_VERSION < 10304
+
+/*
+ Return the size of the gap to allocate when inserting insertedLength bytes
+ into a buffer of bufLength bytes whose gap is too small.
+ The spare room grows with the buffer (by 1/8 of its length, but at least
+ preferredGapSize bytes), so that a sequence of insertions, like loading a
+ large file in chunks or pasting repeatedly, reallocates and copies the
+ buffer only O(log n) times instead of once per insertion.
+ */
+static int new_gap_size(int bufLength, int insertedLength, int preferredGapSize)
+{
+  return insertedLength + max(preferredGapSize, bufLength / 8);
+}
+
 static void def_transcoding_warning_action(Fl_Text_Buffer *text)
 {
   fl_alert("%s", text->file_encoding_warning_message);
@@ -108,7 +1378,9 @@ Fl_Text_Buffer::Fl_Text_Buffer(int requestedSize, int preferredGapSize)
   mPreferredGapSize = preferredGapSize;
   mBuf = (char *) malloc(requestedSize + mPreferredGapSize);
   mGapStart = 0;
-  mGapEnd = mPreferredGapSize;
+  // the whole allocation is gap, so that requestedSize bytes can be
+  // inserted without reallocating
+  mGapEnd = requestedSize + mPreferredGapSize;
   mTabDist = 8;
   mPrimary.mSelected = 0;
   mPrimary.mStart = mPrimary.mEnd = 0;
@@ -126,6 +1398,13 @@ Fl_Text_Buffer::Fl_Text_Buffer(int requestedSize, int preferredGapSize)
   mCanUndo = 1;
   input_file_was_transcoded = 0;
   transcoding_warning_action = def_transcoding_warning_action;
+#if FLTK_ABI_VERSION >= 10304
+  mLineIndex = NULL;
+  mRope = NULL;
+  mUndo = NULL;
+  mUndoMemoryLimit = FL_TEXT_UNDO_LIMIT;
+  mLoader = NULL;
+#endif
 }
 
 
@@ -134,7 +1413,15 @@ Fl_Text_Buffer::Fl_Text_Buffer(int requestedSize, int preferredGapSize)
  */
 Fl_Text_Buffer::~Fl_Text_Buffer()
 {
+#if FLTK_ABI_VERSION >= 10304
+  cancel_load();
+#endif
   free(mBuf);
+#if FLTK_ABI_VERSION >= 10304
+  delete mLineIndex;
+  delete mRope;
+  delete mUndo;
+#endif
   if (mNModifyProcs != 0) {
     delete[]mModifyProcs;
     delete[]mCbArgs;
@@ -152,8 +1439,7 @@ Fl_Text_Buffer::~Fl_Text_Buffer()
  */
 char *Fl_Text_Buffer::text() const {
   char *t = (char *) malloc(mLength + 1);
-  memcpy(t, mBuf, mGapStart);
-  memcpy(t+mGapStart, mBuf+mGapEnd, mLength - mGapStart);
+  copy_bytes(t, 0, mLength);
   t[mLength] = '\0';
   return t;
 } 
@@ -170,20 +1456,41 @@ void Fl_Text_Buffer::text(const char *t)
   // then don't return so that internal cleanup can happen
   if (!t) t="";
 
+#if FLTK_ABI_VERSION >= 10304
+  cancel_load();
+#endif
+
   call_predelete_callbacks(0, length());
   
   /* Save information for redisplay, and get rid of the old buffer */
   const char *deletedText = text();
   int deletedLength = mLength;
-  free((void *) mBuf);
-  
-  /* Start a new buffer with a gap of mPreferredGapSize at the end */
   int insertedLength = (int) strlen(t);
-  mBuf = (char *) malloc(insertedLength + mPreferredGapSize);
+#if FLTK_ABI_VERSION >= 10304
+  if (mRope) {
+    delete mRope;
+    mRope = new Fl_Text_Rope;
+    mRope->replace(0, 0, t, insertedLength);
+  } else
+#endif
+  {
+    free((void *) mBuf);
+
+    /* Start a new buffer with a gap of mPreferredGapSize at the end */
+    mBuf = (char *) malloc(insertedLength + mPreferredGapSize);
+    mGapStart = insertedLength;
+    mGapEnd = mGapStart + mPreferredGapSize;
+    memcpy(mBuf, t, insertedLength);
+  }
   mLength = insertedLength;
-  mGapStart = insertedLength;
-  mGapEnd = mGapStart + mPreferredGapSize;
-  memcpy(mBuf, t, insertedLength);
+#if FLTK_ABI_VERSION >= 10304
+  /* The line index is rebuilt when needed */
+  delete mLineIndex;
+  mLineIndex = NULL;
+  /* Positions in the undo history refer to the old text */
+  if (mUndo)
+    mUndo->clear();
+#endif
   
   /* Zero all of the existing selections */
   update_selections(0, deletedLength, 0);
@@ -222,15 +1529,7 @@ char *Fl_Text_Buffer::text_range(int start, int end) const {
   s = (char *) malloc(copiedLength + 1);
   
   /* Copy the text from the buffer to the returned string */
-  if (end <= mGapStart) {
-    memcpy(s, mBuf + start, copiedLength);
-  } else if (start >= mGapStart) {
-    memcpy(s, mBuf + start + (mGapEnd - mGapStart), copiedLength);
-  } else {
-    int part1Length = mGapStart - start;
-    memcpy(s, mBuf + start, part1Length);
-    memcpy(s + part1Length, mBuf + mGapEnd, copiedLength - part1Length);
-  }
+  copy_bytes(s, start, end);
   s[copiedLength] = '\0';
   return s;
 }
@@ -370,31 +1669,36 @@ void Fl_Text_Buffer::copy(Fl_Text_Buffer * fromBuf, int fromStart,
   
   int copiedLength = fromEnd - fromStart;
   
-  /* Prepare the buffer to receive the new text.  If the new text fits in
-   the current buffer, just move the gap (if necessary) to where
-   the text should be inserted.  If the new text is too large, reallocate
-   the buffer with a gap large enough to accomodate the new text and a
-   gap of mPreferredGapSize */
-  if (copiedLength > mGapEnd - mGapStart)
-    reallocate_with_gap(toPos, copiedLength + mPreferredGapSize);
-  else if (toPos != mGapStart)
-    move_gap(toPos);
-  
-  /* Insert the new text (toPos now corresponds to the start of the gap) */
-  if (fromEnd <= fromBuf->mGapStart) {
-    memcpy(&mBuf[toPos], &fromBuf->mBuf[fromStart], copiedLength);
-  } else if (fromStart >= fromBuf->mGapStart) {
-    memcpy(&mBuf[toPos],
-	   &fromBuf->mBuf[fromStart + (fromBuf->mGapEnd - fromBuf->mGapStart)],
-	   copiedLength);
-  } else {
-    int part1Length = fromBuf->mGapStart - fromStart;
-    memcpy(&mBuf[toPos], &fromBuf->mBuf[fromStart], part1Length);
-    memcpy(&mBuf[toPos + part1Length],
-	   &fromBuf->mBuf[fromBuf->mGapEnd], copiedLength - part1Length);
+#if FLTK_ABI_VERSION >= 10304
+  if (mRope) {
+    /* The text may come from this buffer, copy it first */
+    char *t = fromBuf->text_range(fromStart, fromEnd);
+    mRope->replace(toPos, toPos, t, copiedLength);
+    free(t);
+  } else
+#endif
+  {
+    /* Prepare the buffer to receive the new text.  If the new text fits in
+     the current buffer, just move the gap (if necessary) to where
+     the text should be inserted.  If the new text is too large, reallocate
+     the buffer with a gap large enough to accomodate the new text and
+     some room to grow (see new_gap_size()) */
+    if (copiedLength > mGapEnd - mGapStart)
+      reallocate_with_gap(toPos, new_gap_size(mLength, copiedLength, mPreferredGapSize));
+    else if (toPos != mGapStart)
+      move_gap(toPos);
+
+    /* Insert the new text (toPos now corresponds to the start of the gap) */
+    fromBuf->copy_bytes(&mBuf[toPos], fromStart, fromEnd);
+    mGapStart += copiedLength;
   }
-  mGapStart += copiedLength;
   mLength += copiedLength;
+#if FLTK_ABI_VERSION >= 10304
+  if (mLineIndex)
+    mLineIndex->inserted(this, toPos, copiedLength);
+  if (mCanUndo)
+    undo_journal()->inserted(this, toPos, copiedLength);
+#endif
   update_selections(toPos, 0, copiedLength);
 }
 
@@ -406,6 +1710,13 @@ void Fl_Text_Buffer::copy(Fl_Text_Buffer * fromBuf, int fromStart,
  */ 
 int Fl_Text_Buffer::undo(int *cursorPos)
 {
+#if FLTK_ABI_VERSION >= 10304
+  if (!mUndo || !mUndo->undo(this))
+    return 0;
+  if (cursorPos)
+    *cursorPos = mCursorPosHint;
+  return 1;
+#else
   if (undowidget != this || (!undocut && !undoinsert && !mCanUndo))
     return 0;
   
@@ -439,6 +1750,7 @@ int Fl_Text_Buffer::undo(int *cursorPos)
   }
   
   return 1;
+#endif
 }
 
 
@@ -449,10 +1761,43 @@ void Fl_Text_Buffer::canUndo(char flag)
 {
   mCanUndo = flag;
   // disabling undo also clears the last undo operation!
+#if FLTK_ABI_VERSION >= 10304
+  if (!mCanUndo && mUndo) {
+    delete mUndo;
+    mUndo = NULL;
+  }
+#else
   if (!mCanUndo && undowidget==this) 
     undowidget = 0;
+#endif
+}
+
+#if FLTK_ABI_VERSION >= 10304
+
+/*
+ Redo the last undone changes. Return the cursor position after the
+ changes in cursorPos. Returns 1 if the changes were applied.
+ */
+int Fl_Text_Buffer::redo(int *cursorPos)
+{
+  if (!mUndo || !mUndo->redo(this))
+    return 0;
+  if (cursorPos)
+    *cursorPos = mCursorPosHint;
+  return 1;
+}
+
+
+/*
+ Set the memory limit of the undo history.
+ */
+void Fl_Text_Buffer::undo_memory_limit(int bytes)
+{
+  mUndoMemoryLimit = bytes;
 }
 
+#endif // FLTK_ABI_VERSION >= 10304
+
 
 /*
  Change the tab width. This will cause a couple of callbacks and a complete 
@@ -904,22 +2249,22 @@ int Fl_Text_Buffer::count_lines(int startPos, int endPos) const {
   IS_UTF8_ALIGNED2(this, (startPos))
   IS_UTF8_ALIGNED2(this, (endPos))
   
-  int gapLen = mGapEnd - mGapStart;
+#if FLTK_ABI_VERSION >= 10304
+  /* Use the line index for long ranges */
+  if (startPos >= 0 && min(endPos, mLength) - startPos > FL_TEXT_LINE_INDEX_MIN)
+    return newlines_before(endPos) - newlines_before(startPos);
+#endif
+
   int lineCount = 0;
   
-  int pos = startPos;
-  while (pos < mGapStart)
-  {
-    if (pos == endPos)
-      return lineCount;
-    if (mBuf[pos++] == '\n')
-      lineCount++;
-  } 
-  while (pos < mLength) {
-    if (pos == endPos)
-      return lineCount;
-    if (mBuf[pos++ + gapLen] == '\n')
-      lineCount++;
+  /* an end before the start, or beyond the buffer, counts to the end */
+  if (endPos < startPos || endPos > mLength)
+    endPos = mLength;
+  while (startPos < endPos) {
+    int segEnd = min(segment_end(startPos), endPos);
+    const char *p = address(startPos);
+    lineCount += count_byte(p, p + (segEnd - startPos), '\n');
+    startPos = segEnd;
   }
   return lineCount;
 }
@@ -937,25 +2282,35 @@ int Fl_Text_Buffer::skip_lines(int startPos, int nLines)
   if (nLines == 0)
     return startPos;
   
-  int gapLen = mGapEnd - mGapStart;
-  int pos = startPos;
-  int lineCount = 0;
-  while (pos < mGapStart) {
-    if (mBuf[pos++] == '\n') {
-      lineCount++;
-      if (lineCount == nLines) {
-        IS_UTF8_ALIGNED2(this, (pos))
-	return pos;
-      }
+#if FLTK_ABI_VERSION >= 10304
+  /* Use the line index if the target is not close to startPos */
+  if (nLines > 0 && startPos >= 0 && mLength - startPos > FL_TEXT_LINE_INDEX_MIN) {
+    int pos = Fl_Text_Line_Index::find_newline(this, startPos,
+                                               startPos + FL_TEXT_LINE_INDEX_MIN, nLines - 1);
+    if (pos < 0) {
+      pos = newline_position(newlines_before(startPos) + nLines - 1);
+      if (pos < 0)
+        return mLength;
     }
+    return pos + 1;
   }
+#endif
+
+  int pos = startPos;
+  int lineCount = 0;
   while (pos < mLength) {
-    if (mBuf[pos++ + gapLen] == '\n') {
-      lineCount++;
-      if (lineCount >= nLines) {
-        IS_UTF8_ALIGNED2(this, (pos))
-	return pos;
-      }
+    /* search the newline in the contiguous text after pos */
+    const char *b = address(pos);
+    const char *e = b + (segment_end(pos) - pos);
+    const char *p = (const char *)memchr(b, '\n', e - b);
+    if (!p) {
+      pos += (int)(e - b);
+      continue;
+    }
+    pos += (int)(p - b) + 1;
+    if (++lineCount >= nLines) {
+      IS_UTF8_ALIGNED2(this, (pos))
+      return pos;
     }
   }
   IS_UTF8_ALIGNED2(this, (pos))
@@ -976,23 +2331,34 @@ int Fl_Text_Buffer::rewind_lines(int startPos, int nLines)
   if (pos <= 0)
     return 0;
   
-  int gapLen = mGapEnd - mGapStart;
-  int lineCount = -1;
-  while (pos >= mGapStart) {
-    if (mBuf[pos + gapLen] == '\n') {
-      if (++lineCount >= nLines) {
-        IS_UTF8_ALIGNED2(this, (pos+1))
-	return pos + 1;
-      }
+#if FLTK_ABI_VERSION >= 10304
+  /* Use the line index if the target is not close to startPos */
+  if (nLines >= 0 && pos > FL_TEXT_LINE_INDEX_MIN && startPos <= mLength) {
+    pos = Fl_Text_Line_Index::rfind_newline(this, startPos - FL_TEXT_LINE_INDEX_MIN,
+                                            startPos, nLines);
+    if (pos < 0) {
+      pos = newline_position(newlines_before(startPos) - 1 - nLines);
+      if (pos < 0)
+        return 0;
     }
-    pos--;
+    return pos + 1;
   }
+#endif
+
+  int lineCount = -1;
   while (pos >= 0) {
-    if (mBuf[pos] == '\n') {
-      if (++lineCount >= nLines) {
-        IS_UTF8_ALIGNED2(this, (pos+1))
-	return pos + 1;
-      }
+    /* search the newline in the contiguous text before pos */
+    int segStart = segment_start(pos);
+    const char *b = address(segStart);
+    const char *p = find_byte_backward(b, b + (pos - segStart) + 1, '\n');
+    if (!p) {
+      pos = segStart - 1;
+      continue;
+    }
+    pos = segStart + (int)(p - b);
+    if (++lineCount >= nLines) {
+      IS_UTF8_ALIGNED2(this, (pos+1))
+      return pos + 1;
     }
     pos--;
   }
@@ -1015,6 +2381,18 @@ int Fl_Text_Buffer::search_forward(int startPos, const char *searchString,
   const char *sp;
   if (matchCase) {
     while (startPos < length()) {
+      if (*searchString) {
+        // skip to the next occurrence of the first byte of the "needle",
+        // which is the start of a UTF-8 sequence
+        const char *b = address(startPos);
+        const char *e = b + (segment_end(startPos) - startPos);
+        const char *p = (const char *)memchr(b, *searchString, e - b);
+        if (!p) {
+          startPos += (int)(e - b);
+          continue;
+        }
+        startPos += (int)(p - b);
+      }
       bp = startPos;
       sp = searchString;
       for (;;) {
@@ -1025,32 +2403,16 @@ int Fl_Text_Buffer::search_forward(int startPos, const char *searchString,
           return 1;
         }
         int l = fl_utf8len1(c);
-        if (memcmp(sp, address(bp), l))
+        if (bp + l > mLength || memcmp(sp, address(bp), l))
           break;
         sp += l; bp += l;
       }
       startPos = next_char(startPos);
     }
   } else {
-    while (startPos < length()) {
-      bp = startPos;
-      sp = searchString;
-      for (;;) {
-        // we reached the end of the "needle", so we found the string!
-        if (!*sp) {
-          *foundPos = startPos;
-          return 1;
-        }
-        int l;
-        unsigned int b = char_at(bp);
-        unsigned int s = fl_utf8decode(sp, 0, &l);
-        if (fl_tolower(b)!=fl_tolower(s))
-          break;
-        sp += l; 
-        bp = next_char(bp);
-      }
-      startPos = next_char(startPos);
-    }
+    // skip tables for all the case variants of the "needle"
+    Fl_Text_Search search(searchString);
+    return search.forward(this, startPos, foundPos);
   }  
   return 0;
 }
@@ -1067,6 +2429,20 @@ int Fl_Text_Buffer::search_backward(int startPos, const char *searchString,
   const char *sp;
   if (matchCase) {
     while (startPos >= 0) {
+      if (*searchString) {
+        // skip back to the previous occurrence of the first byte of the
+        // "needle", which is the start of a UTF-8 sequence
+        if (startPos >= mLength && (startPos = mLength - 1) < 0)
+          break;
+        int segStart = segment_start(startPos);
+        const char *b = address(segStart);
+        const char *p = find_byte_backward(b, b + (startPos - segStart) + 1, *searchString);
+        if (!p) {
+          startPos = segStart - 1;
+          continue;
+        }
+        startPos = segStart + (int)(p - b);
+      }
       bp = startPos;
       sp = searchString;
       for (;;) {
@@ -1077,32 +2453,16 @@ int Fl_Text_Buffer::search_backward(int startPos, const char *searchString,
           return 1;
         }
         int l = fl_utf8len1(c);
-        if (memcmp(sp, address(bp), l))
+        if (bp + l > mLength || memcmp(sp, address(bp), l))
           break;
         sp += l; bp += l;
       }
       startPos = prev_char(startPos);
     }
   } else {
-    while (startPos >= 0) {
-      bp = startPos;
-      sp = searchString;
-      for (;;) {
-        // we reached the end of the "needle", so we found the string!
-        if (!*sp) {
-          *foundPos = startPos;
-          return 1;
-        }
-        int l;
-        unsigned int b = char_at(bp);
-        unsigned int s = fl_utf8decode(sp, 0, &l);
-        if (fl_tolower(b)!=fl_tolower(s))
-          break;
-        sp += l; 
-        bp = next_char(bp);
-      }
-      startPos = prev_char(startPos);
-    }
+    // skip tables for all the case variants of the "needle"
+    Fl_Text_Search search(searchString);
+    return search.backward(this, startPos, foundPos);
   }  
   return 0;
 }
@@ -1120,22 +2480,37 @@ int Fl_Text_Buffer::insert_(int pos, const char *text)
   
   int insertedLength = (int) strlen(text);
   
-  /* Prepare the buffer to receive the new text.  If the new text fits in
-   the current buffer, just move the gap (if necessary) to where
-   the text should be inserted.  If the new text is too large, reallocate
-   the buffer with a gap large enough to accomodate the new text and a
-   gap of mPreferredGapSize */
-  if (insertedLength > mGapEnd - mGapStart)
-    reallocate_with_gap(pos, insertedLength + mPreferredGapSize);
-  else if (pos != mGapStart)
-    move_gap(pos);
-  
-  /* Insert the new text (pos now corresponds to the start of the gap) */
-  memcpy(&mBuf[pos], text, insertedLength);
-  mGapStart += insertedLength;
+#if FLTK_ABI_VERSION >= 10304
+  if (mRope) {
+    mRope->replace(pos, pos, text, insertedLength);
+  } else
+#endif
+  {
+    /* Prepare the buffer to receive the new text.  If the new text fits in
+     the current buffer, just move the gap (if necessary) to where
+     the text should be inserted.  If the new text is too large, reallocate
+     the buffer with a gap large enough to accomodate the new text and
+     some room to grow (see new_gap_size()) */
+    if (insertedLength > mGapEnd - mGapStart)
+      reallocate_with_gap(pos, new_gap_size(mLength, insertedLength, mPreferredGapSize));
+    else if (pos != mGapStart)
+      move_gap(pos);
+
+    /* Insert the new text (pos now corresponds to the start of the gap) */
+    memcpy(&mBuf[pos], text, insertedLength);
+    mGapStart += insertedLength;
+  }
   mLength += insertedLength;
+#if FLTK_ABI_VERSION >= 10304
+  if (mLineIndex)
+    mLineIndex->inserted(this, pos, insertedLength);
+#endif
   update_selections(pos, 0, insertedLength);
   
+#if FLTK_ABI_VERSION >= 10304
+  if (mCanUndo)
+    undo_journal()->inserted(this, pos, insertedLength);
+#else
   if (mCanUndo) {
     if (undowidget == this && undoat == pos && undoinsert) {
       undoinsert += insertedLength;
@@ -1147,6 +2522,7 @@ int Fl_Text_Buffer::insert_(int pos, const char *text)
     undocut = 0;
     undowidget = this;
   }
+#endif
   
   return insertedLength;
 }
@@ -1158,6 +2534,25 @@ int Fl_Text_Buffer::insert_(int pos, const char *text)
  */
 void Fl_Text_Buffer::remove_(int start, int end)
 {
+#if FLTK_ABI_VERSION >= 10304
+  if (mLineIndex)
+    mLineIndex->removing(this, start, end);
+  if (mCanUndo)
+    undo_journal()->removing(this, start, end);
+
+  if (mRope) {
+    mRope->replace(start, end, "", 0);
+    mLength -= end - start;
+    update_selections(start, end - start, 0);
+    return;
+  }
+
+  /* if the gap is not contiguous to the area to remove, move it there */
+  if (start > mGapStart)
+    move_gap(start);
+  else if (end < mGapStart)
+    move_gap(end);
+#else
   /* if the gap is not contiguous to the area to remove, move it there */
   
   if (mCanUndo) {
@@ -1191,6 +2586,7 @@ void Fl_Text_Buffer::remove_(int start, int end)
       memcpy(undobuffer + prelen, mBuf + mGapEnd, end - start - prelen);
     }
   }
+#endif
   
   /* expand the gap to encompass the deleted characters */
   mGapEnd += end - mGapStart;
@@ -1378,6 +2774,48 @@ void Fl_Text_Buffer::redisplay_selection(Fl_Text_Selection *
 }
 
 
+/*
+ Return the end of the contiguous bytes from pos: the gap, the end of the
+ text, or the end of a rope block.
+ */
+int Fl_Text_Buffer::segment_end(int pos) const
+{
+#if FLTK_ABI_VERSION >= 10304
+  if (mRope)
+    return mRope->segment_end(pos);
+#endif
+  return (pos < mGapStart) ? mGapStart : mLength;
+}
+
+
+/*
+ Return the start of the contiguous bytes up to pos: the end of the gap,
+ the start of the text, or the start of a rope block.
+ */
+int Fl_Text_Buffer::segment_start(int pos) const
+{
+#if FLTK_ABI_VERSION >= 10304
+  if (mRope)
+    return mRope->segment_start(pos);
+#endif
+  return (pos >= mGapStart) ? mGapStart : 0;
+}
+
+
+/*
+ Copy the text between start and end, one contiguous part at a time.
+ */
+void Fl_Text_Buffer::copy_bytes(char *dst, int start, int end) const
+{
+  while (start < end) {
+    int segEnd = min(segment_end(start), end);
+    memcpy(dst, address(start), segEnd - start);
+    dst += segEnd - start;
+    start = segEnd;
+  }
+}
+
+
 /*
  Move the gap around without changing buffer content.
  Unicode safe. Pos must be at a character boundary.
@@ -1475,6 +2913,22 @@ int Fl_Text_Buffer::findchar_forward(int startPos, unsigned searchChar,
   if (startPos<0)
     startPos = 0;
   
+  if (searchChar < 0x80) {
+    /* ASCII characters are searched as bytes in each contiguous part */
+    while (startPos < mLength) {
+      const char *b = address(startPos);
+      const char *e = b + (segment_end(startPos) - startPos);
+      const char *p = (const char *)memchr(b, (int)searchChar, e - b);
+      if (p) {
+        *foundPos = startPos + (int)(p - b);
+        return 1;
+      }
+      startPos += (int)(e - b);
+    }
+    *foundPos = mLength;
+    return 0;
+  }
+
   for ( ; startPos<mLength; startPos = next_char(startPos)) {
     if (searchChar == char_at(startPos)) {
       *foundPos = startPos;
@@ -1501,6 +2955,22 @@ int Fl_Text_Buffer::findchar_backward(int startPos, unsigned int searchChar,
   if (startPos > mLength)
     startPos = mLength;
   
+  if (searchChar < 0x80) {
+    /* ASCII characters are searched as bytes in each contiguous part */
+    while (startPos > 0) {
+      int segStart = segment_start(startPos - 1);
+      const char *b = address(segStart);
+      const char *p = find_byte_backward(b, b + (startPos - segStart), (char)searchChar);
+      if (p) {
+        *foundPos = segStart + (int)(p - b);
+        return 1;
+      }
+      startPos = segStart;
+    }
+    *foundPos = 0;
+    return 0;
+  }
+
   for (startPos = prev_char(startPos); startPos>=0; startPos = prev_char(startPos)) {
     if (searchChar == char_at(startPos)) {
       *foundPos = startPos;
@@ -1622,6 +3092,16 @@ static int utf8_input_filter(char *buffer, 		// result buffer we fill with utf8
       if (r == 0) return (int) (q - buffer);	// EOF? return bytes read into buffer[]
       p = line;
     }
+    // Copy runs of ASCII characters, which need no transcoding
+    if (!(*p & 0x80)) {
+      char *e = p;
+      char *stop = (endline - p < buffer + buflen - q) ? endline : p + (buffer + buflen - q);
+      while (e < stop && !(*e & 0x80)) e++;
+      memcpy(q, p, e - p);
+      q += e - p;
+      p = e;
+      continue;
+    }
     // Predict length of utf8 sequence
     //    See if utf8 seq we're working on would extend off end of line buffer,
     //    and if so, adjust + load more data so that it doesn't.
@@ -1672,8 +3152,21 @@ const char *Fl_Text_Buffer::file_encoding_warning_message =
   FILE *fp;
   if (!(fp = fl_fopen(file, "r")))
     return 1;
+  // make room for the whole file at once instead of growing the buffer
+  // while inserting
+  int reserve = (pos >= 0 && pos <= mLength);
+#if FLTK_ABI_VERSION >= 10304
+  if (mRope)
+    reserve = 0;      // rope blocks are allocated as the text is inserted
+#endif
+  if (reserve && fseek(fp, 0, SEEK_END) == 0) {
+    long size = ftell(fp);
+    if (size > mGapEnd - mGapStart && size < 0x7fffffff - mLength - mPreferredGapSize)
+      reallocate_with_gap(pos, (int)size + mPreferredGapSize);
+    fseek(fp, 0, SEEK_SET);
+  }
   char *buffer = new char[buflen + 1];  
-  char *endline, line[100];
+  char *endline, line[4096];
   int l;
   input_file_was_transcoded = false;
   endline = line;
@@ -1703,6 +3196,239 @@ const char *Fl_Text_Buffer::file_encoding_warning_message =
   return e;
 }
 
+#if FLTK_ABI_VERSION >= 10304
+
+/* Size of the chunks of text read by loadfile_async() */
+#define FL_TEXT_LOAD_CHUNK (1024 * 1024)
+
+/*
+ State of a file loaded by Fl_Text_Buffer::loadfile_async().
+
+ The file is read and transcoded to UTF-8 one chunk at a time by
+ Fl_Thread_Pool tasks. The done function of a task runs in the main
+ thread: it submits the task that reads the next chunk, then inserts its
+ own chunk into the buffer and reports the progress, so reading and
+ inserting overlap while at most one chunk waits besides the buffer.
+
+ A single task is in flight at a time. The loader is shared by the buffer
+ and that task, and all its members but the ones written by the task are
+ only used by the main thread; the last user deletes it.
+ */
+class Fl_Text_Loader {
+  Fl_Text_Buffer *buf;          // NULL once the load is finished or cancelled
+  FILE *fp;
+  int pos;                      // where the next chunk is inserted
+  Fl_Text_Load_Cb cb;
+  void *cbArg;
+  double size;                  // size of the file
+  int refs;                     // number of users of the loader
+  // the members below are written by the task
+  char line[4096];              // read buffer of utf8_input_filter()
+  char *endline;
+  int transcoded;               // input was not UTF-8
+  char *chunk;                  // text read by the task, or NULL at the end
+  double bytesRead;             // file position after the chunk
+  int finished;                 // the whole file was read
+  int error;                    // a read error occurred
+  volatile int cancelled;       // the task can skip reading
+
+  void release();
+  void finish();
+  static void read_work(void *loader);
+  static void read_done(void *loader);
+  static void modify_cb(int pos, int nInserted, int nDeleted, int nRestyled,
+                        const char *deletedText, void *cbArg);
+
+public:
+  Fl_Text_Loader(Fl_Text_Buffer *b, FILE *f, int p, Fl_Text_Load_Cb callback, void *arg);
+  ~Fl_Text_Loader();
+  int read_next();
+  void cancel();
+};
+
+Fl_Text_Loader::Fl_Text_Loader(Fl_Text_Buffer *b, FILE *f, int p,
+                               Fl_Text_Load_Cb callback, void *arg)
+{
+  buf = b;
+  fp = f;
+  pos = p;
+  cb = callback;
+  cbArg = arg;
+  refs = 1;
+  endline = line;
+  transcoded = 0;
+  chunk = NULL;
+  bytesRead = 0;
+  finished = error = cancelled = 0;
+
+  // make room for the whole file at once
+  size = 0;
+  if (fseek(fp, 0, SEEK_END) == 0) {
+    long l = ftell(fp);
+    if (l > 0) size = l;
+    fseek(fp, 0, SEEK_SET);
+  }
+  if (size > 0 && size < 0x7fffffff - buf->mLength - buf->mPreferredGapSize &&
+      !buf->mRope && size > buf->mGapEnd - buf->mGapStart)
+    buf->reallocate_with_gap(pos, (int)size + buf->mPreferredGapSize);
+  buf->add_modify_callback(modify_cb, this);
+}
+
+Fl_Text_Loader::~Fl_Text_Loader()
+{
+  free(chunk);
+  fclose(fp);
+}
+
+/*
+ Submit the task that reads the next chunk, returns -1 if it failed.
+ */
+int Fl_Text_Loader::read_next()
+{
+  refs++;
+  if (Fl_Thread_Pool::submit(read_work, read_done, this) < 0) {
+    refs--;
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ Read and transcode the next chunk of the file, in a worker thread.
+ */
+void Fl_Text_Loader::read_work(void *loader)
+{
+  Fl_Text_Loader *l = (Fl_Text_Loader *)loader;
+  if (l->cancelled)
+    return;
+  char *text = (char *) malloc(FL_TEXT_LOAD_CHUNK + 1);
+  int n = text ? utf8_input_filter(text, FL_TEXT_LOAD_CHUNK, l->line, sizeof(l->line),
+                                   l->endline, l->fp, &l->transcoded) : 0;
+  if (n) {
+    text[n] = 0;
+    l->chunk = text;
+  } else {
+    free(text);
+    l->finished = 1;
+    l->error = !text || ferror(l->fp);
+  }
+  long p = ftell(l->fp);
+  if (p > 0) l->bytesRead = p;
+}
+
+/*
+ Insert the chunk read by the task into the buffer and report the
+ progress, in the main thread.
+ */
+void Fl_Text_Loader::read_done(void *loader)
+{
+  Fl_Text_Loader *l = (Fl_Text_Loader *)loader;
+  char *text = l->chunk;
+  l->chunk = NULL;
+  int done = l->finished;
+  double fraction = l->size > 0 ? l->bytesRead / l->size : 0.0;
+
+  // the task is not running anymore, start reading the next chunk
+  if (l->buf && !done && l->read_next() < 0)
+    done = l->error = 1;
+
+  // pos is moved after the text by modify_cb()
+  if (l->buf && text)
+    l->buf->insert(l->pos, text);
+  free(text);
+  if (l->buf) {
+    if (done)
+      l->finish();
+    else if (l->cb)
+      l->cb(l->buf, -1, fraction > 1.0 ? 1.0 : fraction, l->cbArg);
+  }
+  l->release();
+}
+
+/*
+ Detach the loader from the buffer at the end of the file and report the
+ result.
+ */
+void Fl_Text_Loader::finish()
+{
+  Fl_Text_Buffer *b = buf;
+  int e = error ? 2 : 0;
+  Fl_Text_Load_Cb callback = cb;
+  void *arg = cbArg;
+  cancel();
+  b->input_file_was_transcoded = transcoded;
+  if (callback)
+    callback(b, e, 1.0, arg);
+  if (!e && b->input_file_was_transcoded && b->transcoding_warning_action)
+    b->transcoding_warning_action(b);
+}
+
+/*
+ Stop loading: the buffer forgets the loader, and the task in flight, if
+ any, skips reading and deletes it.
+ */
+void Fl_Text_Loader::cancel()
+{
+  if (!buf)
+    return;
+  buf->remove_modify_callback(modify_cb, this);
+  buf->mLoader = NULL;
+  buf = NULL;
+  cancelled = 1;
+  release();
+}
+
+void Fl_Text_Loader::release()
+{
+  if (!--refs)
+    delete this;
+}
+
+/*
+ Keep the insertion position in place when the buffer is modified while
+ the file is loading, including by the insertion of the chunks.
+ */
+void Fl_Text_Loader::modify_cb(int pos, int nInserted, int nDeleted, int,
+                               const char *, void *cbArg)
+{
+  Fl_Text_Loader *l = (Fl_Text_Loader *)cbArg;
+  if (nDeleted && pos < l->pos)
+    l->pos -= min(nDeleted, l->pos - pos);
+  if (nInserted && pos <= l->pos)
+    l->pos += nInserted;
+}
+
+/*
+ Load a file in the background.
+ */
+int Fl_Text_Buffer::loadfile_async(const char *file, Fl_Text_Load_Cb cb, void *cbArg)
+{
+  cancel_load();
+  FILE *fp = fl_fopen(file, "r");
+  if (!fp)
+    return 1;
+  select(0, length());
+  remove_selection();
+  input_file_was_transcoded = false;
+  mLoader = new Fl_Text_Loader(this, fp, length(), cb, cbArg);
+  if (mLoader->read_next() < 0) {
+    mLoader->cancel();
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ Stop loading a file.
+ */
+void Fl_Text_Buffer::cancel_load()
+{
+  if (mLoader)
+    mLoader->cancel();
+}
+
+#endif // FLTK_ABI_VERSION >= 10304
+
 
 /*
  Write text to file.
@@ -74,6 +74,697 @@ static int scroll_x = 0;
 
 
 
+#if FLTK_ABI_VERSION >= 10304
+/* Distance in bytes between the saved tokenizer states of Fl_Text_Highlight */
+#define FL_TEXT_HIGHLIGHT_STEP 4096
+/* Number of styled lines kept by Fl_Text_Highlight, a power of two */
+#define FL_TEXT_HIGHLIGHT_LINES 256
+
+/*
+ Styles of the text computed by the tokenizer of highlight_data().
+
+ Instead of a style buffer of one byte per character, only the lines that
+ are displayed are styled, on demand, and kept as runs of the same style
+ in a small table indexed by their position. Styling a line needs the
+ state of the tokenizer at its start, which is the state at the end of
+ the previous line: states are saved at the first line start after every
+ FL_TEXT_HIGHLIGHT_STEP bytes, so that a line is styled by tokenizing at
+ most that much text before it, and the whole buffer is only tokenized
+ once if the end of the buffer is displayed.
+
+ A modification forgets the styled lines from the modified one on, and
+ the saved states after it. These states are kept to be checked again:
+ when tokenizing reaches one of them with the same state, the states up
+ to the next modification are valid again. modified() also tells the
+ display whether the state at the end of the modified line changed, so
+ that the lines below it are redrawn.
+ */
+class Fl_Text_Highlight {
+public:
+  Fl_Text_Highlight(Fl_Text_Display::Tokenizer_Cb cb, void *cbArg);
+  ~Fl_Text_Highlight();
+
+  void clear();
+  int style_at(const Fl_Text_Buffer *buf, int pos);
+  char *style_range(const Fl_Text_Buffer *buf, int start, int end);
+  int modified(const Fl_Text_Buffer *buf, int pos, int nInserted, int nDeleted,
+               const char *deletedText);
+
+private:
+  struct Run {
+    int length;       // number of bytes
+    char style;       // style of these bytes
+  };
+  struct Line {
+    int pos;          // buffer position of the line, -1 if the slot is unused
+    int len;          // length of the line without its newline
+    int state;        // state of the tokenizer at the start of the line
+    int next;         // state at the start of the next line
+    int nRuns, runsAlloc;
+    Run *runs;
+  };
+  struct Point {
+    int pos;          // a line start
+    int state;        // state of the tokenizer at pos
+    int edited;       // the text before pos was modified since state was computed
+  };
+
+  int tokenize(const Fl_Text_Buffer *buf, int lineStart, int state, int *lineEnd);
+  int state_at(const Fl_Text_Buffer *buf, int lineStart);
+  Line *line(const Fl_Text_Buffer *buf, int lineStart);
+  Line &slot(int pos) { return mLines[((unsigned)pos * 2654435761U) >> 7 & (FL_TEXT_HIGHLIGHT_LINES - 1)]; }
+
+  Fl_Text_Display::Tokenizer_Cb mTokenizer;
+  void *mArg;
+  Line mLines[FL_TEXT_HIGHLIGHT_LINES];
+  Line *mLast;        // line of the last style_at(), and its run containing mRunStart
+  int mRun, mRunStart;
+  Point *mPoints;     // saved states, mPoints[0] is the start of the buffer
+  int mNPoints, mPointsAlloc;
+  int mValid;         // number of saved states known to be valid
+  char *mStyles;      // styles of the last tokenized line
+  int mStylesSize;
+};
+
+Fl_Text_Highlight::Fl_Text_Highlight(Fl_Text_Display::Tokenizer_Cb cb, void *cbArg)
+: mTokenizer(cb), mArg(cbArg), mLast(0), mRun(0), mRunStart(0),
+  mPoints(0), mNPoints(0), mPointsAlloc(0), mValid(0), mStyles(0), mStylesSize(0) {
+  memset(mLines, 0, sizeof(mLines));
+  for (int i = 0; i < FL_TEXT_HIGHLIGHT_LINES; i++)
+    mLines[i].pos = -1;
+  clear();
+}
+
+Fl_Text_Highlight::~Fl_Text_Highlight() {
+  for (int i = 0; i < FL_TEXT_HIGHLIGHT_LINES; i++)
+    free(mLines[i].runs);
+  free(mPoints);
+  free(mStyles);
+}
+
+/*
+ Forget all styles and states, when the buffer changed.
+ */
+void Fl_Text_Highlight::clear() {
+  for (int i = 0; i < FL_TEXT_HIGHLIGHT_LINES; i++)
+    mLines[i].pos = -1;
+  mLast = 0;
+  if (!mPointsAlloc) {
+    mPointsAlloc = 64;
+    mPoints = (Point *)malloc(mPointsAlloc * sizeof(Point));
+  }
+  mPoints[0].pos = mPoints[0].state = mPoints[0].edited = 0;
+  mNPoints = mValid = 1;
+}
+
+/*
+ Tokenize the line at lineStart into mStyles, and return the state at the
+ start of the next line.
+ */
+int Fl_Text_Highlight::tokenize(const Fl_Text_Buffer *buf, int lineStart, int state,
+                                int *lineEnd) {
+  int end = buf->line_end(lineStart), len = end - lineStart;
+  if (len >= mStylesSize) {
+    mStylesSize = len + 256;
+    mStyles = (char *)realloc(mStyles, mStylesSize);
+  }
+  char *text = buf->text_range(lineStart, end);
+  memset(mStyles, 'A', len + 1);
+  state = mTokenizer(text, len, state, mStyles, mArg);
+  free(text);
+  *lineEnd = end;
+  return state;
+}
+
+/*
+ Return the state of the tokenizer at the start of a line: the state at
+ the end of the previous line if it is styled, else the result of
+ tokenizing the text from the last saved state before the line.
+ */
+int Fl_Text_Highlight::state_at(const Fl_Text_Buffer *buf, int lineStart) {
+  if (lineStart <= 0) return 0;
+  int prev = buf->line_start(lineStart - 1);
+  Line &l = slot(prev);
+  if (l.pos == prev) return l.next;
+
+  int lo = 0, hi = mValid - 1;
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (mPoints[mid].pos <= lineStart) lo = mid;
+    else hi = mid - 1;
+  }
+  int pos = mPoints[lo].pos, state = mPoints[lo].state, end;
+  while (pos < lineStart) {
+    state = tokenize(buf, pos, state, &end);
+    pos = end + 1;
+    if (mValid < mNPoints) {
+      // check the next saved state that may have changed
+      Point &p = mPoints[mValid];
+      if (p.pos != pos) continue;
+      int same = p.state == state;
+      p.state = state;
+      p.edited = 0;
+      mValid++;
+      if (same) {
+        // the following states are valid up to the next modification
+        while (mValid < mNPoints && !mPoints[mValid].edited) mValid++;
+        while (lo < mValid - 1 && mPoints[lo + 1].pos <= lineStart) lo++;
+        if (mPoints[lo].pos > pos) {
+          pos = mPoints[lo].pos;
+          state = mPoints[lo].state;
+        }
+      }
+    } else if (pos >= mPoints[mNPoints - 1].pos + FL_TEXT_HIGHLIGHT_STEP && pos <= lineStart) {
+      // save the state
+      if (mNPoints == mPointsAlloc) {
+        mPointsAlloc *= 2;
+        mPoints = (Point *)realloc(mPoints, mPointsAlloc * sizeof(Point));
+      }
+      Point &p = mPoints[mNPoints++];
+      p.pos = pos;
+      p.state = state;
+      p.edited = 0;
+      mValid = mNPoints;
+    }
+  }
+  return state;
+}
+
+/*
+ Return the styles of the line at lineStart, tokenizing it if needed.
+ */
+Fl_Text_Highlight::Line *Fl_Text_Highlight::line(const Fl_Text_Buffer *buf, int lineStart) {
+  Line &l = slot(lineStart);
+  if (l.pos == lineStart) return &l;
+  int state = state_at(buf, lineStart), end;
+  int next = tokenize(buf, lineStart, state, &end);
+  if (mLast == &l) mLast = 0;
+  l.pos = lineStart;
+  l.len = end - lineStart;
+  l.state = state;
+  l.next = next;
+  l.nRuns = 0;
+  for (int i = 0; i < l.len; ) {
+    int j = i + 1;
+    while (j < l.len && mStyles[j] == mStyles[i]) j++;
+    if (l.nRuns == l.runsAlloc) {
+      l.runsAlloc = l.runsAlloc ? 2 * l.runsAlloc : 8;
+      l.runs = (Run *)realloc(l.runs, l.runsAlloc * sizeof(Run));
+    }
+    l.runs[l.nRuns].length = j - i;
+    l.runs[l.nRuns].style = mStyles[i];
+    l.nRuns++;
+    i = j;
+  }
+  return &l;
+}
+
+/*
+ Return the style of the character at pos. Consecutive positions are
+ found without searching their line.
+ */
+int Fl_Text_Highlight::style_at(const Fl_Text_Buffer *buf, int pos) {
+  if (!mLast || pos < mLast->pos || pos > mLast->pos + mLast->len) {
+    mLast = line(buf, buf->line_start(pos));
+    mRun = 0;
+    mRunStart = mLast->pos;
+  }
+  if (pos == mLast->pos + mLast->len)
+    return 'A';       // the newline
+  if (pos < mRunStart) {
+    mRun = 0;
+    mRunStart = mLast->pos;
+  }
+  while (pos >= mRunStart + mLast->runs[mRun].length)
+    mRunStart += mLast->runs[mRun++].length;
+  return (unsigned char)mLast->runs[mRun].style;
+}
+
+/*
+ Return a copy of the styles of a range of text, like the text of a style
+ buffer; the caller must free() it.
+ */
+char *Fl_Text_Highlight::style_range(const Fl_Text_Buffer *buf, int start, int end) {
+  char *s = (char *)malloc(end - start + 1);
+  for (int i = start; i < end; i++)
+    s[i - start] = (char)style_at(buf, i);
+  s[end - start] = 0;
+  return s;
+}
+
+/*
+ Forget the styles and states made invalid by a modification of the buffer,
+ and return 1 if the styles of the lines after the modified ones may have
+ changed.
+ */
+int Fl_Text_Highlight::modified(const Fl_Text_Buffer *buf, int pos, int nInserted,
+                                int nDeleted, const char *deletedText) {
+  int i, lineStart = buf->line_start(pos);
+  Line &old = slot(lineStart);
+  int known = old.pos == lineStart, oldNext = old.next;
+
+  mLast = 0;
+  for (i = 0; i < FL_TEXT_HIGHLIGHT_LINES; i++)
+    if (mLines[i].pos >= 0 && mLines[i].pos + mLines[i].len >= pos)
+      mLines[i].pos = -1;
+
+  // remove the saved states of deleted line starts, move the following ones,
+  // and mark the first one after the modification to be checked again
+  int first = mNPoints, n = 0;
+  for (i = 0; i < mNPoints; i++) {
+    Point p = mPoints[i];
+    if (p.pos > pos && p.pos <= pos + nDeleted) continue;
+    if (p.pos > pos) {
+      p.pos += nInserted - nDeleted;
+      if (first == mNPoints) {
+        first = n;
+        p.edited = 1;
+      }
+    }
+    mPoints[n++] = p;
+  }
+  mNPoints = n;
+  if (first > mNPoints) first = mNPoints;
+  if (mValid > first) mValid = first;
+
+  // a modification of the line breaks redraws the rest of the display anyway
+  if (!known || (nDeleted && memchr(deletedText, '\n', nDeleted)) ||
+      buf->line_start(pos + nInserted) != lineStart)
+    return 1;
+  return line(buf, lineStart)->next != oldNext;
+}
+
+/*
+ Character positions of recently drawn lines.
+
+ Drawing a line, placing the cursor in it and finding the character under
+ the mouse all need the horizontal position of its characters, which used
+ to be measured with the font system again each time. The layout of a line
+ is the right edge of the character of each of its bytes, relative to the
+ start of the line; it is kept in a small table indexed by the position of
+ the line in the buffer, and reused as long as the text and the style
+ bytes of the line did not change. Tabs are stops relative to the start of
+ the line, so that the layout does not depend on horizontal scrolling, and
+ the layout of a line also answers for any shorter part of it.
+
+ Everything else the widths depend on (fonts, style table, tab distance)
+ is compared once per lookup, and the whole table is dropped when any of
+ it changed.
+ */
+class Fl_Text_Layout {
+public:
+  struct Line {
+    int pos;          // buffer position of the line, -1 if the slot is unused
+    int len;          // number of bytes measured
+    int size;         // allocated size of text, style and right
+    char *text;       // copy of the text of the line
+    char *style;      // copy of the style bytes, or NULL without a style buffer
+    int *right;       // right edge of the character of each byte
+  };
+
+  Fl_Text_Layout() : mLines(0), mCount(0), mFont(0), mSize(0), mStyleTable(0),
+    mNStyles(0), mStyles(0), mTab(0) {}
+  ~Fl_Text_Layout() { clear(); free(mLines); }
+
+  const Line *get(const Fl_Text_Display *d, int pos, int len, const char *text);
+  void clear();
+
+private:
+  void measure(const Fl_Text_Display *d, Line &line, const char *text);
+  static char *style_range(const Fl_Text_Display *d, int start, int end) {
+    if (d->mHighlight) return d->mHighlight->style_range(d->mBuffer, start, end);
+    return d->mStyleBuffer->text_range(start, end);
+  }
+
+  Line *mLines;       // hash table of lines, indexed by their position
+  int mCount;         // size of the table, a power of two
+  // settings the layouts were measured with
+  Fl_Font mFont;
+  Fl_Fontsize mSize;
+  const Fl_Text_Display::Style_Table_Entry *mStyleTable;
+  int mNStyles;
+  const void *mStyles;  // style buffer or highlighter
+  int mTab;
+};
+
+/*
+ Forget all layouts.
+ */
+void Fl_Text_Layout::clear() {
+  for (int i = 0; i < mCount; i++) {
+    Line &line = mLines[i];
+    free(line.text);
+    free(line.style);
+    free(line.right);
+    line.pos = -1;
+    line.len = line.size = 0;
+    line.text = line.style = 0;
+    line.right = 0;
+  }
+}
+
+/*
+ Return the layout of the first len bytes of the line at pos, whose text
+ is given, measuring it if it is not known yet.
+ */
+const Fl_Text_Layout::Line *Fl_Text_Layout::get(const Fl_Text_Display *d, int pos,
+                                                int len, const char *text) {
+  int tab = (int)d->col_to_x(d->mBuffer->tab_distance());
+  if (tab < 1) tab = 1;
+  const void *styles = d->mHighlight ? (const void *)d->mHighlight : (const void *)d->mStyleBuffer;
+  if (mFont != d->textfont() || mSize != d->textsize() || mStyleTable != d->mStyleTable ||
+      mNStyles != d->mNStyles || mStyles != styles || mTab != tab) {
+    clear();
+    mFont = d->textfont();
+    mSize = d->textsize();
+    mStyleTable = d->mStyleTable;
+    mNStyles = d->mNStyles;
+    mStyles = styles;
+    mTab = tab;
+  }
+  // keep twice as many lines as are visible, so that collisions are rare
+  int count = 64;
+  while (count < 2 * d->mNVisibleLines) count *= 2;
+  if (count > mCount) {
+    clear();
+    mLines = (Line *)realloc(mLines, count * sizeof(Line));
+    memset(mLines + mCount, 0, (count - mCount) * sizeof(Line));
+    for (int i = mCount; i < count; i++) mLines[i].pos = -1;
+    mCount = count;
+  }
+  Line &line = mLines[((unsigned)pos * 2654435761U) >> 7 & (mCount - 1)];
+
+  char *style = 0;
+  int valid = line.pos == pos && line.len >= len && !memcmp(line.text, text, len);
+  if (valid && mStyles) {
+    // the style bytes may have changed without a modification of the text
+    style = style_range(d, pos, pos + len);
+    if (d->mStyleBuffer && d->mUnfinishedHighlightCB && memchr(style, d->mUnfinishedStyle, len))
+      valid = 0;          // measure it again so that it is highlighted first
+    else
+      valid = !memcmp(line.style, style, len);
+    free(style);
+  }
+  if (valid) return &line;
+
+  if (len > line.size) {
+    free(line.text);
+    free(line.style);
+    free(line.right);
+    line.size = len + 64;
+    line.text = (char *)malloc(line.size);
+    line.style = mStyles ? (char *)malloc(line.size) : 0;
+    line.right = (int *)malloc(line.size * sizeof(int));
+  }
+  line.pos = pos;
+  line.len = len;
+  memcpy(line.text, text, len);
+  measure(d, line, text);
+  if (mStyles) {
+    // copy the style bytes after measuring, which may have highlighted them
+    style = style_range(d, pos, pos + len);
+    memcpy(line.style, style, len);
+    free(style);
+  }
+  return &line;
+}
+
+/*
+ Measure the characters of a line. Runs of characters of the same font
+ are measured as one segment, as they are drawn.
+ */
+void Fl_Text_Layout::measure(const Fl_Text_Display *d, Line &line, const char *text) {
+  int pos = line.pos, len = line.len, *right = line.right;
+  int i = 0, x = 0;
+  while (i < len) {
+    if (text[i] == '\t') {
+      x = ((x / mTab) + 1) * mTab;
+      right[i++] = x;
+      continue;
+    }
+    int style = d->position_style(pos, len, i) & STYLE_LOOKUP_MASK;
+    d->string_width(text + i, 0, style); // selects the font of the segment
+    double w = 0.0;
+    int start = i;
+    while (i < len && text[i] != '\t' &&
+           (i == start || (d->position_style(pos, len, i) & STYLE_LOOKUP_MASK) == style)) {
+      int cl = fl_utf8len1(text[i]);
+      if (cl <= 0) cl = 1;
+      if (cl > len - i) cl = len - i;
+      w += fl_width(text + i, cl);
+      for (int j = 0; j < cl; j++)
+        right[i++] = x + int(w);
+    }
+    x += int(w);
+  }
+}
+/* Approximate size of the blocks of text whose wrapped lines are counted at once */
+#define FL_TEXT_WRAP_BLOCK 65536
+
+/*
+ Number of wrapped lines of the buffer in continuous wrap mode.
+
+ Counting the wrapped lines of a buffer means measuring all of its text,
+ which froze the widget for seconds on large files whenever it was resized
+ or its wrap mode changed. The buffer is divided into blocks of whole lines
+ of about FL_TEXT_WRAP_BLOCK bytes, and the wrapped lines of each block are
+ counted separately: the block shown at the top of the display right away,
+ the others at idle time, in small slices. Until a block is counted, its
+ lines are estimated from its newlines and the ratio of wrapped lines to
+ newlines of the blocks counted so far, and the scrollbar uses the estimate.
+
+ Modifications of the buffer update the lines of the blocks they touch with
+ the change computed by buffer_modified_cb(), so that editing never needs
+ a recount; blocks that grow too large are split when they are counted.
+ */
+class Fl_Text_Wrap_Count {
+public:
+  Fl_Text_Wrap_Count(Fl_Text_Display *d);
+  ~Fl_Text_Wrap_Count();
+
+  void restart();
+  void modified(int pos, int nInserted, int nDeleted, int newlinesInserted,
+                int newlinesDeleted, int linesDelta);
+  int exact() const;
+
+private:
+  struct Block {
+    int length;       // size in bytes, blocks end after a newline or at the end of the buffer
+    int newlines;     // number of newlines
+    int lines;        // number of wrapped lines, -1 if not counted yet
+  };
+
+  double ratio() const;
+  int total() const;
+  int lines_before(int pos) const;
+  void count(int i, int start);
+  void update();
+  void insert(int i, const Block &b);
+  void remove(int i, int n);
+  static void idle_cb(void *data);
+
+  Fl_Text_Display *mDisplay;
+  Block *mBlocks;
+  int mCount, mAlloc;
+};
+
+/*
+ Divide the buffer of the display into blocks.
+ */
+Fl_Text_Wrap_Count::Fl_Text_Wrap_Count(Fl_Text_Display *d)
+: mDisplay(d), mBlocks(0), mCount(0), mAlloc(0) {
+  Fl_Text_Buffer *buf = d->buffer();
+  int len = buf->length();
+  for (int pos = 0; pos < len; ) {
+    int end = pos + FL_TEXT_WRAP_BLOCK;
+    end = end >= len ? len : min(buf->line_end(end) + 1, len);
+    Block b = { end - pos, buf->count_lines(pos, end), -1 };
+    insert(mCount, b);
+    pos = end;
+  }
+}
+
+Fl_Text_Wrap_Count::~Fl_Text_Wrap_Count() {
+  Fl::remove_idle(idle_cb, this);
+  free(mBlocks);
+}
+
+void Fl_Text_Wrap_Count::insert(int i, const Block &b) {
+  if (mCount == mAlloc) {
+    mAlloc = mAlloc ? 2 * mAlloc : 64;
+    mBlocks = (Block *)realloc(mBlocks, mAlloc * sizeof(Block));
+  }
+  memmove(mBlocks + i + 1, mBlocks + i, (mCount - i) * sizeof(Block));
+  mBlocks[i] = b;
+  mCount++;
+}
+
+void Fl_Text_Wrap_Count::remove(int i, int n) {
+  memmove(mBlocks + i, mBlocks + i + n, (mCount - i - n) * sizeof(Block));
+  mCount -= n;
+}
+
+/*
+ Return true if the lines of all blocks are counted.
+ */
+int Fl_Text_Wrap_Count::exact() const {
+  for (int i = 0; i < mCount; i++)
+    if (mBlocks[i].lines < 0) return 0;
+  return 1;
+}
+
+/*
+ Return the average number of wrapped lines per newline of the counted blocks.
+ */
+double Fl_Text_Wrap_Count::ratio() const {
+  double lines = 0.0, newlines = 0.0;
+  for (int i = 0; i < mCount; i++)
+    if (mBlocks[i].lines >= 0) {
+      lines += mBlocks[i].lines;
+      newlines += mBlocks[i].newlines;
+    }
+  return (lines > newlines && newlines > 0.0) ? lines / newlines : 1.0;
+}
+
+/*
+ Return the number of wrapped lines of the buffer, estimated if not all
+ blocks are counted.
+ */
+int Fl_Text_Wrap_Count::total() const {
+  double r = ratio(), lines = 0.0;
+  for (int i = 0; i < mCount; i++)
+    lines += mBlocks[i].lines >= 0 ? mBlocks[i].lines : mBlocks[i].newlines * r;
+  return int(lines + 0.5);
+}
+
+/*
+ Return the number of wrapped lines before pos, estimated for the blocks
+ before the one containing pos, and counted within that block.
+ */
+int Fl_Text_Wrap_Count::lines_before(int pos) const {
+  double r = ratio(), lines = 0.0;
+  int i, start = 0;
+  for (i = 0; i < mCount && start + mBlocks[i].length <= pos; start += mBlocks[i++].length)
+    lines += mBlocks[i].lines >= 0 ? mBlocks[i].lines : mBlocks[i].newlines * r;
+  return int(lines + 0.5) + (pos > start ? mDisplay->count_lines(start, pos, true) : 0);
+}
+
+/*
+ Count the wrapped lines of block i, which starts at start. Large blocks are
+ split first, and only their first part is counted.
+ */
+void Fl_Text_Wrap_Count::count(int i, int start) {
+  Fl_Text_Buffer *buf = mDisplay->buffer();
+  int end = start + mBlocks[i].length;
+  if (mBlocks[i].length > 2 * FL_TEXT_WRAP_BLOCK) {
+    int split = buf->line_end(start + FL_TEXT_WRAP_BLOCK) + 1;
+    if (split < end) {
+      Block rest = { end - split, buf->count_lines(split, end), -1 };
+      mBlocks[i].length = split - start;
+      mBlocks[i].newlines -= rest.newlines;
+      insert(i + 1, rest);
+      end = split;
+    }
+  }
+  mBlocks[i].lines = mDisplay->count_lines(start, end, true);
+}
+
+/*
+ Update the line count and the top line number of the display.
+ */
+void Fl_Text_Wrap_Count::update() {
+  Fl_Text_Display *d = mDisplay;
+  d->mNBufferLines = total();
+  d->mTopLineNum = lines_before(d->mFirstChar) + 1;
+}
+
+/*
+ Count the wrapped lines again, after a change of the wrap width. The
+ lines of the block at the top of the display are counted right away, and
+ the others at idle time.
+ */
+void Fl_Text_Wrap_Count::restart() {
+  Fl_Text_Display *d = mDisplay;
+  int i, start = 0;
+  for (i = 0; i < mCount; i++)
+    mBlocks[i].lines = -1;
+  d->mFirstChar = d->line_start(d->mFirstChar);
+  for (i = 0; i < mCount - 1 && start + mBlocks[i].length <= d->mFirstChar; i++)
+    start += mBlocks[i].length;
+  if (i < mCount) count(i, start);
+  update();
+  if (!exact() && !Fl::has_idle(idle_cb, this))
+    Fl::add_idle(idle_cb, this);
+}
+
+/*
+ Update the blocks after a modification of the buffer: the blocks that
+ contain the modified text are merged, and their lines are updated by the
+ number of wrapped lines inserted and deleted.
+ */
+void Fl_Text_Wrap_Count::modified(int pos, int nInserted, int nDeleted,
+                                  int newlinesInserted, int newlinesDeleted,
+                                  int linesDelta) {
+  if (!mCount) {
+    Block b = { 0, 0, 0 };
+    insert(0, b);
+  }
+  int b = 0, start = 0;
+  while (b < mCount - 1 && start + mBlocks[b].length <= pos)
+    start += mBlocks[b++].length;
+  int e = b, end = start + mBlocks[b].length;
+  while (e < mCount - 1 && end <= pos + nDeleted)
+    end += mBlocks[++e].length;
+
+  Block m = { nInserted - nDeleted, newlinesInserted - newlinesDeleted, linesDelta };
+  int counted = 1;
+  for (int i = b; i <= e; i++) {
+    m.length += mBlocks[i].length;
+    m.newlines += mBlocks[i].newlines;
+    m.lines += mBlocks[i].lines;
+    if (mBlocks[i].lines < 0) counted = 0;
+  }
+  if (!counted || m.length > 2 * FL_TEXT_WRAP_BLOCK) m.lines = -1;
+  mBlocks[b] = m;
+  remove(b + 1, e - b);
+  if (!m.length && mCount > 1) remove(b, 1);
+
+  if (m.lines < 0 && !Fl::has_idle(idle_cb, this))
+    Fl::add_idle(idle_cb, this);
+}
+
+/*
+ Count the lines of a few blocks, those on display first.
+ */
+void Fl_Text_Wrap_Count::idle_cb(void *data) {
+  Fl_Text_Wrap_Count *w = (Fl_Text_Wrap_Count *)data;
+  Fl_Text_Display *d = w->mDisplay;
+  for (int budget = 4 * FL_TEXT_WRAP_BLOCK; budget > 0; ) {
+    int i, start, next = -1, nextStart = 0;
+    for (i = 0, start = 0; i < w->mCount; start += w->mBlocks[i++].length) {
+      if (w->mBlocks[i].lines >= 0) continue;
+      if (next < 0) {
+        next = i;
+        nextStart = start;
+      }
+      if (start <= d->mLastChar && start + w->mBlocks[i].length > d->mFirstChar) {
+        next = i;
+        nextStart = start;
+        break;
+      }
+    }
+    if (next < 0) break;
+    budget -= min(w->mBlocks[next].length, 2 * FL_TEXT_WRAP_BLOCK);
+    w->count(next, nextStart);
+  }
+  w->update();
+  d->update_v_scrollbar();
+  if (w->exact())
+    Fl::remove_idle(idle_cb, data);
+}
+#endif // FLTK_ABI_VERSION >= 10304
+
+
 /**
  \brief Creates a new text display widget.
 
@@ -160,6 +851,11 @@ Fl_Text_Display::Fl_Text_Display(int X, int Y, int W, int H, const char* l)
   linenumber_align_   = FL_ALIGN_RIGHT;
   linenumber_format_  = strdup("%d");
 #endif
+#if FLTK_ABI_VERSION >= 10304
+  mLayout = 0;
+  mWrapCount = 0;
+  mHighlight = 0;
+#endif
 }
 
 
@@ -186,6 +882,11 @@ Fl_Text_Display::~Fl_Text_Display() {
     linenumber_format_ = 0;
   }
 #endif
+#if FLTK_ABI_VERSION >= 10304
+  delete mLayout;
+  delete mWrapCount;
+  delete mHighlight;
+#endif
 }
 
 
@@ -372,6 +1073,11 @@ void Fl_Text_Display::buffer( Fl_Text_Buffer *buf ) {
   /* If the text display is already displaying a buffer, clear it off
    of the display and remove our callback from it */
   if ( buf == mBuffer) return;
+#if FLTK_ABI_VERSION >= 10304
+  delete mWrapCount;
+  mWrapCount = 0;
+  if (mHighlight) mHighlight->clear();
+#endif
   if ( mBuffer != 0 ) {
     // we must provide a copy of the buffer that we are deleting!
     char *deletedText = mBuffer->text();
@@ -431,6 +1137,10 @@ void Fl_Text_Display::highlight_data(Fl_Text_Buffer *styleBuffer,
                                      int nStyles, char unfinishedStyle,
                                      Unfinished_Style_Cb unfinishedHighlightCB,
                                      void *cbArg ) {
+#if FLTK_ABI_VERSION >= 10304
+  delete mHighlight;
+  mHighlight = 0;
+#endif
   mStyleBuffer = styleBuffer;
   mStyleTable = styleTable;
   mNStyles = nStyles;
@@ -438,12 +1148,69 @@ void Fl_Text_Display::highlight_data(Fl_Text_Buffer *styleBuffer,
   mUnfinishedHighlightCB = unfinishedHighlightCB;
   mHighlightCBArg = cbArg;
   mColumnScale = 0;
+#if FLTK_ABI_VERSION >= 10304
+  // the style table may have been changed in place
+  if (mLayout) mLayout->clear();
+#endif
 
   mStyleBuffer->canUndo(0);
   damage(FL_DAMAGE_EXPOSE);
 }
 
 
+#if FLTK_ABI_VERSION >= 10304
+/**
+ \brief Attach (or remove) a tokenizer that highlights the text.
+
+ This is an alternative to a style buffer that does not need the
+ application to keep the styles of the whole text up to date. The
+ tokenizer is called to style one line of text at a time, starting with
+ the state at the end of the previous line, only for the lines that are
+ displayed, and again when they are modified. Only the styles of recently
+ displayed lines are kept, as runs of the same style, and the state of
+ the tokenizer every few kilobytes of text, so that typing only restyles
+ the modified lines, and the lines below them if their state changed.
+
+ \code
+   // C comments, which continue on the next line
+   int tokenize(const char *text, int length, int state, char *styles, void *) {
+     for (int i = 0; i < length; i++) {
+       if (!state && text[i] == '/' && text[i + 1] == '*') state = 1;
+       styles[i] = state ? 'B' : 'A';
+       if (state && i > 1 && text[i - 1] == '*' && text[i] == '/') state = 0;
+     }
+     return state;
+   }
+   ...
+   display->highlight_data(tokenize, styletable, 2);
+ \endcode
+
+ \param tokenizer the tokenizer, NULL to remove highlighting
+ \param styleTable a list of styles indexed by the style characters returned
+   by the tokenizer ('A' for the first entry)
+ \param nStyles number of styles in the style table
+ \param cbArg an argument for the tokenizer
+ \see Tokenizer_Cb
+ */
+void Fl_Text_Display::highlight_data(Tokenizer_Cb tokenizer,
+                                     const Style_Table_Entry *styleTable,
+                                     int nStyles, void *cbArg) {
+  delete mHighlight;
+  mHighlight = tokenizer ? new Fl_Text_Highlight(tokenizer, cbArg) : 0;
+  mStyleBuffer = 0;
+  mStyleTable = styleTable;
+  mNStyles = nStyles;
+  mUnfinishedStyle = 0;
+  mUnfinishedHighlightCB = 0;
+  mHighlightCBArg = 0;
+  mColumnScale = 0;
+  if (mLayout) mLayout->clear();
+
+  damage(FL_DAMAGE_EXPOSE);
+}
+#endif
+
+
 
 /**
  \brief Find the longest line of all visible lines.
@@ -505,9 +1272,14 @@ void Fl_Text_Display::resize(int X, int Y, int W, int H) {
      the top character no longer pointing at a valid line start */
     if (mContinuousWrap && !mWrapMarginPix && (W!=oldWidth || text_area.w!=oldTAWidth)) {
       int oldFirstChar = mFirstChar;
+#if FLTK_ABI_VERSION >= 10304
+      if (!mWrapCount) mWrapCount = new Fl_Text_Wrap_Count(this);
+      mWrapCount->restart();
+#else
       mNBufferLines = count_lines(0, buffer()->length(), true);
       mFirstChar = line_start(mFirstChar);
       mTopLineNum = count_lines(0, mFirstChar, true)+1;
+#endif
       absolute_top_line_number(oldFirstChar);
 #ifdef DEBUG
       printf("    mNBufferLines=%d\n", mNBufferLines);
@@ -870,15 +1642,31 @@ void Fl_Text_Display::wrap_mode(int wrap, int wrapMargin) {
       break;
   }
 
+#if FLTK_ABI_VERSION >= 10304
+  if (!mContinuousWrap) {
+    delete mWrapCount;
+    mWrapCount = 0;
+  }
+#endif
+
   if (buffer()) {
-    /* wrapping can change the total number of lines, re-count */
-    mNBufferLines = count_lines(0, buffer()->length(), true);
+#if FLTK_ABI_VERSION >= 10304
+    /* in wrapped mode, the lines are counted in the background */
+    if (mContinuousWrap) {
+      if (!mWrapCount) mWrapCount = new Fl_Text_Wrap_Count(this);
+      mWrapCount->restart();
+    } else
+#endif
+    {
+      /* wrapping can change the total number of lines, re-count */
+      mNBufferLines = count_lines(0, buffer()->length(), true);
 
-    /* changing wrap margins or changing from wrapped mode to non-wrapped
-     can leave the character at the top no longer at a line start, and/or
-     change the line number */
-    mFirstChar = line_start(mFirstChar);
-    mTopLineNum = count_lines(0, mFirstChar, true) + 1;
+      /* changing wrap margins or changing from wrapped mode to non-wrapped
+       can leave the character at the top no longer at a line start, and/or
+       change the line number */
+      mFirstChar = line_start(mFirstChar);
+      mTopLineNum = count_lines(0, mFirstChar, true) + 1;
+    }
 
     reset_absolute_top_line_number();
 
@@ -897,6 +1685,22 @@ void Fl_Text_Display::wrap_mode(int wrap, int wrapMargin) {
 }
 
 
+#if FLTK_ABI_VERSION >= 10304
+/**
+ \brief Returns whether the number of lines is exact.
+
+ In continuous wrap mode, the wrapped lines of large buffers are counted
+ in the background after the wrap mode or the width of the widget changed.
+ Until all of them are counted, the number of lines, which sizes the
+ vertical scrollbar, is estimated.
+
+ \return 1 if the number of lines is exact, 0 if it is an estimate
+ */
+int Fl_Text_Display::line_count_exact() const {
+  return !mWrapCount || mWrapCount->exact();
+}
+#endif
+
 
 /**
  \brief Inserts "text" at the current cursor location.
@@ -1618,6 +2422,14 @@ void Fl_Text_Display::buffer_modified_cb( int pos, int nInserted, int nDeleted,
   if ( nInserted != 0 || nDeleted != 0 )
     textD->mCursorPreferredXPos = -1;
 
+#if FLTK_ABI_VERSION >= 10304
+  /* Forget the styles of the tokenizer that the modification changed before
+   anything is measured */
+  int restyled = 0;
+  if ( textD->mHighlight && ( nInserted != 0 || nDeleted != 0 ) )
+    restyled = textD->mHighlight->modified(buf, pos, nInserted, nDeleted, deletedText);
+#endif
+
   /* Count the number of lines inserted and deleted, and in the case
    of continuous wrap mode, how much has changed */
   if (textD->mContinuousWrap) {
@@ -1654,6 +2466,13 @@ void Fl_Text_Display::buffer_modified_cb( int pos, int nInserted, int nDeleted,
 
   /* Update the line count for the whole buffer */
   textD->mNBufferLines += linesInserted - linesDeleted;
+#if FLTK_ABI_VERSION >= 10304
+  if (textD->mWrapCount && (nInserted != 0 || nDeleted != 0))
+    textD->mWrapCount->modified(pos, nInserted, nDeleted,
+                                nInserted == 0 ? 0 : buf->count_lines(pos, pos + nInserted),
+                                nDeleted == 0 ? 0 : countlines(deletedText),
+                                linesInserted - linesDeleted);
+#endif
 
   /* Update the cursor position */
   if ( textD->mCursorToHint != NO_HINT ) {
@@ -1731,6 +2550,12 @@ void Fl_Text_Display::buffer_modified_cb( int pos, int nInserted, int nDeleted,
    text).  Extend the redraw range to incorporate style changes */
   if ( textD->mStyleBuffer )
     textD->extend_range_for_styles( &startDispPos, &endDispPos );
+#if FLTK_ABI_VERSION >= 10304
+  /* If the state of the tokenizer at the end of the modified lines changed,
+   the lines below them may have changed style too */
+  if ( restyled )
+    endDispPos = buf->length();
+#endif
   IS_UTF8_ALIGNED2(buf, startDispPos)
   IS_UTF8_ALIGNED2(buf, endDispPos)
 
@@ -1930,6 +2755,66 @@ int Fl_Text_Display::handle_vline(
   }
 
   char currChar = 0, prevChar = 0;
+#if FLTK_ABI_VERSION >= 10304
+  if (!mLayout) mLayout = new Fl_Text_Layout;
+  const int *right = mLayout->get(this, lineStartPos, lineLen, lineStr)->right;
+  int lineWidth = lineLen ? right[lineLen-1] : 0;
+
+  if (mode==GET_WIDTH) {
+    free(lineStr);
+    return lineWidth;
+  }
+  if (mode==FIND_INDEX) {
+    // find the first character that ends right of the given position
+    int lo = 0, hi = lineLen;
+    while (lo < hi) {
+      int mid = (lo + hi) / 2;
+      if (startX + right[mid] > rightClip) hi = mid;
+      else lo = mid + 1;
+    }
+    free(lineStr);
+    IS_UTF8_ALIGNED2(buffer(), (lineStartPos+lo))
+    return lineStartPos + lo;
+  }
+
+  // draw a segment whenever the style changes or a Tab is found, skipping
+  // the segments that are scrolled out of view
+  int segX = 0;
+  style = position_style(lineStartPos, lineLen, 0);
+  charStyle = style;
+  for (i=0; i<=lineLen; ) {
+    if (i<lineLen) {
+      currChar = lineStr[i];
+      charStyle = position_style(lineStartPos, lineLen, i);
+    }
+    if (i==lineLen || (i>0 && (charStyle!=style || currChar=='\t' || prevChar=='\t'))) {
+      int toX = i>0 ? right[i-1] : 0;
+      if (i>0 && startX+toX >= leftClip-LEFT_MARGIN && startX+segX-RIGHT_MARGIN <= rightClip) {
+        if (prevChar=='\t')
+          draw_string( style|BG_ONLY_MASK, startX+segX, Y, startX+toX, 0, 0 );
+        else
+          draw_string( style, startX+segX, Y, startX+toX, lineStr+startIndex, i-startIndex );
+      }
+      if (i==lineLen) break;
+      style = charStyle;
+      segX = toX;
+      startIndex = i;
+    }
+    int len = fl_utf8len1(currChar);
+    if (len<=0) len = 1; // OUCH!
+    i += len;
+    if (i>lineLen) i = lineLen;
+    prevChar = currChar;
+  }
+
+  // clear the rest of the line
+  style = position_style(lineStartPos, lineLen, lineLen);
+  draw_string( style|BG_ONLY_MASK, startX+lineWidth, Y, text_area.x+text_area.w, lineStr, lineLen );
+
+  free(lineStr);
+  IS_UTF8_ALIGNED2(buffer(), (lineStartPos+lineLen))
+  return lineStartPos + lineLen;
+#else
   // draw the line
   style = position_style(lineStartPos, lineLen, 0);
   for (i=0; i<lineLen; ) {
@@ -2011,6 +2896,7 @@ int Fl_Text_Display::handle_vline(
   free(lineStr);
   IS_UTF8_ALIGNED2(buffer(), (lineStartPos+lineLen))
   return lineStartPos + lineLen;
+#endif // FLTK_ABI_VERSION >= 10304
 }
 
 
@@ -2374,6 +3260,10 @@ int Fl_Text_Display::position_style( int lineStartPos, int lineLen, int lineInde
       style = (unsigned char) styleBuf->byte_at( pos);
     }
   }
+#if FLTK_ABI_VERSION >= 10304
+  else if ( mHighlight )
+    style = mHighlight->style_at(buf, pos);
+#endif
   if (buf->primary_selection()->includes(pos))
     style |= PRIMARY_MASK;
   if (buf->highlight_selection()->includes(pos))
@@ -3449,6 +4339,11 @@ double Fl_Text_Display::measure_proportional_character(const char *s, int xPix,
   if (mStyleBuffer) {
     style = mStyleBuffer->byte_at(pos);
   }
+#if FLTK_ABI_VERSION >= 10304
+  else if (mHighlight) {
+    style = mHighlight->style_at(mBuffer, pos);
+  }
+#endif
   return string_width(s, charLen, style);
 }
 
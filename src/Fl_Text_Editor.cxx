@@ -133,6 +133,10 @@ static struct {
 //{ FL_Clear,	  0,                        Fl_Text_Editor::delete_to_eol },
   { 'z',          FL_CTRL,                  Fl_Text_Editor::kf_undo	  },
   { '/',          FL_CTRL,                  Fl_Text_Editor::kf_undo	  },
+#if FLTK_ABI_VERSION >= 10304
+  { 'z',          FL_CTRL|FL_SHIFT,         Fl_Text_Editor::kf_redo       },
+  { 'y',          FL_CTRL,                  Fl_Text_Editor::kf_redo       },
+#endif
   { 'x',          FL_CTRL,                  Fl_Text_Editor::kf_cut        },
   { FL_Delete,    FL_SHIFT,                 Fl_Text_Editor::kf_cut        },
   { 'c',          FL_CTRL,                  Fl_Text_Editor::kf_copy       },
@@ -144,6 +148,9 @@ static struct {
 #ifdef __APPLE__
   // Define CMD+key accelerators...
   { 'z',          FL_COMMAND,               Fl_Text_Editor::kf_undo       },
+#if FLTK_ABI_VERSION >= 10304
+  { 'z',          FL_COMMAND|FL_SHIFT,      Fl_Text_Editor::kf_redo       },
+#endif
   { 'x',          FL_COMMAND,               Fl_Text_Editor::kf_cut        },
   { 'c',          FL_COMMAND,               Fl_Text_Editor::kf_copy       },
   { 'v',          FL_COMMAND,               Fl_Text_Editor::kf_paste      },
@@ -510,7 +517,7 @@ int Fl_Text_Editor::kf_select_all(int, Fl_Text_Editor* e) {
 int Fl_Text_Editor::kf_undo(int , Fl_Text_Editor* e) {
   e->buffer()->unselect();
   Fl::copy("", 0, 0);
-  int crsr;
+  int crsr = e->insert_position();
   int ret = e->buffer()->undo(&crsr);
   e->insert_position(crsr);
   e->show_insert_position();
@@ -519,6 +526,24 @@ int Fl_Text_Editor::kf_undo(int , Fl_Text_Editor* e) {
   return ret;
 }
 
+/**  Redo the last undone edit in the current buffer. Also deselect previous selection. */
+int Fl_Text_Editor::kf_redo(int , Fl_Text_Editor* e) {
+#if FLTK_ABI_VERSION >= 10304
+  e->buffer()->unselect();
+  Fl::copy("", 0, 0);
+  int crsr = e->insert_position();
+  int ret = e->buffer()->redo(&crsr);
+  e->insert_position(crsr);
+  e->show_insert_position();
+  e->set_changed();
+  if (e->when()&FL_WHEN_CHANGED) e->do_callback();
+  return ret;
+#else
+  (void)e;
+  return 0;
+#endif
+}
+
 /** Handles a key press in the editor */
 int Fl_Text_Editor::handle_key() {
   // Call FLTK's rules to try to turn this into a printing character.
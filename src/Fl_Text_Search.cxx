@@ -0,0 +1,474 @@
+//
+// "$Id$"
+//
+// Search engine for Fl_Text_Buffer for the Fast Light Tool Kit (FLTK).
+//
+// Copyright 2001-2016 by Bill Spitzak and others.
+//
+// This library is free software. Distribution and use rights are outlined in
+// the file "COPYING" which should have been included with this file.  If this
+// file is missing or damaged, see the license at:
+//
+//     http://www.fltk.org/COPYING.php
+//
+// Please report all bugs and problems on the following page:
+//
+//     http://www.fltk.org/str.php
+//
+
+#include <config.h>
+#include <FL/Fl_Text_Search.H>
+#include <FL/Fl_Text_Buffer.H>
+#include <FL/fl_utf8.h>
+#include "flstring.h"
+#include <stdlib.h>
+#if HAVE_REGEX_H
+#  include <sys/types.h>
+#  include <regex.h>
+#endif
+
+/*
+ Byte access to the text of a buffer: the contiguous bytes around the last
+ position read start at seg, from segStart to segEnd.
+ */
+struct Fl_Text_Bytes {
+  const Fl_Text_Buffer *buf;
+  const unsigned char *seg;
+  int segStart, segEnd;
+  Fl_Text_Bytes(const Fl_Text_Buffer *b) {
+    buf = b;
+    seg = NULL;
+    segStart = segEnd = 0;
+  }
+  unsigned char operator[](int pos) {
+    if (pos < segStart || pos >= segEnd) {
+      segStart = buf->segment_start(pos);
+      segEnd = buf->segment_end(pos);
+      seg = (const unsigned char *)buf->address(segStart);
+    }
+    return seg[pos - segStart];
+  }
+};
+
+// Bit set operations on the byte sets of the pattern positions
+#define BYTE_IN_SET(set, b) ((set)[(b) >> 3] & (1 << ((b) & 7)))
+#define ADD_BYTE_TO_SET(set, b) ((set)[(b) >> 3] |= (unsigned char)(1 << ((b) & 7)))
+
+
+/**
+ Creates a search engine and sets its pattern.
+ \see pattern(const char*, int)
+ */
+Fl_Text_Search::Fl_Text_Search(const char *p, int f)
+{
+  mPattern = NULL;
+  mBytes = NULL;
+  mRegex = NULL;
+  mLine = NULL;
+  mLineSize = 0;
+  mLength = 0;
+  mFlags = 0;
+  pattern(p, f);
+}
+
+
+/**
+ Frees the search pattern and its tables.
+ */
+Fl_Text_Search::~Fl_Text_Search()
+{
+  clear();
+  free(mLine);
+}
+
+
+/*
+ Forget the current pattern.
+ */
+void Fl_Text_Search::clear()
+{
+  free(mPattern);
+  mPattern = NULL;
+  free(mBytes);
+  mBytes = NULL;
+#if HAVE_REGEX_H
+  if (mRegex) {
+    regfree((regex_t *)mRegex);
+    delete (regex_t *)mRegex;
+  }
+#endif
+  mRegex = NULL;
+  mLength = 0;
+  mFlags = 0;
+}
+
+
+/**
+ Sets the search pattern.
+
+ The pattern is a UTF-8 string that is matched literally, unless \p flags
+ contains REGEX. Characters are matched regardless of their case, unless
+ \p flags contains MATCH_CASE.
+
+ The skip tables, or the compiled regular expression, are computed here
+ once for all following searches.
+
+ \param pattern UTF-8 encoded search pattern, or NULL to clear the pattern
+ \param flags any combination of MATCH_CASE and REGEX
+ \return 0 on success, -1 if \p pattern is not a valid regular expression
+   or if regular expressions are not supported
+ */
+int Fl_Text_Search::pattern(const char *p, int f)
+{
+  clear();
+  if (!p)
+    return 0;
+  mPattern = strdup(p);
+  mLength = (int) strlen(p);
+  mFlags = f;
+
+  if (f & REGEX) {
+#if HAVE_REGEX_H
+    regex_t *re = new regex_t;
+    if (regcomp(re, p, REG_EXTENDED | ((f & MATCH_CASE) ? 0 : REG_ICASE)) == 0) {
+      mRegex = re;
+      return 0;
+    }
+    delete re;
+#endif
+    clear();
+    return -1;
+  }
+
+  if (!mLength)
+    return 0;
+
+  /* For each position in the pattern, find the set of bytes that may be
+   found there in a match. Case conversions do not change the length of the
+   UTF-8 encoding of characters, so positions in the pattern and in a match
+   correspond to each other. */
+  mBytes = (unsigned char (*)[32]) calloc(mLength, 32);
+  const char *end = p + mLength;
+  for (const char *s = p; s < end; ) {
+    int l, i;
+    unsigned c = fl_utf8decode(s, end, &l);
+    int pos = (int) (s - p);
+    for (i = 0; i < l; i++)
+      ADD_BYTE_TO_SET(mBytes[pos + i], (unsigned char)s[i]);
+    if (!(f & MATCH_CASE)) {
+      if (c < 0x80) {
+        // no other character than the upper and lower case ASCII letters
+        // converts to an ASCII letter
+        ADD_BYTE_TO_SET(mBytes[pos], fl_tolower(c));
+        ADD_BYTE_TO_SET(mBytes[pos], fl_toupper(c));
+      } else {
+        // accept any character of the same length, literal_match() does
+        // the case conversion of the candidates
+        for (i = 0x80; i < 0x100; i++) {
+          if (fl_utf8len1((char)i) == l)
+            ADD_BYTE_TO_SET(mBytes[pos], i);
+        }
+        for (int j = 1; j < l; j++)
+          for (i = 0x80; i < 0xc0; i++)
+            ADD_BYTE_TO_SET(mBytes[pos + j], i);
+      }
+    }
+    s += l;
+  }
+
+  /* Boyer-Moore-Horspool skip tables. When the window ending (starting) with
+   byte b does not match, it can be moved so that the last (first) position
+   of the pattern that accepts b comes over b. */
+  int b, j;
+  for (b = 0; b < 256; b++)
+    mShift[b] = mBackShift[b] = mLength;
+  for (j = 0; j < mLength - 1; j++)
+    for (b = 0; b < 256; b++)
+      if (BYTE_IN_SET(mBytes[j], b)) mShift[b] = mLength - 1 - j;
+  for (j = mLength - 1; j > 0; j--)
+    for (b = 0; b < 256; b++)
+      if (BYTE_IN_SET(mBytes[j], b)) mBackShift[b] = j;
+  return 0;
+}
+
+
+/*
+ Check if the pattern matches the text at pos exactly.
+ */
+int Fl_Text_Search::literal_match(const Fl_Text_Buffer *buf, int pos) const
+{
+  if (pos < 0 || pos + mLength > buf->length())
+    return 0;
+  Fl_Text_Bytes text(buf);
+  int i;
+  if (mFlags & MATCH_CASE) {
+    for (i = 0; i < mLength; i++)
+      if (text[pos + i] != (unsigned char)mPattern[i])
+        return 0;
+    return 1;
+  }
+  for (i = 0; i < mLength; ) {
+    int l = fl_utf8len1(mPattern[i]);
+    if (l < 1) l = 1;
+    if (fl_utf8len1(text[pos + i]) != l && l > 1)
+      return 0;
+    unsigned s = fl_utf8decode(mPattern + i, mPattern + mLength, 0);
+    unsigned c = buf->char_at(pos + i);
+    if (fl_tolower(c) != fl_tolower(s))
+      return 0;
+    i += l;
+  }
+  return 1;
+}
+
+
+/*
+ Return the first position between startPos and endPos where the pattern
+ matches, or -1.
+ */
+int Fl_Text_Search::literal_forward(const Fl_Text_Buffer *buf, int startPos, int endPos) const
+{
+  Fl_Text_Bytes text(buf);
+  int last = mLength - 1;
+  for (int pos = startPos; pos + mLength <= endPos; ) {
+    unsigned char c = text[pos + last];
+    if (BYTE_IN_SET(mBytes[last], c)) {
+      int j = last - 1;
+      while (j >= 0 && BYTE_IN_SET(mBytes[j], text[pos + j]))
+        j--;
+      if (j < 0 && literal_match(buf, pos))
+        return pos;
+    }
+    pos += mShift[c];
+  }
+  return -1;
+}
+
+
+/*
+ Return the last position before or at startPos where the pattern
+ matches, or -1.
+ */
+int Fl_Text_Search::literal_backward(const Fl_Text_Buffer *buf, int startPos) const
+{
+  Fl_Text_Bytes text(buf);
+  int pos = buf->length() - mLength;
+  if (startPos < pos)
+    pos = startPos;
+  while (pos >= 0) {
+    unsigned char c = text[pos];
+    if (BYTE_IN_SET(mBytes[0], c)) {
+      int j = 1;
+      while (j < mLength && BYTE_IN_SET(mBytes[j], text[pos + j]))
+        j++;
+      if (j == mLength && literal_match(buf, pos))
+        return pos;
+    }
+    pos -= mBackShift[c];
+  }
+  return -1;
+}
+
+
+#if HAVE_REGEX_H
+/*
+ Copy the text between start and end into a nul-terminated line buffer.
+ */
+static char *copy_line(const Fl_Text_Buffer *buf, int start, int end,
+                       char *&line, int &lineSize)
+{
+  if (end - start + 1 > lineSize) {
+    lineSize = end - start + 256;
+    line = (char *)realloc(line, lineSize);
+  }
+  buf->copy_bytes(line, start, end);
+  line[end - start] = 0;
+  return line;
+}
+#endif
+
+
+/*
+ Find the first match of the regular expression that starts at or after
+ startPos and ends before or at endPos.
+ */
+int Fl_Text_Search::regex_forward(const Fl_Text_Buffer *buf, int startPos, int endPos,
+                                  int *foundPos, int *foundEnd) const
+{
+#if HAVE_REGEX_H
+  int length = buf->length();
+  if (endPos > length) endPos = length;
+  int lineStart = buf->line_start(startPos);
+  int pos = startPos;
+  while (pos <= endPos) {
+    int lineEnd = buf->line_end(pos);
+    int eflags = (pos > lineStart) ? REG_NOTBOL : 0;
+    if (lineEnd > endPos) {
+      lineEnd = endPos;
+      eflags |= REG_NOTEOL;
+    }
+    char *line = copy_line(buf, pos, lineEnd, mLine, mLineSize);
+    regmatch_t match;
+    if (regexec((regex_t *)mRegex, line, 1, &match, eflags) == 0) {
+      *foundPos = pos + (int)match.rm_so;
+      if (foundEnd) *foundEnd = pos + (int)match.rm_eo;
+      return 1;
+    }
+    if (lineEnd >= endPos)
+      break;
+    lineStart = pos = lineEnd + 1;
+  }
+#endif
+  return 0;
+}
+
+
+/*
+ Find the last match of the regular expression that starts at or before
+ startPos.
+ */
+int Fl_Text_Search::regex_backward(const Fl_Text_Buffer *buf, int startPos,
+                                   int *foundPos, int *foundEnd) const
+{
+#if HAVE_REGEX_H
+  if (startPos > buf->length()) startPos = buf->length();
+  for (;;) {
+    int lineStart = buf->line_start(startPos);
+    int lineEnd = buf->line_end(startPos);
+    char *line = copy_line(buf, lineStart, lineEnd, mLine, mLineSize);
+    int found = -1, foundLast = 0;
+    // try all the starting positions of the line, since matches may overlap
+    for (int off = 0; off <= lineEnd - lineStart && lineStart + off <= startPos; ) {
+      regmatch_t match;
+      if (regexec((regex_t *)mRegex, line + off, 1, &match,
+                  off ? REG_NOTBOL : 0) != 0)
+        break;
+      int s = off + (int)match.rm_so;
+      if (lineStart + s > startPos)
+        break;
+      found = s;
+      foundLast = off + (int)match.rm_eo;
+      off = s + (line[s] ? fl_utf8len1(line[s]) : 1);
+      if (off < s + 1) off = s + 1;
+    }
+    if (found >= 0) {
+      *foundPos = lineStart + found;
+      if (foundEnd) *foundEnd = lineStart + foundLast;
+      return 1;
+    }
+    if (lineStart == 0)
+      break;
+    startPos = lineStart - 1;
+  }
+#endif
+  return 0;
+}
+
+
+/**
+ Searches forward in \p buf, starting at byte offset \p startPos.
+
+ \param buf the text buffer
+ \param startPos byte offset to start the search at
+ \param[out] foundPos byte offset of the first match
+ \param[out] foundEnd if not NULL, byte offset after the end of the match
+ \return 1 if found, 0 if not
+ */
+int Fl_Text_Search::forward(const Fl_Text_Buffer *buf, int startPos,
+                            int *foundPos, int *foundEnd) const
+{
+  if (!mPattern)
+    return 0;
+  if (startPos < 0)
+    startPos = 0;
+  if (mRegex)
+    return regex_forward(buf, startPos, buf->length(), foundPos, foundEnd);
+  int pos;
+  if (!mLength)
+    pos = (startPos < buf->length()) ? startPos : -1;
+  else
+    pos = literal_forward(buf, startPos, buf->length());
+  if (pos < 0)
+    return 0;
+  *foundPos = pos;
+  if (foundEnd) *foundEnd = pos + mLength;
+  return 1;
+}
+
+
+/**
+ Searches backward in \p buf for a match starting at or before byte
+ offset \p startPos.
+
+ \param buf the text buffer
+ \param startPos byte offset to start the search at
+ \param[out] foundPos byte offset of the match
+ \param[out] foundEnd if not NULL, byte offset after the end of the match
+ \return 1 if found, 0 if not
+ */
+int Fl_Text_Search::backward(const Fl_Text_Buffer *buf, int startPos,
+                             int *foundPos, int *foundEnd) const
+{
+  if (!mPattern || startPos < 0)
+    return 0;
+  if (mRegex)
+    return regex_backward(buf, startPos, foundPos, foundEnd);
+  int pos = mLength ? literal_backward(buf, startPos) : startPos;
+  if (pos < 0)
+    return 0;
+  *foundPos = pos;
+  if (foundEnd) *foundEnd = pos + mLength;
+  return 1;
+}
+
+
+/**
+ Finds all the matches between byte offsets \p start and \p end in one pass.
+
+ The callback \p cb is called for each match, in the order of the text,
+ with the start and end offsets of the match and \p data. Matches do not
+ overlap; empty matches of regular expressions are reported, but the
+ search goes on after the next character.
+
+ \param buf the text buffer
+ \param start, end range of the buffer to search
+ \param cb function called for each match
+ \param data user data passed to \p cb
+ \return the number of matches
+ */
+int Fl_Text_Search::find_all(const Fl_Text_Buffer *buf, int start, int end,
+                             Fl_Text_Search_Cb cb, void *data) const
+{
+  if (!mPattern || (!mLength && !mRegex))
+    return 0;
+  if (start < 0) start = 0;
+  if (end > buf->length()) end = buf->length();
+  int count = 0;
+  int pos = start;
+  while (pos <= end) {
+    int matchStart, matchEnd;
+    if (mRegex) {
+      if (!regex_forward(buf, pos, end, &matchStart, &matchEnd))
+        break;
+    } else {
+      matchStart = literal_forward(buf, pos, end);
+      if (matchStart < 0)
+        break;
+      matchEnd = matchStart + mLength;
+    }
+    count++;
+    if (cb)
+      cb(matchStart, matchEnd, data);
+    if (matchEnd > matchStart)
+      pos = matchEnd;
+    else if (matchStart < end)
+      pos = buf->next_char(matchStart);
+    else
+      break;
+  }
+  return count;
+}
+
+//
+// End of "$Id$".
+//
@@ -0,0 +1,745 @@
+//
+// "$Id$"
+//
+// Worker thread pool for the Fast Light Tool Kit (FLTK).
+//
+// Copyright 1998-2016 by Bill Spitzak and others.
+//
+// This library is free software. Distribution and use rights are outlined in
+// the file "COPYING" which should have been included with this file.  If this
+// file is missing or damaged, see the license at:
+//
+//     http://www.fltk.org/COPYING.php
+//
+// Please report all bugs and problems on the following page:
+//
+//     http://www.fltk.org/str.php
+//
+
+//
+// The tasks submitted by the main thread (or any thread that is not a
+// worker) go to a shared FIFO queue.  The tasks submitted by a task go to
+// the queue of its worker thread, which runs the newest of them first while
+// the other workers steal the oldest ones when they have nothing else to
+// do.  Every queued task is counted in ready_, and a worker first claims
+// one of them by decrementing ready_ and then looks for it in its own
+// queue, the shared queue and the other queues, in that order.
+//
+// Finished tasks are put on the done list, and the main thread is woken
+// up with a single Fl::awake() for any number of them, so the worker
+// threads never take the FLTK lock.  Tasks without a done function or an
+// owner are deleted by their worker instead.  Without thread support, or
+// if Fl::lock() was not called for the done functions, the main thread
+// runs the tasks in idle callbacks instead.
+//
+// fl_parallel_for() splits a loop between the calling thread and helper
+// tasks, for the image scaler.
+//
+
+#include <FL/Fl.H>
+#include <FL/Fl_Thread_Pool.H>
+#include <config.h>
+#include <stdlib.h>
+#include "fl_threads.h"
+
+#if defined(WIN32)
+#  include <windows.h>
+#  include <process.h>
+#elif defined(HAVE_PTHREAD)
+#  include <pthread.h>
+#  include <unistd.h>
+#endif
+
+struct Fl_Task {
+  Fl_Task		*next;		// Next task in the done list
+  Fl_Task		*prev_pending;	// Links in the list of all tasks
+  Fl_Task		*next_pending;
+  Fl_Task_Handler	work, done;	// Functions of the task and their data
+  void			*data;
+  Fl_Widget		*owner;		// Watched widget, NULL once deleted
+  int			has_owner;	// Was the task submitted with an owner?
+  volatile int		cancelled;	// Was the task cancelled by cancel()?
+};
+
+// A queue of tasks, the tasks are taken from either end
+struct Fl_Task_Queue {
+  Fl_Task	**tasks;		// Ring buffer of size entries
+  int		first, count, size;
+
+  int push(Fl_Task *t);
+  Fl_Task *pop_first();
+  Fl_Task *pop_last();
+};
+
+// A worker thread and the queue of the tasks submitted by its tasks
+struct Fl_Task_Worker {
+  Fl_Task_Queue	queue;
+  Fl_Task	*current;		// Task being run, if any
+#if defined(WIN32)
+  CRITICAL_SECTION mutex;		// Protects queue
+#elif defined(HAVE_PTHREAD)
+  pthread_mutex_t mutex;
+#endif
+};
+
+static Fl_Task_Queue shared_queue;	// Tasks submitted by other threads
+static Fl_Task_Queue main_queue;	// Tasks run by the idle callback
+static Fl_Task *done_ = 0;		// Tasks waiting for delivery
+static Fl_Task *pending_ = 0;		// All tasks not delivered yet
+static int pending_count_ = 0;
+static int ready_ = 0;			// Queued tasks not claimed by a thread
+static int deliver_pending_ = 0;	// Was Fl::awake() called for done_?
+static Fl_Task_Worker *workers_ = 0;
+static int threads_ = 0;		// Number of worker threads
+static Fl_Task *main_current_ = 0;	// Task run by the idle callback
+
+#if defined(WIN32)
+static CRITICAL_SECTION pool_mutex;	// Protects all the above but workers_
+static HANDLE pool_work = 0;		// Semaphore released for each queued task
+static DWORD worker_key;		// Thread local Fl_Task_Worker pointer
+static volatile LONG pool_init = 0;	// 1 while initializing, 2 once done
+#elif defined(HAVE_PTHREAD)
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_loop = PTHREAD_COND_INITIALIZER; // see fl_parallel_for()
+static pthread_key_t worker_key;
+#endif
+
+static void lock_pool() {
+#if defined(WIN32)
+  // The first call may come from any thread, see fl_parallel_for()
+  if (pool_init != 2) {
+    if (!InterlockedCompareExchange(&pool_init, 1, 0)) {
+      InitializeCriticalSection(&pool_mutex);
+      pool_work = CreateSemaphore(NULL, 0, 0x7fffffff, NULL);
+      pool_init = 2;
+    } else {
+      while (pool_init != 2) Sleep(0);
+    }
+  }
+  EnterCriticalSection(&pool_mutex);
+#elif defined(HAVE_PTHREAD)
+  pthread_mutex_lock(&pool_mutex);
+#endif
+}
+
+static void unlock_pool() {
+#if defined(WIN32)
+  LeaveCriticalSection(&pool_mutex);
+#elif defined(HAVE_PTHREAD)
+  pthread_mutex_unlock(&pool_mutex);
+#endif
+}
+
+static void lock_worker(Fl_Task_Worker *w) {
+#if defined(WIN32)
+  EnterCriticalSection(&w->mutex);
+#elif defined(HAVE_PTHREAD)
+  pthread_mutex_lock(&w->mutex);
+#endif
+}
+
+static void unlock_worker(Fl_Task_Worker *w) {
+#if defined(WIN32)
+  LeaveCriticalSection(&w->mutex);
+#elif defined(HAVE_PTHREAD)
+  pthread_mutex_unlock(&w->mutex);
+#endif
+}
+
+// Returns the worker of the calling thread, or NULL if it is not a worker.
+static Fl_Task_Worker *current_worker() {
+  if (!threads_) return 0;
+#if defined(WIN32)
+  return (Fl_Task_Worker *)TlsGetValue(worker_key);
+#elif defined(HAVE_PTHREAD)
+  return (Fl_Task_Worker *)pthread_getspecific(worker_key);
+#else
+  return 0;
+#endif
+}
+
+// More threads rarely pay off for the work done by FLTK
+#define MAX_THREADS 16
+
+// Returns the number of processors, at most MAX_THREADS.
+int fl_processor_count() {
+  static int count = 0;
+  if (!count) {
+#if defined(WIN32)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    count = (int)info.dwNumberOfProcessors;
+#elif defined(HAVE_PTHREAD) && defined(_SC_NPROCESSORS_ONLN)
+    count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if (count < 1) count = 1;
+    if (count > MAX_THREADS) count = MAX_THREADS;
+  }
+  return count;
+}
+
+
+int Fl_Task_Queue::push(Fl_Task *t) {
+  if (count == size) {
+    int new_size = size ? 2 * size : 64;
+    Fl_Task **temp = (Fl_Task **)malloc(new_size * sizeof(Fl_Task *));
+    if (!temp) return -1;
+    for (int i = 0; i < count; i ++) temp[i] = tasks[(first + i) % size];
+    free(tasks);
+    tasks = temp;
+    first = 0;
+    size  = new_size;
+  }
+  tasks[(first + count ++) % size] = t;
+  return 0;
+}
+
+Fl_Task *Fl_Task_Queue::pop_first() {
+  if (!count) return 0;
+  Fl_Task *t = tasks[first];
+  first = (first + 1) % size;
+  count --;
+  return t;
+}
+
+Fl_Task *Fl_Task_Queue::pop_last() {
+  if (!count) return 0;
+  return tasks[(first + -- count) % size];
+}
+
+
+// Returns non-zero if the task must not run or be delivered.
+static int is_cancelled(Fl_Task *t) {
+  // The owner is cleared by the main thread when the widget is deleted
+  return t->cancelled || (t->has_owner && !*(Fl_Widget * volatile *)&t->owner);
+}
+
+// Removes a task from the list of all tasks, the pool is locked.
+static void unlink_pending(Fl_Task *t) {
+  if (t->prev_pending) t->prev_pending->next_pending = t->next_pending;
+  else pending_ = t->next_pending;
+  if (t->next_pending) t->next_pending->prev_pending = t->prev_pending;
+  pending_count_ --;
+}
+
+// Counts a queued task in ready_ and wakes up a worker for it, the pool is locked.
+static void post_task() {
+  ready_ ++;
+#if defined(WIN32)
+  if (threads_) ReleaseSemaphore(pool_work, 1, NULL);
+#elif defined(HAVE_PTHREAD)
+  if (threads_) pthread_cond_signal(&pool_work);
+#endif
+}
+
+// Takes a queued task, w is the worker of the calling thread or NULL.
+// The task must have been claimed in ready_.
+static Fl_Task *take_task(Fl_Task_Worker *w) {
+  Fl_Task *t = 0;
+  int i;
+
+  // The newest task of our own queue...
+  if (w) {
+    lock_worker(w);
+    t = w->queue.pop_last();
+    unlock_worker(w);
+    if (t) return t;
+  }
+
+  // The oldest task submitted by the other threads...
+  lock_pool();
+  t = shared_queue.pop_first();
+  unlock_pool();
+  if (t) return t;
+
+  // The oldest task of the other workers...
+  int first = w ? (int)(w - workers_) + 1 : 0;
+  for (i = 0; i < threads_ && !t; i ++) {
+    Fl_Task_Worker *other = workers_ + (first + i) % threads_;
+    if (other == w) continue;
+    lock_worker(other);
+    t = other->queue.pop_first();
+    unlock_worker(other);
+  }
+  return t;
+}
+
+static void deliver(void *);
+
+// Moves a task that was run by a worker thread to the done list, or
+// deletes it if the main thread has nothing to do with it.
+static void finish(Fl_Task *t) {
+  lock_pool();
+  if (!t->done && !t->has_owner) {
+    unlink_pending(t);
+    unlock_pool();
+    delete t;
+    return;
+  }
+  t->next = done_;
+  done_   = t;
+  int awake = !deliver_pending_;
+  deliver_pending_ = 1;
+  unlock_pool();
+
+  if (awake && Fl::awake(deliver, 0) < 0) {
+    // Out of memory, the next finished task tries again
+    lock_pool();
+    deliver_pending_ = 0;
+    unlock_pool();
+  }
+}
+
+
+#if defined(WIN32) || defined(HAVE_PTHREAD)
+//
+// Body of the worker threads.
+//
+
+#  if defined(WIN32)
+static unsigned __stdcall worker_proc(void *data) {
+#  else
+static void *worker_proc(void *data) {
+#  endif
+  Fl_Task_Worker *w = (Fl_Task_Worker *)data;
+  Fl_Task *t;
+
+#  if defined(WIN32)
+  TlsSetValue(worker_key, w);
+#  else
+  pthread_setspecific(worker_key, w);
+#  endif
+
+  for (;;) {
+    // Claim a task...
+#  if defined(WIN32)
+    WaitForSingleObject(pool_work, INFINITE);
+    lock_pool();
+#  else
+    lock_pool();
+    while (!ready_) pthread_cond_wait(&pool_work, &pool_mutex);
+#  endif
+    ready_ --;
+    unlock_pool();
+
+    // ...and find it, it may still be on its way to a queue
+    while ((t = take_task(w)) == NULL) {
+#  if defined(WIN32)
+      Sleep(0);
+#  else
+      usleep(0);
+#  endif
+    }
+
+    w->current = t;
+    if (!is_cancelled(t)) (t->work)(t->data);
+    w->current = 0;
+
+    finish(t);
+  }
+
+  return 0;
+}
+
+// Starts one worker thread per processor.
+static void start_workers() {
+  int n = fl_processor_count();
+
+  lock_pool();
+  if (workers_) {
+    // Another thread was faster...
+    unlock_pool();
+    return;
+  }
+  workers_ = (Fl_Task_Worker *)calloc(n, sizeof(Fl_Task_Worker));
+  if (!workers_) {
+    unlock_pool();
+    return;
+  }
+
+#  if defined(WIN32)
+  worker_key = TlsAlloc();
+#  else
+  pthread_key_create(&worker_key, NULL);
+#  endif
+
+  // threads_ is set last, the workers look at the other queues from then on
+  int started = 0;
+  for (int i = 0; i < n; i ++) {
+    Fl_Task_Worker *w = workers_ + i;
+#  if defined(WIN32)
+    InitializeCriticalSection(&w->mutex);
+    uintptr_t t = _beginthreadex(NULL, 0, worker_proc, w, 0, NULL);
+    if (!t) break;
+    CloseHandle((HANDLE)t);
+#  else
+    pthread_mutex_init(&w->mutex, NULL);
+    pthread_t t;
+    if (pthread_create(&t, NULL, worker_proc, w)) break;
+    pthread_detach(t);
+#  endif
+    started ++;
+  }
+  threads_ = started;
+
+  // Wake up the workers for the tasks that are already queued...
+#  if defined(WIN32)
+  if (threads_ && ready_) ReleaseSemaphore(pool_work, ready_, NULL);
+#  else
+  if (threads_ && ready_) pthread_cond_broadcast(&pool_work);
+#  endif
+  unlock_pool();
+}
+#endif // WIN32 || HAVE_PTHREAD
+
+
+//
+// Runs one task in the main thread, when threads are not available.
+//
+
+static void idle_cb(void *) {
+  lock_pool();
+  Fl_Task *t = main_queue.pop_first();
+  int more = main_queue.count > 0;
+  unlock_pool();
+
+  if (!more) Fl::remove_idle(idle_cb);
+
+  if (t) {
+    main_current_ = t;
+    if (!is_cancelled(t)) (t->work)(t->data);
+    main_current_ = 0;
+
+    lock_pool();
+    t->next = done_;
+    done_   = t;
+    unlock_pool();
+  }
+
+  deliver(0);
+}
+
+
+//
+// Calls the done functions of the finished tasks, in the main thread.
+//
+
+static void deliver(void *) {
+  Fl_Task *list = 0, *t, *next;
+
+  lock_pool();
+  // Reverse the done list to deliver in the order the tasks finished...
+  for (t = done_; t; t = next) {
+    next    = t->next;
+    t->next = list;
+    list    = t;
+  }
+  done_            = 0;
+  deliver_pending_ = 0;
+  unlock_pool();
+
+  for (t = list; t; t = next) {
+    next = t->next;
+
+    lock_pool();
+    unlink_pending(t);
+    unlock_pool();
+
+    int cancelled = is_cancelled(t);
+    if (t->has_owner) Fl::release_widget_pointer(t->owner);
+    if (!cancelled && t->done) (t->done)(t->data);
+
+    delete t;
+  }
+}
+
+
+/**
+  Submits a task to the worker threads.
+
+  Calls \p work with \p data in a worker thread, and then \p done with
+  \p data in the main thread, from the event loop. Either function may
+  submit more tasks. The done functions are called in the order the tasks
+  finished, which is not always the order they were submitted.
+
+  If \p owner is not NULL, deleting the widget cancels the task, see
+  cancel(Fl_Widget*). Tasks with an owner must be submitted by the main
+  thread, others may be submitted by any thread. If Fl::lock() was not
+  called, tasks with a \p done function or an owner must be submitted by
+  the main thread too.
+
+  Returns 0 if the task was queued, or -1 if \p work is NULL or the
+  task could not be queued.
+
+  \param work function called in a worker thread
+  \param done function called in the main thread when \p work returned, or NULL
+  \param data user data passed to \p work and \p done
+  \param owner widget whose deletion cancels the task, or NULL
+  \version 1.3.5
+*/
+int Fl_Thread_Pool::submit(Fl_Task_Handler work, Fl_Task_Handler done,
+                           void *data, Fl_Widget *owner) {
+  if (!work) return -1;
+
+  Fl_Task *t = new Fl_Task;
+  t->next      = 0;
+  t->work      = work;
+  t->done      = done;
+  t->data      = data;
+  t->owner     = owner;
+  t->has_owner = owner != 0;
+  t->cancelled = 0;
+  if (owner) Fl::watch_widget_pointer(t->owner);
+
+  // The done functions are called from Fl::awake(), which only wakes up
+  // the main thread if Fl::lock() was called...
+  int in_main = 0;
+  if ((done || owner) && !fl_awake_enabled()) in_main = 1;
+#if defined(WIN32) || defined(HAVE_PTHREAD)
+  else if (!workers_) start_workers();
+#endif
+  if (!threads_) in_main = 1;
+
+  Fl_Task_Worker *w = in_main ? 0 : current_worker();
+
+  lock_pool();
+  t->prev_pending = 0;
+  t->next_pending = pending_;
+  if (pending_) pending_->prev_pending = t;
+  pending_ = t;
+  pending_count_ ++;
+
+  int failed;
+  if (in_main) {
+    failed = main_queue.push(t);
+  } else if (w) {
+    lock_worker(w);
+    failed = w->queue.push(t);
+    unlock_worker(w);
+  } else {
+    failed = shared_queue.push(t);
+  }
+  if (failed) {
+    pending_ = t->next_pending;
+    if (pending_) pending_->prev_pending = 0;
+    pending_count_ --;
+    unlock_pool();
+    if (owner) Fl::release_widget_pointer(t->owner);
+    delete t;
+    return -1;
+  }
+  if (!in_main) post_task();
+  unlock_pool();
+
+  if (in_main && !Fl::has_idle(idle_cb)) Fl::add_idle(idle_cb);
+  return 0;
+}
+
+
+//
+// Runs cb(data, i) for i from 0 to n-1 in the calling thread and helper
+// tasks, and returns once all calls returned.  The loop is shared by
+// reference with the helpers, which may still be about to look at it
+// when the caller returns, so the last of them deletes it.
+//
+
+struct Fl_Parallel_Loop {
+  void	(*cb)(void *data, int i);
+  void	*data;
+  int	n;
+  int	next, finished;		// Calls started and returned
+  int	refs;			// The caller and the helpers still running
+#if defined(WIN32)
+  HANDLE done;			// Set once all calls returned
+#endif
+};
+
+// Runs the calls that were not started yet, the pool is not locked.
+static void run_loop(Fl_Parallel_Loop *l) {
+  for (;;) {
+    lock_pool();
+    int i = l->next < l->n ? l->next ++ : -1;
+    unlock_pool();
+    if (i < 0) break;
+
+    (l->cb)(l->data, i);
+
+    lock_pool();
+    if (++ l->finished == l->n) {
+#if defined(WIN32)
+      SetEvent(l->done);
+#elif defined(HAVE_PTHREAD)
+      pthread_cond_broadcast(&pool_loop);
+#endif
+    }
+    unlock_pool();
+  }
+}
+
+static void release_loop(Fl_Parallel_Loop *l) {
+  lock_pool();
+  int last = !-- l->refs;
+  unlock_pool();
+  if (!last) return;
+#if defined(WIN32)
+  CloseHandle(l->done);
+#endif
+  delete l;
+}
+
+static void loop_work(void *data) {
+  Fl_Parallel_Loop *l = (Fl_Parallel_Loop *)data;
+  run_loop(l);
+  release_loop(l);
+}
+
+void fl_parallel_for(int n, void (*cb)(void *data, int i), void *data) {
+  int helpers = 0;
+#if defined(WIN32) || defined(HAVE_PTHREAD)
+  if (n > 1 && !workers_) start_workers();
+  helpers = n - 1 < threads_ ? n - 1 : threads_;
+#endif
+  if (helpers <= 0) {
+    for (int i = 0; i < n; i ++) cb(data, i);
+    return;
+  }
+
+  Fl_Parallel_Loop *l = new Fl_Parallel_Loop;
+  l->cb       = cb;
+  l->data     = data;
+  l->n        = n;
+  l->next     = 0;
+  l->finished = 0;
+  l->refs     = 1 + helpers;
+#if defined(WIN32)
+  l->done     = CreateEvent(NULL, TRUE, FALSE, NULL);
+  if (!l->done) {
+    delete l;
+    for (int i = 0; i < n; i ++) cb(data, i);
+    return;
+  }
+#endif
+
+  for (int k = 0; k < helpers; k ++)
+    if (Fl_Thread_Pool::submit(loop_work, 0, l) < 0) release_loop(l);
+
+  run_loop(l);
+
+  // Wait for the calls that the helpers are still running...
+  lock_pool();
+#if defined(WIN32)
+  if (l->finished < l->n) {
+    unlock_pool();
+    WaitForSingleObject(l->done, INFINITE);
+    lock_pool();
+  }
+#elif defined(HAVE_PTHREAD)
+  while (l->finished < l->n) pthread_cond_wait(&pool_loop, &pool_mutex);
+#endif
+  unlock_pool();
+
+  release_loop(l);
+}
+
+
+/**
+  Cancels the tasks with the work function \p work and the data \p data.
+
+  The work function of a cancelled task is not called if it did not start
+  yet. If it is running, it can call cancelled() to return early. The done
+  function of a cancelled task is not called. Returns the number of tasks
+  that were cancelled.
+
+  \version 1.3.5
+*/
+int Fl_Thread_Pool::cancel(Fl_Task_Handler work, void *data) {
+  int n = 0;
+
+  lock_pool();
+  for (Fl_Task *t = pending_; t; t = t->next_pending)
+    if (t->work == work && t->data == data && !t->cancelled) {
+      t->cancelled = 1;
+      n ++;
+    }
+  unlock_pool();
+
+  return n;
+}
+
+
+/**
+  Cancels the tasks submitted with the widget \p owner.
+
+  This happens automatically when the widget is deleted, and can be used
+  to cancel them before, see cancel(Fl_Task_Handler, void*). Must be
+  called by the main thread. Returns the number of tasks that were
+  cancelled.
+
+  \version 1.3.5
+*/
+int Fl_Thread_Pool::cancel(Fl_Widget *owner) {
+  int n = 0;
+
+  if (!owner) return 0;
+
+  lock_pool();
+  for (Fl_Task *t = pending_; t; t = t->next_pending)
+    if (t->has_owner && t->owner == owner && !t->cancelled) {
+      t->cancelled = 1;
+      n ++;
+    }
+  unlock_pool();
+
+  return n;
+}
+
+
+/**
+  Returns non-zero if the task that calls it was cancelled.
+
+  A long work function can call this now and then and return early when
+  the task was cancelled, either by cancel() or by deleting its owner
+  widget. Returns 0 if not called by a work function.
+
+  \version 1.3.5
+*/
+int Fl_Thread_Pool::cancelled() {
+  Fl_Task_Worker *w = current_worker();
+  Fl_Task *t = w ? w->current : main_current_;
+
+  return t ? is_cancelled(t) : 0;
+}
+
+
+/**
+  Returns the number of tasks whose done function was not called yet,
+  including the cancelled tasks that are not finished yet.
+
+  \version 1.3.5
+*/
+int Fl_Thread_Pool::pending() {
+  lock_pool();
+  int n = pending_count_;
+  unlock_pool();
+  return n;
+}
+
+
+/**
+  Returns the number of worker threads.
+
+  The pool starts one worker thread per processor the first time it needs
+  them. Returns 0 before, or if threads are not available, in which case
+  the main thread runs the tasks.
+
+  \version 1.3.5
+*/
+int Fl_Thread_Pool::threads() {
+  return threads_;
+}
+
+
+//
+// End of "$Id$".
+//
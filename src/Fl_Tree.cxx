@@ -1142,7 +1142,9 @@ void Fl_Tree::clear() {
   _root->clear_children();
   delete _root; _root = 0;
   _item_focus = 0;
+#if FLTK_ABI_VERSION >= 10301
   _lastselect = 0;
+#endif /*FLTK_ABI_VERSION*/
   _vscroll->range( 0, 0 );
 } 
 
@@ -51,6 +51,7 @@ extern "C" {
 #include <limits.h>
 #include <dlfcn.h>
 #include <string.h>
+#include "fl_profile.h"
 
 #import <Cocoa/Cocoa.h>
 
@@ -70,6 +71,7 @@ extern "C" {
 extern void fl_fix_focus();
 extern unsigned short *fl_compute_macKeyLookUp();
 extern int fl_send_system_handlers(void *e);
+extern void fl_frame_flush();
 
 // forward definition of functions in this file
 // converting cr lf converter function
@@ -540,7 +542,9 @@ static void do_timer(CFRunLoopTimerRef timer, void* data)
   fl_lock_function();
   current_timer = (MacTimeout*)data;
   current_timer->pending = 0;
+  double t0 = fl_profile_begin();
   (current_timer->callback)(current_timer->data);
+  fl_profile_end(t0, FL_PROFILE_TIMEOUTS);
   if (current_timer && current_timer->pending == 0)
     delete_timer(*current_timer);
   current_timer = NULL;
@@ -853,7 +857,7 @@ double fl_mac_flush_and_wait(double time_to_wait) {
     if (Fl::idle) time_to_wait = 0.0;
   }
   NSDisableScreenUpdates(); // 10.3 Makes updates to all windows appear as a single event
-  Fl::flush();
+  fl_frame_flush();
   NSEnableScreenUpdates(); // 10.3
   if (Fl::idle && !in_idle) // 'idle' may have been set within flush()
     time_to_wait = 0.0;
@@ -21,6 +21,8 @@
 #include <config.h>
 
 #include <stdlib.h>
+#include <string.h>
+#include "fl_threads.h"
 
 /*
    From Bill:
@@ -59,6 +61,7 @@
 */
 
 #ifndef FL_DOXYGEN
+// The awake ring is no longer used, these are kept for binary compatibility
 Fl_Awake_Handler *Fl::awake_ring_;
 void **Fl::awake_data_;
 int Fl::awake_ring_size_;
@@ -66,59 +69,160 @@ int Fl::awake_ring_head_;
 int Fl::awake_ring_tail_;
 #endif
 
-static const int AWAKE_RING_SIZE = 1024;
-static void lock_ring();
-static void unlock_ring();
+/*
+   The awake queue:
+
+   Threads post awake callbacks (and, on POSIX systems, the messages of
+   Fl::awake(void*)) by pushing a node on a lock-free stack with a
+   compare-and-swap, so a thread never waits for another one. Nothing is
+   posted before Fl::lock() installed the main thread side, and at most
+   AWAKE_QUEUE_MAX nodes can be pending. The main thread takes the whole stack at once
+   and reverses it into its private FIFO list (awake_first), so that the
+   callbacks are called in the order they were posted.
+
+   The main thread is only woken up (one pipe/eventfd write or thread
+   message) when awake_signalled changes from 0 to 1. The main thread
+   resets it before it takes the stack, so that any later post wakes it
+   up again, and tens of thousands of posts per second cost one wakeup
+   per event loop iteration instead of one system call each.
+*/
 
-/** Adds an awake handler for use in awake(). */
-int Fl::add_awake_handler_(Fl_Awake_Handler func, void *data)
-{
-  int ret = 0;
-  lock_ring();
-  if (!awake_ring_) {
-    awake_ring_size_ = AWAKE_RING_SIZE;
-    awake_ring_ = (Fl_Awake_Handler*)malloc(awake_ring_size_*sizeof(Fl_Awake_Handler));
-    awake_data_ = (void**)malloc(awake_ring_size_*sizeof(void*));
-    // explicitly initialize the head and tail indices
-    awake_ring_head_= awake_ring_tail_ = 0;
+struct Fl_Awake_Node {
+  Fl_Awake_Node *next;
+  Fl_Awake_Handler func;	// callback, or NULL for a message
+  void *data;
+};
+
+// Maximum number of pending callbacks and messages
+static const long AWAKE_QUEUE_MAX = 65536;
+
+static Fl_Awake_Node * volatile awake_posted;	// stack of posted nodes, newest first
+static volatile long awake_queued;		// number of nodes posted and not freed
+static volatile long awake_signalled;		// main thread was woken up?
+static Fl_Awake_Node *awake_first;	// FIFO of the main thread
+static int awake_coalescing_;
+
+#if defined(WIN32) && !defined(__GNUC__)
+#  include <windows.h>
+static inline int awake_cas(Fl_Awake_Node * volatile *p, Fl_Awake_Node *o, Fl_Awake_Node *n) {
+  return InterlockedCompareExchangePointer((PVOID volatile *)p, n, o) == o;
+}
+static inline long awake_exchange(volatile long *p, long v) {
+  return InterlockedExchange((LONG volatile *)p, v);
+}
+static inline long awake_add(volatile long *p, long v) {
+  return InterlockedExchangeAdd((LONG volatile *)p, v) + v;
+}
+#else
+static inline int awake_cas(Fl_Awake_Node * volatile *p, Fl_Awake_Node *o, Fl_Awake_Node *n) {
+  return __sync_bool_compare_and_swap(p, o, n);
+}
+static inline long awake_exchange(volatile long *p, long v) {
+  long o;
+  do { o = *p; } while (!__sync_bool_compare_and_swap(p, o, v));
+  return o;
+}
+static inline long awake_add(volatile long *p, long v) {
+  return __sync_add_and_fetch(p, v);
+}
+#endif // WIN32 && !__GNUC__
+
+static void awake_signal();	// platform dependent, see below
+
+// Frees a node taken by the main thread.
+static void awake_free(Fl_Awake_Node *node) {
+  free(node);
+  awake_add(&awake_queued, -1);
+}
+
+// Pushes a callback or message on the stack, returns -1 if Fl::lock() was
+// not called, if the queue is full, or if out of memory.
+static int awake_post(Fl_Awake_Handler func, void *data) {
+  if (!fl_awake_enabled()) return -1;
+  if (awake_add(&awake_queued, 1) > AWAKE_QUEUE_MAX) {
+    awake_add(&awake_queued, -1);
+    return -1;
   }
-  // The next head index we will want (not the current index):
-  // We use this to check if the ring-buffer is full or not
-  // (and to update awake_ring_head_ if we do use the current index.)
-  int next_head = awake_ring_head_ + 1;
-  if (next_head >= awake_ring_size_) {
-    next_head = 0;
+  Fl_Awake_Node *node = (Fl_Awake_Node *)malloc(sizeof(Fl_Awake_Node));
+  if (!node) {
+    awake_add(&awake_queued, -1);
+    return -1;
   }
-  // check that the ring buffer is not full, and that it exists
-  if ((!awake_ring_) || (next_head == awake_ring_tail_)) {
-    // ring is non-existent or full. Return -1 as an error indicator.
-    ret = -1;
-  } else {
-    awake_ring_[awake_ring_head_] = func;
-    awake_data_[awake_ring_head_] = data;
-    awake_ring_head_ = next_head;
+  node->func = func;
+  node->data = data;
+  do {
+    node->next = awake_posted;
+  } while (!awake_cas(&awake_posted, node->next, node));
+  return 0;
+}
+
+// Moves the posted nodes to the empty FIFO of the main thread, dropping
+// the older duplicates of each callback and data if coalescing is on.
+static void awake_take() {
+  Fl_Awake_Node *node, *next, *list = 0;
+  static Fl_Awake_Node **seen;	// hash table of the callbacks taken
+  static int seen_size;
+  int count = 0;
+
+  awake_exchange(&awake_signalled, 0);
+  do {
+    node = awake_posted;
+  } while (node && !awake_cas(&awake_posted, node, 0));
+  if (!node) return;
+
+  if (awake_coalescing_) {
+    for (next = node; next; next = next->next) count ++;
+    if (count > 1 && 2 * count > seen_size) {
+      while (2 * count > seen_size) seen_size = seen_size ? 2 * seen_size : 64;
+      free(seen);
+      seen = (Fl_Awake_Node **)malloc(seen_size * sizeof(Fl_Awake_Node *));
+    }
+    if (count > 1) memset(seen, 0, seen_size * sizeof(Fl_Awake_Node *));
   }
-  unlock_ring();
-  return ret;
+
+  // Reverse the stack, the newest node comes first...
+  for (; node; node = next) {
+    next = node->next;
+    if (count > 1 && node->func) {
+      size_t h = ((size_t)node->func * 31 + (size_t)node->data) * 2654435761U;
+      int i = (int)((h >> 8) & (seen_size - 1));
+      while (seen[i] && (seen[i]->func != node->func || seen[i]->data != node->data))
+        i = (i + 1) & (seen_size - 1);
+      if (seen[i]) {
+        // A newer post of the same callback follows, skip this one
+        awake_free(node);
+        continue;
+      }
+      seen[i] = node;
+    }
+    node->next = list;
+    list = node;
+  }
+  awake_first = list;
+}
+
+// Returns non-zero if awake callbacks are waiting for the main thread.
+int fl_awake_pending() {
+  return awake_first != 0 || awake_posted != 0;
+}
+
+/** Adds an awake handler for use in awake(). */
+int Fl::add_awake_handler_(Fl_Awake_Handler func, void *data)
+{
+  return awake_post(func, data);
 }
 
 /** Gets the last stored awake handler for use in awake(). */
 int Fl::get_awake_handler_(Fl_Awake_Handler &func, void *&data)
 {
-  int ret = 0;
-  lock_ring();
-  if ((!awake_ring_) || (awake_ring_head_ == awake_ring_tail_)) {
-    ret = -1;
-  } else {
-    func = awake_ring_[awake_ring_tail_];
-    data = awake_data_[awake_ring_tail_];
-    ++awake_ring_tail_;
-    if (awake_ring_tail_ >= awake_ring_size_) {
-      awake_ring_tail_ = 0;
-    }
-  }
-  unlock_ring();
-  return ret;
+  if (!awake_first) awake_take();
+  Fl_Awake_Node *node = awake_first;
+  if (!node) return -1;
+  awake_first = node->next;
+  func = node->func;
+  data = node->data;
+  awake_free(node);
+  return 0;
 }
 
 /**
@@ -126,17 +230,44 @@ int Fl::get_awake_handler_(Fl_Awake_Handler &func, void *&data)
  Registers a function that will be 
  called by the main thread during the next message handling cycle. 
  Returns 0 if the callback function was registered, 
- and -1 if registration failed. Over a thousand awake callbacks can be
- registered simultaneously.
+ and -1 if registration failed: Fl::lock() must have been called first,
+ and up to 65536 callbacks and messages can be pending.
+
+ Posting from a thread does not block on other threads, and wakes up
+ the main thread only if it was not woken up already. If coalescing is
+ enabled, posting the same function and data again before the main
+ thread ran it only moves the callback to the end of the queue.
  
- \see Fl::awake(void* message=0)
+ \see Fl::awake(void* message=0), Fl::awake_coalescing(int)
 */
 int Fl::awake(Fl_Awake_Handler func, void *data) {
   int ret = add_awake_handler_(func, data);
-  Fl::awake();
+  awake_signal();
   return ret;
 }
 
+/**
+  Sets whether repeated awake callbacks are collapsed into one.
+
+  With coalescing enabled, all posts of the same function and data by
+  Fl::awake(Fl_Awake_Handler, void*) that are pending when the main
+  thread runs the awake callbacks result in a single call, at the
+  position of the last post. This suits progress updates and other
+  callbacks that show the latest state of something, which worker
+  threads may post much more often than the display is updated.
+  Coalescing is disabled by default.
+
+  \version 1.3.5
+*/
+void Fl::awake_coalescing(int on) {
+  awake_coalescing_ = on;
+}
+
+/** Returns non-zero if repeated awake callbacks are collapsed, see awake_coalescing(int). */
+int Fl::awake_coalescing() {
+  return awake_coalescing_;
+}
+
 ////////////////////////////////////////////////////////////////
 // Windows threading...
 /** \fn int Fl::lock()
@@ -177,9 +308,11 @@ int Fl::awake(Fl_Awake_Handler func, void *data) {
     
     Multiple calls to Fl::awake() will queue multiple pointers 
     for the main thread to process, up to a system-defined (typically several 
-    thousand) depth. The default message handler saves the last message which 
-    can be accessed using the 
-    Fl::thread_message() function.
+    thousand) depth on Windows, and up to 65536 pending callbacks and messages
+    on other systems; further messages are dropped, as are the messages sent
+    before the main thread called Fl::lock(). The
+    default message handler saves the last message which can be accessed
+    using the Fl::thread_message() function.
 
     In the context of a threaded application, a call to Fl::awake() with no
     argument will trigger event loop handling in the main thread. Since
@@ -202,19 +335,6 @@ static DWORD main_thread;
 
 // Microsoft's version of a MUTEX...
 CRITICAL_SECTION cs;
-CRITICAL_SECTION *cs_ring;
-
-void unlock_ring() {
-  LeaveCriticalSection(cs_ring);
-}
-
-void lock_ring() {
-  if (!cs_ring) {
-    cs_ring = (CRITICAL_SECTION*)malloc(sizeof(CRITICAL_SECTION));
-    InitializeCriticalSection(cs_ring);
-  }
-  EnterCriticalSection(cs_ring);
-}
 
 //
 // 'unlock_function()' - Release the lock.
@@ -253,15 +373,30 @@ void Fl::awake(void* msg) {
   PostThreadMessage( main_thread, fl_wake_msg, (WPARAM)msg, 0);
 }
 
+// Wakes up the main thread for the awake callbacks, unless already done
+static void awake_signal() {
+  if (main_thread && !awake_exchange(&awake_signalled, 1) &&
+      !PostThreadMessage(main_thread, fl_wake_msg, 0, 0))
+    awake_signalled = 0;
+}
+
+// Returns non-zero if Fl::lock() was called, so that Fl::awake() can be used
+int fl_awake_enabled() {
+  return main_thread != 0;
+}
+
 ////////////////////////////////////////////////////////////////
 // POSIX threading...
 #elif defined(HAVE_PTHREAD)
 #  include <unistd.h>
 #  include <fcntl.h>
 #  include <pthread.h>
+#  ifdef HAVE_SYS_EVENTFD_H
+#    include <sys/eventfd.h>
+#  endif // HAVE_SYS_EVENTFD_H
 
-// Pipe for thread messaging via Fl::awake()...
-static int thread_filedes[2];
+// Pipe (or eventfd, then both are the same) to wake up the main thread...
+static int thread_filedes[2] = { -1, -1 };
 
 // Mutex and state information for Fl::lock() and Fl::unlock()...
 static pthread_mutex_t fltk_mutex;
@@ -306,8 +441,28 @@ static void unlock_function_rec() {
 }
 #  endif // PTHREAD_MUTEX_RECURSIVE
 
+// Wakes up the main thread for the awake queue, unless already done
+static void awake_signal() {
+  if (thread_filedes[1] < 0 || awake_exchange(&awake_signalled, 1)) return;
+#  ifdef HAVE_SYS_EVENTFD_H
+  if (thread_filedes[0] == thread_filedes[1]) {
+    uint64_t one = 1;
+    if (write(thread_filedes[1], &one, sizeof(one))==0) { /* ignore */ }
+    return;
+  }
+#  endif // HAVE_SYS_EVENTFD_H
+  if (write(thread_filedes[1], "", 1)==0) { /* ignore */ }
+}
+
 void Fl::awake(void* msg) {
-  if (write(thread_filedes[1], &msg, sizeof(void*))==0) { /* ignore */ }
+  // Messages are queued with the callbacks, without a callback...
+  if (msg) awake_post(0, msg);
+  awake_signal();
+}
+
+// Returns non-zero if Fl::lock() was called, so that Fl::awake() can be used
+int fl_awake_enabled() {
+  return thread_filedes[1] >= 0;
 }
 
 static void* thread_message_;
@@ -318,13 +473,22 @@ void* Fl::thread_message() {
 }
 
 static void thread_awake_cb(int fd, void*) {
-  if (read(fd, &thread_message_, sizeof(void*))==0) { 
+  char buf[64];
+  if (read(fd, buf, sizeof(buf))==0) { 
     /* This should never happen */
   }
   Fl_Awake_Handler func;
   void *data;
   while (Fl::get_awake_handler_(func, data)==0) {
-    (*func)(data);
+    if (func) {
+      (*func)(data);
+    } else {
+      // Let Fl::wait() return with this message, and come back for the rest
+      thread_message_ = data;
+      awake_exchange(&awake_signalled, 0);
+      if (fl_awake_pending()) awake_signal();
+      break;
+    }
   }
 }
 
@@ -333,17 +497,25 @@ extern void (*fl_lock_function)();
 extern void (*fl_unlock_function)();
 
 int Fl::lock() {
-  if (!thread_filedes[1]) {
+  if (thread_filedes[1] < 0) {
     // Initialize thread communication pipe to let threads awake FLTK
-    // from Fl::wait()
+    // from Fl::wait(), an eventfd needs one descriptor instead of two
+#  ifdef HAVE_SYS_EVENTFD_H
+    int efd = eventfd(0, 0);
+    if (efd >= 0) {
+      thread_filedes[0] = thread_filedes[1] = efd;
+    } else
+#  endif // HAVE_SYS_EVENTFD_H
     if (pipe(thread_filedes)==-1) {
       /* this should not happen */
     }
 
-    // Make the write side of the pipe non-blocking to avoid deadlock
-    // conditions (STR #1537)
+    // Make the pipe non-blocking to avoid deadlock conditions (STR #1537),
+    // and so that the main thread can read all there is
     fcntl(thread_filedes[1], F_SETFL,
           fcntl(thread_filedes[1], F_GETFL) | O_NONBLOCK);
+    fcntl(thread_filedes[0], F_SETFL,
+          fcntl(thread_filedes[0], F_GETFL) | O_NONBLOCK);
 
     // Monitor the read side of the pipe so that messages sent via
     // Fl::awake() from a thread will "wake up" the main thread in
@@ -374,30 +546,16 @@ void Fl::unlock() {
   fl_unlock_function();
 }
 
-// Mutex code for the awake ring buffer
-static pthread_mutex_t *ring_mutex;
-
-void unlock_ring() {
-  pthread_mutex_unlock(ring_mutex);
-}
-
-void lock_ring() {
-  if (!ring_mutex) {
-    ring_mutex = (pthread_mutex_t*)malloc(sizeof(pthread_mutex_t));
-    pthread_mutex_init(ring_mutex, NULL);
-  }
-  pthread_mutex_lock(ring_mutex);
-}
-
 #else
 
-void unlock_ring() {
+static void awake_signal() {
 }
 
-void lock_ring() {
+void Fl::awake(void*) {
 }
 
-void Fl::awake(void*) {
+int fl_awake_enabled() {
+  return 0;
 }
 
 int Fl::lock() {
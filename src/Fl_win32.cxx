@@ -32,6 +32,7 @@
 #include <FL/Fl_Paged_Device.H>
 #include "flstring.h"
 #include "Fl_Font.H"
+#include "fl_threads.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
@@ -343,6 +344,7 @@ void* Fl::thread_message() {
 }
 
 extern int fl_send_system_handlers(void *e);
+extern void fl_frame_flush();
 
 MSG fl_msg;
 
@@ -370,7 +372,9 @@ int fl_wait(double time_to_wait) {
   static char in_idle;
   if (Fl::idle && !in_idle) {
     in_idle = 1;
+    double t0 = fl_profile_begin();
     Fl::idle();
+    fl_profile_end(t0, FL_PROFILE_IDLE);
     in_idle = 0;
   }
   
@@ -391,7 +395,11 @@ int fl_wait(double time_to_wait) {
 	if (fl_wsk_fd_is_set(f, &fdt[0])) revents |= FL_READ;
 	if (fl_wsk_fd_is_set(f, &fdt[1])) revents |= FL_WRITE;
 	if (fl_wsk_fd_is_set(f, &fdt[2])) revents |= FL_EXCEPT;
-	if (fd[i].events & revents) fd[i].cb(f, fd[i].arg);
+	if (fd[i].events & revents) {
+	  double t0 = fl_profile_begin();
+	  fd[i].cb(f, fd[i].arg);
+	  fl_profile_end(t0, FL_PROFILE_FD);
+	}
       }
       time_to_wait = 0.0; // just peek for any messages
     } else {
@@ -412,15 +420,20 @@ int fl_wait(double time_to_wait) {
 
   time_to_wait = (time_to_wait > 10000 ? 10000 : time_to_wait);
   int t_msec = (int) (time_to_wait * 1000.0 + 0.5);
+  double t0 = fl_profile_begin();
   MsgWaitForMultipleObjects(0, NULL, FALSE, t_msec, QS_ALLINPUT);
+  fl_profile_end(t0, FL_PROFILE_WAIT);
 
   fl_lock_function();
 
   // Execute the message we got, and all other pending messages:
   // have_message = PeekMessage(&fl_msg, NULL, 0, 0, PM_REMOVE);
   while ((have_message = PeekMessageW(&fl_msg, NULL, 0, 0, PM_REMOVE)) > 0) {
-    if (fl_send_system_handlers(&fl_msg))
+    t0 = fl_profile_begin();
+    if (fl_send_system_handlers(&fl_msg)) {
+      fl_profile_end(t0, FL_PROFILE_EVENTS);
       continue;
+    }
 
     // Let applications treat WM_QUIT identical to SIGTERM on *nix
     if (fl_msg.message == WM_QUIT)
@@ -434,33 +447,34 @@ int fl_wait(double time_to_wait) {
 
     TranslateMessage(&fl_msg);
     DispatchMessageW(&fl_msg);
+    fl_profile_end(t0, FL_PROFILE_EVENTS);
   }
 
   // The following conditional test:
-  //    (Fl::awake_ring_head_ != Fl::awake_ring_tail_)
+  //    fl_awake_pending()
   // is a workaround / fix for STR #3143. This works, but a better solution
   // would be to understand why the PostThreadMessage() messages are not
   // seen by the main window if it is being dragged/ resized at the time.
-  // If a worker thread posts an awake callback to the ring buffer
+  // If a worker thread posts an awake callback to the queue
   // whilst the main window is unresponsive (if a drag or resize operation
   // is in progress) we may miss the PostThreadMessage(). So here, we check if
-  // there is anything pending in the awake ring buffer and if so process
-  // it. This is not strictly thread safe (for speed it compares the head
-  // and tail indices without first locking the ring buffer) but is intended
+  // there is anything pending in the awake queue and if so process it.
+  // The test reads the queue heads without synchronization, but is intended
   // only as a fall-back recovery mechanism if the awake processing stalls.
-  // If the test erroneously returns true (may happen if we test the indices
-  // whilst they are being modified) we will call process_awake_handler_requests()
-  // unnecessarily, but this has no harmful consequences so is safe to do.
+  // If the test erroneously returns true we will call
+  // process_awake_handler_requests() unnecessarily, but this has no harmful
+  // consequences so is safe to do. Processing the queue also lets worker
+  // threads wake up the main thread again if a wakeup message was lost.
   // Note also that if we miss the PostThreadMessage(), then thread_message_
   // will not be updated, so this is not a perfect solution, but it does
   // recover and process any pending awake callbacks.
-  // Normally the ring buffer head and tail indices will match and this
-  // comparison will do nothing. Addresses STR #3143
-  if (Fl::awake_ring_head_ != Fl::awake_ring_tail_) {
+  // Normally the queue is empty and this test will do nothing.
+  // Addresses STR #3143
+  if (fl_awake_pending()) {
     process_awake_handler_requests();
   }
 
-  Fl::flush();
+  fl_frame_flush();
 
   // This should return 0 if only timer events were handled:
   return 1;
@@ -2029,7 +2043,9 @@ static LRESULT CALLBACK s_TimerProc(HWND hwnd, UINT msg,
         void*              data = win32_timers[id].data;
         delete_timer(win32_timers[id]);
         if (cb) {
+          double t0 = fl_profile_begin();
           (*cb)(data);
+          fl_profile_end(t0, FL_PROFILE_TIMEOUTS);
         }
       }
     }
@@ -40,6 +40,7 @@
 #  include <stdio.h>
 #  include <stdlib.h>
 #  include "flstring.h"
+#  include "fl_profile.h"
 #  include <unistd.h>
 #  include <time.h>
 #  include <sys/time.h>
@@ -110,7 +111,159 @@ struct FD {
 
 static FD *fd = 0;
 
+#  if HAVE_SYS_EPOLL_H
+#    include <sys/epoll.h>
+#    include <errno.h>
+#    include <fcntl.h>
+
+// On Linux the fds are watched with epoll: adding or removing an fd is
+// O(1) and fl_wait() only looks at the fds that are ready, so watching
+// hundreds of sockets costs no more than watching a few. If epoll is
+// not available at run time, poll() or select() is used as above.
+//
+// Each fd has one callback per event, and epoll_fds[] is indexed by
+// the fd. nfds counts the watched fds, like in the arrays above.
+struct Fl_Epoll_FD {
+  int events;				// POLLIN, POLLOUT and POLLERR
+  int always;				// Not supported by epoll, always ready
+  void (*cb[3])(int, void*);		// callback of each event
+  void *arg[3];
+};
+
+static const int epoll_event_bit[3] = { POLLIN, POLLOUT, POLLERR };
+static const int epoll_event_mask[3] = { EPOLLIN, EPOLLOUT, EPOLLPRI };
+
+static int epoll_fd = -2;		// -2 until created, -1 if not available
+static Fl_Epoll_FD *epoll_fds = 0;
+static int epoll_fds_size = 0;
+static int epoll_always = 0;		// Number of fds with always set
+
+static int use_epoll() {
+  if (epoll_fd == -2) {
+#    ifdef EPOLL_CLOEXEC
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+#    else
+    epoll_fd = epoll_create(64);
+    if (epoll_fd >= 0) fcntl(epoll_fd, F_SETFD, FD_CLOEXEC);
+#    endif // EPOLL_CLOEXEC
+    if (epoll_fd < 0) epoll_fd = -1;
+  }
+  return epoll_fd >= 0;
+}
+
+// Tells epoll about the events of fd n, which were old_events before.
+static void epoll_update(int n, int old_events) {
+  struct epoll_event ev;
+  int op;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.data.fd = n;
+  for (int i = 0; i < 3; i++)
+    if (epoll_fds[n].events & epoll_event_bit[i]) ev.events |= epoll_event_mask[i];
+
+  if (!epoll_fds[n].events) op = EPOLL_CTL_DEL;
+  else if (!old_events) op = EPOLL_CTL_ADD;
+  else op = EPOLL_CTL_MOD;
+
+  if (epoll_fds[n].always) {
+    // poll() and select() report regular files as always ready, but
+    // epoll refuses them, so fl_wait() calls their callbacks every time
+    if (!epoll_fds[n].events) {
+      epoll_fds[n].always = 0;
+      epoll_always--;
+    }
+    return;
+  }
+
+  if (epoll_ctl(epoll_fd, op, n, &ev) < 0) {
+    // The fd may have been closed and reopened without remove_fd()...
+    if (op == EPOLL_CTL_ADD && errno == EEXIST) epoll_ctl(epoll_fd, EPOLL_CTL_MOD, n, &ev);
+    else if (op == EPOLL_CTL_MOD && errno == ENOENT) epoll_ctl(epoll_fd, EPOLL_CTL_ADD, n, &ev);
+    else if (op == EPOLL_CTL_ADD && errno == EPERM) {
+      epoll_fds[n].always = 1;
+      epoll_always++;
+    }
+  }
+}
+
+static void epoll_add_fd(int n, int events, void (*cb)(int, void*), void *v) {
+  if (n < 0) return;
+  if (n >= epoll_fds_size) {
+    int size = epoll_fds_size ? epoll_fds_size : 64;
+    while (size <= n) size *= 2;
+    Fl_Epoll_FD *temp = (Fl_Epoll_FD*)realloc(epoll_fds, size*sizeof(Fl_Epoll_FD));
+    if (!temp) return;
+    memset(temp + epoll_fds_size, 0, (size - epoll_fds_size)*sizeof(Fl_Epoll_FD));
+    epoll_fds = temp;
+    epoll_fds_size = size;
+  }
+
+  Fl_Epoll_FD *e = epoll_fds + n;
+  int old_events = e->events;
+  for (int i = 0; i < 3; i++)
+    if (events & epoll_event_bit[i]) {
+      e->cb[i] = cb;
+      e->arg[i] = v;
+      e->events |= epoll_event_bit[i];
+    }
+  if (!e->events) return;
+  if (!old_events) nfds++;
+  epoll_update(n, old_events);
+}
+
+static void epoll_remove_fd(int n, int events) {
+  if (n < 0 || n >= epoll_fds_size || !(epoll_fds[n].events & events)) return;
+
+  Fl_Epoll_FD *e = epoll_fds + n;
+  int old_events = e->events;
+  for (int i = 0; i < 3; i++)
+    if (events & epoll_event_bit[i]) {
+      e->cb[i] = 0;
+      e->arg[i] = 0;
+      e->events &= ~epoll_event_bit[i];
+    }
+  if (!e->events) nfds--;
+  epoll_update(n, old_events);
+}
+
+// Calls the callbacks of fd n for the epoll events r, each callback once
+// even if it was added for several events. The callbacks may add and
+// remove fds, so epoll_fds[] is looked up again for each one.
+static void epoll_do_fd(int n, unsigned r) {
+  void (*done_cb[3])(int, void*);
+  void *done_arg[3];
+  int done = 0;
+
+  for (int i = 0; i < 3; i++) {
+    if (n >= epoll_fds_size) return;
+    Fl_Epoll_FD *e = epoll_fds + n;
+    if (!(e->events & epoll_event_bit[i])) continue;
+    // Errors and hangups are reported to all callbacks, like poll() does
+    if (!(r & (epoll_event_mask[i] | EPOLLERR | EPOLLHUP))) continue;
+
+    void (*cb)(int, void*) = e->cb[i];
+    void *arg = e->arg[i];
+    int j;
+    for (j = 0; j < done; j++)
+      if (done_cb[j] == cb && done_arg[j] == arg) break;
+    if (j < done) continue;
+    done_cb[done] = cb;
+    done_arg[done] = arg;
+    done++;
+    double t0 = fl_profile_begin();
+    cb(n, arg);
+    fl_profile_end(t0, FL_PROFILE_FD);
+  }
+}
+#  endif // HAVE_SYS_EPOLL_H
+
 void Fl::add_fd(int n, int events, void (*cb)(int, void*), void *v) {
+#  if HAVE_SYS_EPOLL_H
+  if (use_epoll()) {
+    epoll_add_fd(n, events, cb, v);
+    return;
+  }
+#  endif // HAVE_SYS_EPOLL_H
   remove_fd(n,events);
   int i = nfds++;
   if (i >= fd_array_size) {
@@ -154,6 +307,12 @@ void Fl::add_fd(int n, void (*cb)(int, void*), void* v) {
 
 void Fl::remove_fd(int n, int events) {
   int i,j;
+#  if HAVE_SYS_EPOLL_H
+  if (use_epoll()) {
+    epoll_remove_fd(n, events);
+    return;
+  }
+#  endif // HAVE_SYS_EPOLL_H
 # if !USE_POLL
   maxfd = -1; // recalculate maxfd on the fly
 # endif
@@ -205,9 +364,10 @@ static void do_queued_events() {
   while (XEventsQueued(fl_display,QueuedAfterReading)) {
     XEvent xevent;
     XNextEvent(fl_display, &xevent);
-    if (fl_send_system_handlers(&xevent))
-      continue;
-    fl_handle(xevent);
+    double t0 = fl_profile_begin();
+    if (!fl_send_system_handlers(&xevent))
+      fl_handle(xevent);
+    fl_profile_end(t0, FL_PROFILE_EVENTS);
   }
   // we send FL_LEAVE only if the mouse did not enter some other window:
   if (!in_a_window) Fl::handle(FL_LEAVE, 0);
@@ -234,6 +394,40 @@ int fl_wait(double time_to_wait) {
   // so we must check for already-read events:
   if (fl_display && XQLength(fl_display)) {do_queued_events(); return 1;}
 
+#  if HAVE_SYS_EPOLL_H
+  if (use_epoll()) {
+    struct epoll_event ev[64];
+    int n;
+
+    if (epoll_always) time_to_wait = 0.0;
+
+    fl_unlock_function();
+    double t0 = fl_profile_begin();
+    // round up, so that waiting for a timeout that is due in less than
+    // half a millisecond does not return immediately over and over:
+    if (time_to_wait < 2147483.648)
+      n = epoll_wait(epoll_fd, ev, 64, int(time_to_wait*1000 + .999));
+    else
+      n = epoll_wait(epoll_fd, ev, 64, -1);
+    fl_profile_end(t0, FL_PROFILE_WAIT);
+    fl_lock_function();
+
+    // More than 64 ready fds are returned by the next call, epoll rotates
+    // them so that all of them are served
+    for (int i = 0; i < n; i++) epoll_do_fd(ev[i].data.fd, ev[i].events);
+
+    if (epoll_always) {
+      if (n < 0) n = 0;
+      for (int f = 0; f < epoll_fds_size; f++)
+        if (epoll_fds[f].always) {
+          epoll_do_fd(f, EPOLLIN | EPOLLOUT);
+          n++;
+        }
+    }
+    return n;
+  }
+#  endif // HAVE_SYS_EPOLL_H
+
 #  if !USE_POLL
   fd_set fdt[3];
   fdt[0] = fdsets[0];
@@ -243,10 +437,11 @@ int fl_wait(double time_to_wait) {
   int n;
 
   fl_unlock_function();
+  double t0 = fl_profile_begin();
 
   if (time_to_wait < 2147483.648) {
 #  if USE_POLL
-    n = ::poll(pollfds, nfds, int(time_to_wait*1000 + .5));
+    n = ::poll(pollfds, nfds, int(time_to_wait*1000 + .999));
 #  else
     timeval t;
     t.tv_sec = int(time_to_wait);
@@ -261,20 +456,25 @@ int fl_wait(double time_to_wait) {
 #  endif
   }
 
+  fl_profile_end(t0, FL_PROFILE_WAIT);
   fl_lock_function();
 
   if (n > 0) {
     for (int i=0; i<nfds; i++) {
 #  if USE_POLL
-      if (pollfds[i].revents) fd[i].cb(pollfds[i].fd, fd[i].arg);
+      if (!pollfds[i].revents) continue;
+      int f = pollfds[i].fd;
 #  else
       int f = fd[i].fd;
       short revents = 0;
       if (FD_ISSET(f,&fdt[0])) revents |= POLLIN;
       if (FD_ISSET(f,&fdt[1])) revents |= POLLOUT;
       if (FD_ISSET(f,&fdt[2])) revents |= POLLERR;
-      if (fd[i].events & revents) fd[i].cb(f, fd[i].arg);
+      if (!(fd[i].events & revents)) continue;
 #  endif
+      t0 = fl_profile_begin();
+      fd[i].cb(f, fd[i].arg);
+      fl_profile_end(t0, FL_PROFILE_FD);
     }
   }
   return n;
@@ -284,6 +484,13 @@ int fl_wait(double time_to_wait) {
 int fl_ready() {
   if (XQLength(fl_display)) return 1;
   if (!nfds) return 0; // nothing to select or poll
+#  if HAVE_SYS_EPOLL_H
+  if (use_epoll()) {
+    struct epoll_event ev;
+    if (epoll_always) return 1;
+    return epoll_wait(epoll_fd, &ev, 1, 0);
+  }
+#  endif // HAVE_SYS_EPOLL_H
 #  if USE_POLL
   return ::poll(pollfds, nfds, 0);
 #  else
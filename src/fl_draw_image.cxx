@@ -63,6 +63,8 @@ static int scanline_mask;
 
 static void (*converter)(const uchar *from, uchar *to, int w, int delta);
 static void (*mono_converter)(const uchar *from, uchar *to, int w, int delta);
+static void (*argb_converter)(const uchar *from, uchar *to, int w, int delta);
+static int direct_delta;	// delta of images that are already in the server's format
 
 static int dir;		// direction-alternator
 static int ri,gi,bi;	// saved error-diffusion value
@@ -347,6 +349,242 @@ mono32_converter(const uchar *from,uchar *to,int w, int delta) {
     (*from << fl_redshift)+(*from << fl_greenshift)+(*from << fl_blueshift));
 }
 
+////////////////////////////////////////////////////////////////
+// Vectorized versions of the converters of the usual TrueColor visuals
+// (RGB, RGBA and gray images to BGRX pixels) and of the premultiplied
+// ARGB converter.  They store exactly the same pixels as the converters
+// above, which they call for other deltas and for the last few pixels
+// of each line.  vector_converters() picks the best versions the CPU
+// supports.
+
+#  if !WORDS_BIGENDIAN && (defined(__x86_64__) || defined(__i386__)) && \
+      (defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#    define USE_X86_CONVERTERS 1
+#    include <immintrin.h>
+#    define FL_TARGET(t) __attribute__((target(t)))
+
+FL_TARGET("sse2")
+static void xrgb_converter_sse2(const uchar *from, uchar *to, int w, int delta) {
+  int i = 0;
+  if (delta == 4) {
+    const __m128i m0 = _mm_set1_epi32(0xff);
+    const __m128i m1 = _mm_set1_epi32(0xff00);
+    for (; i + 4 <= w; i += 4) {
+      __m128i v = _mm_loadu_si128((const __m128i *)(from + 4*i));
+      v = _mm_or_si128(_mm_or_si128(_mm_slli_epi32(_mm_and_si128(v, m0), 16),
+                                    _mm_and_si128(v, m1)),
+                       _mm_and_si128(_mm_srli_epi32(v, 16), m0));
+      _mm_storeu_si128((__m128i *)(to + 4*i), v);
+    }
+  }
+  if (i < w) xrgb_converter(from + i*delta, to + 4*i, w - i, delta);
+}
+
+FL_TARGET("ssse3")
+static void xrgb_converter_ssse3(const uchar *from, uchar *to, int w, int delta) {
+  int i = 0;
+  if (delta == 3 || delta == 4) {
+    const __m128i mask = delta == 3 ?
+      _mm_setr_epi8(2, 1, 0, -128, 5, 4, 3, -128, 8, 7, 6, -128, 11, 10, 9, -128) :
+      _mm_setr_epi8(2, 1, 0, -128, 6, 5, 4, -128, 10, 9, 8, -128, 14, 13, 12, -128);
+    // 16 bytes are read for 4 RGB pixels, don't read past the line:
+    int last = w - (delta == 3 ? 6 : 4);
+    for (; i <= last; i += 4) {
+      __m128i v = _mm_loadu_si128((const __m128i *)(from + delta*i));
+      _mm_storeu_si128((__m128i *)(to + 4*i), _mm_shuffle_epi8(v, mask));
+    }
+  }
+  if (i < w) xrgb_converter(from + i*delta, to + 4*i, w - i, delta);
+}
+
+FL_TARGET("avx2")
+static void xrgb_converter_avx2(const uchar *from, uchar *to, int w, int delta) {
+  int i = 0;
+  if (delta == 3 || delta == 4) {
+    const __m256i mask = delta == 3 ?
+      _mm256_setr_epi8(2, 1, 0, -128, 5, 4, 3, -128, 8, 7, 6, -128, 11, 10, 9, -128,
+                       2, 1, 0, -128, 5, 4, 3, -128, 8, 7, 6, -128, 11, 10, 9, -128) :
+      _mm256_setr_epi8(2, 1, 0, -128, 6, 5, 4, -128, 10, 9, 8, -128, 14, 13, 12, -128,
+                       2, 1, 0, -128, 6, 5, 4, -128, 10, 9, 8, -128, 14, 13, 12, -128);
+    // 28 bytes are read for 8 RGB pixels, don't read past the line:
+    int last = w - (delta == 3 ? 10 : 8);
+    for (; i <= last; i += 8) {
+      const uchar *f = from + delta*i;
+      __m256i v;
+      if (delta == 3)
+        v = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)f)),
+                                    _mm_loadu_si128((const __m128i *)(f + 12)), 1);
+      else
+        v = _mm256_loadu_si256((const __m256i *)f);
+      _mm256_storeu_si256((__m256i *)(to + 4*i), _mm256_shuffle_epi8(v, mask));
+    }
+  }
+  if (i < w) xrgb_converter(from + i*delta, to + 4*i, w - i, delta);
+}
+
+FL_TARGET("sse2")
+static void xrrr_converter_sse2(const uchar *from, uchar *to, int w, int delta) {
+  int i = 0;
+  if (delta == 1) {
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 16 <= w; i += 16) {
+      __m128i v = _mm_loadu_si128((const __m128i *)(from + i));
+      __m128i *t = (__m128i *)(to + 4*i);
+      __m128i vv = _mm_unpacklo_epi8(v, v), v0 = _mm_unpacklo_epi8(v, zero);
+      _mm_storeu_si128(t, _mm_unpacklo_epi16(vv, v0));
+      _mm_storeu_si128(t + 1, _mm_unpackhi_epi16(vv, v0));
+      vv = _mm_unpackhi_epi8(v, v); v0 = _mm_unpackhi_epi8(v, zero);
+      _mm_storeu_si128(t + 2, _mm_unpacklo_epi16(vv, v0));
+      _mm_storeu_si128(t + 3, _mm_unpackhi_epi16(vv, v0));
+    }
+  }
+  if (i < w) xrrr_converter(from + i*delta, to + 4*i, w - i, delta);
+}
+
+// Premultiplies two RGBA pixels stored in 16 bit lanes and reorders them
+// to BGRA. x/255 is computed as (x+1+(x>>8))>>8, which is exact for the
+// products of two bytes, and the alpha lane is multiplied by 255.
+FL_TARGET("sse2")
+static inline __m128i premul_sse2(__m128i p) {
+  __m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(p, _MM_SHUFFLE(3,3,3,3)), _MM_SHUFFLE(3,3,3,3));
+  a = _mm_or_si128(_mm_and_si128(a, _mm_setr_epi16(-1, -1, -1, 0, -1, -1, -1, 0)),
+                   _mm_setr_epi16(0, 0, 0, 255, 0, 0, 0, 255));
+  p = _mm_shufflehi_epi16(_mm_shufflelo_epi16(p, _MM_SHUFFLE(3,0,1,2)), _MM_SHUFFLE(3,0,1,2));
+  p = _mm_mullo_epi16(p, a);
+  p = _mm_add_epi16(_mm_add_epi16(p, _mm_set1_epi16(1)), _mm_srli_epi16(p, 8));
+  return _mm_srli_epi16(p, 8);
+}
+
+FL_TARGET("sse2")
+static void argb_premul_converter_sse2(const uchar *from, uchar *to, int w, int delta) {
+  int i = 0;
+  if (delta == 4) {
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 4 <= w; i += 4) {
+      __m128i v = _mm_loadu_si128((const __m128i *)(from + 4*i));
+      v = _mm_packus_epi16(premul_sse2(_mm_unpacklo_epi8(v, zero)),
+                           premul_sse2(_mm_unpackhi_epi8(v, zero)));
+      _mm_storeu_si128((__m128i *)(to + 4*i), v);
+    }
+  }
+  if (i < w) argb_premul_converter(from + i*delta, to + 4*i, w - i, delta);
+}
+
+FL_TARGET("avx2")
+static inline __m256i premul_avx2(__m256i p) {
+  __m256i a = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(p, _MM_SHUFFLE(3,3,3,3)), _MM_SHUFFLE(3,3,3,3));
+  a = _mm256_or_si256(_mm256_and_si256(a, _mm256_setr_epi16(-1, -1, -1, 0, -1, -1, -1, 0,
+                                                            -1, -1, -1, 0, -1, -1, -1, 0)),
+                      _mm256_setr_epi16(0, 0, 0, 255, 0, 0, 0, 255, 0, 0, 0, 255, 0, 0, 0, 255));
+  p = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(p, _MM_SHUFFLE(3,0,1,2)), _MM_SHUFFLE(3,0,1,2));
+  p = _mm256_mullo_epi16(p, a);
+  p = _mm256_add_epi16(_mm256_add_epi16(p, _mm256_set1_epi16(1)), _mm256_srli_epi16(p, 8));
+  return _mm256_srli_epi16(p, 8);
+}
+
+FL_TARGET("avx2")
+static void argb_premul_converter_avx2(const uchar *from, uchar *to, int w, int delta) {
+  int i = 0;
+  if (delta == 4) {
+    const __m256i zero = _mm256_setzero_si256();
+    for (; i + 8 <= w; i += 8) {
+      // unpacking and packing work within 128 bit lanes, so pixels stay in order
+      __m256i v = _mm256_loadu_si256((const __m256i *)(from + 4*i));
+      v = _mm256_packus_epi16(premul_avx2(_mm256_unpacklo_epi8(v, zero)),
+                              premul_avx2(_mm256_unpackhi_epi8(v, zero)));
+      _mm256_storeu_si256((__m256i *)(to + 4*i), v);
+    }
+  }
+  if (i < w) argb_premul_converter(from + i*delta, to + 4*i, w - i, delta);
+}
+
+#  elif !WORDS_BIGENDIAN && (defined(__ARM_NEON) || defined(__ARM_NEON__))
+#    define USE_NEON_CONVERTERS 1
+#    include <arm_neon.h>
+
+static void xrgb_converter_neon(const uchar *from, uchar *to, int w, int delta) {
+  int i = 0;
+  uint8x16x4_t d;
+  d.val[3] = vdupq_n_u8(0);
+  if (delta == 3) {
+    for (; i + 16 <= w; i += 16) {
+      uint8x16x3_t s = vld3q_u8(from + 3*i);
+      d.val[0] = s.val[2]; d.val[1] = s.val[1]; d.val[2] = s.val[0];
+      vst4q_u8(to + 4*i, d);
+    }
+  } else if (delta == 4) {
+    for (; i + 16 <= w; i += 16) {
+      uint8x16x4_t s = vld4q_u8(from + 4*i);
+      d.val[0] = s.val[2]; d.val[1] = s.val[1]; d.val[2] = s.val[0];
+      vst4q_u8(to + 4*i, d);
+    }
+  }
+  if (i < w) xrgb_converter(from + i*delta, to + 4*i, w - i, delta);
+}
+
+static void xrrr_converter_neon(const uchar *from, uchar *to, int w, int delta) {
+  int i = 0;
+  if (delta == 1) {
+    uint8x16x4_t d;
+    d.val[3] = vdupq_n_u8(0);
+    for (; i + 16 <= w; i += 16) {
+      d.val[0] = d.val[1] = d.val[2] = vld1q_u8(from + i);
+      vst4q_u8(to + 4*i, d);
+    }
+  }
+  if (i < w) xrrr_converter(from + i*delta, to + 4*i, w - i, delta);
+}
+
+// x/255 for the products of two bytes, see premul_sse2()
+static inline uint8x8_t div255_neon(uint16x8_t x) {
+  return vshrn_n_u16(vaddq_u16(vaddq_u16(x, vdupq_n_u16(1)), vshrq_n_u16(x, 8)), 8);
+}
+
+static inline uint8x16_t premul_neon(uint8x16_t c, uint8x16_t a) {
+  return vcombine_u8(div255_neon(vmull_u8(vget_low_u8(c), vget_low_u8(a))),
+                     div255_neon(vmull_u8(vget_high_u8(c), vget_high_u8(a))));
+}
+
+static void argb_premul_converter_neon(const uchar *from, uchar *to, int w, int delta) {
+  int i = 0;
+  if (delta == 4) {
+    for (; i + 16 <= w; i += 16) {
+      uint8x16x4_t s = vld4q_u8(from + 4*i), d;
+      d.val[0] = premul_neon(s.val[2], s.val[3]);
+      d.val[1] = premul_neon(s.val[1], s.val[3]);
+      d.val[2] = premul_neon(s.val[0], s.val[3]);
+      d.val[3] = s.val[3];
+      vst4q_u8(to + 4*i, d);
+    }
+  }
+  if (i < w) argb_premul_converter(from + i*delta, to + 4*i, w - i, delta);
+}
+#  endif
+
+// Replaces the converters picked by figure_out_visual() with their
+// vectorized versions where the CPU supports them.
+static void vector_converters() {
+#  if USE_X86_CONVERTERS
+  __builtin_cpu_init();
+  int sse2 = __builtin_cpu_supports("sse2");
+  int ssse3 = __builtin_cpu_supports("ssse3");
+  int avx2 = __builtin_cpu_supports("avx2");
+  if (converter == xrgb_converter) {
+    if (avx2) converter = xrgb_converter_avx2;
+    else if (ssse3) converter = xrgb_converter_ssse3;
+    else if (sse2) converter = xrgb_converter_sse2;
+  }
+  if (mono_converter == xrrr_converter && sse2)
+    mono_converter = xrrr_converter_sse2;
+  if (avx2) argb_converter = argb_premul_converter_avx2;
+  else if (sse2) argb_converter = argb_premul_converter_sse2;
+#  elif USE_NEON_CONVERTERS
+  if (converter == xrgb_converter) converter = xrgb_converter_neon;
+  if (mono_converter == xrrr_converter) mono_converter = xrrr_converter_neon;
+  argb_converter = argb_premul_converter_neon;
+#  endif
+}
+
 ////////////////////////////////////////////////////////////////
 
 static void figure_out_visual() {
@@ -452,10 +690,160 @@ static void figure_out_visual() {
     Fl::fatal("Can't do %d bits_per_pixel",xi.bits_per_pixel);
   }
 
+  // RGB and RGBX images that are already in the format of the server's
+  // pixels are sent without converting them:
+  if (converter == rgb_converter) direct_delta = 3;
+#  if WORDS_BIGENDIAN
+  else if (converter == rgbx_converter) direct_delta = 4;
+#  else
+  else if (converter == xbgr_converter) direct_delta = 4;
+#  endif
 }
 
 #  define MAXBUFFER 0x40000 // 256k
 
+#  if USE_XSHM
+////////////////////////////////////////////////////////////////
+// MIT-SHM support: large images are converted directly into a shared
+// memory segment which the X server reads with XShmPutImage, so that
+// the pixels are not copied through the X connection.  The segment is
+// kept and reused as long as the images fit in it, and is only
+// reallocated when a larger image (i.e. a larger window) is drawn.
+
+#    include <X11/extensions/XShm.h>
+#    include <sys/ipc.h>
+#    include <sys/shm.h>
+
+#    define SHMTHRESHOLD 0x4000 // smaller images are sent with XPutImage
+
+static int shm_supported = -1;	// -1 until the extension was checked
+static int shm_completion;	// event type of ShmCompletion
+static XShmSegmentInfo shm_info;// the attached segment, shmaddr is 0 if none
+static long shm_size;		// size of the attached segment
+static int shm_busy;		// the last XShmPutImage did not complete yet
+static unsigned long shm_request; // request number of that XShmPutImage
+static int shm_error;		// set by shm_error_handler()
+
+static int shm_error_handler(Display *, XErrorEvent *) {
+  shm_error = 1;
+  return 0;
+}
+
+static Bool shm_is_completion(Display *, XEvent *e, XPointer) {
+  return e->type == shm_completion &&
+	 ((XShmCompletionEvent *)e)->shmseg == shm_info.shmseg;
+}
+
+// Waits until the X server is done reading the segment.
+static void shm_wait() {
+  if (!shm_busy) return;
+  shm_busy = 0;
+  XEvent e;
+  if (XCheckIfEvent(fl_display, &e, shm_is_completion, 0)) return;
+  // The completion event may already have been read (and ignored) by the
+  // event loop, in which case the request is known to be processed and
+  // waiting for the event would block forever:
+  if ((long)(LastKnownRequestProcessed(fl_display) - shm_request) >= 0) return;
+  XIfEvent(fl_display, &e, shm_is_completion, 0);
+}
+
+// Returns the shared segment, reallocated if it is smaller than size
+// bytes, or NULL if MIT-SHM can't be used (the extension is missing, the
+// display is remote, or the system is out of shared memory).
+static char *shm_buffer(long size) {
+  if (shm_supported < 0) {
+    shm_supported = XShmQueryExtension(fl_display);
+    if (shm_supported)
+      shm_completion = XShmGetEventBase(fl_display) + ShmCompletion;
+  }
+  if (!shm_supported) return 0;
+  shm_wait();
+  if (size <= shm_size) return shm_info.shmaddr;
+
+  if (shm_info.shmaddr) {
+    XShmDetach(fl_display, &shm_info);
+    shmdt(shm_info.shmaddr);
+    shm_info.shmaddr = 0;
+    shm_size = 0;
+  }
+  size = (size + MAXBUFFER - 1) & -MAXBUFFER; // don't grow by a few lines at a time
+  shm_info.shmid = shmget(IPC_PRIVATE, size, IPC_CREAT | 0600);
+  if (shm_info.shmid < 0) return 0;
+  shm_info.shmaddr = (char *)shmat(shm_info.shmid, 0, 0);
+  if (shm_info.shmaddr == (char *)-1) {
+    shmctl(shm_info.shmid, IPC_RMID, 0);
+    shm_info.shmaddr = 0;
+    return 0;
+  }
+  shm_info.readOnly = True;
+
+  // XShmAttach fails with an X error if the server can't access our
+  // memory, which is what happens on a remote display:
+  XSync(fl_display, False);
+  shm_error = 0;
+  XErrorHandler old_handler = XSetErrorHandler(shm_error_handler);
+  XShmAttach(fl_display, &shm_info);
+  XSync(fl_display, False);
+  XSetErrorHandler(old_handler);
+  // the segment is destroyed once both the server and we detach it:
+  shmctl(shm_info.shmid, IPC_RMID, 0);
+  if (shm_error) {
+    shmdt(shm_info.shmaddr);
+    shm_info.shmaddr = 0;
+    shm_supported = 0;
+    return 0;
+  }
+  shm_size = size;
+  return shm_info.shmaddr;
+}
+
+// Converts the image into the shared segment and sends it to the server,
+// conv is NULL if buf is already in the server's format and is copied.
+// Returns 0 if this is not possible and the image must be sent with XPutImage.
+static int shm_innards(const uchar *buf, int X, int Y, int W,
+		       int dx, int dy, int w, int h,
+		       int delta, int linedelta,
+		       void (*conv)(const uchar *from, uchar *to, int w, int delta),
+		       Fl_Draw_Image_Cb cb, void *userdata)
+{
+  // The server computes the line size from the image width, so use a
+  // width whose lines are already padded the way we want:
+  int tw = w;
+  while ((tw*bytes_per_pixel) & scanline_add) tw++;
+  int linesize = tw*bytes_per_pixel;
+  if ((long)linesize*h < SHMTHRESHOLD) return 0;
+  char *data = shm_buffer((long)linesize*h);
+  if (!data) return 0;
+
+  uchar *to = (uchar *)data;
+  if (buf) {
+    buf += delta*dx+linedelta*dy;
+    for (int j=0; j<h; j++, buf += linedelta, to += linesize) {
+      if (conv) conv(buf, to, w, delta);
+      else memcpy(to, buf, w*bytes_per_pixel);
+    }
+  } else {
+    STORETYPE* linebuf = new STORETYPE[(W*delta+(sizeof(STORETYPE)-1))/sizeof(STORETYPE)];
+    for (int j=0; j<h; j++, to += linesize) {
+      cb(userdata, dx, dy+j, w, (uchar*)linebuf);
+      conv((uchar*)linebuf, to, w, delta);
+    }
+    delete[] linebuf;
+  }
+
+  XImage si = xi;
+  si.width = tw;
+  si.height = h;
+  si.data = data;
+  si.bytes_per_line = linesize;
+  si.obdata = (char *)&shm_info;
+  shm_request = NextRequest(fl_display);
+  XShmPutImage(fl_display, fl_window, fl_gc, &si, 0, 0, X+dx, Y+dy, w, h, True);
+  shm_busy = 1;
+  return 1;
+}
+#  endif // USE_XSHM
+
 static void innards(const uchar *buf, int X, int Y, int W, int H,
 		    int delta, int linedelta, int mono,
 		    Fl_Draw_Image_Cb cb, void* userdata,
@@ -469,7 +857,11 @@ static void innards(const uchar *buf, int X, int Y, int W, int H,
   dx -= X;
   dy -= Y;
 
-  if (!bytes_per_pixel) figure_out_visual();
+  if (!bytes_per_pixel) {
+    figure_out_visual();
+    argb_converter = argb_premul_converter;
+    vector_converters();
+  }
   const unsigned oldbpp = bytes_per_pixel;
   const GC oldgc = fl_gc;
   static GC gc32 = None;
@@ -481,7 +873,7 @@ static void innards(const uchar *buf, int X, int Y, int W, int H,
   if (alpha) {
     // This flag states the destination format is ARGB32 (big-endian), pre-multiplied.
     bytes_per_pixel = 4;
-    conv = argb_premul_converter;
+    conv = argb_converter;
     xi.depth = 32;
     xi.bits_per_pixel = 32;
 
@@ -493,26 +885,23 @@ static void innards(const uchar *buf, int X, int Y, int W, int H,
     }
   }
 
-  // See if the data is already in the right format.  Unfortunately
-  // some 32-bit x servers (XFree86) care about the unknown 8 bits
-  // and they must be zero.  I can't confirm this for user-supplied
-  // data, so the 32-bit shortcut is disabled...
+  // See if the data is already in the right format.  For 32-bit
+  // pixels the unknown 8 bits are sent as they are (the alpha channel
+  // of RGBA images), which some old x servers (XFree86) did not like,
+  // but the server ignores them for visuals of depth 24.
+  const int direct = buf && conv == converter && delta == direct_delta;
+
+#  if USE_XSHM
+  if (shm_innards(buf, X, Y, W, dx, dy, w, h, delta, linedelta, direct ? 0 : conv, cb, userdata)) {
+    // the image was sent through the shared segment
+  } else
+#  endif
   // This can set bytes_per_line negative if image is bottom-to-top
   // I tested it on Linux, but it may fail on other Xlib implementations:
-  if (buf && (
-#  if 0	// set this to 1 to allow 32-bit shortcut
-      delta == 4 &&
-#    if WORDS_BIGENDIAN
-      conv == rgbx_converter
-#    else
-      conv == xbgr_converter
-#    endif
-      ||
-#  endif
-      conv == rgb_converter && delta==3
-      ) && !(linedelta&scanline_add)) {
+  if (direct && !(linedelta&scanline_add)) {
     xi.data = (char *)(buf+delta*dx+linedelta*dy);
     xi.bytes_per_line = linedelta;
+    XPutImage(fl_display,fl_window,fl_gc, &xi, 0, 0, X+dx, Y+dy, w, h);
 
   } else {
     int linesize = ((w*bytes_per_pixel+scanline_add)&scanline_mask)/sizeof(STORETYPE);
@@ -333,12 +333,16 @@ Fl_Font_Descriptor::Fl_Font_Descriptor(const char* name, Fl_Fontsize fsize, int
 #if HAVE_GL
   listbase = 0;
 #endif // HAVE_GL
+  for (unsigned i = 0; i < sizeof(width)/sizeof(int*); i++) width[i] = NULL;
   font = fontopen(name, fsize, false, angle);
 }
 
 Fl_Font_Descriptor::~Fl_Font_Descriptor() {
   if (this == fl_graphics_driver->font_descriptor()) fl_graphics_driver->font_descriptor(NULL);
 //  XftFontClose(fl_display, font);
+  for (unsigned i = 0; i < sizeof(width)/sizeof(int*); i++) {
+    if (width[i]) free(width[i]);
+  }
 }
 
 /* decodes the input UTF-8 string into a series of wchar_t characters.
@@ -385,13 +389,49 @@ int Fl_Xlib_Graphics_Driver::descent() {
   else return -1;
 }
 
-double Fl_Xlib_Graphics_Driver::width(const char* str, int n) {
-  if (!font_descriptor()) return -1.0;
+/* Returns the advance of character c in font desc.
+ Advances of characters of the basic multilingual plane are cached
+ in desc->width[], by blocks of 1024 characters allocated when first hit,
+ so that measuring text does not call Xft again for characters already seen.
+ Characters above U+FFFF are rare and are measured explicitly.
+ */
+static int xft_char_width(Fl_Font_Descriptor *desc, unsigned int c) {
   XGlyphInfo i;
-  utf8extents(font_descriptor(), str, n, &i);
+  FcChar32 ucs = c;
+  if (c > 0xFFFF) {
+    XftTextExtents32(fl_display, desc->font, &ucs, 1, &i);
+    return i.xOff;
+  }
+  unsigned int r = c >> 10; // index of the character block containing c
+  int *block = desc->width[r];
+  if (!block) { // this character block has not been hit yet
+    block = desc->width[r] = (int*)malloc(sizeof(int) * 0x400);
+    for (int j = 0; j < 0x400; j++) block[j] = -1;
+  } else if (block[c & 0x3FF] >= 0) { // already cached
+    return block[c & 0x3FF];
+  }
+  XftTextExtents32(fl_display, desc->font, &ucs, 1, &i);
+  block[c & 0x3FF] = i.xOff;
   return i.xOff;
 }
 
+double Fl_Xlib_Graphics_Driver::width(const char* str, int n) {
+  Fl_Font_Descriptor *desc = font_descriptor();
+  if (!desc) return -1.0;
+  // Xft does not kern, so that the advance of a string is the
+  // sum of the advances of its characters
+  int w = 0;
+  const char *end = str + n;
+  while (str < end) {
+    int l;
+    unsigned int ucs = fl_utf8decode(str, end, &l);
+    if (l < 1) l = 1;
+    str += l;
+    w += xft_char_width(desc, ucs);
+  }
+  return w;
+}
+
 /*double fl_width(uchar c) {
   return fl_graphics_driver->width((const char *)(&c), 1);
 }*/
@@ -404,7 +444,9 @@ static double fl_xft_width(Fl_Font_Descriptor *desc, FcChar32 *str, int n) {
 }
 
 double Fl_Xlib_Graphics_Driver::width(unsigned int c) {
-  return fl_xft_width(font_descriptor(), (FcChar32 *)(&c), 1);
+  Fl_Font_Descriptor *desc = font_descriptor();
+  if (!desc) return -1.0;
+  return xft_char_width(desc, c);
 }
 
 void Fl_Xlib_Graphics_Driver::text_extents(const char *c, int n, int &dx, int &dy, int &w, int &h) {
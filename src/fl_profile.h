@@ -0,0 +1,55 @@
+//
+// "$Id$"
+//
+// Event loop profiler definitions for the Fast Light Tool Kit (FLTK).
+//
+// Copyright 1998-2016 by Bill Spitzak and others.
+//
+// This library is free software. Distribution and use rights are outlined in
+// the file "COPYING" which should have been included with this file.  If this
+// file is missing or damaged, see the license at:
+//
+//     http://www.fltk.org/COPYING.php
+//
+// Please report all bugs and problems on the following page:
+//
+//     http://www.fltk.org/str.php
+//
+
+// Internal functions used by the event loop and Fl_Group to measure their
+// phases for Fl_Profile. A phase is measured with:
+//
+//   double t0 = fl_profile_begin();
+//   ...
+//   fl_profile_end(t0, FL_PROFILE_FD);
+//
+// fl_profile_begin() returns 0 when the profiler is off, and fl_profile_end()
+// then does nothing, even if the profiler was turned on in between.
+//
+#ifndef FL_PROFILE_H
+#define FL_PROFILE_H
+
+#include <FL/Fl_Profile.H>
+
+class Fl_Widget;
+
+extern int fl_profile_on;
+
+extern double fl_clock();
+extern double fl_profile_push();
+extern void fl_profile_pop(double t0, int phase, const Fl_Widget *widget);
+
+inline double fl_profile_begin() {
+  return fl_profile_on ? fl_profile_push() : 0.0;
+}
+
+// The time is also added to the class of widget, if given:
+inline void fl_profile_end(double t0, int phase, const Fl_Widget *widget = 0) {
+  if (t0 != 0.0) fl_profile_pop(t0, phase, widget);
+}
+
+#endif // !FL_PROFILE_H
+
+//
+// End of "$Id$".
+//
@@ -0,0 +1,390 @@
+//
+// "$Id$"
+//
+// Image scaling routines for the Fast Light Tool Kit (FLTK).
+//
+// Copyright 1998-2016 by Bill Spitzak and others.
+//
+// This library is free software. Distribution and use rights are outlined in
+// the file "COPYING" which should have been included with this file.  If this
+// file is missing or damaged, see the license at:
+//
+//     http://www.fltk.org/COPYING.php
+//
+// Please report all bugs and problems on the following page:
+//
+//     http://www.fltk.org/str.php
+//
+
+// Separable resampling of 8 bit images, used by Fl_RGB_Image::copy()
+// for all the Fl_RGB_Scaling methods except FL_RGB_SCALING_NEAREST.
+//
+// The image is first scaled horizontally into a temporary image, which
+// is then scaled vertically.  The filter weights of each destination
+// column and row are computed once, in 14 bit fixed point, and each pass
+// is a sum of products of bytes and weights, done with SSE2 where it is
+// available.  When downscaling, the filter is widened by the scale
+// factor so that all source pixels contribute to the result.  Both
+// passes are split into bands of rows, which are run in parallel by the
+// threads of Fl_Thread_Pool for large images.
+//
+// Images with an alpha channel are premultiplied before being scaled
+// so that the color of transparent pixels does not bleed into their
+// neighbours.
+
+#include <FL/Fl_Image.H>
+#include "flstring.h"
+#include "fl_threads.h"
+#include <FL/math.h>
+#include <stdlib.h>
+#if defined(__SSE2__)
+#  include <emmintrin.h>
+#endif
+
+#define FL_SCALE_BITS 14			// precision of the weights
+#define FL_SCALE_ONE (1 << FL_SCALE_BITS)
+#define FL_SCALE_BAND_COST (1 << 18)		// minimum work of a band, in products
+
+////////////////////////////////////////////////////////////////
+// Filters, with their support radius:
+
+static double box_filter(double x) {
+  return (x >= -0.5 && x <= 0.5) ? 1.0 : 0.0;
+}
+
+static double triangle_filter(double x) {
+  if (x < 0.0) x = -x;
+  return x < 1.0 ? 1.0 - x : 0.0;
+}
+
+// Keys' cubic convolution with a = -0.5 (Catmull-Rom)
+static double cubic_filter(double x) {
+  const double a = -0.5;
+  if (x < 0.0) x = -x;
+  if (x < 1.0) return ((a + 2.0) * x - (a + 3.0)) * x * x + 1.0;
+  if (x < 2.0) return (((x - 5.0) * x + 8.0) * x - 4.0) * a;
+  return 0.0;
+}
+
+static double sinc(double x) {
+  if (x == 0.0) return 1.0;
+  x *= M_PI;
+  return sin(x) / x;
+}
+
+static double lanczos_filter(double x) {
+  if (x <= -3.0 || x >= 3.0) return 0.0;
+  return sinc(x) * sinc(x / 3.0);
+}
+
+////////////////////////////////////////////////////////////////
+// Filter weights of the destination pixels along one axis.  All pixels
+// use the same number of taps, windows near the edges are moved inside
+// the source and padded with zero weights.
+
+struct Fl_Scale_Weights {
+  int taps;		// number of source pixels of each destination pixel
+  int *start;		// first source pixel of each destination pixel
+  short *weights;	// taps weights of each destination pixel
+
+  Fl_Scale_Weights(int in, int out, Fl_RGB_Scaling method);
+  ~Fl_Scale_Weights() { delete[] start; delete[] weights; }
+};
+
+Fl_Scale_Weights::Fl_Scale_Weights(int in, int out, Fl_RGB_Scaling method) {
+  double (*filter)(double);
+  double support;
+  switch (method) {
+    case FL_RGB_SCALING_BOX:     filter = box_filter;      support = 0.5; break;
+    case FL_RGB_SCALING_BICUBIC: filter = cubic_filter;    support = 2.0; break;
+    case FL_RGB_SCALING_LANCZOS: filter = lanczos_filter;  support = 3.0; break;
+    default:                     filter = triangle_filter; support = 1.0; break;
+  }
+  double scale = (double)in / out;
+  double fscale = scale > 1.0 ? scale : 1.0;	// widen the filter when downscaling
+  double radius = support * fscale;
+  taps = (int)ceil(radius) * 2 + 1;
+  if (taps > in) taps = in;
+  start = new int[out];
+  weights = new short[out * taps];
+  double *w = new double[taps];
+
+  for (int i = 0; i < out; i++) {
+    double center = (i + 0.5) * scale;
+    int lo = (int)(center - radius + 0.5);
+    int hi = (int)(center + radius + 0.5);
+    if (lo < 0) lo = 0;
+    if (hi > in) hi = in;
+    if (hi - lo > taps) hi = lo + taps;
+    int first = lo;
+    if (first + taps > in) first = in - taps;
+    start[i] = first;
+
+    double sum = 0.0;
+    int k;
+    for (k = 0; k < taps; k++) {
+      int x = first + k;
+      w[k] = (x >= lo && x < hi) ? filter((x + 0.5 - center) / fscale) : 0.0;
+      sum += w[k];
+    }
+    if (sum == 0.0) {	// can't happen with these filters, but be safe
+      w[0] = sum = 1.0;
+    }
+    // Round the weights so that they add up to exactly FL_SCALE_ONE,
+    // the error goes to the largest weight:
+    short *iw = weights + i * taps;
+    int isum = 0, big = 0;
+    for (k = 0; k < taps; k++) {
+      iw[k] = (short)floor(w[k] / sum * FL_SCALE_ONE + 0.5);
+      isum += iw[k];
+      if (iw[k] > iw[big]) big = k;
+    }
+    iw[big] += FL_SCALE_ONE - isum;
+  }
+  delete[] w;
+}
+
+static inline uchar clamp_byte(int v) {
+  v = (v + FL_SCALE_ONE / 2) >> FL_SCALE_BITS;
+  return v < 0 ? 0 : v > 255 ? 255 : (uchar)v;
+}
+
+////////////////////////////////////////////////////////////////
+// The two passes:
+
+struct Fl_Scale_Job {
+  const uchar *src;	// source of the pass
+  int src_ld;		// bytes per source row
+  uchar *dst;		// destination of the pass
+  int dst_ld;		// bytes per destination row
+  int d;		// bytes per pixel
+  int width;		// destination width of the horizontal pass, row bytes of the vertical pass
+  const Fl_Scale_Weights *weights;
+};
+
+#if defined(__SSE2__)
+// Returns two weights in the low and high 16 bits of an int
+static inline int pair(short w0, short w1) {
+  return (int)((unsigned short)w0 | ((unsigned)(unsigned short)w1 << 16));
+}
+
+// Loads a pixel of 3 or 4 bytes into the low bytes of a register
+static inline __m128i load_pixel(const uchar *p, int d) {
+  int v;
+  if (d == 4) memcpy(&v, p, 4);
+  else v = p[0] | (p[1] << 8) | (p[2] << 16);
+  return _mm_cvtsi32_si128(v);
+}
+#endif
+
+// Scales the source rows [r0, r1) horizontally.
+static void horizontal_pass(void *data, int r0, int r1) {
+  const Fl_Scale_Job *job = (const Fl_Scale_Job *)data;
+  const int d = job->d, taps = job->weights->taps, W = job->width;
+  const int *start = job->weights->start;
+  for (int r = r0; r < r1; r++) {
+    const uchar *src = job->src + (long)r * job->src_ld;
+    uchar *dst = job->dst + (long)r * job->dst_ld;
+    const short *w = job->weights->weights;
+    for (int x = 0; x < W; x++, w += taps, dst += d) {
+      const uchar *p = src + start[x] * d;
+      int k;
+#if defined(__SSE2__)
+      if (d >= 3) {
+        // The channels of two pixels are interleaved so that
+        // _mm_madd_epi16() adds the products of both taps.
+        const __m128i zero = _mm_setzero_si128();
+        __m128i acc = _mm_set1_epi32(FL_SCALE_ONE / 2);
+        for (k = 0; k + 2 <= taps; k += 2, p += 2 * d) {
+          __m128i px = _mm_unpacklo_epi8(load_pixel(p, d), load_pixel(p + d, d));
+          __m128i wk = _mm_set1_epi32(pair(w[k], w[k + 1]));
+          acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_unpacklo_epi8(px, zero), wk));
+        }
+        if (k < taps) {
+          __m128i px = _mm_unpacklo_epi16(_mm_unpacklo_epi8(load_pixel(p, d), zero), zero);
+          acc = _mm_add_epi32(acc, _mm_madd_epi16(px, _mm_set1_epi32((unsigned short)w[k])));
+        }
+        acc = _mm_srai_epi32(acc, FL_SCALE_BITS);
+        int v = _mm_cvtsi128_si32(_mm_packus_epi16(_mm_packs_epi32(acc, zero), zero));
+        if (d == 4) memcpy(dst, &v, 4);
+        else { dst[0] = (uchar)v; dst[1] = (uchar)(v >> 8); dst[2] = (uchar)(v >> 16); }
+        continue;
+      }
+#endif
+      for (int c = 0; c < d; c++) {
+        int sum = 0;
+        for (k = 0; k < taps; k++) sum += w[k] * p[k * d + c];
+        dst[c] = clamp_byte(sum);
+      }
+    }
+  }
+}
+
+// Computes the destination rows [r0, r1) of the vertical pass.
+static void vertical_pass(void *data, int r0, int r1) {
+  const Fl_Scale_Job *job = (const Fl_Scale_Job *)data;
+  const int taps = job->weights->taps, n = job->width;
+  for (int r = r0; r < r1; r++) {
+    const uchar *src = job->src + (long)job->weights->start[r] * job->src_ld;
+    const short *w = job->weights->weights + r * taps;
+    uchar *dst = job->dst + (long)r * job->dst_ld;
+    const long ld = job->src_ld;
+    int i = 0, k;
+#if defined(__SSE2__)
+    // 16 bytes at a time, the bytes of two rows are interleaved so that
+    // _mm_madd_epi16() adds the products of both taps.
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 16 <= n; i += 16) {
+      __m128i acc0 = _mm_set1_epi32(FL_SCALE_ONE / 2);
+      __m128i acc1 = acc0, acc2 = acc0, acc3 = acc0;
+      const uchar *p = src + i;
+      for (k = 0; k + 2 <= taps; k += 2, p += 2 * ld) {
+        __m128i a = _mm_loadu_si128((const __m128i *)p);
+        __m128i b = _mm_loadu_si128((const __m128i *)(p + ld));
+        __m128i wk = _mm_set1_epi32(pair(w[k], w[k + 1]));
+        __m128i lo = _mm_unpacklo_epi8(a, b), hi = _mm_unpackhi_epi8(a, b);
+        acc0 = _mm_add_epi32(acc0, _mm_madd_epi16(_mm_unpacklo_epi8(lo, zero), wk));
+        acc1 = _mm_add_epi32(acc1, _mm_madd_epi16(_mm_unpackhi_epi8(lo, zero), wk));
+        acc2 = _mm_add_epi32(acc2, _mm_madd_epi16(_mm_unpacklo_epi8(hi, zero), wk));
+        acc3 = _mm_add_epi32(acc3, _mm_madd_epi16(_mm_unpackhi_epi8(hi, zero), wk));
+      }
+      if (k < taps) {
+        __m128i a = _mm_loadu_si128((const __m128i *)p);
+        __m128i wk = _mm_set1_epi32((unsigned short)w[k]);
+        __m128i lo = _mm_unpacklo_epi8(a, zero), hi = _mm_unpackhi_epi8(a, zero);
+        acc0 = _mm_add_epi32(acc0, _mm_madd_epi16(_mm_unpacklo_epi16(lo, zero), wk));
+        acc1 = _mm_add_epi32(acc1, _mm_madd_epi16(_mm_unpackhi_epi16(lo, zero), wk));
+        acc2 = _mm_add_epi32(acc2, _mm_madd_epi16(_mm_unpacklo_epi16(hi, zero), wk));
+        acc3 = _mm_add_epi32(acc3, _mm_madd_epi16(_mm_unpackhi_epi16(hi, zero), wk));
+      }
+      __m128i v0 = _mm_packs_epi32(_mm_srai_epi32(acc0, FL_SCALE_BITS), _mm_srai_epi32(acc1, FL_SCALE_BITS));
+      __m128i v1 = _mm_packs_epi32(_mm_srai_epi32(acc2, FL_SCALE_BITS), _mm_srai_epi32(acc3, FL_SCALE_BITS));
+      _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(v0, v1));
+    }
+#endif
+    for (; i < n; i++) {
+      int sum = 0;
+      const uchar *p = src + i;
+      for (k = 0; k < taps; k++, p += ld) sum += w[k] * *p;
+      dst[i] = clamp_byte(sum);
+    }
+  }
+}
+
+////////////////////////////////////////////////////////////////
+// Running the bands of a pass in parallel, by the calling thread and
+// the threads of Fl_Thread_Pool.
+
+typedef void (*Fl_Scale_Band_Cb)(void *data, int r0, int r1);
+
+struct Fl_Scale_Bands {
+  Fl_Scale_Band_Cb cb;
+  void *data;
+  int rows, nbands;
+};
+
+static void run_band(void *data, int band) {
+  Fl_Scale_Bands *b = (Fl_Scale_Bands *)data;
+  int r0 = (int)((long)b->rows * band / b->nbands);
+  int r1 = (int)((long)b->rows * (band + 1) / b->nbands);
+  b->cb(b->data, r0, r1);
+}
+
+// Calls cb for bands of rows that cover [0, rows), in parallel if the
+// work (row_cost products per row) is large enough.
+static void run_bands(Fl_Scale_Band_Cb cb, void *data, int rows, long row_cost) {
+  Fl_Scale_Bands b;
+  b.cb = cb;
+  b.data = data;
+  b.rows = rows;
+  long bands = (long)rows * row_cost / FL_SCALE_BAND_COST;
+  // a few bands per thread to even out the work
+  if (bands > fl_processor_count() * 4) bands = fl_processor_count() * 4;
+  if (bands > rows) bands = rows;
+  b.nbands = bands > 1 ? (int)bands : 1;
+  if (b.nbands > 1 && fl_processor_count() > 1) fl_parallel_for(b.nbands, run_band, &b);
+  else cb(data, 0, rows);
+}
+
+////////////////////////////////////////////////////////////////
+
+static void premultiply(const uchar *src, int w, int h, int d, int ld, uchar *dst) {
+  for (int y = 0; y < h; y++) {
+    const uchar *s = src + (long)y * ld;
+    for (int x = 0; x < w; x++, s += d, dst += d) {
+      int a = s[d - 1];
+      for (int c = 0; c < d - 1; c++) {
+        int v = s[c] * a + 128;
+        dst[c] = (uchar)((v + (v >> 8)) >> 8);
+      }
+      dst[d - 1] = (uchar)a;
+    }
+  }
+}
+
+static void unpremultiply(uchar *p, int n, int d) {
+  for (; n > 0; n--, p += d) {
+    int a = p[d - 1];
+    if (a == 255) continue;
+    for (int c = 0; c < d - 1; c++) {
+      if (!a) p[c] = 0;
+      else {
+        int v = (p[c] * 255 + a / 2) / a;
+        p[c] = v > 255 ? 255 : (uchar)v;
+      }
+    }
+  }
+}
+
+/*
+ Scales the image src of size w*h, d bytes per pixel and ld bytes per
+ row into dst, of size W*H and W*d bytes per row, with the filter of
+ method (any method except FL_RGB_SCALING_NEAREST).
+ */
+void fl_scale_image(const uchar *src, int w, int h, int d, int ld,
+                    uchar *dst, int W, int H, Fl_RGB_Scaling method) {
+  if (!ld) ld = w * d;
+  uchar *premul = 0;
+  if (d == 2 || d == 4) {
+    premul = new uchar[(long)w * h * d];
+    premultiply(src, w, h, d, ld, premul);
+    src = premul;
+    ld = w * d;
+  }
+
+  Fl_Scale_Job job;
+  job.d = d;
+  uchar *tmp = 0;
+  if (W != w) {
+    Fl_Scale_Weights wx(w, W, method);
+    job.src = src;
+    job.src_ld = ld;
+    job.dst = (H == h) ? dst : (tmp = new uchar[(long)W * h * d]);
+    job.dst_ld = W * d;
+    job.width = W;
+    job.weights = &wx;
+    run_bands(horizontal_pass, &job, h, (long)W * d * wx.taps);
+    src = job.dst;
+    ld = job.dst_ld;
+  }
+  if (H != h) {
+    Fl_Scale_Weights wy(h, H, method);
+    job.src = src;
+    job.src_ld = ld;
+    job.dst = dst;
+    job.dst_ld = W * d;
+    job.width = W * d;
+    job.weights = &wy;
+    run_bands(vertical_pass, &job, H, (long)W * d * wy.taps);
+  } else if (W == w) {
+    for (int y = 0; y < h; y++) memcpy(dst + (long)y * W * d, src + (long)y * ld, W * d);
+  }
+  delete[] tmp;
+  delete[] premul;
+
+  if (d == 2 || d == 4) unpremultiply(dst, W * H, d);
+}
+
+//
+// End of "$Id$".
+//
@@ -0,0 +1,40 @@
+//
+// "$Id$"
+//
+// Internal threading functions for the Fast Light Tool Kit (FLTK).
+//
+// Copyright 1998-2016 by Bill Spitzak and others.
+//
+// This library is free software. Distribution and use rights are outlined in
+// the file "COPYING" which should have been included with this file.  If this
+// file is missing or damaged, see the license at:
+//
+//     http://www.fltk.org/COPYING.php
+//
+// Please report all bugs and problems on the following page:
+//
+//     http://www.fltk.org/str.php
+//
+
+// Functions shared by the code that uses threads: the awake queue in
+// Fl_lock.cxx, and Fl_Thread_Pool and its users.
+//
+#ifndef FL_THREADS_H
+#define FL_THREADS_H
+
+// in Fl_lock.cxx: returns non-zero if Fl::lock() enabled Fl::awake() for threads
+extern int fl_awake_enabled();
+// in Fl_lock.cxx: returns non-zero if awake callbacks are waiting for the main thread
+extern int fl_awake_pending();
+
+// in Fl_Thread_Pool.cxx: returns the number of processors, at most 16
+extern int fl_processor_count();
+// in Fl_Thread_Pool.cxx: calls cb(data, i) for i from 0 to n-1 in parallel,
+// returns once all calls returned
+extern void fl_parallel_for(int n, void (*cb)(void *data, int i), void *data);
+
+#endif // !FL_THREADS_H
+
+//
+// End of "$Id$".
+//
@@ -0,0 +1,294 @@
+//
+// "$Id$"
+//
+// Benchmark program for the Fast Light Tool Kit (FLTK).
+//
+// Copyright 1998-2016 by Bill Spitzak and others.
+//
+// This library is free software. Distribution and use rights are outlined in
+// the file "COPYING" which should have been included with this file.  If this
+// file is missing or damaged, see the license at:
+//
+//     http://www.fltk.org/COPYING.php
+//
+// Please report all bugs and problems on the following page:
+//
+//     http://www.fltk.org/str.php
+//
+
+//
+// Times a few performance sensitive FLTK primitives and lists the
+// results, which are also printed on stdout so that runs of different
+// FLTK versions can easily be compared.
+//
+
+#include <FL/Fl.H>
+#include <FL/Fl_Double_Window.H>
+#include <FL/Fl_Browser.H>
+#include <FL/Fl_RGB_Image.H>
+#include <FL/Fl_Text_Buffer.H>
+#include <FL/Fl_Text_Search.H>
+#include <FL/fl_draw.H>
+#include <FL/x.H>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef WIN32
+#  include <windows.h>
+#else
+#  include <sys/time.h>
+#endif
+
+static Fl_Browser *results;
+
+// Returns a wall clock time stamp in seconds.
+static double now() {
+#ifdef WIN32
+  return GetTickCount() / 1000.0;
+#else
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+#endif
+}
+
+// Lists the result of one benchmark.
+static void report(const char *name, double count, const char *unit, double secs) {
+  char line[256];
+  if (secs <= 0.0) secs = 1e-6;
+  snprintf(line, sizeof(line), "%s\t%.3f s\t%.0f %s/s", name, secs, count / secs, unit);
+  puts(line);
+  results->add(line);
+  Fl::check();
+}
+
+// Sample text mixing ASCII, Latin-1 and a few other BMP characters
+static const char *sample_text[] = {
+  "The quick brown fox jumps over the lazy dog 0123456789",
+  "Fl_Text_Display::draw_vline() measures every character",
+  "\xc3\xa4\xc3\xb6\xc3\xbc \xc3\x84\xc3\x96\xc3\x9c \xc3\x9f \xe2\x82\xac \xc2\xa9 \xc2\xae",
+  "\xce\x91\xce\xb2\xce\xb3\xce\xb4 \xd0\x96\xd0\xb8\xd0\xb7\xd0\xbd\xd1\x8c \xe2\x86\x92 \xe2\x88\x9e"
+};
+static const int sample_count = sizeof(sample_text) / sizeof(sample_text[0]);
+
+// Measures text with fl_width(), and with fl_text_extents() which
+// always asks the platform's font system, as a reference.
+static void bench_fl_width() {
+  const int loops = 20000;
+  int i, j, dx, dy, w, h;
+  double t, total = 0.0;
+  long bytes = 0;
+  fl_font(FL_HELVETICA, 14);
+  for (j = 0; j < sample_count; j++) bytes += strlen(sample_text[j]);
+  bytes *= loops;
+
+  t = now();
+  for (i = 0; i < loops; i++)
+    for (j = 0; j < sample_count; j++)
+      total += fl_width(sample_text[j]);
+  report("fl_width(const char*)", bytes, "bytes", now() - t);
+
+  t = now();
+  for (i = 0; i < loops; i++)
+    for (j = 0; j < sample_count; j++) {
+      fl_text_extents(sample_text[j], dx, dy, w, h);
+      total += w;
+    }
+  report("fl_text_extents(const char*)", bytes, "bytes", now() - t);
+
+  t = now();
+  for (i = 0; i < loops; i++)
+    for (j = 32; j < 127; j++)
+      total += fl_width((unsigned int)j);
+  report("fl_width(unsigned int)", loops * 95.0, "chars", now() - t);
+
+  if (total < 0) puts("unexpected negative width");
+}
+
+// Scans a 100 MB text buffer for newlines and strings that do not occur,
+// and compares with a plain byte loop over the same text.
+static void bench_text_scan() {
+  const int size = 100 * 1024 * 1024;
+  char *text = (char *)malloc(size + 1);
+  int i, pos, found = 0;
+  for (i = 0; i < size; i++)
+    text[i] = (i % 64 == 63) ? '\n' : 'a' + (i % 26);
+  text[size] = 0;
+  Fl_Text_Buffer *buf = new Fl_Text_Buffer;
+  buf->text(text);
+  buf->insert(size / 2, "x"); // moves the gap to the middle of the text
+  buf->remove(size / 2, size / 2 + 1);
+  double t;
+
+  t = now();
+  for (i = 0, pos = 0; i < size; i++)
+    if (text[i] == '\n') pos++;
+  report("newlines (byte loop)", size, "bytes", now() - t);
+  found += pos;
+
+  t = now();
+  found += buf->count_lines(0, buf->length());
+  report("Fl_Text_Buffer::count_lines()", size, "bytes", now() - t);
+
+  t = now();
+  found += buf->findchar_forward(0, '#', &pos);
+  report("Fl_Text_Buffer::findchar_forward()", size, "bytes", now() - t);
+
+  t = now();
+  found += buf->findchar_backward(buf->length(), '#', &pos);
+  report("Fl_Text_Buffer::findchar_backward()", size, "bytes", now() - t);
+
+  const char *needle = "#fltk";
+  t = now();
+  for (i = 0; i < size; i++)
+    if (!strncmp(text + i, needle, 5)) break;
+  report("string search (byte loop)", size, "bytes", now() - t);
+  found += i;
+
+  t = now();
+  found += buf->search_forward(0, needle, &pos, 1);
+  report("Fl_Text_Buffer::search_forward()", size, "bytes", now() - t);
+
+  t = now();
+  found += buf->search_forward(0, "#FLTK", &pos, 0);
+  report("Fl_Text_Buffer::search_forward(), any case", size, "bytes", now() - t);
+
+  Fl_Text_Search search("XYZ");
+  t = now();
+  found += search.find_all(buf, 0, buf->length(), NULL, NULL);
+  report("Fl_Text_Search::find_all()", size, "bytes", now() - t);
+
+  if (!found) puts("unexpected scan results");
+  delete buf;
+  free(text);
+}
+
+// Draws full HD frames with fl_draw_image() into an offscreen buffer,
+// which converts the pixels to the server's format and sends them.
+static void bench_draw_image() {
+  const int W = 1920, H = 1080, frames = 60;
+  static const char *names[] = { 0, "fl_draw_image(), gray", 0,
+                                 "fl_draw_image(), RGB", "fl_draw_image(), RGBA" };
+  double secs[5];
+  uchar *pixels = (uchar *)malloc(W * H * 4);
+  int i, d;
+  for (i = 0; i < W * H * 4; i++)
+    pixels[i] = (uchar)(i * 7 + i / (W * 4));
+
+  Fl_Offscreen offscreen = fl_create_offscreen(W, H);
+  fl_begin_offscreen(offscreen);
+  for (d = 1; d <= 4; d++) {
+    if (!names[d]) continue;
+    double t = now();
+    for (i = 0; i < frames; i++)
+      fl_draw_image(pixels, 0, 0, W, H, d);
+#if !defined(WIN32) && !defined(__APPLE__)
+    XSync(fl_display, False); // wait until the server has drawn all frames
+#endif
+    secs[d] = now() - t;
+  }
+  fl_end_offscreen();
+  fl_delete_offscreen(offscreen);
+  free(pixels);
+
+  for (d = 1; d <= 4; d++)
+    if (names[d]) report(names[d], frames, "frames", secs[d]);
+}
+
+// Makes thumbnails of a 12 megapixel photo-sized image with each of
+// the scaling methods of Fl_RGB_Image::copy().
+static void bench_image_scaling() {
+  const int W = 4000, H = 3000, thumbs = 10;
+  static const char *names[] = { "copy(), nearest", "copy(), bilinear", "copy(), box",
+                                 "copy(), bicubic", "copy(), Lanczos" };
+  uchar *pixels = (uchar *)malloc(W * H * 3);
+  int i, m;
+  for (i = 0; i < W * H * 3; i++)
+    pixels[i] = (uchar)(i * 7 + i / (W * 3));
+  Fl_RGB_Image image(pixels, W, H, 3);
+  Fl_RGB_Scaling saved = Fl_Image::RGB_scaling();
+
+  for (m = FL_RGB_SCALING_NEAREST; m <= FL_RGB_SCALING_LANCZOS; m++) {
+    Fl_Image::RGB_scaling((Fl_RGB_Scaling)m);
+    double t = now();
+    for (i = 0; i < thumbs; i++)
+      delete image.copy(320 + i, 240 + i);
+    report(names[m], thumbs, "images", now() - t);
+  }
+  Fl_Image::RGB_scaling(saved);
+  free(pixels);
+}
+
+static void timeout_cb(void *) {}
+
+// Adds, finds, removes and calls as many timeouts as a dashboard with
+// lots of animated and blinking widgets has pending.
+static void bench_timeouts() {
+  const long count = 20000;
+  long i;
+  int found = 0;
+  double t;
+
+  t = now();
+  for (i = 0; i < count; i++)
+    Fl::add_timeout(10.0 + (i * 7919 % count) * 0.001, timeout_cb, (void *)i);
+  report("Fl::add_timeout()", count, "timeouts", now() - t);
+
+  t = now();
+  for (i = 0; i < count; i++)
+    found += Fl::has_timeout(timeout_cb, (void *)i);
+  report("Fl::has_timeout()", count, "timeouts", now() - t);
+
+  t = now();
+  for (i = 0; i < count; i++)
+    Fl::remove_timeout(timeout_cb, (void *)i);
+  report("Fl::remove_timeout()", count, "timeouts", now() - t);
+
+  for (i = 0; i < count; i++)
+    Fl::add_timeout(0.0, timeout_cb, (void *)i);
+  t = now();
+  while (Fl::has_timeout(timeout_cb, (void *)(count - 1)))
+    Fl::wait(0.0);
+  report("expired timeouts", count, "timeouts", now() - t);
+
+  if (found != count) puts("unexpected timeout count");
+}
+
+struct Benchmark {
+  const char *name;
+  void (*run)();
+};
+
+static Benchmark benchmarks[] = {
+  { "text measurement", bench_fl_width },
+  { "text buffer scanning", bench_text_scan },
+  { "image drawing", bench_draw_image },
+  { "image scaling", bench_image_scaling },
+  { "timeouts", bench_timeouts }
+};
+
+int main(int argc, char **argv) {
+  Fl_Double_Window window(500, 300, "FLTK Benchmarks");
+  static int widths[] = { 250, 80, 0 };
+  results = new Fl_Browser(10, 10, 480, 280);
+  results->column_widths(widths);
+  results->column_char('\t');
+  window.resizable(results);
+  window.end();
+  window.show(argc, argv);
+  Fl::check();
+
+  for (unsigned i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++) {
+    char title[256];
+    snprintf(title, sizeof(title), "@b%s", benchmarks[i].name);
+    printf("%s:\n", benchmarks[i].name);
+    results->add(title);
+    benchmarks[i].run();
+  }
+
+  return Fl::run();
+}
+
+//
+// End of "$Id$".
+//
@@ -157,7 +157,7 @@ extern "C" {
 // 'style_parse()' - Parse text and produce style data.
 //
 
-void
+char
 style_parse(const char *text,
             char       *style,
 	    int        length) {
@@ -287,9 +287,34 @@ style_parse(const char *text,
       if (current == 'B' || current == 'E') current = 'A';
     }
   }
+
+  return current;
 }
 
 
+#if FLTK_ABI_VERSION >= 10304
+//
+// 'style_tokenize()' - Produce the style data of one line of text.
+//
+
+int
+style_tokenize(const char *text,	// I - Text of the line
+               int        length,	// I - Length of the line
+               int        state,	// I - Style at the start of the line
+               char       *style,	// O - Style data
+               void       *) {
+  char	current;			// Style at the end of the line
+
+  style[0] = state ? (char)state : 'A';
+  current = style_parse(text, style, length);
+
+  // Only block comments and strings continue on the next line...
+  if (current != 'C' && current != 'D') current = 'A';
+  return current;
+}
+#endif // FLTK_ABI_VERSION >= 10304
+
+
 //
 // 'style_init()' - Initialize the style buffer...
 //
@@ -804,14 +829,21 @@ Fl_Window* new_view() {
     w->editor->textsize(TS);
   //w->editor->wrap_mode(Fl_Text_Editor::WRAP_AT_BOUNDS, 250);
     w->editor->buffer(textbuf);
+#if FLTK_ABI_VERSION >= 10304
+    w->editor->highlight_data(style_tokenize, styletable,
+                              sizeof(styletable) / sizeof(styletable[0]));
+#else
     w->editor->highlight_data(stylebuf, styletable,
                               sizeof(styletable) / sizeof(styletable[0]),
 			      'A', style_unfinished_cb, 0);
+#endif
   w->end();
   w->resizable(w->editor);
   w->callback((Fl_Callback *)close_cb, w);
 
+#if FLTK_ABI_VERSION < 10304
   textbuf->add_modify_callback(style_update, w->editor);
+#endif
   textbuf->add_modify_callback(changed_cb, w);
   textbuf->call_modify_callbacks();
   num_windows++;
@@ -825,7 +857,9 @@ void cb(const char *fname) {
 int main(int argc, char **argv) {
   textbuf = new Fl_Text_Buffer;
 //textbuf->transcoding_warning_action = NULL;
+#if FLTK_ABI_VERSION < 10304
   style_init();
+#endif
   fl_open_callback(cb);
 
   Fl_Window* window = new_view();